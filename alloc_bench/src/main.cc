@@ -0,0 +1,267 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/trivial.hpp>
+#include <managed_client.h>
+#include "lookup.pb.h"
+#include "ebox.pb.h"
+#include "lookup_server.h"
+#include "coordinator_server.h"
+#include "update_server.h"
+namespace po = boost::program_options;
+using boost::asio::ip::tcp;
+
+namespace {
+// Allocations made by the thread serving requests, while it counts them
+thread_local bool counting = false;
+std::atomic<uint64_t> allocations (0);
+
+// Requests sent before counting, so that buffers, pools and Redis records
+// have grown to what serving needs
+const uint64_t WARMUP = 1000;
+
+// Send request framed (64-bit length, then the message) and read the
+// framed response
+template <typename Request, typename Response>
+bool call (tcp::socket& socket,
+           const Request& request,
+           Response& response,
+           std::string& buffer) {
+    uint64_t size = request.ByteSize ();
+    buffer.resize (sizeof(uint64_t) + size);
+    memcpy (&buffer[0], &size, sizeof(uint64_t));
+    request.SerializeToArray (&buffer[sizeof(uint64_t)], size);
+    boost::system::error_code ec;
+    boost::asio::write (socket, boost::asio::buffer (buffer), ec);
+    if (!ec) {
+        boost::asio::read (socket, boost::asio::buffer (&size, sizeof(uint64_t)), ec);
+    }
+    if (ec) {
+        return false;
+    }
+    buffer.resize (size);
+    boost::asio::read (socket, boost::asio::buffer (&buffer[0], size), ec);
+    return !ec && response.ParseFromArray (buffer.data (), size);
+}
+
+// Send count requests one at a time to the server on port, and report how
+// many allocations the serving thread made for each
+template <typename Request, typename Response>
+bool measure (const std::string& name,
+              boost::asio::io_service& io_service,
+              const std::string& port,
+              const Request& request,
+              uint64_t count) {
+    boost::asio::io_service client;
+    tcp::socket socket (client);
+    tcp::resolver resolver (client);
+    boost::system::error_code ec;
+    boost::asio::connect (socket, resolver.resolve (tcp::resolver::query ("127.0.0.1", port)), ec);
+    if (ec) {
+        std::cerr << "Could not connect to the " << name << " server " << ec << std::endl;
+        return false;
+    }
+    Response response;
+    std::string buffer;
+    uint64_t failed = 0;
+    io_service.post ([] { counting = true; });
+    for (uint64_t i = 0; i < WARMUP; i++) {
+        if (!call (socket, request, response, buffer)) {
+            std::cerr << "Lost the " << name << " server" << std::endl;
+            return false;
+        }
+    }
+    allocations = 0;
+    auto start = std::chrono::steady_clock::now ();
+    for (uint64_t i = 0; i < count; i++) {
+        if (!call (socket, request, response, buffer)) {
+            std::cerr << "Lost the " << name << " server" << std::endl;
+            return false;
+        }
+        if (!response.success ()) {
+            failed++;
+        }
+    }
+    auto end = std::chrono::steady_clock::now ();
+    uint64_t counted = allocations;
+    io_service.post ([] { counting = false; });
+    double usec = std::chrono::duration_cast<std::chrono::microseconds>
+            (end - start).count ();
+    std::cout << name << " x " << count << ": "
+              << (double)counted / count << " allocations/request, "
+              << (usec > 0 ? count * 1e6 / usec : 0.0) << " requests/s, "
+              << failed << " failed" << std::endl;
+    return true;
+}
+}
+
+void* operator new (std::size_t size) {
+    if (counting) {
+        allocations++;
+    }
+    void* p = malloc (size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc ();
+    }
+    return p;
+}
+
+void operator delete (void* p) noexcept {
+    free (p);
+}
+
+// Count the allocations the lookup, coordinator and edge box servers make
+// per request once warmed up, each serving one client that sends a request
+// at a time against a real Redis
+int main (int argc, char* argv[]) {
+    po::options_description desc("per-request allocation benchmark");
+    std::string redisAddress = "127.0.0.1";
+    uint32_t redisPort = 6379;
+    std::string prefix = "alloc_bench";
+    uint32_t port = 18085;
+    uint64_t count = 100000;
+    std::string only;
+
+    desc.add_options()
+        ("h,help", "Display help")
+        ("a,address", po::value<std::string>(&redisAddress)->implicit_value(redisAddress),
+            "Redis address")
+        ("p,port", po::value<uint32_t>(&redisPort)->implicit_value(redisPort),
+            "Redis port")
+        ("x,prefix", po::value<std::string>(&prefix)->implicit_value(prefix),
+            "Prefix for the keys written and read")
+        ("l,listen", po::value<uint32_t>(&port)->implicit_value(port),
+            "Serve lookups on this port, updates and edge box updates on the next two")
+        ("n,count", po::value<uint64_t>(&count)->implicit_value(count),
+            "Requests to send to each server")
+        ("s,server", po::value<std::string>(&only),
+            "Only measure this server (lookup, coordinator or ebox)");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::cerr << desc << std::endl;
+        return 0;
+    }
+
+    if (!only.empty () && only != "lookup" && only != "coordinator" && only != "ebox") {
+        std::cerr << "Unknown server " << only << std::endl;
+        return 1;
+    }
+
+    if (count == 0) {
+        std::cerr << "count must be at least 1" << std::endl;
+        return 1;
+    }
+
+    boost::log::core::get()->set_filter (
+            boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    boost::asio::io_service io_service;
+
+    // A Redis connection per server, as each would have running on its own
+    asio_redis::ManagedRedisClient lookupRedis (io_service, redisAddress, redisPort);
+    asio_redis::ManagedRedisClient updateRedis (io_service, redisAddress, redisPort);
+    asio_redis::ManagedRedisClient eboxRedis (io_service, redisAddress, redisPort);
+    if (!lookupRedis.connect () || !updateRedis.connect () || !eboxRedis.connect ()) {
+        std::cerr << "Failed to connect to redis instance " << redisAddress
+                  << ":" << redisPort << std::endl;
+        return 1;
+    }
+
+    hlv::service::lookup::server::Connection::decode_replies (lookupRedis);
+    hlv::service::lookup::server::ConnectionInformation lookupInformation
+                                                    (0,
+                                                     redisAddress,
+                                                     redisPort,
+                                                     &lookupRedis,
+                                                     io_service);
+    lookupInformation.add_tenant (std::unique_ptr<hlv::service::lookup::server::Tenant> (
+            new hlv::service::lookup::server::Tenant ("", prefix, prefix + ".local")));
+    hlv::service::lookup::server::Server lookupServer (io_service,
+                                                       "127.0.0.1",
+                                                       std::to_string (port),
+                                                       lookupInformation);
+
+    hlv::service::coordinator::ConnectionInformation updateInformation
+                                                    (redisAddress,
+                                                     redisPort,
+                                                     &updateRedis,
+                                                     prefix,
+                                                     io_service);
+    hlv::service::coordinator::Server updateServer (io_service,
+                                                    "127.0.0.1",
+                                                    std::to_string (port + 1),
+                                                    updateInformation);
+
+    hlv::service::ebox::update::ConnectionInformation eboxInformation
+                                                    (redisAddress,
+                                                     redisPort,
+                                                     &eboxRedis,
+                                                     prefix + ".local",
+                                                     io_service);
+    hlv::service::ebox::update::Server eboxServer (io_service,
+                                                   "127.0.0.1",
+                                                   std::to_string (port + 2),
+                                                   eboxInformation);
+
+    lookupServer.start ();
+    updateServer.start ();
+    eboxServer.start ();
+    std::thread server ([&io_service] { io_service.run (); });
+
+    // The same key is updated over and over, and looked up once it has
+    // been set
+    ev_lookup::Update update;
+    update.set_token (0);
+    update.set_operation (ev_lookup::Update::SET_VALUES);
+    update.set_key ("key");
+    auto value = update.add_values ();
+    value->set_type ("address");
+    value->set_value ("10.0.0.1:8080");
+
+    ev_lookup::Query query;
+    query.set_type (ev_lookup::Query::GLOBAL);
+    query.set_token (0);
+    query.set_querystring ("key");
+
+    ev_ebox::LocalUpdate local;
+    local.set_type (ev_ebox::LocalUpdate::ADD);
+    local.set_token (1);
+    local.set_key ("key");
+    local.add_values ("host");
+
+    // Lookups need the coordinator to have set the key first
+    bool ok = true;
+    if (only.empty () || only == "coordinator" || only == "lookup") {
+        ok = ok && measure<ev_lookup::Update, ev_lookup::UpdateResponse>
+                ("coordinator", io_service, std::to_string (port + 1), update,
+                 only == "lookup" ? 1 : count);
+    }
+    if (only.empty () || only == "lookup") {
+        ok = ok && measure<ev_lookup::Query, ev_lookup::Response>
+                ("lookup", io_service, std::to_string (port), query, count);
+    }
+    if (only.empty () || only == "ebox") {
+        ok = ok && measure<ev_ebox::LocalUpdate, ev_ebox::Response>
+                ("ebox", io_service, std::to_string (port + 2), local, count);
+    }
+
+    io_service.stop ();
+    server.join ();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,66 @@
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifndef __HIREDIS_COMMAND_BUILDER_H__
+#define __HIREDIS_COMMAND_BUILDER_H__
+
+namespace asio_redis {
+
+/* Writes a command in the Redis protocol directly, for commands built one
+ * argument at a time. Every argument comes with its length, so nothing is
+ * scanned for a NUL or parsed as a format, and keys made of a prefix, a
+ * name and a suffix are written in place rather than put together first.
+ *
+ * The text lives in a buffer that keeps its capacity from command to
+ * command: ManagedRedisClient swaps it with the buffer of the command it
+ * sends, so once warmed up building and sending a command allocates
+ * nothing. One builder per connection (or per thread), reused for every
+ * command.
+ *
+ *   builder.begin(2 + n).arg("SADD", 4).key(name, ".local", 6);
+ *   for (...) builder.arg(member);
+ *   client->write(callback, privdata, builder);
+ */
+class CommandBuilder
+{
+  public:
+    CommandBuilder();
+    explicit CommandBuilder(const std::string& prefix);
+
+    /* key() writes prefix:name, the prefix is fixed for the builder's
+     * lifetime (typically the service's namespace in Redis) */
+    void set_prefix(const std::string& prefix);
+    const std::string& prefix() const { return prefix_; }
+
+    /* Start a command of argc arguments, the name included, dropping
+     * whatever was built before */
+    CommandBuilder& begin(size_t argc);
+
+    CommandBuilder& arg(const char *data, size_t length);
+    CommandBuilder& arg(const std::string& value)
+    {
+        return arg(value.data(), value.size());
+    }
+    CommandBuilder& arg(uint64_t value);
+
+    /* prefix:name followed by suffix as one argument */
+    CommandBuilder& key(const std::string& name,
+                        const char *suffix = NULL, size_t suffixLength = 0);
+
+    /* True once argc arguments were added */
+    bool complete() const { return remaining_ == 0 && !text_.empty(); }
+
+    /* The command so far; a client sending it may swap it out */
+    std::string& text() { return text_; }
+
+  private:
+    void header(char type, size_t value);
+
+    std::string prefix_;
+    std::string text_;
+    size_t remaining_;
+};
+}
+
+#endif /*__HIREDIS_COMMAND_BUILDER_H__*/
@@ -0,0 +1,89 @@
+// Recycled memory for asio handlers, after the allocation example that
+// ships with Boost.Asio
+#include <cstddef>
+#include <new>
+
+#include <boost/aligned_storage.hpp>
+
+#ifndef __HIREDIS_HANDLER_ALLOCATOR_H__
+#define __HIREDIS_HANDLER_ALLOCATOR_H__
+
+namespace asio_redis {
+
+/* Memory for one outstanding handler at a time. asio asks for it every
+ * time an operation is started; with this it is the same block every time
+ * instead of a trip to the heap. Falls back to the heap if the block is in
+ * use or too small. */
+class handler_allocator
+{
+  public:
+    handler_allocator() : in_use_(false) {}
+
+    void *allocate(std::size_t size)
+    {
+        if (!in_use_ && size <= sizeof(storage_)) {
+            in_use_ = true;
+            return storage_.address();
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void *pointer)
+    {
+        if (pointer == storage_.address()) {
+            in_use_ = false;
+        } else {
+            ::operator delete(pointer);
+        }
+    }
+
+  private:
+    handler_allocator(const handler_allocator&);
+    handler_allocator& operator=(const handler_allocator&);
+
+    boost::aligned_storage<256> storage_;
+    bool in_use_;
+};
+
+/* Wraps a handler so asio allocates its operation from a handler_allocator */
+template <typename Handler>
+class custom_alloc_handler
+{
+  public:
+    custom_alloc_handler(handler_allocator& a, Handler h)
+        : allocator_(a), handler_(h) {}
+
+    void operator()() { handler_(); }
+
+    template <typename Arg1>
+    void operator()(Arg1 arg1) { handler_(arg1); }
+
+    template <typename Arg1, typename Arg2>
+    void operator()(Arg1 arg1, Arg2 arg2) { handler_(arg1, arg2); }
+
+    friend void *asio_handler_allocate(std::size_t size,
+                                       custom_alloc_handler<Handler> *this_handler)
+    {
+        return this_handler->allocator_.allocate(size);
+    }
+
+    friend void asio_handler_deallocate(void *pointer, std::size_t,
+                                        custom_alloc_handler<Handler> *this_handler)
+    {
+        this_handler->allocator_.deallocate(pointer);
+    }
+
+  private:
+    handler_allocator& allocator_;
+    Handler handler_;
+};
+
+template <typename Handler>
+inline custom_alloc_handler<Handler> make_custom_alloc_handler(handler_allocator& a,
+                                                               Handler h)
+{
+    return custom_alloc_handler<Handler>(a, h);
+}
+}
+
+#endif /*__HIREDIS_HANDLER_ALLOCATOR_H__*/
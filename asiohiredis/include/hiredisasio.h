@@ -3,26 +3,61 @@
 #include <hiredis/async.h>
 
 #include <iostream>
+#include <memory>
 #include <string>
 #include <stdio.h>
 
 #include <boost/asio.hpp>
+#include <boost/asio/generic/stream_protocol.hpp>
 #include <boost/bind.hpp>
 #include <boost/log/trivial.hpp>
 
+#include "handler_allocator.h"
+#include "reply_decoder.h"
+
 #ifndef __HIREDIS_BOOSTASIO_H__
 #define __HIREDIS_BOOSTASIO_H__
 
 namespace asio_redis {
+/* Drives a hiredis async context from an io_service.
+ *
+ * Commands issued while handling one event are written together: the
+ * first one schedules a flush on the io_service and the flush writes
+ * everything hiredis has buffered by then with one call. Waiting for the
+ * socket is only needed when a flush cannot write everything. Memory for
+ * the handlers is reused, so steady state reads and writes allocate
+ * nothing.
+ *
+ * The context may be connected over IPv4, IPv6 or a Unix socket. With
+ * threaded set the io_service may be run by several threads: everything
+ * the adapter does, including running hiredis callbacks, goes through a
+ * strand, and commands must be issued from inside it (see dispatch).
+ */
 class redisBoostClient
 {
   public:
-    redisBoostClient(boost::asio::io_service& io_service,redisAsyncContext *ac);
+    redisBoostClient(boost::asio::io_service& io_service,redisAsyncContext *ac,
+                     bool threaded = false);
+
+    /* Run f on the strand (or right away if not threaded and called
+     * from the io_service) */
+    template <typename Function>
+    void dispatch(Function f)
+    {
+        if (threaded_) {
+            strand_.dispatch(f);
+        } else {
+            io_service_.dispatch(f);
+        }
+    }
+
+    boost::asio::io_service::strand& strand() { return strand_; }
 
 	void operate();
 
 	void handle_read(boost::system::error_code ec);
     void handle_write(boost::system::error_code ec);
+    void flush();
     void add_read(void *privdata);
     void del_read(void *privdata);
     void add_write(void *privdata);
@@ -30,13 +65,37 @@ class redisBoostClient
 	void cleanup(void *privdata);
     void stop ();
 
+    /* Hand callback fn a FlatReply (see reply_decoder.h) rather than a
+     * redisReply. Not for contexts in subscribe mode. */
+    void decode_flat(redisCallbackFn *fn);
+
+    /* free for whoever owns the client, like redisAsyncContext's data */
+    void *data;
+
   private:
+    /* Wait for the socket, or schedule a flush. Handlers run on the strand
+     * if threaded, in memory kept for each. */
+    void wait_readable();
+    void wait_writable();
+    void post_flush();
+
+    boost::asio::io_service& io_service_;
+    boost::asio::io_service::strand strand_;
+    bool threaded_;
     redisAsyncContext *context_;
-    boost::asio::ip::tcp::socket socket_;
+    boost::asio::generic::stream_protocol::socket socket_;
     bool read_requested_;
     bool write_requested_;
     bool read_in_progress_;
     bool write_in_progress_;
+    /* a flush is scheduled */
+    bool flush_posted_;
+    /* inside redisAsyncHandleWrite, which asks for writes it will do */
+    bool flushing_;
+    handler_allocator read_memory_;
+    handler_allocator write_memory_;
+    handler_allocator flush_memory_;
+    std::unique_ptr<ReplyDecoder> decoder_;
 };
 
 /*C wrappers for class member functions*/
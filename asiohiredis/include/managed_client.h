@@ -0,0 +1,184 @@
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "command_builder.h"
+#include "hiredisasio.h"
+
+#ifndef __HIREDIS_MANAGED_CLIENT_H__
+#define __HIREDIS_MANAGED_CLIENT_H__
+
+namespace asio_redis {
+
+/* A Redis connection that outlives the Redis server going away.
+ *
+ * When the connection drops the client reconnects by itself, waiting a
+ * jittered, exponentially growing time between attempts so that a fleet of
+ * servers does not stampede a Redis that just came back. Meanwhile:
+ *
+ *  - reads (commands that are safe to send twice) are buffered for up to a
+ *    window and sent once connected again, including reads that were sent
+ *    but not answered when the connection dropped;
+ *  - writes fail right away, they may or may not have been applied and
+ *    only the caller knows whether trying again is safe;
+ *  - subscriptions are gone, on_connect is the place to redo them.
+ *
+ * Every callback passed to read or write is called exactly once, with a
+ * NULL reply if the command did not complete. Failures are reported from
+ * the io_service, never from inside read or write.
+ */
+class ManagedRedisClient
+{
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    /* Connect to address:port, or to the Unix socket at address if port
+     * is 0 */
+    ManagedRedisClient(boost::asio::io_service& io_service,
+                       const std::string& address, int port);
+    ~ManagedRedisClient();
+
+    /* Make the first connection attempt, false (see errstr) if it failed
+     * right away. Either way the client keeps trying until stopped. */
+    bool connect();
+    const std::string& errstr() const { return errstr_; }
+
+    /* Buffer reads for at most window and hold at most limit of them */
+    void set_buffering(Clock::duration window, size_t limit);
+
+    /* Wait between min and max before reconnecting */
+    void set_backoff(Clock::duration min, Clock::duration max);
+
+    /* Hand callback fn a FlatReply (see reply_decoder.h) */
+    void decode_flat(redisCallbackFn *fn);
+
+    /* Called whenever a connection is made (the first one included) or
+     * lost */
+    void on_connect(std::function<void()> f);
+    void on_disconnect(std::function<void()> f);
+
+    /* Send a command, formatted as for redisAsyncCommand. REDIS_ERR only if
+     * the command could not be formatted, fn is not called then. */
+    int read(redisCallbackFn *fn, void *privdata, const char *format, ...);
+    int write(redisCallbackFn *fn, void *privdata, const char *format, ...);
+    int write_argv(redisCallbackFn *fn, void *privdata, int argc,
+                   const char **argv, const size_t *argvlen);
+
+    /* Send the command in builder, which must be complete. Its buffer is
+     * swapped with a spare one, so builder is empty but ready for the next
+     * command afterwards. */
+    int read(redisCallbackFn *fn, void *privdata, CommandBuilder& builder);
+    int write(redisCallbackFn *fn, void *privdata, CommandBuilder& builder);
+
+    /* Send a subscribe mode command straight to the connection, REDIS_ERR
+     * if there is none. fn is called for every message, as with hiredis. */
+    int subscribe(redisCallbackFn *fn, void *privdata, const char *format, ...);
+
+    bool connected() const { return state_ == CONNECTED; }
+
+    /* Current connection, NULL while there is none */
+    redisAsyncContext *context() { return context_; }
+
+    /* Stop reconnecting, fail buffered reads and close the connection */
+    void stop();
+
+    /* Ask hiredis to disconnect once outstanding replies are in, for use
+     * after the io_service is done */
+    void disconnect();
+
+    uint64_t reconnects() const { return reconnects_; }
+    uint64_t replayed() const { return replayed_; }
+    uint64_t failed() const { return failed_; }
+    size_t buffered() const { return buffered_.size(); }
+
+  private:
+    ManagedRedisClient(const ManagedRedisClient&);
+    ManagedRedisClient& operator=(const ManagedRedisClient&);
+
+    enum State { DISCONNECTED, CONNECTING, CONNECTED, STOPPED };
+
+    /* A command in flight, buffered or waiting to be failed */
+    struct Command {
+        ManagedRedisClient *client;
+        redisCallbackFn *fn;
+        void *privdata;
+        bool idempotent;
+        Clock::time_point issued;
+        /* formatted command, kept to send it again */
+        std::string text;
+    };
+
+    Command *allocate(redisCallbackFn *fn, void *privdata, bool idempotent);
+    void release(Command *command);
+    int submit(Command *command, char *text, int length);
+    int submit(Command *command, CommandBuilder& builder);
+    int dispatch(Command *command);
+    void send(Command *command);
+    bool expired(const Command *command, Clock::time_point now) const;
+    void complete(redisAsyncContext *ac, Command *command, void *reply);
+    void fail(Command *command);
+    void fail_posted();
+
+    void attempt();
+    void up();
+    void lost();
+    void schedule_reconnect();
+    void sweep();
+
+    static void replied(redisAsyncContext *ac, void *reply, void *privdata);
+    static void replied_flat(redisAsyncContext *ac, void *reply, void *privdata);
+    static void connect_callback(const redisAsyncContext *ac, int status);
+    static void disconnect_callback(const redisAsyncContext *ac, int status);
+
+    boost::asio::io_service& io_service_;
+    const std::string address_;
+    const int port_;
+    State state_;
+    std::string errstr_;
+    redisAsyncContext *context_;
+    std::unique_ptr<redisBoostClient> client_;
+    /* the client of the connection that was lost last. asio may still
+     * hold handlers for it, so it is only freed once the next one is
+     * lost or made. */
+    std::unique_ptr<redisBoostClient> retired_;
+
+    Clock::duration window_;
+    size_t limit_;
+    Clock::duration minBackoff_;
+    Clock::duration maxBackoff_;
+    uint32_t attempts_;
+    std::minstd_rand random_;
+    boost::asio::deadline_timer reconnect_;
+    boost::asio::deadline_timer sweep_;
+    bool sweeping_;
+
+    std::vector<redisCallbackFn*> flat_;
+    std::vector<std::function<void()>> connectHooks_;
+    std::vector<std::function<void()>> disconnectHooks_;
+
+    std::vector<std::unique_ptr<Command>> commands_;
+    std::vector<Command*> free_;
+    /* reads waiting for a connection, oldest first */
+    std::deque<Command*> buffered_;
+    /* commands to fail from the io_service */
+    std::vector<Command*> failing_;
+    std::vector<Command*> failingNow_;
+    bool failPosted_;
+
+    bool connectedOnce_;
+    uint64_t reconnects_;
+    uint64_t replayed_;
+    uint64_t failed_;
+};
+}
+
+#endif /*__HIREDIS_MANAGED_CLIENT_H__*/
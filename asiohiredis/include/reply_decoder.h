@@ -0,0 +1,110 @@
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+
+#include <cstddef>
+#include <vector>
+
+#ifndef __HIREDIS_REPLY_DECODER_H__
+#define __HIREDIS_REPLY_DECODER_H__
+
+namespace asio_redis {
+
+/* A reply decoded into flat storage instead of a tree of redisReply. All
+ * strings live in one arena (NUL terminated), elements of arrays (nested
+ * ones included, in order) live in one vector. Both keep their capacity
+ * from reply to reply, so once warmed up decoding allocates nothing.
+ *
+ * Only valid inside the callback it is handed to.
+ */
+class FlatReply
+{
+  public:
+    struct Element {
+        int type;
+        long long integer;
+        size_t offset;
+        size_t length;
+        /* for arrays, number of elements (which follow this one) */
+        size_t elements;
+    };
+
+    FlatReply();
+
+    /* Type of the reply (REDIS_REPLY_*) */
+    int type() const { return root_.type; }
+    long long integer() const { return root_.integer; }
+    const char* str() const { return str(root_); }
+    size_t len() const { return root_.length; }
+
+    /* All array elements, depth first */
+    size_t elements() const { return elements_.size(); }
+    const Element& element(size_t i) const { return elements_[i]; }
+    const char* str(size_t i) const { return str(elements_[i]); }
+
+    /* Does string element i (or the reply if i is omitted) equal s */
+    bool equals(size_t i, const char* s, size_t length) const;
+    bool equals(const char* s, size_t length) const;
+
+  private:
+    friend class ReplyDecoder;
+
+    const char* str(const Element& e) const { return arena_.data() + e.offset; }
+    void clear();
+    Element& add(int type);
+    void set_string(Element& e, const char* s, size_t length);
+
+    /* Tells a FlatReply from a redisReply when freeing, redisReply starts
+     * with its type which is never this */
+    int magic_;
+    Element root_;
+    std::vector<Element> elements_;
+    std::vector<char> arena_;
+};
+
+/* Plugs into a hiredis async context's reader so that replies to commands
+ * sent with one of the registered callbacks are decoded into a FlatReply,
+ * which is what the callback gets instead of a redisReply. Replies to all
+ * other commands are built by hiredis as usual, so the context can still be
+ * shared. Does not work on a context in subscribe mode.
+ */
+class ReplyDecoder
+{
+  public:
+    static const int FLAT_MAGIC = 0x464c4154;
+
+    explicit ReplyDecoder(redisAsyncContext *ac);
+    ~ReplyDecoder();
+
+    /* Decode replies for commands sent with callback fn */
+    void add(redisCallbackFn *fn);
+
+    /* The context is being freed, leave its reader alone from now on.
+     * hiredis still frees the reply being read (if any) after this, so the
+     * decoder has to outlive the context. */
+    void detach() { context_ = NULL; }
+
+  private:
+    ReplyDecoder(const ReplyDecoder&);
+    ReplyDecoder& operator=(const ReplyDecoder&);
+
+    /* Decide how the reply now being read is decoded */
+    bool start(const redisReadTask *task);
+
+    static void *createString(const redisReadTask *task, char *str, size_t len);
+    static void *createArray(const redisReadTask *task, int elements);
+    static void *createInteger(const redisReadTask *task, long long value);
+    static void *createNil(const redisReadTask *task);
+    static void freeObject(void *obj);
+
+    redisAsyncContext *context_;
+    redisReplyObjectFunctions functions_;
+    /* hiredis's own functions, for every other reply */
+    redisReplyObjectFunctions *original_;
+    std::vector<redisCallbackFn*> callbacks_;
+    /* is the reply being read flat */
+    bool flat_;
+    FlatReply reply_;
+};
+}
+
+#endif /*__HIREDIS_REPLY_DECODER_H__*/
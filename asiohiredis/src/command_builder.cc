@@ -0,0 +1,82 @@
+#include "command_builder.h"
+
+#include <cassert>
+
+namespace asio_redis {
+CommandBuilder::CommandBuilder()
+               : remaining_(0)
+{
+}
+
+CommandBuilder::CommandBuilder(const std::string& prefix)
+               : prefix_(prefix),
+                 remaining_(0)
+{
+}
+
+void CommandBuilder::set_prefix(const std::string& prefix)
+{
+    prefix_ = prefix;
+}
+
+void CommandBuilder::header(char type, size_t value)
+{
+    /*digits come out backwards, at most 20 of them*/
+    char digits[20];
+    size_t count = 0;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    text_.push_back(type);
+    while (count > 0) {
+        text_.push_back(digits[--count]);
+    }
+    text_.append("\r\n", 2);
+}
+
+CommandBuilder& CommandBuilder::begin(size_t argc)
+{
+    text_.clear();
+    remaining_ = argc;
+    header('*', argc);
+    return *this;
+}
+
+CommandBuilder& CommandBuilder::arg(const char *data, size_t length)
+{
+    assert(remaining_ > 0);
+    remaining_--;
+    header('$', length);
+    text_.append(data, length);
+    text_.append("\r\n", 2);
+    return *this;
+}
+
+CommandBuilder& CommandBuilder::arg(uint64_t value)
+{
+    char digits[20];
+    size_t count = 0;
+    do {
+        digits[sizeof(digits) - ++count] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    return arg(digits + sizeof(digits) - count, count);
+}
+
+CommandBuilder& CommandBuilder::key(const std::string& name,
+                                    const char *suffix, size_t suffixLength)
+{
+    assert(remaining_ > 0);
+    remaining_--;
+    header('$', prefix_.size() + 1 + name.size() + suffixLength);
+    text_.append(prefix_);
+    text_.push_back(':');
+    text_.append(name);
+    if (suffixLength > 0) {
+        text_.append(suffix, suffixLength);
+    }
+    text_.append("\r\n", 2);
+    return *this;
+}
+}
@@ -1,8 +1,33 @@
 #include "hiredisasio.h"
 
 namespace asio_redis {
-redisBoostClient::redisBoostClient(boost::asio::io_service& io_service,redisAsyncContext *ac)
-               : socket_ (io_service)
+namespace {
+/*the protocol of whatever socket hiredis connected*/
+boost::asio::generic::stream_protocol protocol_of(int fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(fd, (struct sockaddr*)&addr, &len) != 0) {
+		addr.ss_family = AF_INET;
+	}
+	return boost::asio::generic::stream_protocol(addr.ss_family,
+	                                             addr.ss_family == AF_UNIX ? 0 : IPPROTO_TCP);
+}
+}
+
+redisBoostClient::redisBoostClient(boost::asio::io_service& io_service,redisAsyncContext *ac,
+                                   bool threaded)
+               : data (NULL),
+                 io_service_ (io_service),
+                 strand_ (io_service),
+                 threaded_ (threaded),
+                 socket_ (io_service),
+                 read_requested_ (false),
+                 write_requested_ (false),
+                 read_in_progress_ (false),
+                 write_in_progress_ (false),
+                 flush_posted_ (false),
+                 flushing_ (false)
 {
 	/*this gives us access to c->fd*/
 	redisContext *c = &(ac->c);
@@ -11,9 +36,9 @@ redisBoostClient::redisBoostClient(boost::asio::io_service& io_service,redisAsyn
 	context_ = ac;		
 
 	/*hiredis already connected
-	 *use the existing native socket
+	 *use the existing native socket, whatever it is
 	 */
-	socket_.assign(boost::asio::ip::tcp::v4(),c->fd);
+	socket_.assign(protocol_of(c->fd), c->fd);
 
 	/*register hooks with the hiredis async context*/
 	ac->ev.addRead = call_C_addRead;
@@ -34,21 +59,62 @@ redisBoostClient::redisBoostClient(boost::asio::io_service& io_service,redisAsyn
 }
 
 void redisBoostClient::stop () {
-    socket_.close ();
+    boost::system::error_code ec;
+    socket_.close (ec);
+}
+
+void redisBoostClient::decode_flat(redisCallbackFn *fn)
+{
+	if (!decoder_) {
+		decoder_.reset(new ReplyDecoder(context_));
+	}
+	decoder_->add(fn);
 }
 
 void redisBoostClient::operate()
 {
 	if(read_requested_ && !read_in_progress_) {
 		read_in_progress_ = true;
-		socket_.async_read_some(boost::asio::null_buffers(),
-                       	boost::bind(&redisBoostClient::handle_read,this,boost::asio::placeholders::error));
+		wait_readable();
 	}
 
-	if(write_requested_ && !write_in_progress_) {
+	/*a scheduled flush writes without waiting, and waits itself if it has to*/
+	if(write_requested_ && !write_in_progress_ && !flush_posted_ && !flushing_) {
 		write_in_progress_ = true;
-		socket_.async_write_some(boost::asio::null_buffers(),
-                       	boost::bind(&redisBoostClient::handle_write,this,boost::asio::placeholders::error));
+		wait_writable();
+	}
+}
+
+void redisBoostClient::wait_readable()
+{
+	auto handler = make_custom_alloc_handler(read_memory_,
+		[this](boost::system::error_code ec, std::size_t) { handle_read(ec); });
+	if (threaded_) {
+		socket_.async_read_some(boost::asio::null_buffers(), strand_.wrap(handler));
+	} else {
+		socket_.async_read_some(boost::asio::null_buffers(), handler);
+	}
+}
+
+void redisBoostClient::wait_writable()
+{
+	auto handler = make_custom_alloc_handler(write_memory_,
+		[this](boost::system::error_code ec, std::size_t) { handle_write(ec); });
+	if (threaded_) {
+		socket_.async_write_some(boost::asio::null_buffers(), strand_.wrap(handler));
+	} else {
+		socket_.async_write_some(boost::asio::null_buffers(), handler);
+	}
+}
+
+void redisBoostClient::post_flush()
+{
+	flush_posted_ = true;
+	auto handler = make_custom_alloc_handler(flush_memory_, [this]() { flush(); });
+	if (threaded_) {
+		strand_.post(handler);
+	} else {
+		io_service_.post(handler);
 	}
 }
 	
@@ -68,7 +134,9 @@ void redisBoostClient::handle_write(boost::system::error_code ec)
 {
 	write_in_progress_ = false;
 	if(!ec) {
+		flushing_ = true;
 		redisAsyncHandleWrite(context_);
+		flushing_ = false;
 	}
 
 	if (!ec || ec == boost::asio::error::would_block) {
@@ -76,6 +144,23 @@ void redisBoostClient::handle_write(boost::system::error_code ec)
     }
 }
 
+/*Runs once the handlers that issued commands are done, so one write
+ *carries all of them. hiredis keeps asking for writes (add_write) until
+ *its buffer is empty, in which case wait for the socket. */
+void redisBoostClient::flush()
+{
+	flush_posted_ = false;
+	if (!socket_.is_open() || write_in_progress_) {
+		return;
+	}
+	if (write_requested_) {
+		flushing_ = true;
+		redisAsyncHandleWrite(context_);
+		flushing_ = false;
+	}
+	operate();
+}
+
 void redisBoostClient::add_read(void *privdata) 
 {
 	read_requested_ = true;
@@ -90,7 +175,10 @@ void redisBoostClient::del_read(void *privdata)
 void redisBoostClient::add_write(void *privdata) 
 {
 	write_requested_ = true;
-	operate();
+	/*batch up the commands issued before the io_service gets control back*/
+	if (!flush_posted_ && !flushing_ && !write_in_progress_) {
+		post_flush();
+	}
 }
 
 void redisBoostClient::del_write(void *privdata) 
@@ -100,8 +188,19 @@ void redisBoostClient::del_write(void *privdata)
 
 void redisBoostClient::cleanup(void *privdata) 
 {
-	/*Do I even need this?*/
-	printf("cleanup called...\n");	
+	BOOST_LOG_TRIVIAL(debug) << "hiredis context cleaned up";
+	read_requested_ = false;
+	write_requested_ = false;
+
+	/*the context is about to be freed. The socket is ours to close, and
+	 *hiredis must not close the descriptor again (by then it may belong
+	 *to a new connection)*/
+	boost::system::error_code ec;
+	socket_.close(ec);
+	context_->c.fd = -1;
+	if (decoder_) {
+		decoder_->detach();
+	}
 }
 
 /*wrappers*/
@@ -0,0 +1,455 @@
+#include "managed_client.h"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdlib>
+
+#include <boost/log/trivial.hpp>
+
+namespace asio_redis {
+namespace {
+/*how often buffered reads are checked for having waited too long*/
+const int SWEEP_MS = 100;
+
+boost::posix_time::milliseconds posix(ManagedRedisClient::Clock::duration d)
+{
+    return boost::posix_time::milliseconds(
+            std::chrono::duration_cast<std::chrono::milliseconds>(d).count());
+}
+}
+
+ManagedRedisClient::ManagedRedisClient(boost::asio::io_service& io_service,
+                                       const std::string& address, int port)
+               : io_service_(io_service),
+                 address_(address),
+                 port_(port),
+                 state_(DISCONNECTED),
+                 context_(NULL),
+                 window_(std::chrono::seconds(2)),
+                 limit_(10000),
+                 minBackoff_(std::chrono::milliseconds(100)),
+                 maxBackoff_(std::chrono::seconds(5)),
+                 attempts_(0),
+                 random_(std::random_device()()),
+                 reconnect_(io_service),
+                 sweep_(io_service),
+                 sweeping_(false),
+                 failPosted_(false),
+                 connectedOnce_(false),
+                 reconnects_(0),
+                 replayed_(0),
+                 failed_(0)
+{
+}
+
+ManagedRedisClient::~ManagedRedisClient()
+{
+    reconnect_.cancel();
+    sweep_.cancel();
+}
+
+bool ManagedRedisClient::connect()
+{
+    attempt();
+    return context_ != NULL;
+}
+
+void ManagedRedisClient::set_buffering(Clock::duration window, size_t limit)
+{
+    window_ = window;
+    limit_ = limit;
+}
+
+void ManagedRedisClient::set_backoff(Clock::duration min, Clock::duration max)
+{
+    minBackoff_ = min;
+    maxBackoff_ = std::max(min, max);
+}
+
+void ManagedRedisClient::decode_flat(redisCallbackFn *fn)
+{
+    if (std::find(flat_.begin(), flat_.end(), fn) == flat_.end()) {
+        flat_.push_back(fn);
+    }
+    if (client_) {
+        client_->decode_flat(replied_flat);
+    }
+}
+
+void ManagedRedisClient::on_connect(std::function<void()> f)
+{
+    connectHooks_.push_back(f);
+}
+
+void ManagedRedisClient::on_disconnect(std::function<void()> f)
+{
+    disconnectHooks_.push_back(f);
+}
+
+int ManagedRedisClient::read(redisCallbackFn *fn, void *privdata, const char *format, ...)
+{
+    char *text;
+    va_list ap;
+    va_start(ap, format);
+    int length = redisvFormatCommand(&text, format, ap);
+    va_end(ap);
+    if (length < 0) {
+        return REDIS_ERR;
+    }
+    return submit(allocate(fn, privdata, true), text, length);
+}
+
+int ManagedRedisClient::write(redisCallbackFn *fn, void *privdata, const char *format, ...)
+{
+    char *text;
+    va_list ap;
+    va_start(ap, format);
+    int length = redisvFormatCommand(&text, format, ap);
+    va_end(ap);
+    if (length < 0) {
+        return REDIS_ERR;
+    }
+    return submit(allocate(fn, privdata, false), text, length);
+}
+
+int ManagedRedisClient::write_argv(redisCallbackFn *fn, void *privdata, int argc,
+                                   const char **argv, const size_t *argvlen)
+{
+    char *text;
+    int length = redisFormatCommandArgv(&text, argc, argv, argvlen);
+    if (length < 0) {
+        return REDIS_ERR;
+    }
+    return submit(allocate(fn, privdata, false), text, length);
+}
+
+int ManagedRedisClient::read(redisCallbackFn *fn, void *privdata, CommandBuilder& builder)
+{
+    if (!builder.complete()) {
+        return REDIS_ERR;
+    }
+    return submit(allocate(fn, privdata, true), builder);
+}
+
+int ManagedRedisClient::write(redisCallbackFn *fn, void *privdata, CommandBuilder& builder)
+{
+    if (!builder.complete()) {
+        return REDIS_ERR;
+    }
+    return submit(allocate(fn, privdata, false), builder);
+}
+
+int ManagedRedisClient::subscribe(redisCallbackFn *fn, void *privdata, const char *format, ...)
+{
+    if (state_ != CONNECTED) {
+        return REDIS_ERR;
+    }
+    va_list ap;
+    va_start(ap, format);
+    int status = redisvAsyncCommand(context_, fn, privdata, format, ap);
+    va_end(ap);
+    return status;
+}
+
+void ManagedRedisClient::stop()
+{
+    state_ = STOPPED;
+    reconnect_.cancel();
+    sweep_.cancel();
+    while (!buffered_.empty()) {
+        fail(buffered_.front());
+        buffered_.pop_front();
+    }
+    if (client_) {
+        client_->stop();
+    }
+}
+
+void ManagedRedisClient::disconnect()
+{
+    if (context_ != NULL) {
+        redisAsyncContext *ac = context_;
+        context_ = NULL;
+        redisAsyncDisconnect(ac);
+    }
+}
+
+ManagedRedisClient::Command *ManagedRedisClient::allocate(redisCallbackFn *fn, void *privdata,
+                                                          bool idempotent)
+{
+    Command *command;
+    if (free_.empty()) {
+        commands_.emplace_back(new Command);
+        command = commands_.back().get();
+        command->client = this;
+    } else {
+        command = free_.back();
+        free_.pop_back();
+    }
+    command->fn = fn;
+    command->privdata = privdata;
+    command->idempotent = idempotent;
+    command->issued = Clock::now();
+    return command;
+}
+
+void ManagedRedisClient::release(Command *command)
+{
+    /*keeps its capacity for the next command*/
+    command->text.clear();
+    free_.push_back(command);
+}
+
+int ManagedRedisClient::submit(Command *command, char *text, int length)
+{
+    command->text.assign(text, length);
+    free(text);
+    return dispatch(command);
+}
+
+int ManagedRedisClient::submit(Command *command, CommandBuilder& builder)
+{
+    /*the builder gets the buffer of a released command to fill next*/
+    command->text.swap(builder.text());
+    builder.text().clear();
+    return dispatch(command);
+}
+
+int ManagedRedisClient::dispatch(Command *command)
+{
+    if (state_ == CONNECTED) {
+        send(command);
+    } else if (command->idempotent && state_ != STOPPED && buffered_.size() < limit_) {
+        buffered_.push_back(command);
+        sweep();
+    } else {
+        fail(command);
+    }
+    return REDIS_OK;
+}
+
+void ManagedRedisClient::send(Command *command)
+{
+    bool flat = std::find(flat_.begin(), flat_.end(), command->fn) != flat_.end();
+    if (redisAsyncFormattedCommand(context_, flat ? replied_flat : replied, command,
+                                   command->text.data(), command->text.size()) != REDIS_OK) {
+        /*the connection is on its way out, wait for the next one*/
+        if (command->idempotent && buffered_.size() < limit_) {
+            buffered_.push_back(command);
+        } else {
+            fail(command);
+        }
+    }
+}
+
+bool ManagedRedisClient::expired(const Command *command, Clock::time_point now) const
+{
+    return now - command->issued > window_;
+}
+
+void ManagedRedisClient::complete(redisAsyncContext *ac, Command *command, void *reply)
+{
+    /*hiredis answers whatever was in flight with NULL when the connection
+     *goes away, reads get another go on the next connection*/
+    if (reply == NULL && command->idempotent && state_ != STOPPED &&
+        !expired(command, Clock::now()) && buffered_.size() < limit_) {
+        buffered_.push_back(command);
+        return;
+    }
+    if (reply == NULL) {
+        failed_++;
+    }
+    redisCallbackFn *fn = command->fn;
+    void *privdata = command->privdata;
+    release(command);
+    if (fn != NULL) {
+        fn(ac, reply, privdata);
+    }
+}
+
+void ManagedRedisClient::fail(Command *command)
+{
+    failing_.push_back(command);
+    if (!failPosted_) {
+        failPosted_ = true;
+        io_service_.post([this]() { fail_posted(); });
+    }
+}
+
+void ManagedRedisClient::fail_posted()
+{
+    failPosted_ = false;
+    failingNow_.swap(failing_);
+    for (Command *command : failingNow_) {
+        failed_++;
+        redisCallbackFn *fn = command->fn;
+        void *privdata = command->privdata;
+        release(command);
+        if (fn != NULL) {
+            fn(context_, NULL, privdata);
+        }
+    }
+    failingNow_.clear();
+}
+
+void ManagedRedisClient::attempt()
+{
+    redisAsyncContext *ac = (port_ == 0) ? redisAsyncConnectUnix(address_.c_str())
+                                         : redisAsyncConnect(address_.c_str(), port_);
+    if (ac == NULL || ac->err) {
+        errstr_ = (ac == NULL) ? "could not allocate context" : ac->errstr;
+        if (ac != NULL) {
+            redisAsyncFree(ac);
+        }
+        BOOST_LOG_TRIVIAL(error) << "Could not connect to redis " << errstr_;
+        schedule_reconnect();
+        return;
+    }
+    state_ = CONNECTING;
+    context_ = ac;
+    client_.reset(new redisBoostClient(io_service_, ac));
+    client_->data = this;
+    if (!flat_.empty()) {
+        client_->decode_flat(replied_flat);
+    }
+    /*after the adapter is in place: setting the connect callback is what
+     *makes hiredis wait for the connection to complete*/
+    redisAsyncSetConnectCallback(ac, connect_callback);
+    redisAsyncSetDisconnectCallback(ac, disconnect_callback);
+}
+
+void ManagedRedisClient::up()
+{
+    state_ = CONNECTED;
+    attempts_ = 0;
+    retired_.reset();
+    if (connectedOnce_) {
+        reconnects_++;
+    }
+    connectedOnce_ = true;
+    BOOST_LOG_TRIVIAL(info) << "Connected with redis";
+
+    Clock::time_point now = Clock::now();
+    while (!buffered_.empty() && state_ == CONNECTED) {
+        Command *command = buffered_.front();
+        buffered_.pop_front();
+        if (expired(command, now)) {
+            fail(command);
+        } else {
+            replayed_++;
+            send(command);
+        }
+    }
+    for (auto& hook : connectHooks_) {
+        hook();
+    }
+}
+
+void ManagedRedisClient::lost()
+{
+    bool wasConnected = (state_ == CONNECTED);
+    state_ = DISCONNECTED;
+    context_ = NULL;
+    retired_ = std::move(client_);
+    if (wasConnected) {
+        BOOST_LOG_TRIVIAL(error) << "Lost connection to redis, reconnecting";
+        for (auto& hook : disconnectHooks_) {
+            hook();
+        }
+    }
+    schedule_reconnect();
+    if (!buffered_.empty()) {
+        sweep();
+    }
+}
+
+void ManagedRedisClient::schedule_reconnect()
+{
+    Clock::duration cap = minBackoff_;
+    for (uint32_t i = 0; i < attempts_ && cap < maxBackoff_; i++) {
+        cap *= 2;
+    }
+    cap = std::min(cap, maxBackoff_);
+    attempts_++;
+
+    /*anywhere from half the backoff to all of it, so that servers that
+     *lost Redis together do not all come back at once*/
+    std::uniform_int_distribution<Clock::rep> jitter(cap.count() / 2, cap.count());
+    reconnect_.expires_from_now(posix(Clock::duration(jitter(random_))));
+    reconnect_.async_wait([this](const boost::system::error_code& ec) {
+        if (!ec && state_ == DISCONNECTED) {
+            attempt();
+        }
+    });
+}
+
+void ManagedRedisClient::sweep()
+{
+    if (sweeping_) {
+        return;
+    }
+    sweeping_ = true;
+    sweep_.expires_from_now(boost::posix_time::milliseconds(SWEEP_MS));
+    sweep_.async_wait([this](const boost::system::error_code& ec) {
+        sweeping_ = false;
+        if (ec || state_ == CONNECTED) {
+            return;
+        }
+        Clock::time_point now = Clock::now();
+        for (size_t i = buffered_.size(); i > 0; i--) {
+            Command *command = buffered_.front();
+            buffered_.pop_front();
+            if (expired(command, now)) {
+                fail(command);
+            } else {
+                buffered_.push_back(command);
+            }
+        }
+        if (!buffered_.empty()) {
+            sweep();
+        }
+    });
+}
+
+void ManagedRedisClient::replied(redisAsyncContext *ac, void *reply, void *privdata)
+{
+    Command *command = (Command*)privdata;
+    command->client->complete(ac, command, reply);
+}
+
+/*same as replied, hiredis tells the two apart by address*/
+void ManagedRedisClient::replied_flat(redisAsyncContext *ac, void *reply, void *privdata)
+{
+    Command *command = (Command*)privdata;
+    command->client->complete(ac, command, reply);
+}
+
+void ManagedRedisClient::connect_callback(const redisAsyncContext *ac, int status)
+{
+    ManagedRedisClient *client = (ManagedRedisClient*)((redisBoostClient*)ac->data)->data;
+    /*some hiredis versions also report a failed connection as a disconnect*/
+    if (ac != client->context_ || client->state_ == STOPPED) {
+        return;
+    }
+    if (status != REDIS_OK) {
+        client->errstr_ = ac->errstr;
+        BOOST_LOG_TRIVIAL(error) << "Could not connect to redis " << client->errstr_;
+        client->lost();
+        return;
+    }
+    client->up();
+}
+
+void ManagedRedisClient::disconnect_callback(const redisAsyncContext *ac, int status)
+{
+    ManagedRedisClient *client = (ManagedRedisClient*)((redisBoostClient*)ac->data)->data;
+    if (ac != client->context_ || client->state_ == STOPPED) {
+        return;
+    }
+    if (status != REDIS_OK) {
+        client->errstr_ = ac->errstr;
+        BOOST_LOG_TRIVIAL(error) << "Disconnected from redis " << client->errstr_;
+    }
+    client->lost();
+}
+}
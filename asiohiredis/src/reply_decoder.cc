@@ -0,0 +1,175 @@
+#include "reply_decoder.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace asio_redis {
+namespace {
+/* hiredis's default functions are shared by every reader, freeObject has
+ * no way to find a decoder so keep them here */
+redisReplyObjectFunctions *defaultFunctions = NULL;
+}
+
+FlatReply::FlatReply() : magic_(ReplyDecoder::FLAT_MAGIC)
+{
+    clear();
+}
+
+void FlatReply::clear()
+{
+    root_.type = REDIS_REPLY_NIL;
+    root_.integer = 0;
+    root_.offset = 0;
+    root_.length = 0;
+    root_.elements = 0;
+    elements_.clear();
+    arena_.clear();
+}
+
+FlatReply::Element& FlatReply::add(int type)
+{
+    Element e;
+    e.type = type;
+    e.integer = 0;
+    e.offset = 0;
+    e.length = 0;
+    e.elements = 0;
+    elements_.push_back(e);
+    return elements_.back();
+}
+
+void FlatReply::set_string(Element& e, const char* s, size_t length)
+{
+    e.offset = arena_.size();
+    e.length = length;
+    arena_.insert(arena_.end(), s, s + length);
+    arena_.push_back('\0');
+}
+
+bool FlatReply::equals(size_t i, const char* s, size_t length) const
+{
+    const Element& e = elements_[i];
+    return e.length == length && memcmp(str(e), s, length) == 0;
+}
+
+bool FlatReply::equals(const char* s, size_t length) const
+{
+    return root_.length == length && memcmp(str(root_), s, length) == 0;
+}
+
+ReplyDecoder::ReplyDecoder(redisAsyncContext *ac)
+               : context_(ac), flat_(false)
+{
+    redisReader *reader = ac->c.reader;
+    original_ = reader->fn;
+    if (defaultFunctions == NULL) {
+        defaultFunctions = original_;
+    }
+    functions_.createString = createString;
+    functions_.createArray = createArray;
+    functions_.createInteger = createInteger;
+    functions_.createNil = createNil;
+    functions_.freeObject = freeObject;
+    reader->fn = &functions_;
+    /*handed to every task*/
+    reader->privdata = this;
+}
+
+ReplyDecoder::~ReplyDecoder()
+{
+    if (context_ == NULL) {
+        return;
+    }
+    redisReader *reader = context_->c.reader;
+    if (reader != NULL && reader->fn == &functions_) {
+        reader->fn = original_;
+        reader->privdata = NULL;
+    }
+}
+
+void ReplyDecoder::add(redisCallbackFn *fn)
+{
+    if (std::find(callbacks_.begin(), callbacks_.end(), fn) == callbacks_.end()) {
+        callbacks_.push_back(fn);
+    }
+}
+
+/* The first object created for a reply has no parent. Replies come back in
+ * the order commands were sent, and the callback for a reply is only taken
+ * off the list once it is read, so the head of the list is the command
+ * this reply is for. */
+bool ReplyDecoder::start(const redisReadTask *task)
+{
+    if (task->parent == NULL) {
+        redisCallback *cb = context_->replies.head;
+        flat_ = (cb != NULL &&
+                 std::find(callbacks_.begin(), callbacks_.end(), cb->fn) != callbacks_.end());
+        if (flat_) {
+            reply_.clear();
+        }
+    }
+    return flat_;
+}
+
+void *ReplyDecoder::createString(const redisReadTask *task, char *str, size_t len)
+{
+    ReplyDecoder *d = (ReplyDecoder*)task->privdata;
+    if (!d->start(task)) {
+        return d->original_->createString(task, str, len);
+    }
+    FlatReply::Element& e = (task->parent == NULL) ? d->reply_.root_ : d->reply_.add(task->type);
+    e.type = task->type;
+    d->reply_.set_string(e, str, len);
+    return &d->reply_;
+}
+
+void *ReplyDecoder::createArray(const redisReadTask *task, int elements)
+{
+    ReplyDecoder *d = (ReplyDecoder*)task->privdata;
+    if (!d->start(task)) {
+        return d->original_->createArray(task, elements);
+    }
+    FlatReply::Element& e = (task->parent == NULL) ? d->reply_.root_ : d->reply_.add(REDIS_REPLY_ARRAY);
+    e.type = REDIS_REPLY_ARRAY;
+    e.elements = elements;
+    if (task->parent == NULL) {
+        d->reply_.elements_.reserve(elements);
+    }
+    return &d->reply_;
+}
+
+void *ReplyDecoder::createInteger(const redisReadTask *task, long long value)
+{
+    ReplyDecoder *d = (ReplyDecoder*)task->privdata;
+    if (!d->start(task)) {
+        return d->original_->createInteger(task, value);
+    }
+    FlatReply::Element& e = (task->parent == NULL) ? d->reply_.root_ : d->reply_.add(REDIS_REPLY_INTEGER);
+    e.type = REDIS_REPLY_INTEGER;
+    e.integer = value;
+    return &d->reply_;
+}
+
+void *ReplyDecoder::createNil(const redisReadTask *task)
+{
+    ReplyDecoder *d = (ReplyDecoder*)task->privdata;
+    if (!d->start(task)) {
+        return d->original_->createNil(task);
+    }
+    FlatReply::Element& e = (task->parent == NULL) ? d->reply_.root_ : d->reply_.add(REDIS_REPLY_NIL);
+    e.type = REDIS_REPLY_NIL;
+    return &d->reply_;
+}
+
+void ReplyDecoder::freeObject(void *obj)
+{
+    if (obj == NULL) {
+        return;
+    }
+    /*flat replies are reused, nothing to free*/
+    if (*(int*)obj == FLAT_MAGIC) {
+        return;
+    }
+    defaultFunctions->freeObject(obj);
+}
+}
@@ -0,0 +1,360 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <cstdlib>
+#include <cstring>
+#include "bulk_loader.h"
+
+namespace {
+void put_le (std::ostream& out, uint64_t value, size_t bytes) {
+    char buffer[8];
+    for (size_t i = 0; i < bytes; i++) {
+        buffer[i] = (char)((value >> (8 * i)) & 0xff);
+    }
+    out.write (buffer, bytes);
+}
+
+bool get_le (std::istream& in, uint64_t& value, size_t bytes) {
+    char buffer[8];
+    if (!in.read (buffer, bytes)) {
+        return false;
+    }
+    value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        value |= (uint64_t)(unsigned char)buffer[i] << (8 * i);
+    }
+    return true;
+}
+
+bool parse_token (const char* text, size_t length, uint64_t& token) {
+    if (length == 0 || length > 20) {
+        return false;
+    }
+    char buffer[21];
+    memcpy (buffer, text, length);
+    buffer[length] = '\0';
+    char* end = nullptr;
+    token = strtoull (buffer, &end, 10);
+    return end == buffer + length;
+}
+
+// Credentials longer than this in a binary file mean it is not one
+const uint64_t MAX_CREDENTIAL = 1 << 20;
+}
+
+namespace hlv {
+namespace service {
+namespace admin {
+BulkLoader::BulkLoader (redisContext* context,
+                        const std::string& prefix,
+                        const BulkOptions& options) :
+    context_ (context),
+    prefix_ (prefix),
+    options_ (options),
+    inBatch_ (0),
+    done_ (0),
+    errors_ (0),
+    reported_ (0),
+    start_ (Clock::now ()),
+    lastReport_ (start_) {
+}
+
+bool BulkLoader::append (int argc, const char** argv, const size_t* argvlen,
+                         uint32_t weight) {
+    if (redisAppendCommandArgv (context_, argc, argv, argvlen) != REDIS_OK) {
+        std::cerr << "Could not queue command: " << context_->errstr << std::endl;
+        return false;
+    }
+    outstanding_.push_back (weight);
+    // Replies are read as they come in, keeping window commands in flight
+    // (reading also sends what has been queued so far)
+    while (outstanding_.size () > options_.window) {
+        if (!read_reply ()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BulkLoader::read_reply () {
+    void* r = nullptr;
+    if (redisGetReply (context_, &r) != REDIS_OK || r == nullptr) {
+        std::cerr << "Lost Redis: " << context_->errstr << std::endl;
+        return false;
+    }
+    redisReply* reply = (redisReply*)r;
+    uint32_t weight = outstanding_.front ();
+    outstanding_.pop_front ();
+    // MULTI and queued commands weigh nothing, how they fared shows in
+    // the EXEC reply
+    if (weight > 0) {
+        if (reply->type == REDIS_REPLY_ARRAY) {
+            uint32_t failed = 0;
+            for (size_t i = 0; i < reply->elements; i++) {
+                if (reply->element[i]->type == REDIS_REPLY_ERROR) {
+                    failed++;
+                }
+            }
+            errors_ += failed;
+            done_ += weight - failed;
+        } else if (reply->type == REDIS_REPLY_ERROR ||
+                   reply->type == REDIS_REPLY_NIL) {
+            if (errors_ == 0) {
+                std::cerr << "Redis refused "
+                          << (reply->type == REDIS_REPLY_ERROR ? reply->str : "a batch")
+                          << std::endl;
+            }
+            errors_ += weight;
+        } else {
+            done_ += weight;
+        }
+    }
+    freeReplyObject (reply);
+    return true;
+}
+
+bool BulkLoader::put (const std::string& credential, uint64_t token) {
+    key_.assign (prefix_);
+    key_.push_back (':');
+    key_.append (credential);
+    value_ = std::to_string (token);
+    if (options_.multi && inBatch_ == 0) {
+        const char* argv[] = {"MULTI"};
+        const size_t argvlen[] = {5};
+        if (!append (1, argv, argvlen, 0)) {
+            return false;
+        }
+    }
+    const char* argv[] = {"SET", key_.data (), value_.data ()};
+    const size_t argvlen[] = {3, key_.size (), value_.size ()};
+    if (!append (3, argv, argvlen, options_.multi ? 0 : 1)) {
+        return false;
+    }
+    if (options_.multi && ++inBatch_ >= options_.batch) {
+        return end_batch ();
+    }
+    report ("imported", false);
+    return true;
+}
+
+bool BulkLoader::remove (const std::string& credential) {
+    key_.assign (prefix_);
+    key_.push_back (':');
+    key_.append (credential);
+    const char* argv[] = {"DEL", key_.data ()};
+    const size_t argvlen[] = {3, key_.size ()};
+    return append (2, argv, argvlen, 1);
+}
+
+bool BulkLoader::end_batch () {
+    if (inBatch_ == 0) {
+        return true;
+    }
+    uint32_t weight = inBatch_;
+    inBatch_ = 0;
+    const char* argv[] = {"EXEC"};
+    const size_t argvlen[] = {4};
+    if (!append (1, argv, argvlen, weight)) {
+        return false;
+    }
+    report ("imported", false);
+    return true;
+}
+
+bool BulkLoader::finish () {
+    if (!end_batch ()) {
+        return false;
+    }
+    while (!outstanding_.empty ()) {
+        if (!read_reply ()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BulkLoader::parse_csv (const std::string& line,
+                            std::string& credential,
+                            uint64_t& token) {
+    size_t last = line.rfind (',');
+    if (last == std::string::npos ||
+        !parse_token (line.data () + last + 1, line.size () - last - 1, token)) {
+        return false;
+    }
+    size_t first = line.find (',');
+    credential.assign (line, 0, first);
+    if (first != last) {
+        // user,password,token
+        credential.append (line, first + 1, last - first - 1);
+    }
+    return true;
+}
+
+bool BulkLoader::import (std::istream& in, Format format) {
+    start_ = lastReport_ = Clock::now ();
+    std::string line;
+    std::string credential;
+    uint64_t token = 0;
+    uint64_t records = 0;
+    if (format == Format::CSV) {
+        while (std::getline (in, line)) {
+            records++;
+            if (!line.empty () && line.back () == '\r') {
+                line.pop_back ();
+            }
+            if (line.empty ()) {
+                continue;
+            }
+            if (!parse_csv (line, credential, token)) {
+                std::cerr << "Skipping line " << records << ": " << line << std::endl;
+                errors_++;
+                continue;
+            }
+            if (!put (credential, token)) {
+                return false;
+            }
+        }
+    } else {
+        uint64_t length = 0;
+        while (get_le (in, length, 4)) {
+            records++;
+            if (length > MAX_CREDENTIAL) {
+                std::cerr << "Record " << records << " is " << length
+                          << " bytes long, not a credential file?" << std::endl;
+                return false;
+            }
+            credential.resize (length);
+            if (!in.read (&credential[0], length) || !get_le (in, token, 8)) {
+                std::cerr << "Truncated record " << records << std::endl;
+                return false;
+            }
+            if (!put (credential, token)) {
+                return false;
+            }
+        }
+    }
+    bool ok = finish ();
+    report ("imported", true);
+    return ok;
+}
+
+bool BulkLoader::export_to (std::ostream& out, Format format) {
+    start_ = lastReport_ = Clock::now ();
+    std::string pattern = prefix_ + ":*";
+    std::string count = std::to_string (options_.batch);
+    std::string cursor = "0";
+    std::vector<std::string> keys;
+    std::vector<const char*> argv;
+    std::vector<size_t> argvlen;
+
+    if (redisAppendCommand (context_, "SCAN %s MATCH %b COUNT %s", cursor.c_str (),
+                            pattern.data (), pattern.size (), count.c_str ()) != REDIS_OK) {
+        return false;
+    }
+    bool scanning = true;
+    while (scanning) {
+        void* r = nullptr;
+        if (redisGetReply (context_, &r) != REDIS_OK || r == nullptr) {
+            std::cerr << "Lost Redis: " << context_->errstr << std::endl;
+            return false;
+        }
+        redisReply* reply = (redisReply*)r;
+        if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
+            std::cerr << "Unexpected reply to SCAN" << std::endl;
+            freeReplyObject (reply);
+            return false;
+        }
+        cursor.assign (reply->element[0]->str, reply->element[0]->len);
+        keys.clear ();
+        redisReply* found = reply->element[1];
+        for (size_t i = 0; i < found->elements; i++) {
+            keys.emplace_back (found->element[i]->str, found->element[i]->len);
+        }
+        freeReplyObject (reply);
+        scanning = (cursor != "0");
+
+        // The values of this batch and the next batch of keys in one round
+        // trip
+        if (!keys.empty ()) {
+            argv.assign (1, "MGET");
+            argvlen.assign (1, 4);
+            for (auto& key : keys) {
+                argv.push_back (key.data ());
+                argvlen.push_back (key.size ());
+            }
+            redisAppendCommandArgv (context_, argv.size (), argv.data (), argvlen.data ());
+        }
+        if (scanning) {
+            redisAppendCommand (context_, "SCAN %s MATCH %b COUNT %s", cursor.c_str (),
+                                pattern.data (), pattern.size (), count.c_str ());
+        }
+        if (keys.empty ()) {
+            continue;
+        }
+
+        if (redisGetReply (context_, &r) != REDIS_OK || r == nullptr) {
+            std::cerr << "Lost Redis: " << context_->errstr << std::endl;
+            return false;
+        }
+        reply = (redisReply*)r;
+        if (reply->type != REDIS_REPLY_ARRAY || reply->elements != keys.size ()) {
+            std::cerr << "Unexpected reply to MGET" << std::endl;
+            freeReplyObject (reply);
+            return false;
+        }
+        for (size_t i = 0; i < keys.size (); i++) {
+            redisReply* value = reply->element[i];
+            uint64_t token = 0;
+            if (value->type != REDIS_REPLY_STRING ||
+                !parse_token (value->str, value->len, token)) {
+                // Deleted since the SCAN, or not a credential
+                continue;
+            }
+            const char* credential = keys[i].data () + prefix_.size () + 1;
+            size_t length = keys[i].size () - prefix_.size () - 1;
+            if (format == Format::CSV) {
+                out.write (credential, length);
+                out << ',' << token << '\n';
+            } else {
+                put_le (out, length, 4);
+                out.write (credential, length);
+                put_le (out, token, 8);
+            }
+            done_++;
+        }
+        freeReplyObject (reply);
+        report ("exported", false);
+        if (!out) {
+            std::cerr << "Could not write export" << std::endl;
+            return false;
+        }
+    }
+    out.flush ();
+    report ("exported", true);
+    return true;
+}
+
+void BulkLoader::report (const char* what, bool final) {
+    if (!options_.progress) {
+        return;
+    }
+    // Cheap enough to call for every record, the clock is only read once
+    // in a while
+    if (!final && done_ + errors_ - reported_ < 1000) {
+        return;
+    }
+    reported_ = done_ + errors_;
+    Clock::time_point now = Clock::now ();
+    if (!final && now - lastReport_ < std::chrono::seconds (1)) {
+        return;
+    }
+    lastReport_ = now;
+    double seconds = std::chrono::duration<double> (now - start_).count ();
+    std::cerr << "\r" << what << " " << done_ << " (" << errors_ << " errors), "
+              << (uint64_t)(seconds > 0 ? done_ / seconds : 0) << "/s";
+    if (final) {
+        std::cerr << " in " << seconds << "s" << std::endl;
+    }
+}
+} // namespace admin
+} // namespace service
+} // namespace hlv
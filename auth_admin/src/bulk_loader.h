@@ -0,0 +1,115 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <hiredis/hiredis.h>
+#ifndef _HLV_AUTH_BULK_LOADER_H_
+#define _HLV_AUTH_BULK_LOADER_H_
+namespace hlv {
+namespace service {
+namespace admin {
+
+/// Credentials move in and out of Redis as either
+///  - CSV, one per line: user,password,token or credential,token (the
+///    credential is user and password run together, as exported). Lines
+///    holding more than two commas cannot be told apart, use binary.
+///  - binary records: credential length (uint32 little endian),
+///    credential, token (uint64 little endian).
+enum class Format { CSV, BINARY };
+
+struct BulkOptions {
+    // Commands sent ahead of their replies
+    size_t window;
+    // Keys per SCAN/MGET when exporting, SETs per MULTI/EXEC when importing
+    size_t batch;
+    // Import in MULTI/EXEC batches, so each batch is applied whole or not
+    // at all
+    bool multi;
+    // Report progress on stderr
+    bool progress;
+    BulkOptions () :
+        window (10000),
+        batch (1000),
+        multi (false),
+        progress (true) {
+    }
+};
+
+/// Moves credentials (the prefix:credential -> token keys read by redis_auth)
+/// in bulk over one pipelined connection. Commands are sent window ahead of
+/// their replies, so a million of them cost a handful of round trips instead
+/// of a million.
+class BulkLoader {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    BulkLoader () = delete;
+    BulkLoader (const BulkLoader&) = delete;
+    BulkLoader& operator= (const BulkLoader&) = delete;
+
+    BulkLoader (redisContext* context,
+                const std::string& prefix,
+                const BulkOptions& options);
+
+    /// Store every credential read from in, false if reading or Redis failed
+    bool import (std::istream& in, Format format);
+
+    /// Write every credential under the prefix to out. SCAN may return a key
+    /// more than once, so may the export.
+    bool export_to (std::ostream& out, Format format);
+
+    /// Store one credential (queued, see finish)
+    bool put (const std::string& credential, uint64_t token);
+
+    /// Delete one credential (queued, see finish)
+    bool remove (const std::string& credential);
+
+    /// Wait for every queued command, false if the connection failed
+    bool finish ();
+
+    /// Records applied, and records Redis refused
+    uint64_t done () const { return done_; }
+    uint64_t errors () const { return errors_; }
+
+  private:
+    // Send a command; weight is how many records its reply settles
+    bool append (int argc, const char** argv, const size_t* argvlen,
+                 uint32_t weight);
+
+    // Read the oldest outstanding reply
+    bool read_reply ();
+
+    // Close the current MULTI batch
+    bool end_batch ();
+
+    // Report progress, at most once a second unless final
+    void report (const char* what, bool final);
+
+    bool parse_csv (const std::string& line,
+                    std::string& credential,
+                    uint64_t& token);
+
+    redisContext* context_;
+    const std::string prefix_;
+    const BulkOptions options_;
+    // Weights of the commands sent and not yet answered, oldest first
+    std::deque<uint32_t> outstanding_;
+    // SETs in the open MULTI batch
+    uint32_t inBatch_;
+    // Reused to build keys
+    std::string key_;
+    std::string value_;
+    uint64_t done_;
+    uint64_t errors_;
+    uint64_t reported_;
+    Clock::time_point start_;
+    Clock::time_point lastReport_;
+};
+} // namespace admin
+} // namespace service
+} // namespace hlv
+#endif
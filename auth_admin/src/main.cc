@@ -1,13 +1,88 @@
 // Copyright 20xx The Regents of the University of California
 // This is a test service for SDN-v2 High Level Virtualization
+#include <chrono>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <string>
 #include <boost/program_options.hpp>
 #include <hiredis/hiredis.h>
+#include "bulk_loader.h"
 #include "consts.h"
 
 namespace po = boost::program_options;
+using hlv::service::admin::BulkLoader;
+using hlv::service::admin::BulkOptions;
+using hlv::service::admin::Format;
+
+namespace {
+// Discards everything, for exports that are only timed
+class NullBuffer : public std::streambuf {
+  protected:
+    int overflow (int c) override { return c; }
+    std::streamsize xsputn (const char*, std::streamsize n) override { return n; }
+};
+
+double seconds_since (std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double> (std::chrono::steady_clock::now () - start).count ();
+}
+
+// Import count made up credentials, export them and delete them again,
+// reporting the rate of each
+int bench (redisContext* c,
+           const std::string& prefix,
+           const BulkOptions& options,
+           uint64_t count) {
+    std::string credential;
+    auto start = std::chrono::steady_clock::now ();
+    {
+        BulkLoader loader (c, prefix, options);
+        for (uint64_t i = 0; i < count; i++) {
+            credential = "benchuser" + std::to_string (i) + "benchpassword";
+            if (!loader.put (credential, i)) {
+                return 1;
+            }
+        }
+        if (!loader.finish ()) {
+            return 1;
+        }
+        double elapsed = seconds_since (start);
+        std::cout << "import " << loader.done () << " in " << elapsed << "s, "
+                  << (uint64_t)(loader.done () / elapsed) << "/s, "
+                  << loader.errors () << " errors" << std::endl;
+    }
+    start = std::chrono::steady_clock::now ();
+    {
+        NullBuffer null;
+        std::ostream out (&null);
+        BulkLoader loader (c, prefix, options);
+        if (!loader.export_to (out, Format::BINARY)) {
+            return 1;
+        }
+        double elapsed = seconds_since (start);
+        std::cout << "export " << loader.done () << " in " << elapsed << "s, "
+                  << (uint64_t)(loader.done () / elapsed) << "/s" << std::endl;
+    }
+    start = std::chrono::steady_clock::now ();
+    {
+        BulkLoader loader (c, prefix, options);
+        for (uint64_t i = 0; i < count; i++) {
+            credential = "benchuser" + std::to_string (i) + "benchpassword";
+            if (!loader.remove (credential)) {
+                return 1;
+            }
+        }
+        if (!loader.finish ()) {
+            return 1;
+        }
+        double elapsed = seconds_since (start);
+        std::cout << "delete " << loader.done () << " in " << elapsed << "s, "
+                  << (uint64_t)(loader.done () / elapsed) << "/s" << std::endl;
+    }
+    return 0;
+}
+}
+
 int
 main (int argc, char* argv[]) {
     // Option processing
@@ -21,6 +96,22 @@ main (int argc, char* argv[]) {
         ("raddress,r", po::value<std::string>(&redisAddress)->implicit_value("127.0.0.1"), "Redis server")
         ("rport", po::value<int32_t>(&redisPort)->implicit_value(6379), "Redis port")
         ("name,n", po::value<std::string>(&servicename)->implicit_value(servicename), "Service name"); 
+    std::string importFile;
+    std::string exportFile;
+    std::string format = "csv";
+    uint64_t benchCount = 0;
+    BulkOptions bulk;
+    po::options_description bulkDesc("Bulk options");
+    bulkDesc.add_options()
+        ("import", po::value<std::string>(&importFile), "Import credentials from file (- for stdin)")
+        ("export", po::value<std::string>(&exportFile), "Export credentials to file (- for stdout)")
+        ("format", po::value<std::string>(&format), "csv or binary")
+        ("window", po::value<size_t>(&bulk.window), "Commands sent ahead of their replies")
+        ("batch", po::value<size_t>(&bulk.batch), "Keys per SCAN or per MULTI batch")
+        ("multi", "Import in MULTI/EXEC batches")
+        ("quiet,q", "Do not report progress")
+        ("bench", po::value<uint64_t>(&benchCount), "Import, export and delete this many made up credentials");
+    desc.add(bulkDesc);
     std::string user;
     std::string passwd;
     uint64_t token;
@@ -45,11 +136,25 @@ main (int argc, char* argv[]) {
             options(options).positional(positional).run(), vm);
     po::notify(vm);
 
-    if (vm.count("help") || !vm.count("username") || !vm.count("password") || !vm.count("token")) {
+    bool bulkMode = vm.count("import") || vm.count("export") || vm.count("bench");
+    if (vm.count("help") ||
+        (!bulkMode && (!vm.count("username") || !vm.count("password") || !vm.count("token")))) {
         std::cerr << "Usage: redis_auth_admin <options> username password token" << std::endl; 
+        std::cerr << "       redis_auth_admin <options> --import|--export file" << std::endl; 
         std::cerr << desc;
         return 0;
     }
+    if (format != "csv" && format != "binary") {
+        std::cerr << "Unknown format " << format << std::endl;
+        return 1;
+    }
+    Format fileFormat = (format == "csv" ? Format::CSV : Format::BINARY);
+    bulk.multi = vm.count("multi");
+    bulk.progress = !vm.count("quiet");
+    if (bulk.window == 0 || bulk.batch == 0) {
+        std::cerr << "window and batch must be positive" << std::endl;
+        return 1;
+    }
     //
     // Connect to redis
     redisContext *c  = redisConnect(redisAddress.c_str(), redisPort);
@@ -62,6 +167,37 @@ main (int argc, char* argv[]) {
         std::cerr << "Error connecting to redis " << c->errstr;
         return 0;
     }
+    if (bulkMode) {
+        int result = 0;
+        if (vm.count("bench")) {
+            result = bench (c, servicename, bulk, benchCount);
+        } else if (vm.count("import")) {
+            std::ifstream file;
+            if (importFile != "-") {
+                file.open (importFile, std::ios::in | std::ios::binary);
+                if (!file) {
+                    std::cerr << "Could not open " << importFile << std::endl;
+                    return 1;
+                }
+            }
+            BulkLoader loader (c, servicename, bulk);
+            result = loader.import (importFile == "-" ? std::cin : file, fileFormat) &&
+                     loader.errors () == 0 ? 0 : 1;
+        } else {
+            std::ofstream file;
+            if (exportFile != "-") {
+                file.open (exportFile, std::ios::out | std::ios::binary | std::ios::trunc);
+                if (!file) {
+                    std::cerr << "Could not open " << exportFile << std::endl;
+                    return 1;
+                }
+            }
+            BulkLoader loader (c, servicename, bulk);
+            result = loader.export_to (exportFile == "-" ? std::cout : file, fileFormat) ? 0 : 1;
+        }
+        redisFree(c);
+        return result;
+    }
     redisReply* reply = (redisReply*) redisCommand(c, "SET %s:%s%s %lld",
                                 servicename.c_str(), 
                                 user.c_str(), 
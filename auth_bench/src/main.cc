@@ -0,0 +1,136 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/trivial.hpp>
+#include "mux_client.h"
+namespace po = boost::program_options;
+
+namespace {
+// Keeps window authentications outstanding on one connection until the
+// shared count has been sent
+struct Bench {
+    std::shared_ptr<hlv::service::client::MuxClient> client;
+    std::string identity;
+    uint64_t* remaining;
+    uint64_t sent;
+    uint64_t answered;
+    uint64_t errors;
+};
+
+void issue (Bench* bench) {
+    (*bench->remaining)--;
+    // Tell identities apart so that nothing can cache them
+    std::string identity = bench->identity + std::to_string (bench->sent++);
+    bench->client->authenticate (identity, "bench",
+        [bench] (bool success, const hlv_service::ServiceResponse&) {
+            bench->answered++;
+            if (!success) {
+                bench->errors++;
+            }
+            if (*bench->remaining > 0 && bench->client->connected ()) {
+                issue (bench);
+            } else if (bench->answered == bench->sent) {
+                bench->client->stop ();
+            }
+        });
+}
+}
+
+// Measure how many authentications a second an auth service answers, as
+// seen by many clients reconnecting at once
+int main (int argc, char* argv[]) {
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+    boost::log::core::get()->set_filter (
+            boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    po::options_description desc("Auth service benchmark");
+    std::string address = "127.0.0.1";
+    std::string port = "8080";
+    uint64_t count = 100000;
+    uint32_t connections = 16;
+    uint32_t window = 32;
+    std::string identity = "bench";
+
+    desc.add_options()
+        ("help,h", "Display help")
+        ("address,a", po::value<std::string>(&address)->implicit_value(address),
+            "Auth service address")
+        ("port,p", po::value<std::string>(&port)->implicit_value(port),
+            "Auth service port")
+        ("count,n", po::value<uint64_t>(&count)->implicit_value(count),
+            "Authentications to send")
+        ("connections,c", po::value<uint32_t>(&connections)->implicit_value(connections),
+            "Connections to send them on")
+        ("window,w", po::value<uint32_t>(&window)->implicit_value(window),
+            "Authentications outstanding per connection")
+        ("identity,i", po::value<std::string>(&identity)->implicit_value(identity),
+            "Prefix for the identities authenticated");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::cerr << desc << std::endl;
+        return 0;
+    }
+
+    if (window == 0 || connections == 0) {
+        std::cerr << "window and connections must be at least 1" << std::endl;
+        return 1;
+    }
+
+    boost::asio::io_service io_service;
+    uint64_t remaining = count;
+    std::vector<Bench> benches (connections);
+    for (uint32_t i = 0; i < connections; i++) {
+        Bench& bench = benches[i];
+        bench.client = std::make_shared<hlv::service::client::MuxClient> (
+                io_service, address, port);
+        if (!bench.client->connect ()) {
+            std::cerr << "Could not connect to " << address << ":" << port << std::endl;
+            return 1;
+        }
+        bench.identity = identity + "." + std::to_string (i) + ".";
+        bench.remaining = &remaining;
+        bench.sent = bench.answered = bench.errors = 0;
+    }
+
+    auto start = std::chrono::steady_clock::now ();
+    for (uint32_t w = 0; w < window; w++) {
+        for (auto& bench : benches) {
+            if (remaining > 0) {
+                issue (&bench);
+            }
+        }
+    }
+    for (auto& bench : benches) {
+        if (bench.sent == 0) {
+            bench.client->stop ();
+        }
+    }
+    io_service.run ();
+    auto end = std::chrono::steady_clock::now ();
+
+    uint64_t answered = 0, errors = 0;
+    for (auto& bench : benches) {
+        answered += bench.answered;
+        errors += bench.errors;
+    }
+    double usec = std::chrono::duration_cast<std::chrono::microseconds>
+            (end - start).count ();
+    std::cout << answered << " authentications over " << connections
+              << " connections, window " << window << ": "
+              << (usec > 0 ? answered * 1e6 / usec : 0.0) << " auths/s, "
+              << errors << " errors" << std::endl;
+    google::protobuf::ShutdownProtobufLibrary();
+    return errors == 0 && answered == count ? 0 : 1;
+}
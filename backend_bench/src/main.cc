@@ -0,0 +1,327 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/trivial.hpp>
+#include <hiredis/hiredis.h>
+#include <managed_client.h>
+#include "lookup.pb.h"
+#include "lookup_server.h"
+#include "echo_server.h"
+namespace po = boost::program_options;
+using boost::asio::ip::tcp;
+
+namespace {
+// Keeps window requests in flight on one connection, written together,
+// and writes the next window once all of them are answered, until its
+// share of the count has been sent
+struct Bench {
+    std::unique_ptr<tcp::socket> socket;
+    // window requests back to back
+    const std::string* requests;
+    size_t requestSize;
+    // Echoes are as long as the request, lookups are framed
+    bool echo;
+    std::vector<char> buffer;
+    size_t filled;
+    uint64_t remaining;
+    uint64_t outstanding;
+    uint64_t answered;
+    uint64_t errors;
+};
+
+void send_window (Bench* bench);
+
+// Take the responses that arrived whole off the front of the buffer
+void take_responses (Bench* bench) {
+    size_t start = 0;
+    ev_lookup::Response response;
+    while (bench->outstanding > 0) {
+        size_t size;
+        if (bench->echo) {
+            size = bench->requestSize;
+            if (bench->filled - start < size) {
+                break;
+            }
+        } else {
+            uint64_t length;
+            if (bench->filled - start < sizeof(uint64_t)) {
+                break;
+            }
+            memcpy (&length, &bench->buffer[start], sizeof(uint64_t));
+            size = sizeof(uint64_t) + length;
+            if (bench->buffer.size () < size) {
+                bench->buffer.resize (size);
+            }
+            if (bench->filled - start < size) {
+                break;
+            }
+            if (!response.ParseFromArray (&bench->buffer[start + sizeof(uint64_t)], length) ||
+                !response.success ()) {
+                bench->errors++;
+            }
+        }
+        start += size;
+        bench->outstanding--;
+        bench->answered++;
+    }
+    memmove (&bench->buffer[0], &bench->buffer[start], bench->filled - start);
+    bench->filled -= start;
+}
+
+void read_responses (Bench* bench) {
+    bench->socket->async_read_some (
+        boost::asio::buffer (&bench->buffer[bench->filled], bench->buffer.size () - bench->filled),
+        [bench] (boost::system::error_code ec, std::size_t bytes) {
+            if (ec) {
+                std::cerr << "Lost the server " << ec << std::endl;
+                bench->errors += bench->outstanding;
+                return;
+            }
+            bench->filled += bytes;
+            take_responses (bench);
+            if (bench->outstanding > 0) {
+                read_responses (bench);
+            } else if (bench->remaining > 0) {
+                send_window (bench);
+            } else {
+                bench->socket->close ();
+            }
+        });
+}
+
+void send_window (Bench* bench) {
+    size_t window = bench->requests->size () / bench->requestSize;
+    bench->outstanding = std::min ((uint64_t)window, bench->remaining);
+    bench->remaining -= bench->outstanding;
+    boost::asio::async_write (*bench->socket,
+        boost::asio::buffer (bench->requests->data (), bench->outstanding * bench->requestSize),
+        [bench] (boost::system::error_code ec, std::size_t) {
+            if (ec) {
+                std::cerr << "Could not write to the server " << ec << std::endl;
+            }
+        });
+    read_responses (bench);
+}
+
+// Write the key lookups ask for, so that they find it
+bool seed (const std::string& address, uint32_t port,
+           const std::string& prefix, const std::string& key) {
+    redisContext* context = redisConnect (address.c_str (), port);
+    if (!context || context->err) {
+        if (context) {
+            redisFree (context);
+        }
+        return false;
+    }
+    std::string name = prefix + ":" + key;
+    redisReply* reply = (redisReply*)redisCommand (context,
+            "HSET %b ev:perm_bits 0 address 10.0.0.1:8080", name.data (), name.size ());
+    bool ok = reply && reply->type != REDIS_REPLY_ERROR;
+    if (reply) {
+        freeReplyObject (reply);
+    }
+    redisFree (context);
+    return ok;
+}
+}
+
+// Compare the epoll and io_uring backends: serve echoes or lookups (against
+// a real Redis) on one thread with the backend asked for, and measure how
+// many requests a second clients on other threads get answered
+int main (int argc, char* argv[]) {
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+    boost::log::core::get()->set_filter (
+            boost::log::trivial::severity >= boost::log::trivial::warning);
+
+    po::options_description desc("epoll and io_uring server backend benchmark");
+    std::string server = "echo";
+    std::string backend = "epoll";
+    std::string redisAddress = "127.0.0.1";
+    uint32_t redisPort = 6379;
+    std::string prefix = "backend_bench";
+    uint32_t port = 18090;
+    uint64_t count = 1000000;
+    uint32_t connections = 16;
+    uint32_t window = 1;
+    uint32_t size = 64;
+    uint32_t threads = 1;
+
+    desc.add_options()
+        ("help,h", "Display help")
+        ("server,s", po::value<std::string>(&server)->implicit_value(server),
+            "Server to measure, echo or lookup")
+        ("backend,b", po::value<std::string>(&backend)->implicit_value(backend),
+            "Backend the server runs on, epoll or io_uring")
+        ("address,a", po::value<std::string>(&redisAddress)->implicit_value(redisAddress),
+            "Redis address (lookup)")
+        ("rport,r", po::value<uint32_t>(&redisPort)->implicit_value(redisPort),
+            "Redis port (lookup)")
+        ("prefix,x", po::value<std::string>(&prefix)->implicit_value(prefix),
+            "Prefix for the key looked up")
+        ("port,p", po::value<uint32_t>(&port)->implicit_value(port),
+            "Port to serve on")
+        ("count,n", po::value<uint64_t>(&count)->implicit_value(count),
+            "Requests to send")
+        ("connections,c", po::value<uint32_t>(&connections)->implicit_value(connections),
+            "Connections to send them on")
+        ("window,w", po::value<uint32_t>(&window)->implicit_value(window),
+            "Requests written together on a connection")
+        ("size,m", po::value<uint32_t>(&size)->implicit_value(size),
+            "Bytes in an echo")
+        ("threads,t", po::value<uint32_t>(&threads)->implicit_value(threads),
+            "Client threads");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::cerr << desc << std::endl;
+        return 0;
+    }
+
+    if (server != "echo" && server != "lookup") {
+        std::cerr << "Unknown server " << server << std::endl;
+        return 1;
+    }
+    if (backend != "epoll" && backend != "io_uring") {
+        std::cerr << "Unknown backend " << backend << std::endl;
+        return 1;
+    }
+    if (window == 0 || connections == 0 || size == 0 || threads == 0) {
+        std::cerr << "window, connections, size and threads must be at least 1" << std::endl;
+        return 1;
+    }
+    hlv::service::common::Backend serverBackend = backend == "io_uring" ?
+            hlv::service::common::Backend::IO_URING : hlv::service::common::Backend::EPOLL;
+
+    // The server, on a thread of its own
+    boost::asio::io_service io_service;
+    std::unique_ptr<asio_redis::ManagedRedisClient> redis;
+    std::unique_ptr<hlv::service::lookup::server::ConnectionInformation> lookupInformation;
+    std::unique_ptr<hlv::service::lookup::server::Server> lookupServer;
+    hlv::service::echo::server::ConnectionInformation echoInformation;
+    std::unique_ptr<hlv::service::echo::server::Server> echoServer;
+    bool started;
+    if (server == "lookup") {
+        if (!seed (redisAddress, redisPort, prefix, "key")) {
+            std::cerr << "Failed to write the key to redis instance " << redisAddress
+                      << ":" << redisPort << std::endl;
+            return 1;
+        }
+        redis.reset (new asio_redis::ManagedRedisClient (io_service, redisAddress, redisPort));
+        if (!redis->connect ()) {
+            std::cerr << "Failed to connect to redis instance " << redisAddress
+                      << ":" << redisPort << std::endl;
+            return 1;
+        }
+        hlv::service::lookup::server::Connection::decode_replies (*redis);
+        lookupInformation.reset (new hlv::service::lookup::server::ConnectionInformation
+                (0, redisAddress, redisPort, redis.get (), io_service));
+        lookupInformation->add_tenant (std::unique_ptr<hlv::service::lookup::server::Tenant> (
+                new hlv::service::lookup::server::Tenant ("", prefix, prefix + ".local")));
+        lookupServer.reset (new hlv::service::lookup::server::Server (
+                io_service, "127.0.0.1", std::to_string (port), *lookupInformation));
+        started = lookupServer->set_backend (serverBackend);
+        lookupServer->start ();
+    } else {
+        echoServer.reset (new hlv::service::echo::server::Server (
+                io_service, "127.0.0.1", std::to_string (port), echoInformation));
+        started = echoServer->set_backend (serverBackend);
+        echoServer->start ();
+    }
+    if (!started) {
+        std::cerr << "No " << backend << " backend here" << std::endl;
+        return 1;
+    }
+    std::thread serving ([&io_service] { io_service.run (); });
+
+    // The same request over and over
+    std::string request;
+    if (server == "lookup") {
+        ev_lookup::Query query;
+        query.set_type (ev_lookup::Query::GLOBAL);
+        query.set_token (0);
+        query.set_querystring ("key");
+        uint64_t length = query.ByteSize ();
+        request.assign ((const char*)&length, sizeof(uint64_t));
+        request += query.SerializeAsString ();
+    } else {
+        request.assign (size, 'x');
+    }
+    std::string requests;
+    for (uint32_t i = 0; i < window; i++) {
+        requests += request;
+    }
+
+    // Connections are spread over the client threads, each with an
+    // io_service of its own
+    std::vector<std::unique_ptr<boost::asio::io_service>> clients;
+    for (uint32_t i = 0; i < threads; i++) {
+        clients.emplace_back (new boost::asio::io_service ());
+    }
+    std::vector<Bench> benches (connections);
+    for (uint32_t i = 0; i < connections; i++) {
+        Bench& bench = benches[i];
+        bench.socket.reset (new tcp::socket (*clients[i % threads]));
+        boost::system::error_code ec;
+        bench.socket->connect (tcp::endpoint (
+                boost::asio::ip::address::from_string ("127.0.0.1"), port), ec);
+        if (ec) {
+            std::cerr << "Could not connect to the server " << ec << std::endl;
+            return 1;
+        }
+        bench.socket->set_option (tcp::no_delay (true));
+        bench.requests = &requests;
+        bench.requestSize = request.size ();
+        bench.echo = server == "echo";
+        bench.buffer.resize (std::max ((size_t)65536, requests.size ()));
+        bench.filled = 0;
+        bench.remaining = count / connections + (i < count % connections ? 1 : 0);
+        bench.outstanding = bench.answered = bench.errors = 0;
+    }
+
+    auto start = std::chrono::steady_clock::now ();
+    for (auto& bench : benches) {
+        if (bench.remaining > 0) {
+            send_window (&bench);
+        }
+    }
+    std::vector<std::thread> running;
+    for (auto& client : clients) {
+        boost::asio::io_service* client_service = client.get ();
+        running.emplace_back ([client_service] { client_service->run (); });
+    }
+    for (auto& thread : running) {
+        thread.join ();
+    }
+    auto end = std::chrono::steady_clock::now ();
+
+    io_service.stop ();
+    serving.join ();
+
+    uint64_t answered = 0, errors = 0;
+    for (auto& bench : benches) {
+        answered += bench.answered;
+        errors += bench.errors;
+    }
+    double usec = std::chrono::duration_cast<std::chrono::microseconds>
+            (end - start).count ();
+    std::cout << server << " on " << backend << ", " << answered << " requests over "
+              << connections << " connections, window " << window << ": "
+              << (usec > 0 ? answered * 1e6 / usec : 0.0) << " requests/s, "
+              << errors << " errors" << std::endl;
+    google::protobuf::ShutdownProtobufLibrary();
+    return errors == 0 && answered == count ? 0 : 1;
+}
@@ -0,0 +1,13 @@
+# - Try to find the LZ4 library
+# Once done this will define
+#
+#  LIBLZ4_FOUND - System has LZ4
+#  LIBLZ4_INCLUDE_DIR - The LZ4 include directory
+#  LIBLZ4_LIBRARIES - The libraries needed to use LZ4
+
+FIND_PATH(LIBLZ4_INCLUDE_DIR lz4.h)
+
+FIND_LIBRARY(LIBLZ4_LIBRARIES NAMES lz4)
+
+INCLUDE(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(LibLZ4 DEFAULT_MSG LIBLZ4_LIBRARIES LIBLZ4_INCLUDE_DIR)
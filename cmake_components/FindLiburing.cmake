@@ -0,0 +1,13 @@
+# - Try to find liburing
+# Once done this will define
+#
+#  LIBURING_FOUND - System has liburing
+#  LIBURING_INCLUDE_DIR - The liburing include directory
+#  LIBURING_LIBRARIES - The libraries needed to use liburing
+
+FIND_PATH(LIBURING_INCLUDE_DIR liburing.h)
+
+FIND_LIBRARY(LIBURING_LIBRARIES NAMES uring)
+
+INCLUDE(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(Liburing DEFAULT_MSG LIBURING_LIBRARIES LIBURING_INCLUDE_DIR)
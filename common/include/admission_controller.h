@@ -0,0 +1,228 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <boost/log/trivial.hpp>
+#include "stats_reporter.h"
+#ifndef _HLV_ADMISSION_CONTROLLER_H_
+#define _HLV_ADMISSION_CONTROLLER_H_
+namespace hlv {
+namespace service {
+namespace common {
+
+/// Bounds the number of requests waiting on a backend (Redis) at once, so
+/// that when the backend slows down requests over the limit fail right
+/// away instead of queueing behind everything else.
+///
+/// The limit adapts (AIMD) to the round trip times seen: it grows by one
+/// per limit's worth of requests answered close to the fastest round trip
+/// seen recently, and shrinks by a tenth when round trips take more than
+/// tolerance times as long, and more than floor (at most once per limit's
+/// worth of requests, so a single slow burst only counts once).
+///
+/// A circuit breaker sits in front: it opens when the backend disconnects
+/// (and stays open until it is back), or after FAILURES_TO_OPEN failures in
+/// a row, in which case a single request is let through to probe the
+/// backend every cooldown.
+class AdmissionController {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    enum Breaker {
+        CLOSED = 0,
+        OPEN,
+        HALF_OPEN
+    };
+
+    // Failures in a row that open the breaker
+    static const uint32_t FAILURES_TO_OPEN = 5;
+    // Round trips the fastest round trip is taken over
+    static const uint32_t RTT_WINDOW = 10000;
+
+    AdmissionController () = delete;
+    AdmissionController (const AdmissionController&) = delete;
+    AdmissionController& operator= (const AdmissionController&) = delete;
+
+    /// minLimit, maxLimit: bounds for the number of requests in flight
+    /// tolerance: round trips longer than this times the fastest one mean
+    ///            the backend is overloaded
+    /// floor: round trips shorter than this are never taken as overload
+    /// cooldown: how long an open breaker waits before probing
+    AdmissionController (uint32_t minLimit,
+                         uint32_t maxLimit,
+                         double tolerance = 2.0,
+                         Clock::duration floor = std::chrono::milliseconds (1),
+                         Clock::duration cooldown = std::chrono::seconds (1)) :
+        minLimit_ (std::max (minLimit, 1u)),
+        maxLimit_ (std::max (maxLimit, std::max (minLimit, 1u))),
+        tolerance_ (tolerance),
+        floor_ (floor),
+        cooldown_ (cooldown),
+        limit_ (maxLimit_),
+        inFlight_ (0),
+        sinceDecrease_ (0),
+        minRtt_ (Clock::duration::max ()),
+        windowMinRtt_ (Clock::duration::max ()),
+        windowSamples_ (0),
+        lastRtt_ (Clock::duration::zero ()),
+        breaker_ (CLOSED),
+        disconnected_ (false),
+        failures_ (0),
+        probing_ (false),
+        admitted_ (0),
+        shed_ (0),
+        broken_ (0) {
+    }
+
+    /// Can another request go to the backend. Every true must be matched by
+    /// a call to release.
+    bool try_acquire () {
+        if (breaker_ != CLOSED) {
+            if (!probe ()) {
+                broken_++;
+                return false;
+            }
+        } else if (inFlight_ >= (uint32_t)limit_) {
+            shed_++;
+            return false;
+        }
+        inFlight_++;
+        admitted_++;
+        return true;
+    }
+
+    /// A request admitted at start is done. ok is false if the backend
+    /// failed it (an error, not a missing key).
+    void release (Clock::time_point start, bool ok) {
+        if (inFlight_ > 0) {
+            inFlight_--;
+        }
+        if (!ok) {
+            failed ();
+            return;
+        }
+        failures_ = 0;
+        if (breaker_ == HALF_OPEN && !disconnected_) {
+            BOOST_LOG_TRIVIAL (info) << "Backend recovered, closing breaker";
+            breaker_ = CLOSED;
+            probing_ = false;
+        }
+        sample (Clock::now () - start);
+    }
+
+    /// The backend connection went away, fail everything until connected
+    void disconnected () {
+        BOOST_LOG_TRIVIAL (error) << "Backend disconnected, opening breaker";
+        disconnected_ = true;
+        breaker_ = OPEN;
+    }
+
+    /// The backend connection is (back) up
+    void connected () {
+        if (disconnected_) {
+            disconnected_ = false;
+            breaker_ = HALF_OPEN;
+            probing_ = false;
+        }
+    }
+
+    uint32_t limit () const { return (uint32_t)limit_; }
+    uint32_t in_flight () const { return inFlight_; }
+    Breaker breaker () const { return breaker_; }
+
+    /// Register limit, in flight, shed and breaker metrics, names start
+    /// with prefix
+    void add_metrics (StatsReporter& stats, const std::string& prefix = "") {
+        stats.add (prefix + "admission.limit", [this] () { return (double)limit (); });
+        stats.add (prefix + "admission.in_flight", [this] () { return (double)inFlight_; });
+        stats.add (prefix + "admission.admitted", [this] () { return (double)admitted_; });
+        stats.add (prefix + "admission.shed", [this] () { return (double)shed_; });
+        stats.add (prefix + "admission.broken", [this] () { return (double)broken_; });
+        stats.add (prefix + "admission.breaker", [this] () { return (double)breaker_; });
+        stats.add (prefix + "admission.rtt_us", [this] () {
+            return (double)std::chrono::duration_cast<std::chrono::microseconds> (lastRtt_).count ();
+        });
+    }
+
+  private:
+    // Let a single request through an open breaker once the cooldown is up
+    bool probe () {
+        if (disconnected_) {
+            return false;
+        }
+        Clock::time_point now = Clock::now ();
+        if (breaker_ == OPEN && now - openedAt_ >= cooldown_) {
+            breaker_ = HALF_OPEN;
+            probing_ = false;
+        }
+        if (breaker_ == HALF_OPEN && !probing_) {
+            probing_ = true;
+            return true;
+        }
+        return false;
+    }
+
+    void failed () {
+        failures_++;
+        if (breaker_ == HALF_OPEN ||
+            (breaker_ == CLOSED && failures_ >= FAILURES_TO_OPEN)) {
+            BOOST_LOG_TRIVIAL (error) << "Backend failing, opening breaker";
+            breaker_ = OPEN;
+            openedAt_ = Clock::now ();
+            probing_ = false;
+        }
+    }
+
+    void sample (Clock::duration rtt) {
+        lastRtt_ = rtt;
+        // The fastest round trip is taken over a window, so that it can go
+        // up again if the backend gets slower for good
+        windowMinRtt_ = std::min (windowMinRtt_, rtt);
+        minRtt_ = std::min (minRtt_, rtt);
+        if (++windowSamples_ >= RTT_WINDOW) {
+            minRtt_ = windowMinRtt_;
+            windowMinRtt_ = Clock::duration::max ();
+            windowSamples_ = 0;
+        }
+
+        sinceDecrease_++;
+        if (rtt > floor_ && rtt > minRtt_ * tolerance_) {
+            if (sinceDecrease_ >= (uint32_t)limit_) {
+                limit_ = std::max ((double)minLimit_, limit_ * 0.9);
+                sinceDecrease_ = 0;
+            }
+        } else {
+            limit_ = std::min ((double)maxLimit_, limit_ + 1.0 / limit_);
+        }
+    }
+
+    const uint32_t minLimit_;
+    const uint32_t maxLimit_;
+    const double tolerance_;
+    const Clock::duration floor_;
+    const Clock::duration cooldown_;
+
+    double limit_;
+    uint32_t inFlight_;
+    uint32_t sinceDecrease_;
+    Clock::duration minRtt_;
+    Clock::duration windowMinRtt_;
+    uint32_t windowSamples_;
+    Clock::duration lastRtt_;
+
+    Breaker breaker_;
+    bool disconnected_;
+    uint32_t failures_;
+    bool probing_;
+    Clock::time_point openedAt_;
+
+    uint64_t admitted_;
+    uint64_t shed_;
+    uint64_t broken_;
+};
+} // namespace common
+} // namespace service
+} // namespace hlv
+#endif
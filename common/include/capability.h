@@ -0,0 +1,299 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include "stats_reporter.h"
+#ifndef _HLV_CAPABILITY_H_
+#define _HLV_CAPABILITY_H_
+namespace hlv {
+namespace service {
+namespace common {
+/// Capabilities are tokens minted by the auth service that say who a client
+/// is, which permission bits it holds (the same bits used as tokens by
+/// lookups and updates) and until when. They are signed with HMAC-SHA256
+/// under a key the auth service shares with the services that check them, so
+/// checking one is a couple of hash compressions in process, with no round
+/// trip to the auth service or to Redis.
+///
+/// A capability is laid out as (integers little endian)
+///   version (1) | key id (4) | permissions (8) | expires (8, unix seconds) |
+///   identity length (2) | identity | HMAC-SHA256 of everything before (32)
+///
+/// Header only so that only the services using capabilities need OpenSSL.
+namespace capability {
+const uint8_t VERSION = 1;
+const size_t MAC_SIZE = 32;
+const size_t HEADER_SIZE = 1 + 4 + 8 + 8 + 2;
+const size_t MAX_IDENTITY = 0xffff;
+// Keys shorter than this are refused
+const size_t MIN_SECRET = 16;
+// Capabilities are still honored this long (seconds) after they expire, to
+// allow for clocks that disagree a little
+const int64_t CLOCK_SKEW = 30;
+
+/// What a verified capability says. identity points into the capability it
+/// was read from.
+struct Claims {
+    uint32_t keyId;
+    uint64_t permissions;
+    int64_t expires;
+    const char* identity;
+    size_t identityLength;
+};
+
+namespace detail {
+inline void put (std::string& out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++) {
+        out.push_back ((char)((value >> (8 * i)) & 0xff));
+    }
+}
+
+inline uint64_t get (const char* in, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        value |= (uint64_t)(unsigned char)in[i] << (8 * i);
+    }
+    return value;
+}
+} // namespace detail
+
+/// An HMAC-SHA256 key with both padded key blocks already hashed. HMAC
+/// hashes a block of key before the message and another before the inner
+/// digest; a capability is only a couple of blocks itself, so starting from
+/// the saved states halves the work per check. Not safe to share between
+/// threads.
+class Key {
+  public:
+    Key () = delete;
+    Key (const Key&) = delete;
+    Key& operator= (const Key&) = delete;
+
+    explicit Key (const std::string& secret) :
+        inner_ (EVP_MD_CTX_create ()),
+        outer_ (EVP_MD_CTX_create ()),
+        work_ (EVP_MD_CTX_create ()) {
+        const size_t BLOCK = 64;
+        unsigned char block[BLOCK];
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int length = 0;
+
+        // The key id is the start of the key's hash: services pick the right
+        // key without being told, and keys can be rotated by adding the new
+        // one everywhere before minting with it
+        EVP_Digest (secret.data (), secret.size (), digest, &length,
+                    EVP_sha256 (), NULL);
+        id_ = (uint32_t)detail::get ((const char*)digest, 4);
+
+        memset (block, 0, BLOCK);
+        if (secret.size () > BLOCK) {
+            memcpy (block, digest, length);
+        } else {
+            memcpy (block, secret.data (), secret.size ());
+        }
+        for (size_t i = 0; i < BLOCK; i++) {
+            block[i] ^= 0x36;
+        }
+        EVP_DigestInit_ex (inner_, EVP_sha256 (), NULL);
+        EVP_DigestUpdate (inner_, block, BLOCK);
+        for (size_t i = 0; i < BLOCK; i++) {
+            block[i] ^= 0x36 ^ 0x5c;
+        }
+        EVP_DigestInit_ex (outer_, EVP_sha256 (), NULL);
+        EVP_DigestUpdate (outer_, block, BLOCK);
+        OPENSSL_cleanse (block, BLOCK);
+    }
+
+    ~Key () {
+        EVP_MD_CTX_destroy (inner_);
+        EVP_MD_CTX_destroy (outer_);
+        EVP_MD_CTX_destroy (work_);
+    }
+
+    uint32_t id () const { return id_; }
+
+    /// HMAC of data into mac, which must hold MAC_SIZE bytes
+    void sign (const char* data, size_t length, unsigned char* mac) {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digestLength = 0;
+        EVP_MD_CTX_copy_ex (work_, inner_);
+        EVP_DigestUpdate (work_, data, length);
+        EVP_DigestFinal_ex (work_, digest, &digestLength);
+        EVP_MD_CTX_copy_ex (work_, outer_);
+        EVP_DigestUpdate (work_, digest, digestLength);
+        EVP_DigestFinal_ex (work_, mac, &digestLength);
+    }
+
+  private:
+    uint32_t id_;
+    EVP_MD_CTX* inner_;
+    EVP_MD_CTX* outer_;
+    // Scratch state for sign, copied from inner_ or outer_
+    EVP_MD_CTX* work_;
+};
+
+/// Read a key from path into secret. The whole file is the key, less a
+/// trailing newline so that keys can be kept as text.
+inline bool load_secret (const std::string& path, std::string& secret) {
+    std::ifstream in (path, std::ios::in | std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    secret.assign (std::istreambuf_iterator<char> (in),
+                   std::istreambuf_iterator<char> ());
+    while (!secret.empty () &&
+           (secret.back () == '\n' || secret.back () == '\r')) {
+        secret.pop_back ();
+    }
+    return secret.size () >= MIN_SECRET;
+}
+
+/// Mints capabilities, used by auth services
+class Minter {
+  public:
+    Minter () = delete;
+    Minter (const Minter&) = delete;
+    Minter& operator= (const Minter&) = delete;
+
+    /// secret: signing key
+    /// lifetime: seconds a capability is good for
+    Minter (const std::string& secret, int64_t lifetime) :
+        key_ (secret),
+        lifetime_ (lifetime) {
+    }
+
+    /// A capability for identity holding permissions, good from now for the
+    /// configured lifetime
+    std::string mint (const std::string& identity, uint64_t permissions) {
+        return mint (identity, permissions, (int64_t)time (NULL) + lifetime_);
+    }
+
+    std::string mint (const std::string& identity,
+                      uint64_t permissions,
+                      int64_t expires) {
+        size_t identityLength = std::min (identity.size (), MAX_IDENTITY);
+        std::string out;
+        out.reserve (HEADER_SIZE + identityLength + MAC_SIZE);
+        out.push_back ((char)VERSION);
+        detail::put (out, key_.id (), 4);
+        detail::put (out, permissions, 8);
+        detail::put (out, (uint64_t)expires, 8);
+        detail::put (out, identityLength, 2);
+        out.append (identity.data (), identityLength);
+        unsigned char mac[MAC_SIZE];
+        key_.sign (out.data (), out.size (), mac);
+        out.append ((const char*)mac, MAC_SIZE);
+        return out;
+    }
+
+  private:
+    Key key_;
+    const int64_t lifetime_;
+};
+
+/// Checks capabilities against one or more keys
+class Verifier {
+  public:
+    Verifier (const Verifier&) = delete;
+    Verifier& operator= (const Verifier&) = delete;
+
+    Verifier () :
+        verified_ (0),
+        rejected_ (0) {
+    }
+
+    /// Accept capabilities signed with secret
+    void add_key (const std::string& secret) {
+        keys_.emplace_back (new Key (secret));
+    }
+
+    /// Accept capabilities signed with the key in path, false if it could
+    /// not be read (see load_secret)
+    bool add_key_file (const std::string& path) {
+        std::string secret;
+        if (!load_secret (path, secret)) {
+            return false;
+        }
+        add_key (secret);
+        return true;
+    }
+
+    bool empty () const { return keys_.empty (); }
+
+    /// Check capability and fill claims from it. False if it is malformed,
+    /// signed with a key we do not have, tampered with or expired.
+    bool verify (const std::string& capability, Claims& claims) {
+        return verify (capability, claims, (int64_t)time (NULL));
+    }
+
+    bool verify (const std::string& capability, Claims& claims, int64_t now) {
+        if (!check (capability.data (), capability.size (), claims, now)) {
+            rejected_++;
+            return false;
+        }
+        verified_++;
+        return true;
+    }
+
+    uint64_t verified () const { return verified_; }
+    uint64_t rejected () const { return rejected_; }
+
+    /// Register counts of verified and rejected capabilities, names start
+    /// with prefix
+    void add_metrics (StatsReporter& stats, const std::string& prefix = "") {
+        stats.add (prefix + "capability.verified",
+                   [this] () { return (double)verified_; });
+        stats.add (prefix + "capability.rejected",
+                   [this] () { return (double)rejected_; });
+    }
+
+  private:
+    bool check (const char* data, size_t size, Claims& claims, int64_t now) {
+        if (size < HEADER_SIZE + MAC_SIZE || (uint8_t)data[0] != VERSION) {
+            return false;
+        }
+        claims.keyId = (uint32_t)detail::get (data + 1, 4);
+        claims.permissions = detail::get (data + 5, 8);
+        claims.expires = (int64_t)detail::get (data + 13, 8);
+        claims.identityLength = (size_t)detail::get (data + 21, 2);
+        claims.identity = data + HEADER_SIZE;
+        size_t signedLength = HEADER_SIZE + claims.identityLength;
+        if (size != signedLength + MAC_SIZE) {
+            return false;
+        }
+        // Cheap checks first, forged capabilities cost no hashing
+        if (claims.expires + CLOCK_SKEW < now) {
+            return false;
+        }
+        Key* key = nullptr;
+        for (auto& candidate : keys_) {
+            if (candidate->id () == claims.keyId) {
+                key = candidate.get ();
+                break;
+            }
+        }
+        if (!key) {
+            return false;
+        }
+        unsigned char mac[MAC_SIZE];
+        key->sign (data, signedLength, mac);
+        return CRYPTO_memcmp (mac, data + signedLength, MAC_SIZE) == 0;
+    }
+
+    std::vector<std::unique_ptr<Key>> keys_;
+    uint64_t verified_;
+    uint64_t rejected_;
+};
+} // namespace capability
+} // namespace common
+} // namespace service
+} // namespace hlv
+#endif
@@ -1,43 +1,222 @@
 // Copyright 20xx The Regents of the University of California
 // This is a test service for SDN-v2 High Level Virtualization
-#include <set>
+#include <cstdint>
 #include <memory>
+#include <vector>
+#include <boost/log/trivial.hpp>
+#include "timer_wheel.h"
 #ifndef _HLV_COMMON_MAN_H_
 #define _HLV_COMMON_MAN_H_
 namespace hlv {
 namespace service{
 namespace common {
 
+/// Deadlines a connection can be held to, only one at a time
+enum Deadline {
+    // Nothing (e.g., waiting on Redis)
+    NO_DEADLINE = 0,
+    // Waiting for the next request to start
+    IDLE,
+    // The same, with no limit (e.g., a client holding watches)
+    WATCHING,
+    // Request header read, waiting for the rest of the request
+    READ,
+    // Writing a response
+    WRITE
+};
+
+/// Is a connection held to deadline between requests, with nothing in flight
+inline bool between_requests (Deadline deadline) {
+    return deadline == IDLE || deadline == WATCHING;
+}
+
+/// Seconds allowed for each deadline, 0 means no limit
+struct Timeouts {
+    uint32_t idle;
+    uint32_t read;
+    uint32_t write;
+    Timeouts (uint32_t _idle = 0, uint32_t _read = 0, uint32_t _write = 0) :
+        idle (_idle),
+        read (_read),
+        write (_write) {
+    }
+};
+
+/// Bookkeeping the ConnectionManager keeps in each connection, so that
+/// registering, removing and timing a connection needs no lookups or
+/// allocation. Connections managed by a ConnectionManager derive from this.
+class ManagedConnection {
+  public:
+    ManagedConnection () : slot_ (NO_SLOT), deadline_ (NO_DEADLINE) {}
+    virtual ~ManagedConnection () {}
+
+  private:
+    template<typename ConnectionPtr> friend class ConnectionManager;
+    static const uint32_t NO_SLOT = UINT32_MAX;
+    // Index in the manager's slot map
+    uint32_t slot_;
+    // Current deadline, the timer's data is slot_
+    Deadline deadline_;
+    TimerNode timer_;
+};
+
 /// When exiting it is useful to track what connections are open and shut them
 /// down. The connection manager merely serves as the holder of this state.
+///
+/// Connections are kept in a slot map: each connection holds its index, and
+/// freed indices are reused, so adding and removing a connection is O(1).
+/// The manager also holds each connection to the deadline it asked for
+/// (expect), closing connections that sit idle, trickle in a request or
+/// stop reading responses. Deadlines are kept on a timer wheel advanced
+/// every TICK_MS by tick ().
+///
+/// Once draining (drain) connections are closed as they go back to waiting
+/// for a request: the manager closes those that are waiting already, and
+/// connections check draining () before reading the next request.
 template<typename ConnectionPtr>
 class ConnectionManager {
+public:
+  static const uint32_t TICK_MS = 100;
+
 private:
-  std::set<ConnectionPtr> connections_;
+  std::vector<ConnectionPtr> slots_;
+  std::vector<uint32_t> free_;
+  size_t count_;
+  TimerWheel wheel_;
+  Timeouts timeouts_;
+  bool draining_;
+
+  uint64_t ticks (uint32_t seconds) const {
+      return (uint64_t)seconds * 1000 / TICK_MS;
+  }
+
+  // Take connection out of the slot map, false if it was not in it
+  bool remove (ManagedConnection* connection) {
+      uint32_t slot = connection->slot_;
+      if (slot == ManagedConnection::NO_SLOT) {
+          return false;
+      }
+      wheel_.cancel (&connection->timer_);
+      connection->slot_ = ManagedConnection::NO_SLOT;
+      slots_[slot].reset ();
+      free_.push_back (slot);
+      count_--;
+      return true;
+  }
+
 public:
-  ConnectionManager () {}
+  ConnectionManager () : count_ (0), draining_ (false) {}
 
   void add_connection (ConnectionPtr connection) {
-      connections_.insert(connection);
+      uint32_t slot;
+      if (!free_.empty ()) {
+          slot = free_.back ();
+          free_.pop_back ();
+          slots_[slot] = connection;
+      } else {
+          slot = slots_.size ();
+          slots_.push_back (connection);
+      }
+      ManagedConnection* managed = connection.get ();
+      managed->slot_ = slot;
+      managed->timer_.data = slot;
+      count_++;
       connection->start();
   }
 
   void stop_all() {
-      for (auto conn: connections_) {
-          conn->stop();
+      for (auto& slot: slots_) {
+          if (slot) {
+              ConnectionPtr conn = slot;
+              remove (conn.get ());
+              conn->stop();
+          }
       }
-      connections_.clear();
+      slots_.clear();
+      free_.clear();
   }
-  
+
   void stop(ConnectionPtr c) {
-      connections_.erase(c);
+      remove (c.get ());
       c->stop();
   }
 
+  size_t size() const {
+      return count_;
+  }
+
+  /// Close connections as soon as they have no request in flight, starting
+  /// with the ones waiting for a request now
+  void drain () {
+      draining_ = true;
+      for (size_t slot = 0; slot < slots_.size (); slot++) {
+          ConnectionPtr conn = slots_[slot];
+          ManagedConnection* managed = conn.get ();
+          if (managed && between_requests (managed->deadline_)) {
+              stop (conn);
+          }
+      }
+  }
+
+  /// Should connections close instead of reading another request
+  bool draining () const {
+      return draining_;
+  }
+
+  /// Deadlines to hold connections to from now on
+  void set_timeouts (const Timeouts& timeouts) {
+      timeouts_ = timeouts;
+  }
+
+  /// Hold connection to deadline, replacing its current one
+  void expect (ManagedConnection* connection, Deadline deadline) {
+      if (connection->slot_ == ManagedConnection::NO_SLOT) {
+          return;
+      }
+      uint32_t seconds = 0;
+      switch (deadline) {
+          case IDLE:
+              seconds = timeouts_.idle;
+              break;
+          case READ:
+              seconds = timeouts_.read;
+              break;
+          case WRITE:
+              seconds = timeouts_.write;
+              break;
+          case WATCHING:
+          case NO_DEADLINE:
+              break;
+      }
+      connection->deadline_ = deadline;
+      if (seconds == 0) {
+          wheel_.cancel (&connection->timer_);
+          return;
+      }
+      wheel_.schedule (&connection->timer_, ticks (seconds));
+  }
+
+  /// Advance deadlines by TICK_MS, closing connections that missed theirs
+  void tick () {
+      wheel_.advance ([this] (TimerNode* timer) {
+          ConnectionPtr conn = slots_[timer->data];
+          ManagedConnection* expired = conn.get ();
+          Deadline deadline = expired->deadline_;
+          BOOST_LOG_TRIVIAL (info) << "Closing connection, "
+                                   << (deadline == IDLE ? "idle" :
+                                       deadline == READ ? "read" : "write")
+                                   << " deadline passed";
+          stop (conn);
+      });
+  }
+
   virtual ~ConnectionManager () {
       stop_all ();
   }
 };
+
+template<typename ConnectionPtr>
+const uint32_t ConnectionManager<ConnectionPtr>::TICK_MS;
 } // namespace server
 } // namespace service
 } // namespace hlv
@@ -2,21 +2,36 @@
 // This is a test service for SDN-v2 High Level Virtualization
 
 #include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include <utility>
 #include <iostream>
 #include <memory>
 #include <set>
 #include <string>
+#include <vector>
 #include <boost/asio.hpp>
 #include <boost/log/trivial.hpp>
+#include "common_manager.h"
+#include "stream_socket.h"
+#include "uring.h"
 #ifndef _HLV_COMMON_SERVER_H_
 #define _HLV_COMMON_SERVER_H_
 namespace hlv {
 namespace service {
 namespace common {
 
+/// What a Server waits on its sockets with
+enum class Backend {
+    // asio's reactor, epoll on Linux
+    EPOLL,
+    // io_uring (see uring.h), in builds with HLV_IO_URING
+    IO_URING
+};
+
 /// A server to build other servers. Servers all look the same (mostly),
-/// so this made sense.
+/// so this made sense. Servers listen on TCP and, if asked, on a Unix domain
+/// socket too; connections get a StreamSocket either way.
 template<typename Connection,
          typename ConnectionManager,
          typename ConnectionParameter>
@@ -25,16 +40,35 @@ class Server {
     // I/O services for serving ASIO
     boost::asio::io_service& io_service_;
     
+    typedef boost::asio::basic_socket_acceptor<
+                boost::asio::generic::stream_protocol> Acceptor;
+
     // Listen to incoming connections
-    boost::asio::ip::tcp::acceptor acceptor_;
+    Acceptor acceptor_;
 
     // Listening socket
-    boost::asio::ip::tcp::socket socket_;
+    StreamSocket socket_;
+
+    // The same for connections from this host over a Unix domain socket,
+    // closed unless listen_unix was called
+    Acceptor unixAcceptor_;
+    StreamSocket unixSocket_;
     
     // Collect connections
     ConnectionManager manager_;
 
+    // Advances connection deadlines
+    boost::asio::deadline_timer tick_;
+
     ConnectionParameter services_;
+
+#ifdef HLV_IO_URING
+    // Serves the io_service if set_backend asked for io_uring, and the
+    // multishot accepts on acceptor_ and unixAcceptor_ while they last
+    Uring* ring_ = nullptr;
+    Uring::Operation* ringAccept_ = nullptr;
+    Uring::Operation* unixRingAccept_ = nullptr;
+#endif
   public:
     // Delete some default constructors
     Server() = delete;
@@ -49,50 +83,230 @@ class Server {
     io_service_(io_service),
     acceptor_(io_service_),
     socket_(io_service_),
+    unixAcceptor_(io_service_),
+    unixSocket_(io_service_),
+    tick_(io_service_),
     services_ (services) {
         boost::asio::ip::tcp::resolver resolver(io_service_);
-        boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve({host, port});
+        StreamEndpoint endpoint (resolver.resolve({host, port})->endpoint());
         acceptor_.open(endpoint.protocol());
         acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
         acceptor_.bind(endpoint);
     }
 
+    // Construct a Server on a socket that is already bound and listening,
+    // e.g., one handed over by the instance being replaced
+    Server (boost::asio::io_service& io_service,
+            int listening,
+            ConnectionParameter services):
+    io_service_(io_service),
+    acceptor_(io_service_),
+    socket_(io_service_),
+    unixAcceptor_(io_service_),
+    unixSocket_(io_service_),
+    tick_(io_service_),
+    services_ (services) {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        getsockname(listening, (struct sockaddr*)&addr, &len);
+        acceptor_.assign(boost::asio::generic::stream_protocol(addr.ss_family, IPPROTO_TCP),
+                         listening);
+    }
+
+    // Also accept connections on a Unix domain socket at path, for clients
+    // on this host. Whatever is at path (e.g., left behind by an instance
+    // that is gone) is replaced. Call before start.
+    void listen_unix (const std::string& path) {
+        unlink(path.c_str());
+        StreamEndpoint endpoint = unix_endpoint(path);
+        unixAcceptor_.open(endpoint.protocol());
+        unixAcceptor_.bind(endpoint);
+    }
+
+    // Accept connections on a Unix domain socket that is already bound and
+    // listening, e.g., one handed over along with the TCP one. Call before
+    // start.
+    void adopt_unix (int listening) {
+        unixAcceptor_.assign(boost::asio::generic::stream_protocol(AF_UNIX, 0),
+                             listening);
+    }
+
+    // Serve connections with backend, EPOLL unless this is called. The
+    // backend is the io_service's: with IO_URING every connection on it
+    // (clients too) reads and writes through the ring. False, staying with
+    // EPOLL, if IO_URING is not available. Call before start.
+    bool set_backend (Backend backend) {
+#ifdef HLV_IO_URING
+        if (backend == Backend::IO_URING) {
+            ring_ = Uring::attach(io_service_);
+            return ring_ != nullptr;
+        }
+        ring_ = nullptr;
+        return true;
+#else
+        if (backend == Backend::IO_URING) {
+            BOOST_LOG_TRIVIAL(error) << "Built without io_uring (HLV_IO_URING)";
+            return false;
+        }
+        return true;
+#endif
+    }
+
     // Run server accept loop
     void start () {
-        acceptor_.listen();
-        do_accept();
+        acceptor_.listen(); // A no-op on a socket that is already listening
+        begin_accept(acceptor_, socket_);
+        if (unixAcceptor_.is_open()) {
+            unixAcceptor_.listen();
+            begin_accept(unixAcceptor_, unixSocket_);
+        }
+        do_tick();
     }
 
     // Stop server accept loop
     void stop () {
-        acceptor_.close(); // Stop accepting connections
+        stop_accepting();
+        boost::system::error_code ec;
+        tick_.cancel(ec);
         manager_.stop_all();
     }
 
+    // Close connections that miss a deadline (idle, partly read request or
+    // stalled write) of more than the given number of seconds
+    void set_timeouts (const Timeouts& timeouts) {
+        manager_.set_timeouts(timeouts);
+    }
+
+    // Stop accepting connections, leaving open ones alone. The Unix domain
+    // socket's file stays, an instance taking over may already have
+    // replaced it.
+    void stop_accepting () {
+        boost::system::error_code ec;
+#ifdef HLV_IO_URING
+        if (ringAccept_) {
+            ring_->stop_accept(ringAccept_);
+            ringAccept_ = nullptr;
+        }
+        if (unixRingAccept_) {
+            ring_->stop_accept(unixRingAccept_);
+            unixRingAccept_ = nullptr;
+        }
+#endif
+        acceptor_.close(ec);
+        unixAcceptor_.close(ec);
+    }
+
+    // Listening socket, to hand to another process
+    int native_handle () {
+        return acceptor_.native_handle();
+    }
+
+    // Every listening socket, the TCP one first and then the Unix domain
+    // one if there is one, to hand to another process
+    std::vector<int> native_handles () {
+        std::vector<int> handles (1, acceptor_.native_handle());
+        if (unixAcceptor_.is_open()) {
+            handles.push_back(unixAcceptor_.native_handle());
+        }
+        return handles;
+    }
+
+    // Close each open connection once it has answered the request it is
+    // on, e.g., after handing off to a new instance
+    void drain () {
+        manager_.drain();
+    }
+
+    // Number of open connections
+    size_t connections () const {
+        return manager_.size();
+    }
+
     virtual ~Server () {
         stop ();
     }
 
   private:
 
+    // Accept on acceptor through the ring if serving with io_uring, asio
+    // otherwise
+    void begin_accept (Acceptor& acceptor, StreamSocket& socket) {
+#ifdef HLV_IO_URING
+        if (ring_) {
+            ring_accept(acceptor, socket);
+            return;
+        }
+#endif
+        do_accept(acceptor, socket);
+    }
+
+#ifdef HLV_IO_URING
+    // Take connections off acceptor with one multishot accept, falling back
+    // on asio if the kernel has none
+    void ring_accept (Acceptor& acceptor, StreamSocket& socket) {
+        Uring::Operation*& op = &acceptor == &acceptor_ ? ringAccept_ : unixRingAccept_;
+        // Accepted sockets are of the listening one's family
+        auto protocol = acceptor.local_endpoint().protocol();
+        op = ring_->accept(acceptor.native_handle(),
+            [this, &acceptor, &socket, &op, protocol](int fd) {
+                if (fd < 0) {
+                    op = nullptr;
+                    if (acceptor.is_open()) {
+                        BOOST_LOG_TRIVIAL(error) << "io_uring accept failed: "
+                                                 << strerror(-fd) << ", accepting through asio";
+                        do_accept(acceptor, socket);
+                    }
+                    return;
+                }
+                StreamSocket accepted(io_service_);
+                boost::system::error_code ec;
+                accepted.assign(protocol, fd, ec);
+                if (ec) {
+                    ::close(fd);
+                    return;
+                }
+                manager_.add_connection(std::make_shared<Connection> (
+                        std::move(accepted),
+                        manager_,
+                        services_));
+            });
+        if (!op) {
+            do_accept(acceptor, socket);
+        }
+    }
+#endif
+
     // Set up callbacks for accepts
-    void do_accept ()  {
-        acceptor_.async_accept(socket_,
-            [this](boost::system::error_code ec) {
+    void do_accept (Acceptor& acceptor, StreamSocket& socket)  {
+        acceptor.async_accept(socket,
+            [this, &acceptor, &socket](boost::system::error_code ec) {
                 BOOST_LOG_TRIVIAL(info) << "Accept received";
-                if (!acceptor_.is_open()) {
+                if (!acceptor.is_open()) {
                     BOOST_LOG_TRIVIAL(debug) << "Stop accepting\n";
                     return; // Signal closed acceptor
                 }
                 if (!ec) {
                     BOOST_LOG_TRIVIAL(info) << "Making connection";
                     manager_.add_connection(std::make_shared<Connection> (
-                            std::move(socket_), 
+                            std::move(socket), 
                             manager_,
                             services_));
                 }
 
-                do_accept();
+                do_accept(acceptor, socket);
+            });
+    }
+
+    // Advance connection deadlines every tick
+    void do_tick () {
+        tick_.expires_from_now(
+            boost::posix_time::milliseconds(ConnectionManager::TICK_MS));
+        tick_.async_wait([this](boost::system::error_code ec) {
+                if (ec) {
+                    return;
+                }
+                manager_.tick();
+                do_tick();
             });
     }
 
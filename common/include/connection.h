@@ -1,10 +1,15 @@
 // Copyright 20xx The Regents of the University of California
 // This is a test service for SDN-v2 High Level Virtualization
 #include <memory>
+#include <string>
 #include <boost/asio.hpp>
 #include "service.pb.h"
 #include "service_interface.h"
 #include "common_manager.h"
+#include "stream_socket.h"
+#include "uring.h"
+#include "frame_reader.h"
+#include "handler_memory.h"
 #ifndef _HLV_SERVICE_CONNECTION_H_
 #define _HLV_SERVICE_CONNECTION_H_
 namespace hlv {
@@ -16,7 +21,8 @@ namespace server {
 /// responsible for reading bytes off the wire and dispatching them
 /// appropriately.
 class Connection
-    : public std::enable_shared_from_this<Connection>
+    : public std::enable_shared_from_this<Connection>,
+      public hlv::service::common::ManagedConnection
 {
   private:
     typedef std::shared_ptr<hlv::service::server::Connection> ConnectionPtr;
@@ -25,7 +31,7 @@ class Connection
     Connection& operator=(const Connection&) = delete;
     
     // Construct a Connection given a socket
-    explicit Connection (boost::asio::ip::tcp::socket socket, 
+    explicit Connection (hlv::service::common::StreamSocket socket, 
             hlv::service::common::ConnectionManager<ConnectionPtr>& manager,
             std::shared_ptr<ServiceInterface> services);
 
@@ -36,23 +42,23 @@ class Connection
     void stop ();
 
   private:
-    // Listen for buffer
-    void read_size ();
-
-    // Read buffer off the wire
-    void read_buffer (uint64_t length);
+    // Serve the requests read so far, then read more
+    void read_requests ();
 
     // Dispatch requests
-    hlv_service::ServiceResponse& 
-    dispatch_request (const hlv_service::ServiceRequest& request);
+    void dispatch_request (const hlv_service::ServiceRequest& request);
+
+    // An asynchronous service answered one of our requests
+    void complete (const hlv_service::ServiceResponse& response);
 
+    // Write response, or queue it if another write is in progress
     void write_response (const hlv_service::ServiceResponse& response);
 
-    // Socket for this connection
-    boost::asio::ip::tcp::socket socket_;
+    // Write everything in pending_
+    void start_write ();
 
-    // A temporary variable that holds the amount to be read
-    uint64_t bufferSize_;
+    // Socket for this connection
+    hlv::service::common::StreamSocket socket_;
 
     // Manage several connections
     hlv::service::common::ConnectionManager<ConnectionPtr>& manager_;
@@ -60,9 +66,22 @@ class Connection
     // Service interface
     std::shared_ptr<ServiceInterface> services_;
 
-    // Buffer, expect never to need more than 128k
-    std::array<char, 131072> buffer_;
-    std::array<char, 131072> write_buffer_;
+    // The same service if it answers asynchronously, null otherwise
+    std::shared_ptr<AsyncServiceInterface> async_;
+
+    // Requests handed to async_ and not yet answered. Reading stops (paused_)
+    // while there are too many.
+    uint32_t outstanding_;
+    bool paused_;
+
+    // Framed responses being written, and those that became ready since
+    bool writing_;
+    std::string outgoing_;
+    std::string pending_;
+    hlv::service::common::HandlerMemory writeMemory_;
+
+    // Requests off the wire, expect never to need more than 128k
+    hlv::service::common::FrameReader reader_;
     hlv_service::ServiceRequest request_;
     hlv_service::ServiceResponse response_;
 };
@@ -0,0 +1,248 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <boost/version.hpp>
+#include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/optional.hpp>
+#include <boost/utility/in_place_factory.hpp>
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include <command_builder.h>
+#include <managed_client.h>
+#include <reply_decoder.h>
+#include "frame_reader.h"
+#include "handler_memory.h"
+#include "uring.h"
+#ifndef _HLV_COMMON_COROUTINE_H_
+#define _HLV_COMMON_COROUTINE_H_
+namespace hlv {
+namespace service {
+namespace common {
+
+/// Waiting points for connections written as coroutines (started with
+/// boost::asio::spawn), in place of a callback per step: framed reads and
+/// writes, Redis commands and callbacks from elsewhere (Pending). None of
+/// them allocate: reads use the FrameReader's memory, writes a
+/// HandlerMemory and a frame the connection keeps, and Redis commands
+/// ManagedRedisClient's recycled records with the coroutine's own stack as
+/// privdata.
+namespace detail {
+#if BOOST_VERSION >= 106600
+// The handler a yield_context stands for, and what waits for it to be called
+template <typename Signature>
+struct Completion {
+    typedef boost::asio::async_result<boost::asio::yield_context, Signature> Result;
+    typedef typename Result::completion_handler_type Handler;
+};
+#else
+template <typename Signature>
+struct Completion {
+    typedef typename boost::asio::handler_type<boost::asio::yield_context, Signature>::type Handler;
+    typedef boost::asio::async_result<Handler> Result;
+};
+#endif
+
+typedef Completion<void (redisReply*)> RedisCompletion;
+typedef Completion<void (const asio_redis::FlatReply*)> FlatCompletion;
+
+// Redis callback, privdata is the waiting coroutine's handler
+template <typename Completion, typename Reply>
+inline void resume_redis (redisAsyncContext* context, void* reply, void* data) {
+    // The handler lives on the coroutine's stack, which may be gone by
+    // the time the coroutine is done with this one
+    typename Completion::Handler handler (*(typename Completion::Handler*)data);
+    handler ((Reply)reply);
+}
+
+// Send with send (fn, privdata) and wait for fn to be called
+template <typename Completion, typename Reply, typename Send>
+inline Reply redis_command (Send send, boost::asio::yield_context yield) {
+    typename Completion::Handler handler (yield);
+    typename Completion::Result result (handler);
+    // Like any operation, the command gets a copy of the handler, waiting
+    // may let go of the original
+    typename Completion::Handler waiting (handler);
+    if (send (resume_redis<Completion, Reply>, &waiting) != REDIS_OK) {
+        return NULL;
+    }
+    return result.get ();
+}
+} // namespace detail
+
+/// Write length bytes at data to stream and wait for them to be written,
+/// memory holds the write's handler
+template <typename Stream>
+bool write_buffer (Stream& stream,
+                   const char* data,
+                   size_t length,
+                   HandlerMemory& memory,
+                   boost::asio::yield_context yield,
+                   boost::system::error_code& ec) {
+    typedef detail::Completion<void (boost::system::error_code, std::size_t)> Completion;
+    typename Completion::Handler handler (yield[ec]);
+    typename Completion::Result result (handler);
+    async_write_all (stream, data, length, make_handler (memory, handler));
+    result.get ();
+    return !ec;
+}
+
+/// Wait for the next message on stream. data stays valid until the next
+/// read. False (with ec set) once the stream fails or sends a message
+/// longer than the reader takes. reading (partial) is called before every
+/// read off the stream, partial if part of the message is in already, so
+/// callers can set deadlines.
+template <typename Stream, typename Reading>
+bool read_frame (Stream& stream,
+                 FrameReader& reader,
+                 const char*& data,
+                 size_t& length,
+                 Reading reading,
+                 boost::asio::yield_context yield,
+                 boost::system::error_code& ec) {
+    typedef detail::Completion<void (boost::system::error_code)> Completion;
+    while (!reader.next (data, length)) {
+        if (reader.oversized ()) {
+            ec = boost::asio::error::message_size;
+            return false;
+        }
+        reading (reader.partial ());
+        typename Completion::Handler handler (yield[ec]);
+        typename Completion::Result result (handler);
+        reader.async_fill (stream, handler);
+        result.get ();
+        if (ec) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Write message, framed, to stream and wait for it to be written. frame
+/// is reused from write to write and only grows when message does not
+/// fit, memory holds the write's handler.
+template <typename Stream, typename Message>
+bool write_frame (Stream& stream,
+                  const Message& message,
+                  std::vector<char>& frame,
+                  HandlerMemory& memory,
+                  boost::asio::yield_context yield,
+                  boost::system::error_code& ec) {
+    uint64_t size = message.ByteSize ();
+    if (frame.size () < sizeof(uint64_t) + size) {
+        frame.resize (sizeof(uint64_t) + size);
+    }
+    memcpy (&frame[0], &size, sizeof(uint64_t));
+    message.SerializeToArray (&frame[sizeof(uint64_t)], size);
+    return write_buffer (stream, &frame[0], sizeof(uint64_t) + size,
+                         memory, yield, ec);
+}
+
+/// Send the read (see ManagedRedisClient) in builder and wait for its
+/// reply, NULL if it did not complete. The reply is hiredis's, and only
+/// valid until the coroutine waits again.
+inline redisReply* redis_read (asio_redis::ManagedRedisClient& client,
+                               asio_redis::CommandBuilder& builder,
+                               boost::asio::yield_context yield) {
+    return detail::redis_command<detail::RedisCompletion, redisReply*> (
+        [&client, &builder] (redisCallbackFn* fn, void* data) {
+            return client.read (fn, data, builder);
+        }, yield);
+}
+
+/// As redis_read, for a write
+inline redisReply* redis_write (asio_redis::ManagedRedisClient& client,
+                                asio_redis::CommandBuilder& builder,
+                                boost::asio::yield_context yield) {
+    return detail::redis_command<detail::RedisCompletion, redisReply*> (
+        [&client, &builder] (redisCallbackFn* fn, void* data) {
+            return client.write (fn, data, builder);
+        }, yield);
+}
+
+/// Wait for the reply to commands sent by send (fn, privdata), which hands
+/// fn and privdata to the command whose reply is wanted and returns its
+/// status. For commands sent in a sequence (e.g., MULTI ... EXEC) or by
+/// helpers that take a callback.
+template <typename Send>
+redisReply* redis_wait (Send send, boost::asio::yield_context yield) {
+    return detail::redis_command<detail::RedisCompletion, redisReply*> (send, yield);
+}
+
+/// Have client decode the replies redis_read_flat waits for into flat
+/// storage (see reply_decoder.h)
+inline void decode_flat (asio_redis::ManagedRedisClient& client) {
+    client.decode_flat (detail::resume_redis<detail::FlatCompletion,
+                                             const asio_redis::FlatReply*>);
+}
+
+/// As redis_read, with the reply decoded into flat storage. client has to
+/// have been set up with decode_flat.
+inline const asio_redis::FlatReply* redis_read_flat (asio_redis::ManagedRedisClient& client,
+                                                     asio_redis::CommandBuilder& builder,
+                                                     boost::asio::yield_context yield) {
+    return detail::redis_command<detail::FlatCompletion, const asio_redis::FlatReply*> (
+        [&client, &builder] (redisCallbackFn* fn, void* data) {
+            return client.read (fn, data, builder);
+        }, yield);
+}
+
+/// The result of an operation that reports to a callback, and that is
+/// started before the coroutine is ready to wait for it (e.g., alongside
+/// a Redis command). The callback calls set, which may come before or
+/// after wait. One operation at a time, reset before starting the next.
+template <typename T>
+class Pending {
+  public:
+    Pending () : done_ (false), value_ () {}
+    Pending (const Pending&) = delete;
+    Pending& operator= (const Pending&) = delete;
+
+    /// Expect another result
+    void reset () {
+        done_ = false;
+    }
+
+    /// The operation is done, resume the coroutine if it is waiting
+    void set (const T& value) {
+        value_ = value;
+        done_ = true;
+        if (waiting_) {
+            Handler handler (*waiting_);
+            waiting_ = boost::none;
+            handler ();
+        }
+    }
+
+    /// Has set been called since reset
+    bool done () const {
+        return done_;
+    }
+
+    /// Wait for set, unless it came already
+    T wait (boost::asio::yield_context yield) {
+        if (!done_) {
+            Handler handler (yield);
+            Result result (handler);
+            // Handlers cannot be assigned, only copied
+            waiting_ = boost::in_place (handler);
+            result.get ();
+        }
+        return value_;
+    }
+
+  private:
+    typedef typename detail::Completion<void ()>::Handler Handler;
+    typedef typename detail::Completion<void ()>::Result Result;
+
+    bool done_;
+    T value_;
+    // The waiting coroutine's handler
+    boost::optional<Handler> waiting_;
+};
+} // namespace common
+} // namespace service
+} // namespace hlv
+#endif
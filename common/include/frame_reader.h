@@ -0,0 +1,197 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <boost/asio.hpp>
+#include "handler_memory.h"
+#include "uring.h"
+#ifndef _HLV_COMMON_FRAME_READER_H_
+#define _HLV_COMMON_FRAME_READER_H_
+namespace hlv {
+namespace service {
+namespace common {
+
+/// Reads framed messages (a uint64 length, then the message) off a stream.
+/// Reading the length and then the message costs two system calls a
+/// message, which is most of what a small request costs to serve. Instead
+/// the reader reads whatever the socket has into one buffer, allocated once
+/// per connection, and hands out every message that arrived whole before
+/// reading again: a small request costs one read, and requests a client
+/// sends back to back share theirs. Reads allocate nothing either, their
+/// handlers use memory of the reader's own.
+///
+/// Typical use is to take messages with next until it returns false, then
+/// async_fill and try again.
+class FrameReader {
+  public:
+    FrameReader (const FrameReader&) = delete;
+    FrameReader& operator= (const FrameReader&) = delete;
+
+    /// maxMessage: longest message accepted, the buffer starts at no more
+    ///             than 128k and grows as far as this if it must
+    /// flagBits: bits of the length that mark the message rather than
+    ///           count its bytes (e.g., ev::compression::COMPRESSED_FRAME),
+    ///           see flags
+    explicit FrameReader (uint64_t maxMessage = 131072, uint64_t flagBits = 0) :
+        maxMessage_ (maxMessage),
+        flagBits_ (flagBits),
+        buffer_ (std::min (maxMessage, (uint64_t)131072) + sizeof(uint64_t)),
+        start_ (0),
+        end_ (0),
+        flags_ (0) {
+    }
+
+    ~FrameReader () {
+#ifdef HLV_IO_URING
+        // The ring goes with its io_service, which may be gone already
+        if (ring_ && Uring::of (*context_) == ring_) {
+            ring_->unregister_buffer (slot_);
+        }
+#endif
+    }
+
+    /// Take the next message if all of it has been read. data stays valid
+    /// until the next call to async_fill. Never takes an oversized message,
+    /// check oversized once this returns false.
+    bool next (const char*& data, size_t& length) {
+        uint64_t size;
+        // The length is whatever the peer sent, keep it out of any sums
+        if (!header (size) || size > maxMessage_ ||
+            size > end_ - start_ - sizeof(uint64_t)) {
+            return false;
+        }
+        memcpy (&flags_, &buffer_[start_], sizeof(uint64_t));
+        flags_ &= flagBits_;
+        data = &buffer_[start_ + sizeof(uint64_t)];
+        length = size;
+        start_ += sizeof(uint64_t) + size;
+        return true;
+    }
+
+    /// Flag bits (of those passed to the constructor) set in the length of
+    /// the message next last took
+    uint64_t flags () const {
+        return flags_;
+    }
+
+    /// Part of a message has been read, and the rest is on its way
+    bool partial () const {
+        return end_ > start_;
+    }
+
+    /// The message being read is longer than maxMessage
+    bool oversized () const {
+        uint64_t size;
+        return header (size) && size > maxMessage_;
+    }
+
+    /// Forget everything read, e.g., when the stream is reconnected
+    void reset () {
+        start_ = end_ = 0;
+    }
+
+    /// Read whatever stream has, at least a byte, then call
+    /// handler (error_code). Fails with message_size once the length of an
+    /// oversized message has been read; callers that took messages with
+    /// next should check oversized rather than wait for that. On an
+    /// io_service served by io_uring (see uring.h) the read goes through
+    /// the ring, into the buffer registered with it.
+    template <typename Stream, typename Handler>
+    void async_fill (Stream& stream, Handler handler) {
+        make_room ();
+        auto filled = make_handler (memory_,
+            [this, handler] (boost::system::error_code ec, std::size_t bytes) mutable {
+                end_ += bytes;
+                if (!ec && oversized ()) {
+                    ec = boost::asio::error::message_size;
+                }
+                handler (ec);
+            });
+#ifdef HLV_IO_URING
+        if (use_ring (stream)) {
+            ring_->async_receive (stream.native_handle (), &buffer_[end_],
+                                  buffer_.size () - end_, slot_, std::move (filled));
+            return;
+        }
+#endif
+        stream.async_read_some (
+            boost::asio::buffer (&buffer_[end_], buffer_.size () - end_),
+            std::move (filled));
+    }
+
+  private:
+#ifdef HLV_IO_URING
+    // Is stream's io_service served by io_uring. If so the buffer is
+    // registered with the ring, again whenever make_room moved it.
+    template <typename Stream>
+    bool use_ring (Stream& stream) {
+        if (!ringKnown_) {
+            ringKnown_ = true;
+            context_ = &context_of (stream);
+            ring_ = Uring::of (*context_);
+        }
+        if (ring_ && (registered_ != buffer_.data () || registeredSize_ != buffer_.size ())) {
+            slot_ = ring_->register_buffer (buffer_.data (), buffer_.size (), slot_);
+            registered_ = buffer_.data ();
+            registeredSize_ = buffer_.size ();
+        }
+        return ring_ != nullptr;
+    }
+#endif
+
+    // Length of the message at start_, if that much has been read
+    bool header (uint64_t& size) const {
+        if (end_ - start_ < sizeof(uint64_t)) {
+            return false;
+        }
+        memcpy (&size, &buffer_[start_], sizeof(uint64_t));
+        size &= ~flagBits_;
+        return true;
+    }
+
+    // Move what is left of a message to the front, and grow the buffer if
+    // the message would not fit otherwise
+    void make_room () {
+        if (start_ == end_) {
+            start_ = end_ = 0;
+        } else if (start_ > 0) {
+            memmove (&buffer_[0], &buffer_[start_], end_ - start_);
+            end_ -= start_;
+            start_ = 0;
+        }
+        uint64_t size;
+        if (header (size) && size <= maxMessage_ &&
+            sizeof(uint64_t) + size > buffer_.size ()) {
+            buffer_.resize (sizeof(uint64_t) + size);
+        }
+    }
+
+    const uint64_t maxMessage_;
+    const uint64_t flagBits_;
+    std::vector<char> buffer_;
+    HandlerMemory memory_;
+
+    // Bytes read and not yet handed out
+    size_t start_;
+    size_t end_;
+
+    // Flag bits of the message last taken
+    uint64_t flags_;
+
+#ifdef HLV_IO_URING
+    // The ring reads go through (looked up on the first read), and where
+    // buffer_ is registered with it: slot_ is -1 if it is not
+    bool ringKnown_ = false;
+    const IoContext* context_ = nullptr;
+    Uring* ring_ = nullptr;
+    int slot_ = -1;
+    const char* registered_ = nullptr;
+    size_t registeredSize_ = 0;
+#endif
+};
+} // namespace common
+} // namespace service
+} // namespace hlv
+#endif
@@ -0,0 +1,89 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <boost/aligned_storage.hpp>
+#ifndef _HLV_COMMON_HANDLER_MEMORY_H_
+#define _HLV_COMMON_HANDLER_MEMORY_H_
+namespace hlv {
+namespace service {
+namespace common {
+
+/// Memory for the handler of one outstanding operation. asio asks for
+/// memory every time an operation is started and gives it back before the
+/// handler runs, so with this a connection reading or writing request
+/// after request uses the same block every time instead of a trip to the
+/// heap per step. Keep one for each operation that can be outstanding at
+/// once (usually a read and a write). Falls back to the heap if the block
+/// is in use or too small.
+class HandlerMemory {
+  public:
+    HandlerMemory (const HandlerMemory&) = delete;
+    HandlerMemory& operator= (const HandlerMemory&) = delete;
+
+    HandlerMemory () :
+        inUse_ (false) {
+    }
+
+    void* allocate (std::size_t size) {
+        if (!inUse_ && size <= sizeof(storage_)) {
+            inUse_ = true;
+            return storage_.address ();
+        }
+        return ::operator new (size);
+    }
+
+    void deallocate (void* pointer) {
+        if (pointer == storage_.address ()) {
+            inUse_ = false;
+        } else {
+            ::operator delete (pointer);
+        }
+    }
+
+  private:
+    // Room for a composed write (async_write) whose handler is a
+    // coroutine's, the largest operation kept here
+    boost::aligned_storage<512> storage_;
+    bool inUse_;
+};
+
+/// A handler that has asio allocate its operation from a HandlerMemory
+template <typename Handler>
+class AllocatingHandler {
+  public:
+    AllocatingHandler (HandlerMemory& memory, Handler handler) :
+        memory_ (memory),
+        handler_ (std::move (handler)) {
+    }
+
+    template <typename... Args>
+    void operator() (Args&&... args) {
+        handler_ (std::forward<Args> (args)...);
+    }
+
+    friend void* asio_handler_allocate (std::size_t size,
+                                        AllocatingHandler<Handler>* handler) {
+        return handler->memory_.allocate (size);
+    }
+
+    friend void asio_handler_deallocate (void* pointer, std::size_t,
+                                         AllocatingHandler<Handler>* handler) {
+        handler->memory_.deallocate (pointer);
+    }
+
+  private:
+    HandlerMemory& memory_;
+    Handler handler_;
+};
+
+/// Wrap handler to allocate from memory
+template <typename Handler>
+inline AllocatingHandler<Handler> make_handler (HandlerMemory& memory, Handler handler) {
+    return AllocatingHandler<Handler> (memory, std::move (handler));
+}
+} // namespace common
+} // namespace service
+} // namespace hlv
+#endif
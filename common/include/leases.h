@@ -0,0 +1,317 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/log/trivial.hpp>
+#include <hiredis/hiredis.h>
+#include <command_builder.h>
+#include <managed_client.h>
+#include "consts.h"
+#include "stats_reporter.h"
+#ifndef _HLV_LEASES_H_
+#define _HLV_LEASES_H_
+namespace hlv {
+namespace service {
+namespace common {
+/// Registrations (members of a key's local set, fields of a key's hash) can
+/// be leased: unless renewed they go away once their lease runs out, so a
+/// server that crashed stops being handed out. Rather than a TTL per member
+/// (which Redis does not have), every lease is an entry in one sorted set,
+/// prefix:ev:leases, scored by its deadline in unix milliseconds. A Sweeper
+/// removes expired registrations and bumps their key's version, which is
+/// what watchers are notified of.
+///
+/// Lease entries are the kind of registration, the key, a NUL and the
+/// member or field.
+namespace lease {
+const char LOCAL_SET = 's';
+const char HASH_FIELD = 'h';
+
+/// The lease entry for item (a member or field) of key
+inline void entry (char kind,
+                   const std::string& key,
+                   const std::string& item,
+                   std::string& out) {
+    out.clear ();
+    out.push_back (kind);
+    out.append (key);
+    out.push_back ('\0');
+    out.append (item);
+}
+
+/// Deadline of a lease of seconds starting now
+inline uint64_t deadline (uint32_t seconds) {
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds> (
+                        std::chrono::system_clock::now ().time_since_epoch ());
+    return (uint64_t)now.count () + (uint64_t)seconds * 1000;
+}
+
+/// Renews the entries given, those that still exist. KEYS[1] is the lease
+/// set, ARGV[1] the new deadline and the rest are entries. Replies with how
+/// many were renewed.
+const char RENEW_SCRIPT[] =
+    "local renewed = 0\n"
+    "for i = 2, #ARGV do\n"
+    "  if redis.call('ZSCORE', KEYS[1], ARGV[i]) then\n"
+    "    redis.call('ZADD', KEYS[1], ARGV[1], ARGV[i])\n"
+    "    renewed = renewed + 1\n"
+    "  end\n"
+    "end\n"
+    "return renewed\n";
+
+/// Sets the deadline of the entries given to ARGV[1], except for those
+/// whose lease already runs longer. KEYS[1] is the lease set, ARGV[2..]
+/// the entries. Used when replaying registrations, which must not cut
+/// short a lease that was renewed since.
+const char EXTEND_SCRIPT[] =
+    "for i = 2, #ARGV do\n"
+    "  local score = redis.call('ZSCORE', KEYS[1], ARGV[i])\n"
+    "  if not score or tonumber(score) < tonumber(ARGV[1]) then\n"
+    "    redis.call('ZADD', KEYS[1], ARGV[1], ARGV[i])\n"
+    "  end\n"
+    "end\n"
+    "return 0\n";
+
+/// Removes the registrations of the lease entries ARGV[2..] whose lease ran
+/// out by ARGV[1]; entries renewed since they were found are left alone.
+/// KEYS[1] is the lease set, and entry ARGV[i] comes with the key holding
+/// its registration, KEYS[2i - 2], and that key's version, KEYS[2i - 1].
+/// Every key that lost something has its version bumped once. Replies with
+/// how many leases ran out.
+///
+/// Every key the script touches is declared, as Redis requires of scripts
+/// that are replicated or run on a cluster. On a cluster they also have to
+/// hash to one slot, so the prefix should be a hash tag (e.g., {ev}).
+const char SWEEP_SCRIPT[] =
+    "local expired = 0\n"
+    "local bumped = {}\n"
+    "for i = 2, #ARGV do\n"
+    "  local entry = ARGV[i]\n"
+    "  local score = redis.call('ZSCORE', KEYS[1], entry)\n"
+    "  if score and tonumber(score) <= tonumber(ARGV[1]) then\n"
+    "    redis.call('ZREM', KEYS[1], entry)\n"
+    "    expired = expired + 1\n"
+    "    local item = string.sub(entry, string.find(entry, '\\0', 2, true) + 1)\n"
+    "    local removed\n"
+    "    if string.sub(entry, 1, 1) == 's' then\n"
+    "      removed = redis.call('SREM', KEYS[2 * i - 2], item)\n"
+    "    else\n"
+    "      removed = redis.call('HDEL', KEYS[2 * i - 2], item)\n"
+    "    end\n"
+    "    local version = KEYS[2 * i - 1]\n"
+    "    if removed > 0 and not bumped[version] then\n"
+    "      bumped[version] = true\n"
+    "      redis.call('INCR', version)\n"
+    "    end\n"
+    "  end\n"
+    "end\n"
+    "return expired\n";
+
+/// Periodically removes registrations whose lease ran out: fetches a batch
+/// of expired lease entries, then has SWEEP_SCRIPT remove them atomically,
+/// so several servers may sweep the same prefix.
+class Sweeper {
+  public:
+    Sweeper () = delete;
+    Sweeper (const Sweeper&) = delete;
+    Sweeper& operator= (const Sweeper&) = delete;
+
+    /// interval: time between sweeps
+    /// batch: most leases expired per script run, a full batch is followed
+    ///        by another sweep right away
+    Sweeper (boost::asio::io_service& io_service,
+             asio_redis::ManagedRedisClient& redis,
+             const std::string& prefix,
+             boost::posix_time::time_duration interval,
+             uint32_t batch = 1000) :
+        redis_ (redis),
+        leases_ (prefix + ":" + hlv::service::lookup::LEASE_SET),
+        localSet_ ("." + hlv::service::lookup::LOCAL_SET),
+        version_ ("." + hlv::service::lookup::VERSION_KEY),
+        batch_ (batch),
+        interval_ (interval),
+        timer_ (io_service),
+        command_ (prefix),
+        request_ (nullptr),
+        full_ (false),
+        stopped_ (true),
+        expired_ (0) {
+    }
+
+    ~Sweeper () {
+        // Redis may still answer, it finds nobody there
+        if (request_) {
+            request_->sweeper = nullptr;
+        }
+    }
+
+    void start () {
+        stopped_ = false;
+        wait (interval_);
+    }
+
+    void stop () {
+        stopped_ = true;
+        timer_.cancel ();
+    }
+
+    uint64_t expired () const { return expired_; }
+
+    void add_metrics (StatsReporter& stats, const std::string& prefix = "") {
+        stats.add (prefix + "leases.expired", [this] () { return (double)expired_; });
+    }
+
+  private:
+    // What Redis gets as privdata, so that a reply arriving after the
+    // Sweeper is gone is dropped rather than handed to freed memory
+    struct Request {
+        Sweeper* sweeper;
+    };
+
+    void wait (boost::posix_time::time_duration delay) {
+        timer_.expires_from_now (delay);
+        timer_.async_wait ([this] (boost::system::error_code ec) {
+            if (!ec && !stopped_) {
+                fetch ();
+            }
+        });
+    }
+
+    // Send a command for this sweeper, fn gets the reply
+    void send (redisCallbackFn* fn) {
+        request_ = new Request {this};
+        redis_.write (fn, request_, command_);
+    }
+
+    // The sweeper a reply is for, null if it is gone or stopped
+    static Sweeper* reply_for (void* data) {
+        std::unique_ptr<Request> request ((Request*)data);
+        Sweeper* sweeper = request->sweeper;
+        if (!sweeper) {
+            return nullptr;
+        }
+        sweeper->request_ = nullptr;
+        return sweeper->stopped_ ? nullptr : sweeper;
+    }
+
+    void fetch () {
+        now_ = std::to_string (deadline (0));
+        std::string batch = std::to_string (batch_);
+        command_.begin (7)
+                .arg ("ZRANGEBYSCORE", 13)
+                .arg (leases_)
+                .arg ("-inf", 4)
+                .arg (now_)
+                .arg ("LIMIT", 5)
+                .arg ("0", 1)
+                .arg (batch);
+        send (fetchReply);
+    }
+
+    static void fetchReply (redisAsyncContext*, void* r, void* data) {
+        Sweeper* sweeper = reply_for (data);
+        if (sweeper) {
+            sweeper->fetched ((redisReply*)r);
+        }
+    }
+
+    void fetched (redisReply* reply) {
+        if (!reply || reply->type != REDIS_REPLY_ARRAY) {
+            if (reply && reply->type == REDIS_REPLY_ERROR) {
+                BOOST_LOG_TRIVIAL (error) << "Lease sweep failed: " << reply->str;
+            }
+            wait (interval_);
+            return;
+        }
+        // A full batch means there may be more
+        full_ = reply->elements >= batch_;
+        std::vector<const redisReply*> entries;
+        for (size_t i = 0; i < reply->elements; i++) {
+            const redisReply* entry = reply->element[i];
+            const char* split = (entry->type == REDIS_REPLY_STRING && entry->len > 1) ?
+                    (const char*)memchr (entry->str + 1, '\0', entry->len - 1) : nullptr;
+            if (split && (entry->str[0] == LOCAL_SET || entry->str[0] == HASH_FIELD)) {
+                entries.push_back (entry);
+            } else if (entry->type == REDIS_REPLY_STRING) {
+                // Not a lease anything could have, just drop it
+                command_.begin (3)
+                        .arg ("ZREM", 4)
+                        .arg (leases_)
+                        .arg (entry->str, entry->len);
+                redis_.write (NULL, NULL, command_);
+            }
+        }
+        if (entries.empty ()) {
+            wait (full_ ? boost::posix_time::time_duration () : interval_);
+            return;
+        }
+        command_.begin (5 + 3 * entries.size ())
+                .arg ("EVAL", 4)
+                .arg (SWEEP_SCRIPT, sizeof (SWEEP_SCRIPT) - 1)
+                .arg ((uint64_t)(1 + 2 * entries.size ()))
+                .arg (leases_);
+        for (const redisReply* entry : entries) {
+            std::string key (entry->str + 1, strlen (entry->str + 1));
+            if (entry->str[0] == LOCAL_SET) {
+                command_.key (key, localSet_.data (), localSet_.size ());
+            } else {
+                command_.key (key);
+            }
+            command_.key (key, version_.data (), version_.size ());
+        }
+        command_.arg (now_);
+        for (const redisReply* entry : entries) {
+            command_.arg (entry->str, entry->len);
+        }
+        send (sweepReply);
+    }
+
+    static void sweepReply (redisAsyncContext*, void* r, void* data) {
+        Sweeper* sweeper = reply_for (data);
+        if (sweeper) {
+            sweeper->swept ((redisReply*)r);
+        }
+    }
+
+    void swept (redisReply* reply) {
+        if (!reply || reply->type != REDIS_REPLY_INTEGER) {
+            if (reply && reply->type == REDIS_REPLY_ERROR) {
+                BOOST_LOG_TRIVIAL (error) << "Lease sweep failed: " << reply->str;
+            }
+            wait (interval_);
+            return;
+        }
+        if (reply->integer > 0) {
+            BOOST_LOG_TRIVIAL (info) << "Expired " << reply->integer << " leases";
+            expired_ += reply->integer;
+        }
+        wait (full_ ? boost::posix_time::time_duration () : interval_);
+    }
+
+    asio_redis::ManagedRedisClient& redis_;
+    const std::string leases_;
+    const std::string localSet_;
+    const std::string version_;
+    const uint32_t batch_;
+    const boost::posix_time::time_duration interval_;
+    boost::asio::deadline_timer timer_;
+    // Builds keys under the prefix
+    asio_redis::CommandBuilder command_;
+    // Request waiting for Redis, if any
+    Request* request_;
+    // Time of the sweep in progress, and did it fetch a full batch
+    std::string now_;
+    bool full_;
+    bool stopped_;
+    uint64_t expired_;
+};
+} // namespace lease
+} // namespace common
+} // namespace service
+} // namespace hlv
+#endif
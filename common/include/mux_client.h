@@ -0,0 +1,135 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+#include "service.pb.h"
+#include "frame_reader.h"
+#include "handler_memory.h"
+#include "stream_socket.h"
+#include "uring.h"
+#ifndef _HLV_MUX_CLIENT_H_
+#define _HLV_MUX_CLIENT_H_
+namespace hlv {
+namespace service{
+namespace client {
+/// An asynchronous HLV client that keeps any number of requests outstanding
+/// on one connection. Every request is tagged with its own RequestID and
+/// responses are matched back to callbacks by it, so a slow request holds up
+/// none of those sent after it. Everything, callbacks included, happens on
+/// the io_service the client is given. Handlers keep the client alive, so it
+/// must be owned by a std::shared_ptr.
+class MuxClient
+    : public std::enable_shared_from_this<MuxClient>
+{
+  public:
+    /// success is false if the service failed the request, or if the
+    /// connection went away first (response is empty then)
+    typedef std::function<void (bool success,
+                                const hlv_service::ServiceResponse& response)>
+            Callback;
+
+    MuxClient () = delete;
+    MuxClient (const MuxClient&) = delete;
+    MuxClient& operator= (const MuxClient&) = delete;
+
+    /// rhost may be unix:/path for a service on this host, rport is
+    /// ignored then
+    MuxClient (boost::asio::io_service& io_service,
+               std::string rhost,
+               std::string rport);
+
+    /// Connect to the remote host and port, blocking until done
+    bool connect ();
+
+    /// Connect without blocking, done says whether it worked. Requests made
+    /// in the meantime are sent once connected.
+    void async_connect (std::function<void (bool)> done);
+
+    bool connected () const { return connected_; }
+
+    /// Neither connected nor connecting, requests fail right away
+    bool closed () const { return !connected_ && !connecting_; }
+
+    /// Authenticate, remembering the token (and capability) handed back for
+    /// requests that do not give one
+    void authenticate (const std::string& identity,
+                       const std::string& token,
+                       Callback done);
+
+    void request (const std::string& token,
+                  int32_t rtype,
+                  const std::string& argument,
+                  Callback done);
+
+    void request (int32_t rtype,
+                  const std::string& argument,
+                  Callback done);
+
+    /// Token and capability from the last successful authenticate
+    const std::string& token () const { return token_; }
+    const std::string& capability () const { return capability_; }
+
+    /// Requests sent and not yet answered
+    size_t outstanding () const { return calls_.size (); }
+
+    /// Close the connection, failing every outstanding request
+    void stop ();
+
+  private:
+    // Tag request, remember done for its response and queue it
+    void send (hlv_service::ServiceRequest& request, Callback done);
+
+    // Write everything in pending_
+    void start_write ();
+
+    // Hand on the responses read so far, then read more
+    void read_responses ();
+
+    // Hand response to the callback waiting for it
+    void dispatch (const hlv_service::ServiceResponse& response);
+
+    // The connection is gone: fail everything outstanding
+    void fail_all ();
+
+    // Try connecting to endpoints_[next] and those after it
+    void try_connect (size_t next, std::function<void (bool)> done);
+
+    void on_connected ();
+
+    boost::asio::io_service& io_service_;
+    hlv::service::common::StreamSocket socket_;
+    boost::asio::ip::tcp::resolver resolver_;
+    // Addresses rhost resolved to, tried in turn by async_connect
+    std::vector<hlv::service::common::StreamEndpoint> endpoints_;
+    std::string rhost_;
+    std::string rport_;
+    bool connected_;
+    bool connecting_;
+
+    // Callbacks by RequestID
+    std::unordered_map<int64_t, Callback> calls_;
+    int64_t nextRequestID_;
+
+    // Framed requests being written, and those queued since
+    bool writing_;
+    std::string outgoing_;
+    std::string pending_;
+    hlv::service::common::HandlerMemory writeMemory_;
+
+    hlv::service::common::FrameReader reader_;
+    hlv_service::ServiceRequest request_;
+    hlv_service::ServiceResponse response_;
+    // Handed to callbacks when there is no response
+    const hlv_service::ServiceResponse none_;
+
+    std::string token_;
+    std::string capability_;
+};
+} // namespace client
+} // namespace service
+} // namespace hlv
+#endif
@@ -1,5 +1,7 @@
 // Copyright 20xx The Regents of the University of California
 // This is a test service for SDN-v2 High Level Virtualization
+#include <functional>
+#include <memory>
 #include <string>
 #include "service.pb.h"
 #ifndef _HLV_SERVICE_INTERFACE_H_
@@ -27,6 +29,73 @@ class ServiceInterface {
     virtual bool ProcessRequest (const int64_t requestID,
                                  const hlv_service::ServiceRequest& request, 
                                  hlv_service::ServiceResponse& response) = 0;
+
+    virtual ~ServiceInterface () {}
+};
+
+/// The interface for service providers that wait on I/O (Redis, other
+/// services) before they can answer. Instead of filling in a response before
+/// returning they call done with it once it is ready, from the io_service
+/// thread. Connections keep reading while requests are outstanding, so one
+/// slow answer holds up neither the connection nor the server.
+class AsyncServiceInterface : public ServiceInterface {
+  public:
+    typedef std::function<void (const hlv_service::ServiceResponse&)> Completion;
+
+    // Arguments are only good for the duration of the call, copy whatever
+    // is needed to answer later. Answers may be given in any order, the
+    // response's RequestID tells the client which request it is for.
+    virtual void AuthenticateTokenAsync (const int64_t requestID,
+                                         const std::string& identity,
+                                         const std::string& token,
+                                         Completion done) = 0;
+
+    virtual void ProcessRequestAsync (const int64_t requestID,
+                                      const hlv_service::ServiceRequest& request,
+                                      Completion done) = 0;
+
+    // The synchronous calls only succeed for requests answered without
+    // waiting, false if the answer was not ready on return (it is then
+    // dropped when it arrives).
+    virtual bool AuthenticateToken (const int64_t requestID,
+                                const std::string& identity,
+                                const std::string& token,
+                                hlv_service::ServiceResponse& response) {
+        auto answer = std::make_shared<Answer> ();
+        AuthenticateTokenAsync (requestID, identity, token, answer->completion ());
+        return answer->take (response);
+    }
+
+    virtual bool ProcessRequest (const int64_t requestID,
+                                 const hlv_service::ServiceRequest& request,
+                                 hlv_service::ServiceResponse& response) {
+        auto answer = std::make_shared<Answer> ();
+        ProcessRequestAsync (requestID, request, answer->completion ());
+        return answer->take (response);
+    }
+
+  private:
+    // Where a synchronous call collects its answer. Shared with the
+    // completion, which may outlive the call.
+    struct Answer : public std::enable_shared_from_this<Answer> {
+        bool answered = false;
+        hlv_service::ServiceResponse response;
+
+        Completion completion () {
+            auto self (shared_from_this ());
+            return [self] (const hlv_service::ServiceResponse& r) {
+                self->response.CopyFrom (r);
+                self->answered = true;
+            };
+        }
+
+        bool take (hlv_service::ServiceResponse& out) {
+            if (answered) {
+                out.Swap (&response);
+            }
+            return answered;
+        }
+    };
 };
 } // namespace server
 } // namespace service
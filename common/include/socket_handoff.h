@@ -0,0 +1,289 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/log/trivial.hpp>
+#ifndef _HLV_SOCKET_HANDOFF_H_
+#define _HLV_SOCKET_HANDOFF_H_
+namespace hlv {
+namespace service {
+namespace common {
+/// Hot restart. A running server listens on a Unix socket (the handoff
+/// path). A new instance of the server connects to it and is sent the
+/// listening sockets (SCM_RIGHTS), acknowledges them and starts accepting
+/// right away. Once the acknowledgement arrives the old instance stops
+/// accepting and drains the connections it already has. Connections that
+/// arrive in between are queued on the shared listening socket and are
+/// accepted by whichever instance gets to them first, so none are refused.
+namespace handoff {
+
+// Most sockets handed off at once
+const size_t MAX_FDS = 16;
+
+// Byte sent by the new instance once it has the sockets
+const char ACK = 'K';
+
+/// Send fds over a connected Unix socket
+inline bool send_fds (int sock, const std::vector<int>& fds) {
+    if (fds.empty () || fds.size () > MAX_FDS) {
+        return false;
+    }
+    char count = (char)fds.size ();
+    struct iovec iov;
+    iov.iov_base = &count;
+    iov.iov_len = sizeof(count);
+
+    std::vector<char> control (CMSG_SPACE (sizeof(int) * fds.size ()));
+    struct msghdr msg;
+    memset (&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data ();
+    msg.msg_controllen = control.size ();
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (sizeof(int) * fds.size ());
+    memcpy (CMSG_DATA (cmsg), fds.data (), sizeof(int) * fds.size ());
+
+    ssize_t sent;
+    do {
+        sent = sendmsg (sock, &msg, 0);
+    } while (sent < 0 && errno == EINTR);
+    return sent == sizeof(count);
+}
+
+/// Receive fds sent with send_fds
+inline bool recv_fds (int sock, std::vector<int>& fds) {
+    char count = 0;
+    struct iovec iov;
+    iov.iov_base = &count;
+    iov.iov_len = sizeof(count);
+
+    std::vector<char> control (CMSG_SPACE (sizeof(int) * MAX_FDS));
+    struct msghdr msg;
+    memset (&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data ();
+    msg.msg_controllen = control.size ();
+
+    ssize_t received;
+    do {
+        received = recvmsg (sock, &msg, 0);
+    } while (received < 0 && errno == EINTR);
+    if (received != sizeof(count) || (msg.msg_flags & MSG_CTRUNC)) {
+        return false;
+    }
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR (&msg);
+         cmsg != NULL;
+         cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t n = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof(int);
+        const int* received = (const int*)CMSG_DATA (cmsg);
+        fds.insert (fds.end (), received, received + n);
+    }
+    return fds.size () == (size_t)count;
+}
+
+/// Try to take over listening sockets from a running instance listening
+/// on path. Returns false (and fds is left empty) if there is none, in
+/// which case the caller should bind its own sockets.
+inline bool take_over (const std::string& path, std::vector<int>& fds) {
+    struct sockaddr_un addr;
+    if (path.size () >= sizeof(addr.sun_path)) {
+        BOOST_LOG_TRIVIAL (error) << "Handoff path too long " << path;
+        return false;
+    }
+    memset (&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy (addr.sun_path, path.c_str (), sizeof(addr.sun_path) - 1);
+
+    int sock = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return false;
+    }
+    if (connect (sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        // Nobody there (or a stale path left by a crash)
+        close (sock);
+        return false;
+    }
+    if (!recv_fds (sock, fds)) {
+        BOOST_LOG_TRIVIAL (error) << "Did not receive listening sockets";
+        for (int fd : fds) {
+            close (fd);
+        }
+        fds.clear ();
+        close (sock);
+        return false;
+    }
+    ssize_t sent;
+    do {
+        sent = write (sock, &ACK, sizeof(ACK));
+    } while (sent < 0 && errno == EINTR);
+    close (sock);
+    BOOST_LOG_TRIVIAL (info) << "Took over " << fds.size ()
+                             << " listening sockets through " << path;
+    return true;
+}
+
+/// Waits on the handoff path for a new instance and hands it the listening
+/// sockets. Only one handoff ever happens.
+class Listener {
+  public:
+    typedef std::function<std::vector<int> ()> SocketProvider;
+    typedef std::function<void ()> HandedOff;
+
+    Listener () = delete;
+    Listener (const Listener&) = delete;
+    Listener& operator= (const Listener&) = delete;
+
+    /// path: Unix socket to listen on, replaces whatever is there
+    /// sockets: returns the listening sockets to hand over
+    /// handedOff: called once the new instance has the sockets, the caller
+    ///            should stop accepting and drain
+    Listener (boost::asio::io_service& io_service,
+              const std::string& path,
+              SocketProvider sockets,
+              HandedOff handedOff) :
+        path_ (path),
+        acceptor_ (io_service),
+        socket_ (io_service),
+        sockets_ (sockets),
+        handedOff_ (handedOff),
+        ack_ (0) {
+    }
+
+    /// Start listening for a new instance
+    bool start () {
+        boost::system::error_code ec;
+        // A previous instance has either handed off already or died
+        unlink (path_.c_str ());
+        boost::asio::local::stream_protocol::endpoint endpoint (path_);
+        acceptor_.open (endpoint.protocol (), ec);
+        if (!ec) {
+            acceptor_.bind (endpoint, ec);
+        }
+        if (!ec) {
+            acceptor_.listen (1, ec);
+        }
+        if (ec) {
+            BOOST_LOG_TRIVIAL (error) << "Could not listen for handoff on "
+                                      << path_ << " " << ec;
+            return false;
+        }
+        accept ();
+        return true;
+    }
+
+    /// Stop listening. The path is left alone, it may already belong to
+    /// the new instance.
+    void stop () {
+        boost::system::error_code ec;
+        acceptor_.close (ec);
+        socket_.close (ec);
+    }
+
+  private:
+    void accept () {
+        acceptor_.async_accept (socket_,
+            [this] (boost::system::error_code ec) {
+                if (!acceptor_.is_open ()) {
+                    return;
+                }
+                if (ec) {
+                    accept ();
+                    return;
+                }
+                BOOST_LOG_TRIVIAL (info) << "New instance asking for sockets";
+                if (!send_fds (socket_.native_handle (), sockets_ ())) {
+                    BOOST_LOG_TRIVIAL (error) << "Failed to send sockets";
+                    boost::system::error_code ignored;
+                    socket_.close (ignored);
+                    accept ();
+                    return;
+                }
+                wait_for_ack ();
+            });
+    }
+
+    // Keep serving until the new instance confirms, in case it dies first
+    void wait_for_ack () {
+        boost::asio::async_read (socket_,
+            boost::asio::buffer (&ack_, sizeof(ack_)),
+            [this] (boost::system::error_code ec, std::size_t) {
+                boost::system::error_code ignored;
+                socket_.close (ignored);
+                if (ec || ack_ != ACK) {
+                    BOOST_LOG_TRIVIAL (error) << "New instance went away, "
+                                              << "still serving";
+                    if (acceptor_.is_open ()) {
+                        accept ();
+                    }
+                    return;
+                }
+                BOOST_LOG_TRIVIAL (info) << "Handed off listening sockets";
+                acceptor_.close (ignored);
+                handedOff_ ();
+            });
+    }
+
+    std::string path_;
+    boost::asio::local::stream_protocol::acceptor acceptor_;
+    boost::asio::local::stream_protocol::socket socket_;
+    SocketProvider sockets_;
+    HandedOff handedOff_;
+    char ack_;
+};
+
+// Check every 100ms for server's connections to be gone
+template<typename Server>
+void wait_drained (boost::asio::deadline_timer& timer,
+                   Server& server,
+                   const boost::posix_time::ptime& deadline,
+                   std::function<void ()> done) {
+    if (server.connections () == 0 ||
+        boost::posix_time::microsec_clock::universal_time () >= deadline) {
+        BOOST_LOG_TRIVIAL (info) << "Drained, " << server.connections ()
+                                 << " connections left";
+        done ();
+        return;
+    }
+    timer.expires_from_now (boost::posix_time::milliseconds (100));
+    timer.async_wait ([&timer, &server, deadline, done]
+                      (boost::system::error_code ec) {
+        if (ec) {
+            return;
+        }
+        wait_drained (timer, server, deadline, done);
+    });
+}
+
+/// After a handoff: close server's connections as they finish the request
+/// they are on (idle ones right away), then call done once none are left.
+/// Gives up waiting at deadline.
+template<typename Server>
+void drain (boost::asio::deadline_timer& timer,
+            Server& server,
+            const boost::posix_time::ptime& deadline,
+            std::function<void ()> done) {
+    server.drain ();
+    wait_drained (timer, server, deadline, done);
+}
+} // namespace handoff
+} // namespace common
+} // namespace service
+} // namespace hlv
+#endif
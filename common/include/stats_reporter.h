@@ -0,0 +1,92 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <functional>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/log/trivial.hpp>
+#ifndef _HLV_STATS_REPORTER_H_
+#define _HLV_STATS_REPORTER_H_
+namespace hlv {
+namespace service {
+namespace common {
+
+/// Periodically logs a set of named metrics on one line, e.g.
+///    stats lookup: requests=1042 bloom.memory=119808 ...
+/// Metrics are read through callbacks when the line is written, so
+/// registering one costs nothing in between. Runs on the io_service it is
+/// given, like everything else, so callbacks need no locking.
+class StatsReporter {
+  public:
+    typedef std::function<double ()> Metric;
+
+    StatsReporter () = delete;
+    StatsReporter (const StatsReporter&) = delete;
+    StatsReporter& operator= (const StatsReporter&) = delete;
+
+    /// name: printed at the start of every line
+    /// interval: seconds between lines, 0 disables reporting
+    StatsReporter (boost::asio::io_service& io_service,
+                   const std::string& name,
+                   uint32_t interval) :
+        timer_ (io_service),
+        name_ (name),
+        interval_ (interval),
+        running_ (false) {
+    }
+
+    /// Report metric under name
+    void add (const std::string& name, Metric metric) {
+        metrics_.push_back (std::make_pair (name, metric));
+    }
+
+    /// Start reporting
+    void start () {
+        if (interval_ == 0 || running_) {
+            return;
+        }
+        running_ = true;
+        schedule ();
+    }
+
+    /// Stop reporting
+    void stop () {
+        running_ = false;
+        boost::system::error_code ec;
+        timer_.cancel (ec);
+    }
+
+    /// Write one line now
+    void report () const {
+        std::stringstream line;
+        line << "stats " << name_ << ":";
+        for (auto& metric : metrics_) {
+            line << " " << metric.first << "=" << metric.second ();
+        }
+        BOOST_LOG_TRIVIAL (info) << line.str ();
+    }
+
+  private:
+    void schedule () {
+        timer_.expires_from_now (boost::posix_time::seconds (interval_));
+        timer_.async_wait ([this] (boost::system::error_code ec) {
+            if (ec || !running_) {
+                return;
+            }
+            report ();
+            schedule ();
+        });
+    }
+
+    boost::asio::deadline_timer timer_;
+    std::string name_;
+    uint32_t interval_;
+    bool running_;
+    std::vector<std::pair<std::string, Metric>> metrics_;
+};
+} // namespace common
+} // namespace service
+} // namespace hlv
+#endif
@@ -0,0 +1,61 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <string>
+#include <boost/asio.hpp>
+#ifndef _HLV_COMMON_STREAM_SOCKET_H_
+#define _HLV_COMMON_STREAM_SOCKET_H_
+namespace hlv {
+namespace service {
+namespace common {
+
+/// Sockets and endpoints of stream connections, TCP or Unix domain. Clients
+/// on the same host as a server can skip loopback TCP by connecting to its
+/// Unix domain socket, everything else is the same.
+typedef boost::asio::generic::stream_protocol::socket StreamSocket;
+typedef boost::asio::generic::stream_protocol::endpoint StreamEndpoint;
+
+/// Hosts (and addresses) starting with this name a Unix domain socket,
+/// e.g., unix:/var/run/hlv/ebox.sock
+const std::string UNIX_PREFIX = "unix:";
+
+/// Does host name a Unix domain socket
+inline bool is_unix (const std::string& host) {
+    return host.compare (0, UNIX_PREFIX.size (), UNIX_PREFIX) == 0;
+}
+
+/// Endpoint of the Unix domain socket at path
+inline StreamEndpoint unix_endpoint (const std::string& path) {
+    return StreamEndpoint (boost::asio::local::stream_protocol::endpoint (path));
+}
+
+/// Connect socket to host and port. For unix:/path hosts port is ignored,
+/// other hosts are resolved and every address tried in turn.
+inline bool connect_stream (boost::asio::io_service& io_service,
+                            StreamSocket& socket,
+                            const std::string& host,
+                            const std::string& port,
+                            boost::system::error_code& ec) {
+    if (is_unix (host)) {
+        socket.close (ec);
+        socket.connect (unix_endpoint (host.substr (UNIX_PREFIX.size ())), ec);
+        return !ec;
+    }
+    boost::asio::ip::tcp::resolver resolver (io_service);
+    auto resolved = resolver.resolve ({host, port}, ec);
+    if (ec) {
+        return false;
+    }
+    ec = boost::asio::error::host_not_found;
+    for (; resolved != boost::asio::ip::tcp::resolver::iterator (); ++resolved) {
+        socket.close (ec);
+        socket.connect (StreamEndpoint (resolved->endpoint ()), ec);
+        if (!ec) {
+            return true;
+        }
+    }
+    return false;
+}
+} // namespace common
+} // namespace service
+} // namespace hlv
+#endif
@@ -3,6 +3,7 @@
 #include <memory>
 #include <tuple>
 #include <boost/asio.hpp>
+#include "stream_socket.h"
 #include "service.pb.h"
 #include "service_interface.h"
 #ifndef _HLV_CLIENT_CLIENT_H_
@@ -19,7 +20,7 @@ class SyncClient
     SyncClient (const SyncClient&) = delete;
     SyncClient& operator= (const SyncClient&) = delete;
     
-    // Construct one
+    // Construct one, rhost may be unix:/path (rport is unused then)
     SyncClient (std::string rhost, 
                 std::string rport);
 
@@ -46,20 +47,27 @@ class SyncClient
             int32_t rtype,
             const std::string& argument);
 
+    // Capability from the last successful authentication, empty if the
+    // auth service does not mint them. Send it with lookups and updates.
+    const std::string& capability () const { return capability_; }
+
     void stop ();
 
   private:
     // Send request to HLV server
     bool send_request (const hlv_service::ServiceRequest& request);
 
-    // Receive a response
+    // Receive the response to request_
     bool receive_response ();
+
+    // Receive any response
+    bool receive_message ();
     
     // IO service provider
     boost::asio::io_service io_service_;
 
     // Socket to server
-    boost::asio::ip::tcp::socket socket_;
+    hlv::service::common::StreamSocket socket_;
 
     // A temporary variable that holds the amount to be read
     uint64_t bufferSize_;
@@ -71,6 +79,12 @@ class SyncClient
     // Token after authentication
     std::string token_;
 
+    // Capability after authentication
+    std::string capability_;
+
+    // Tags the next request
+    int64_t nextRequestID_;
+
     // Buffer, expect never to need more than 128k
     std::array<char, 131072> buffer_;
     std::array<char, 131072> write_buffer_;
@@ -0,0 +1,162 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <cstddef>
+#include <cstdint>
+#ifndef _HLV_TIMER_WHEEL_H_
+#define _HLV_TIMER_WHEEL_H_
+namespace hlv {
+namespace service {
+namespace common {
+
+/// A timer, embedded in whatever it times. Linked into at most one wheel
+/// slot at a time.
+struct TimerNode {
+    TimerNode* prev;
+    TimerNode* next;
+    // Tick the timer fires on
+    uint64_t expires;
+    // Identifies the owner to whoever handles expiry
+    uint64_t data;
+
+    TimerNode () : prev (nullptr), next (nullptr), expires (0), data (0) {}
+
+    bool scheduled () const { return next != nullptr; }
+};
+
+/// Hierarchical timer wheel (as in the Linux kernel). Four levels of 64
+/// slots, each level's slot spanning a full turn of the level below, so
+/// 64^4 ticks can be scheduled ahead. Scheduling and cancelling are O(1)
+/// and allocate nothing; timers on higher levels are moved down a level
+/// once a turn. Timers further out than the wheel reaches fire at its
+/// edge.
+///
+/// The wheel has no clock of its own, advance () is called once a tick.
+class TimerWheel {
+  public:
+    static const uint32_t LEVELS = 4;
+    static const uint32_t BITS = 6;
+    static const uint32_t SLOTS = 1 << BITS;
+    static const uint64_t MASK = SLOTS - 1;
+    static const uint64_t MAX_TICKS = (1ULL << (LEVELS * BITS)) - 1;
+
+    TimerWheel (const TimerWheel&) = delete;
+    TimerWheel& operator= (const TimerWheel&) = delete;
+
+    TimerWheel () : now_ (0), count_ (0) {
+        for (uint32_t level = 0; level < LEVELS; level++) {
+            for (uint32_t slot = 0; slot < SLOTS; slot++) {
+                heads_[level][slot].prev = &heads_[level][slot];
+                heads_[level][slot].next = &heads_[level][slot];
+            }
+        }
+    }
+
+    /// Fire node ticks from now (at least 1), replacing any earlier schedule
+    void schedule (TimerNode* node, uint64_t ticks) {
+        cancel (node);
+        if (ticks == 0) {
+            ticks = 1;
+        } else if (ticks > MAX_TICKS) {
+            ticks = MAX_TICKS;
+        }
+        node->expires = now_ + ticks;
+        insert (node);
+        count_++;
+    }
+
+    /// Stop node from firing, fine to call on a node that is not scheduled
+    void cancel (TimerNode* node) {
+        if (!node->scheduled ()) {
+            return;
+        }
+        unlink (node);
+        count_--;
+    }
+
+    /// Move forward one tick, calling expired (node) for every timer that
+    /// fires. expired may schedule and cancel timers, including node.
+    template<typename Expired>
+    void advance (Expired expired) {
+        now_++;
+        if (count_ == 0) {
+            return;
+        }
+        // Move timers down from each level whose slot comes up this tick
+        for (uint32_t level = 1; level < LEVELS; level++) {
+            if ((now_ & ((1ULL << (level * BITS)) - 1)) != 0) {
+                break;
+            }
+            cascade (level, (now_ >> (level * BITS)) & MASK);
+        }
+
+        // Take the slot's list first, so expired can touch the wheel
+        TimerNode due;
+        take (&heads_[0][now_ & MASK], &due);
+        while (due.next != &due) {
+            TimerNode* node = due.next;
+            unlink (node);
+            count_--;
+            expired (node);
+        }
+    }
+
+    /// Ticks so far
+    uint64_t now () const { return now_; }
+
+    /// Scheduled timers
+    size_t size () const { return count_; }
+
+  private:
+    void insert (TimerNode* node) {
+        uint64_t delta = node->expires - now_;
+        uint32_t level = 0;
+        while (level < LEVELS - 1 && delta >= (1ULL << ((level + 1) * BITS))) {
+            level++;
+        }
+        TimerNode* head = &heads_[level][(node->expires >> (level * BITS)) & MASK];
+        node->next = head;
+        node->prev = head->prev;
+        head->prev->next = node;
+        head->prev = node;
+    }
+
+    static void unlink (TimerNode* node) {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = nullptr;
+        node->next = nullptr;
+    }
+
+    // Move the list at head onto the (empty) list at to
+    static void take (TimerNode* head, TimerNode* to) {
+        if (head->next == head) {
+            to->prev = to;
+            to->next = to;
+            return;
+        }
+        to->next = head->next;
+        to->prev = head->prev;
+        to->next->prev = to;
+        to->prev->next = to;
+        head->prev = head;
+        head->next = head;
+    }
+
+    void cascade (uint32_t level, uint64_t slot) {
+        TimerNode moving;
+        take (&heads_[level][slot], &moving);
+        while (moving.next != &moving) {
+            TimerNode* node = moving.next;
+            unlink (node);
+            insert (node);
+        }
+    }
+
+    TimerNode heads_[LEVELS][SLOTS];
+    uint64_t now_;
+    size_t count_;
+};
+} // namespace common
+} // namespace service
+} // namespace hlv
+#endif
@@ -0,0 +1,701 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <boost/version.hpp>
+#include <boost/asio.hpp>
+#include <boost/log/trivial.hpp>
+#include "handler_memory.h"
+#ifdef HLV_IO_URING
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <liburing.h>
+#endif
+#ifndef _HLV_COMMON_URING_H_
+#define _HLV_COMMON_URING_H_
+namespace hlv {
+namespace service {
+namespace common {
+
+/// What sockets run on: the io_service, or the execution context it is one
+/// of on newer Boost
+#if BOOST_VERSION >= 106600
+typedef boost::asio::execution_context IoContext;
+#else
+typedef boost::asio::io_service IoContext;
+#endif
+
+/// The io_service socket runs on
+template <typename Socket>
+inline IoContext& context_of (Socket& socket) {
+#if BOOST_VERSION >= 107400
+    return boost::asio::query (socket.get_executor (), boost::asio::execution::context);
+#elif BOOST_VERSION >= 106600
+    return socket.get_executor ().context ();
+#else
+    return socket.get_io_service ();
+#endif
+}
+
+#ifdef HLV_IO_URING
+/// An io_uring serving the sockets of an io_service, in place of asio's
+/// reactor (epoll), for servers started with Backend::IO_URING (see
+/// common_server.h). With epoll every read and write is a wakeup and then
+/// a system call of its own; here they are queued on the ring and submitted
+/// together once per turn of the io_service, one io_uring_enter for all of
+/// them, and their completions are reaped together on one eventfd wakeup.
+/// Listening sockets take a single multishot accept that keeps producing
+/// connections, and FrameReaders register their buffers so the kernel does
+/// not map them for every read.
+///
+/// The ring belongs to its io_service (it is an asio service, gone with the
+/// io_service), which has to be run by one thread: handlers are called
+/// straight from the completions, with no locking. Sockets keep working
+/// through asio for everything else (connect, options, shutdown), but have
+/// to be closed with close_socket, as operations on the ring hold on to
+/// them otherwise.
+///
+/// Needs liburing 2.2 and Linux 5.19 or later (multishot accept, and
+/// cancelling by descriptor).
+class Uring : public boost::asio::detail::service_base<Uring> {
+  public:
+    /// An operation on the ring, its address is the submission's user data
+    class Operation {
+      public:
+        /// The kernel is done with it, res as the system call would return
+        /// (-errno on failure); more if it will complete again (multishot)
+        virtual void complete (int res, bool more) = 0;
+
+        /// The ring is going away, free the operation without completing it
+        virtual void destroy () = 0;
+
+      protected:
+        Operation () :
+            prev_ (nullptr),
+            next_ (nullptr) {
+        }
+        virtual ~Operation () {}
+
+      private:
+        friend class Uring;
+        // Operations in flight, for destroy at shutdown
+        Operation* prev_;
+        Operation* next_;
+    };
+
+    /// Called with the descriptor of each connection accepted, or with
+    /// -errno once accepting has stopped for good
+    typedef std::function<void (int)> AcceptHandler;
+
+    /// Submission queue size attach gives rings, the completion queue is
+    /// twice that
+    static const unsigned ENTRIES = 4096;
+
+    /// Buffers that can be registered at once (see register_buffer)
+    static const unsigned SLOTS = 1024;
+
+    explicit Uring (boost::asio::io_service& io_service) :
+        boost::asio::detail::service_base<Uring> (io_service),
+        io_service_ (io_service),
+        notify_ (io_service),
+        open_ (false),
+        queued_ (0),
+        flushing_ (false),
+        inFlight_ (nullptr) {
+    }
+
+    ~Uring () {
+        shutdown_ring ();
+        std::lock_guard<std::mutex> lock (registry_lock ());
+        std::vector<Uring*>& rings = registry ();
+        for (auto ring = rings.begin (); ring != rings.end (); ++ring) {
+            if (*ring == this) {
+                rings.erase (ring);
+                generation ()++;
+                break;
+            }
+        }
+    }
+
+    /// The ring serving io_service, set up if it has none yet. Null (with
+    /// the reason logged) if the kernel will not give one.
+    static Uring* attach (boost::asio::io_service& io_service, unsigned entries = ENTRIES) {
+        if (Uring* ring = of (io_service)) {
+            return ring;
+        }
+        std::unique_ptr<Uring> ring (new Uring (io_service));
+        if (!ring->open (entries)) {
+            return nullptr;
+        }
+        boost::asio::add_service (io_service, ring.get ());
+        std::lock_guard<std::mutex> lock (registry_lock ());
+        registry ().push_back (ring.get ());
+        generation ()++;
+        return ring.release ();
+    }
+
+    /// The ring serving context, null if it has none. Called for every
+    /// operation, so the answer is kept per thread until rings come or go.
+    static Uring* of (const IoContext& context) {
+        static thread_local const IoContext* lastContext = nullptr;
+        static thread_local Uring* lastRing = nullptr;
+        static thread_local uint64_t lastGeneration = 0;
+        uint64_t now = generation ().load (std::memory_order_acquire);
+        if (now == 0) {
+            // No ring was ever set up
+            return nullptr;
+        }
+        if (&context != lastContext || now != lastGeneration) {
+            std::lock_guard<std::mutex> lock (registry_lock ());
+            lastContext = &context;
+            lastGeneration = generation ().load ();
+            lastRing = nullptr;
+            for (Uring* ring : registry ()) {
+                if (static_cast<const IoContext*> (&ring->io_service_) == &context) {
+                    lastRing = ring;
+                }
+            }
+        }
+        return lastRing;
+    }
+
+    /// Receive at most length bytes from socket fd into data, then call
+    /// handler (error_code, bytes) as async_read_some would. slot is where
+    /// data was registered (see register_buffer), or -1.
+    template <typename Handler>
+    void async_receive (int fd, char* data, size_t length, int slot, Handler handler) {
+        Transfer<Handler>::start (*this, fd, data, length, slot, false, handler);
+    }
+
+    /// Send all length bytes at data to socket fd, then call
+    /// handler (error_code, bytes) as async_write would
+    template <typename Handler>
+    void async_send (int fd, const char* data, size_t length, Handler handler) {
+        Transfer<Handler>::start (*this, fd, const_cast<char*> (data), length, -1, true, handler);
+    }
+
+    /// Accept connections on listening socket fd until stop_accept, handing
+    /// each to handler. Null if the ring is closed.
+    Operation* accept (int fd, AcceptHandler handler) {
+        if (!open_) {
+            return nullptr;
+        }
+        Accept* op = new Accept (*this, fd, std::move (handler));
+        op->issue ();
+        return op;
+    }
+
+    /// Stop an accept (before its socket is closed). Connections accepted
+    /// after this are closed, op is gone once the kernel lets go of it.
+    void stop_accept (Operation* op) {
+        static_cast<Accept*> (op)->stopped_ = true;
+        cancel (static_cast<Accept*> (op)->fd_);
+    }
+
+    /// Cancel every operation on descriptor fd, each completes with
+    /// operation_aborted. Has to come before fd is closed: operations hold
+    /// on to the socket, closing the descriptor alone leaves them waiting.
+    void cancel (int fd) {
+        io_uring_sqe* sqe = next_sqe ();
+        if (!sqe) {
+            return;
+        }
+        io_uring_prep_cancel_fd (sqe, fd, IORING_ASYNC_CANCEL_ALL);
+        queued (sqe, nullptr);
+        // The descriptor is looked up on submission, and it may be closed
+        // and reused as soon as this returns
+        submit ();
+    }
+
+    /// Register length bytes at data with the kernel for async_receive, in
+    /// slot if it has one already. The slot, or -1 if none is free or the
+    /// kernel will not pin the memory (receives into data then work as
+    /// unregistered ones).
+    int register_buffer (void* data, size_t length, int slot) {
+        if (!open_) {
+            return -1;
+        }
+        if (slot < 0) {
+            if (freeSlots_.empty ()) {
+                return -1;
+            }
+            slot = freeSlots_.back ();
+            freeSlots_.pop_back ();
+        }
+        struct iovec iov;
+        iov.iov_base = data;
+        iov.iov_len = length;
+        __u64 tag = 0;
+        if (io_uring_register_buffers_update_tag (&ring_, slot, &iov, &tag, 1) < 0) {
+            unregister_buffer (slot);
+            return -1;
+        }
+        return slot;
+    }
+
+    /// Let go of slot (from register_buffer), -1 is ignored
+    void unregister_buffer (int slot) {
+        if (!open_ || slot < 0) {
+            return;
+        }
+        struct iovec iov;
+        iov.iov_base = nullptr;
+        iov.iov_len = 0;
+        __u64 tag = 0;
+        io_uring_register_buffers_update_tag (&ring_, slot, &iov, &tag, 1);
+        freeSlots_.push_back (slot);
+    }
+
+  private:
+    // A read or write, allocated with the handler's allocation hooks like
+    // any asio operation (so HandlerMemory works the same)
+    template <typename Handler>
+    class Transfer : public Operation {
+      public:
+        static void start (Uring& ring, int fd, char* data, size_t length,
+                           int slot, bool send, Handler& handler) {
+            void* memory = boost_asio_handler_alloc_helpers::allocate (sizeof(Transfer), handler);
+            Transfer* op = new (memory) Transfer (ring, fd, data, length, slot, send, handler);
+            op->issue ();
+        }
+
+        void complete (int res, bool) override {
+            if (send_ && res > 0 && done_ + res < length_) {
+                // Send the rest, as async_write would
+                done_ += res;
+                issue ();
+                return;
+            }
+            boost::system::error_code ec;
+            size_t bytes = done_;
+            if (res < 0) {
+                ec = boost::system::error_code (-res, boost::asio::error::get_system_category ());
+            } else if (res == 0 && !send_ && length_ > 0) {
+                ec = boost::asio::error::eof;
+            } else {
+                bytes += res;
+            }
+            // Free the operation before the handler runs, so the handler can
+            // start another in the same memory
+            Handler handler (std::move (handler_));
+            free (handler);
+            boost_asio_handler_invoke_helpers::invoke (
+                boost::asio::detail::bind_handler (handler, ec, bytes), handler);
+        }
+
+        void destroy () override {
+            Handler handler (std::move (handler_));
+            free (handler);
+        }
+
+      private:
+        Transfer (Uring& ring, int fd, char* data, size_t length,
+                  int slot, bool send, Handler& handler) :
+            ring_ (ring),
+            fd_ (fd),
+            data_ (data),
+            length_ (length),
+            done_ (0),
+            slot_ (slot),
+            send_ (send),
+            handler_ (std::move (handler)) {
+        }
+
+        void issue () {
+            io_uring_sqe* sqe = ring_.next_sqe ();
+            if (!sqe) {
+                ring_.fail (this, -ECANCELED);
+                return;
+            }
+            if (send_) {
+                io_uring_prep_send (sqe, fd_, data_ + done_, length_ - done_, MSG_NOSIGNAL);
+            } else if (slot_ >= 0) {
+                io_uring_prep_read_fixed (sqe, fd_, data_, length_, 0, slot_);
+            } else {
+                io_uring_prep_recv (sqe, fd_, data_, length_, 0);
+            }
+            ring_.queued (sqe, this);
+        }
+
+        void free (Handler& handler) {
+            this->~Transfer ();
+            boost_asio_handler_alloc_helpers::deallocate (this, sizeof(Transfer), handler);
+        }
+
+        Uring& ring_;
+        const int fd_;
+        char* const data_;
+        const size_t length_;
+        // Sent so far
+        size_t done_;
+        const int slot_;
+        const bool send_;
+        Handler handler_;
+    };
+
+    // A multishot accept, started again whenever the kernel ends it
+    class Accept : public Operation {
+      public:
+        Accept (Uring& ring, int fd, AcceptHandler handler) :
+            ring_ (ring),
+            fd_ (fd),
+            handler_ (std::move (handler)),
+            stopped_ (false) {
+        }
+
+        void issue () {
+            io_uring_sqe* sqe = ring_.next_sqe ();
+            if (!sqe) {
+                ring_.fail (this, -ECANCELED);
+                return;
+            }
+            io_uring_prep_multishot_accept (sqe, fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            ring_.queued (sqe, this);
+        }
+
+        void complete (int res, bool more) override {
+            if (stopped_) {
+                // Nobody wants it any more
+                if (res >= 0) {
+                    ::close (res);
+                }
+            } else if (res >= 0) {
+                handler_ (res);
+            } else if (transient (res) && ring_.open_) {
+                if (res != -ECANCELED) {
+                    BOOST_LOG_TRIVIAL(error) << "Accept failed: " << strerror (-res);
+                }
+            } else if (!more) {
+                // E.g., EINVAL from a kernel without multishot accept
+                stopped_ = true;
+                handler_ (res);
+            }
+            if (!more) {
+                if (stopped_) {
+                    delete this;
+                } else {
+                    issue ();
+                }
+            }
+        }
+
+        void destroy () override {
+            delete this;
+        }
+
+      private:
+        friend class Uring;
+
+        // Errors accepting can go on after
+        static bool transient (int res) {
+            return res == -ECONNABORTED || res == -EMFILE || res == -ENFILE ||
+                   res == -ENOBUFS || res == -ENOMEM || res == -EINTR ||
+                   res == -EAGAIN || res == -ECANCELED;
+        }
+
+        Uring& ring_;
+        const int fd_;
+        AcceptHandler handler_;
+        bool stopped_;
+    };
+
+    // Set up the ring, and the eventfd that wakes the io_service for it
+    bool open (unsigned entries) {
+        int res = io_uring_queue_init (entries, &ring_, 0);
+        if (res < 0) {
+            BOOST_LOG_TRIVIAL(error) << "Could not set up io_uring: " << strerror (-res);
+            return false;
+        }
+        int fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0 || io_uring_register_eventfd (&ring_, fd) < 0) {
+            BOOST_LOG_TRIVIAL(error) << "Could not set up io_uring's eventfd";
+            if (fd >= 0) {
+                ::close (fd);
+            }
+            io_uring_queue_exit (&ring_);
+            return false;
+        }
+        notify_.assign (fd);
+        open_ = true;
+        if (io_uring_register_buffers_sparse (&ring_, SLOTS) == 0) {
+            for (unsigned slot = SLOTS; slot > 0; slot--) {
+                freeSlots_.push_back (slot - 1);
+            }
+        } else {
+            BOOST_LOG_TRIVIAL(info) << "io_uring buffers cannot be registered, receiving into plain ones";
+        }
+        wait ();
+        return true;
+    }
+
+    // Submission entry for the next operation, null once the ring is closed
+    io_uring_sqe* next_sqe () {
+        if (!open_) {
+            return nullptr;
+        }
+        io_uring_sqe* sqe = io_uring_get_sqe (&ring_);
+        if (!sqe) {
+            // The queue is full, make room
+            submit ();
+            sqe = io_uring_get_sqe (&ring_);
+        }
+        return sqe;
+    }
+
+    // sqe is filled in for op (null for none), submit it with the rest this
+    // turn
+    void queued (io_uring_sqe* sqe, Operation* op) {
+        io_uring_sqe_set_data (sqe, op);
+        if (op) {
+            op->prev_ = nullptr;
+            op->next_ = inFlight_;
+            if (inFlight_) {
+                inFlight_->prev_ = op;
+            }
+            inFlight_ = op;
+        }
+        queued_++;
+        if (!flushing_) {
+            flushing_ = true;
+            io_service_.post (make_handler (flushMemory_, [this] {
+                    flushing_ = false;
+                    submit ();
+                }));
+        }
+    }
+
+    // op could not be queued, complete it with res outside of its caller
+    void fail (Operation* op, int res) {
+        io_service_.post ([op, res] { op->complete (res, false); });
+    }
+
+    void unlink (Operation* op) {
+        if (op->prev_) {
+            op->prev_->next_ = op->next_;
+        } else {
+            inFlight_ = op->next_;
+        }
+        if (op->next_) {
+            op->next_->prev_ = op->prev_;
+        }
+        op->prev_ = op->next_ = nullptr;
+    }
+
+    // Hand everything queued to the kernel in one system call
+    void submit () {
+        if (!open_ || queued_ == 0) {
+            return;
+        }
+        queued_ = 0;
+        int res = io_uring_submit (&ring_);
+        if (res < 0) {
+            // What was not taken stays in the queue for the next submit
+            BOOST_LOG_TRIVIAL(error) << "io_uring submit failed: " << strerror (-res);
+            queued_ = 1;
+        }
+    }
+
+    // Wait for the eventfd the kernel signals completions on
+    void wait () {
+        notify_.async_read_some (boost::asio::null_buffers (), make_handler (waitMemory_,
+            [this] (boost::system::error_code ec, std::size_t) {
+                if (ec) {
+                    return;
+                }
+                uint64_t count;
+                if (::read (notify_.native_handle (), &count, sizeof(count)) < 0 &&
+                    errno != EAGAIN) {
+                    BOOST_LOG_TRIVIAL(error) << "io_uring eventfd read failed: " << strerror (errno);
+                }
+                reap ();
+                wait ();
+            }));
+    }
+
+    // Complete what the kernel is done with, and submit what that queued.
+    // Operations that complete in the meantime are taken in the same go
+    // without waking the io_service for them.
+    void reap () {
+        if (!open_) {
+            return;
+        }
+        io_uring_cq_eventfd_toggle (&ring_, false);
+        for (unsigned round = 0; round < REAP_ROUNDS; round++) {
+            complete_ready ();
+            submit ();
+            if (!open_ || io_uring_cq_ready (&ring_) == 0) {
+                break;
+            }
+        }
+        if (!open_) {
+            return;
+        }
+        io_uring_cq_eventfd_toggle (&ring_, true);
+        std::atomic_thread_fence (std::memory_order_seq_cst);
+        // Completions that came before the eventfd was back on did not
+        // signal it
+        if (io_uring_cq_ready (&ring_) > 0) {
+            io_service_.post (make_handler (reapMemory_, [this] { reap (); }));
+        }
+    }
+
+    void complete_ready () {
+        io_uring_cqe* cqe;
+        // Handlers may queue operations that complete at once, take no more
+        // than a queue's worth before submitting
+        for (unsigned taken = 0; taken < 2 * ENTRIES && open_ &&
+                 io_uring_peek_cqe (&ring_, &cqe) == 0; taken++) {
+            Operation* op = (Operation*)io_uring_cqe_get_data (cqe);
+            int res = cqe->res;
+            bool more = cqe->flags & IORING_CQE_F_MORE;
+            io_uring_cqe_seen (&ring_, cqe);
+            if (!op) {
+                // A cancel's own completion
+                continue;
+            }
+            if (!more) {
+                unlink (op);
+            }
+            op->complete (res, more);
+        }
+    }
+
+    // Close the ring, freeing operations still in flight (their handlers
+    // are destroyed uncalled, as asio's are at shutdown)
+    void shutdown_ring () {
+        if (!open_) {
+            return;
+        }
+        open_ = false;
+        boost::system::error_code ec;
+        notify_.close (ec);
+        io_uring_queue_exit (&ring_);
+        while (inFlight_) {
+            Operation* op = inFlight_;
+            unlink (op);
+            op->destroy ();
+        }
+    }
+
+#if BOOST_VERSION >= 106600
+    void shutdown () override {
+        shutdown_ring ();
+    }
+#else
+    void shutdown_service () {
+        shutdown_ring ();
+    }
+#endif
+
+    // Every ring, and a count of their comings and goings for of's cache
+    static std::mutex& registry_lock () {
+        static std::mutex lock;
+        return lock;
+    }
+    static std::vector<Uring*>& registry () {
+        static std::vector<Uring*> rings;
+        return rings;
+    }
+    static std::atomic<uint64_t>& generation () {
+        static std::atomic<uint64_t> count (0);
+        return count;
+    }
+
+    // Rounds of completing and submitting a reap takes before letting the
+    // io_service run other handlers
+    static const unsigned REAP_ROUNDS = 4;
+
+    boost::asio::io_service& io_service_;
+    struct io_uring ring_;
+    // Signalled by the kernel on completions
+    boost::asio::posix::stream_descriptor notify_;
+    bool open_;
+
+    // Entries queued since the last submit, and is a submit posted
+    unsigned queued_;
+    bool flushing_;
+
+    Operation* inFlight_;
+    std::vector<int> freeSlots_;
+
+    // For the ring's own handlers: the flush, the eventfd wait, and a reap
+    // posted for completions the eventfd missed
+    HandlerMemory flushMemory_;
+    HandlerMemory waitMemory_;
+    HandlerMemory reapMemory_;
+};
+#endif
+
+/// Read some of what socket has into length bytes at data, then call
+/// handler (error_code, bytes) as socket.async_read_some would; through
+/// io_uring if socket's io_service has one
+template <typename Socket, typename Handler>
+inline void async_read_some (Socket& socket, char* data, size_t length, Handler handler) {
+#ifdef HLV_IO_URING
+    if (Uring* ring = Uring::of (context_of (socket))) {
+        ring->async_receive (socket.native_handle (), data, length, -1, std::move (handler));
+        return;
+    }
+#endif
+    socket.async_read_some (boost::asio::buffer (data, length), std::move (handler));
+}
+
+/// Write all length bytes at data to socket, then call
+/// handler (error_code, bytes) as boost::asio::async_write would; through
+/// io_uring if socket's io_service has one
+template <typename Socket, typename Handler>
+inline void async_write_all (Socket& socket, const char* data, size_t length, Handler handler) {
+#ifdef HLV_IO_URING
+    if (Uring* ring = Uring::of (context_of (socket))) {
+        ring->async_send (socket.native_handle (), data, length, std::move (handler));
+        return;
+    }
+#endif
+    boost::asio::async_write (socket, boost::asio::buffer (data, length), std::move (handler));
+}
+
+/// Cancel socket's operations, those on io_uring too
+template <typename Socket>
+inline void cancel_socket (Socket& socket, boost::system::error_code& ec) {
+#ifdef HLV_IO_URING
+    if (socket.is_open ()) {
+        if (Uring* ring = Uring::of (context_of (socket))) {
+            ring->cancel (socket.native_handle ());
+        }
+    }
+#endif
+    socket.cancel (ec);
+}
+
+/// Close socket, cancelling its operations on io_uring first
+template <typename Socket>
+inline void close_socket (Socket& socket, boost::system::error_code& ec) {
+#ifdef HLV_IO_URING
+    if (socket.is_open ()) {
+        if (Uring* ring = Uring::of (context_of (socket))) {
+            ring->cancel (socket.native_handle ());
+        }
+    }
+#endif
+    socket.close (ec);
+}
+
+template <typename Socket>
+inline void close_socket (Socket& socket) {
+    boost::system::error_code ec;
+    close_socket (socket, ec);
+}
+} // namespace common
+} // namespace service
+} // namespace hlv
+#endif
@@ -1,83 +1,77 @@
 // Copyright 20xx The Regents of the University of California
 // This is a test service for SDN-v2 High Level Virtualization
 #include <signal.h>
+#include <cstring>
 #include <utility>
 #include <iostream>
 #include <boost/log/trivial.hpp>
 #include "connection.h"
 #include "connection_manager.h"
 
+namespace {
+// Most requests a client can have waiting on an asynchronous service
+const uint32_t MAX_OUTSTANDING = 128;
+}
+
 namespace hlv {
 namespace service{
 namespace server {
-Connection::Connection (boost::asio::ip::tcp::socket socket,
+Connection::Connection (hlv::service::common::StreamSocket socket,
                         ConnectionManager& manager,
                         std::shared_ptr<ServiceInterface> services) :
     socket_ (std::move(socket)),
-    bufferSize_ (0),
     manager_ (manager),
-    services_ (services) {
+    services_ (services),
+    async_ (std::dynamic_pointer_cast<AsyncServiceInterface> (services)),
+    outstanding_ (0),
+    paused_ (false),
+    writing_ (false) {
 }
 
 void Connection::start () {
     BOOST_LOG_TRIVIAL(info) << "Starting connection";
-    read_size();
+    read_requests();
 }
 
 void Connection::stop () {
-    socket_.close();
+    hlv::service::common::close_socket(socket_);
 }
 
-void Connection::read_size () {
+void Connection::read_requests () {
+    // Serve every request that has already been read before reading more
+    const char* data;
+    size_t length;
+    while (outstanding_ < MAX_OUTSTANDING && reader_.next (data, length)) {
+        if (!request_.ParseFromArray(data, length)) {
+            BOOST_LOG_TRIVIAL(error) << "Could not parse request";
+            manager_.stop(shared_from_this());
+            return;
+        }
+        BOOST_LOG_TRIVIAL(info) << "Received " << request_.msgtype();
+        dispatch_request (request_);
+        request_.Clear ();
+    }
+    if (outstanding_ >= MAX_OUTSTANDING) {
+        // Resumed by complete
+        paused_ = true;
+        return;
+    }
+    if (reader_.oversized ()) {
+        BOOST_LOG_TRIVIAL(error) << "Request too large, closing";
+        manager_.stop(shared_from_this());
+        return;
+    }
     auto self(shared_from_this());
-    boost::asio::async_read (socket_, 
-            boost::asio::buffer(&bufferSize_, sizeof(bufferSize_)),
-            [this, self] (boost::system::error_code ec, 
-                                std::size_t bytes_transfered) {
-                BOOST_LOG_TRIVIAL(info) << "Read connection";
+    reader_.async_fill (socket_,
+            [this, self] (boost::system::error_code ec) {
                 if (!ec) {
-                    BOOST_LOG_TRIVIAL(info) << "Read " 
-                                << bufferSize_
-                                << " byte preheader " 
-                                << bytes_transfered;
-                    read_buffer(bufferSize_);
-                } else if (ec != boost::asio::error::operation_aborted) {
-                    // Stop here
-                    BOOST_LOG_TRIVIAL(info) << "Connection ended";
+                    read_requests();
+                } else if (ec == boost::asio::error::message_size) {
+                    BOOST_LOG_TRIVIAL(error) << "Request too large, closing";
                     manager_.stop(shared_from_this());
-                }
-                else {
-                    BOOST_LOG_TRIVIAL(error) << "Unknown ASIO error " << ec << " closing socket";
-                    manager_.stop(shared_from_this());
-                }
-            });
-}
-
-void Connection::read_buffer (uint64_t length) {
-    auto self(shared_from_this());
-    BOOST_LOG_TRIVIAL(info) << "Being asked to read " << bufferSize_ << " bytes";
-    boost::asio::async_read (socket_, 
-            boost::asio::buffer(buffer_),
-            boost::asio::transfer_exactly(length),
-            [this, self] (boost::system::error_code ec,
-                          std::size_t bytes_transfered) {
-                BOOST_LOG_TRIVIAL(info) << "Read data";
-                if (!ec) {
-                    
-                    if (!request_.ParseFromArray(buffer_.data(), bytes_transfered)) {
-                        BOOST_LOG_TRIVIAL(error) << "Could not parse request";
-                        manager_.stop(shared_from_this());
-                        return;
-                    }
-                    BOOST_LOG_TRIVIAL(info) << "Received " << request_.msgtype();
-                    dispatch_request (request_);
-                     
-                    request_.Clear ();
-                    read_size();
-
                 } else if (ec != boost::asio::error::operation_aborted) {
                     // Stop here
-                    BOOST_LOG_TRIVIAL(info) << "Connection ended read: " << bytes_transfered;
+                    BOOST_LOG_TRIVIAL(info) << "Connection ended";
                     manager_.stop(shared_from_this());
                 }
                 else {
@@ -87,8 +81,31 @@ void Connection::read_buffer (uint64_t length) {
             });
 }
 
-hlv_service::ServiceResponse& 
-Connection::dispatch_request (const hlv_service::ServiceRequest& request) {
+void Connection::dispatch_request (const hlv_service::ServiceRequest& request) {
+    if (async_) {
+        // Answers may come back in any order, clients match them up by
+        // RequestID
+        auto self(shared_from_this());
+        outstanding_++;
+        AsyncServiceInterface::Completion done =
+            [this, self] (const hlv_service::ServiceResponse& response) {
+                complete (response);
+            };
+        switch (request.msgtype()) {
+            case hlv_service::ServiceRequest_RequestType_AUTHENTICATE:
+                async_->AuthenticateTokenAsync (request.requestid(),
+                                      request.authenticate().identity(),
+                                      request.authenticate().token(),
+                                      done);
+                break;
+            case hlv_service::ServiceRequest_RequestType_REQUEST:
+                async_->ProcessRequestAsync (request.requestid(),
+                                             request,
+                                             done);
+                break;
+        }
+        return;
+    }
     switch (request.msgtype()) {
         case hlv_service::ServiceRequest_RequestType_AUTHENTICATE:
             services_->AuthenticateToken (request.requestid(),
@@ -103,26 +120,59 @@ Connection::dispatch_request (const hlv_service::ServiceRequest& request) {
             break;
     }
     write_response (response_);
-    return response_;
+    response_.Clear();
+}
+
+void Connection::complete (const hlv_service::ServiceResponse& response) {
+    outstanding_--;
+    if (!socket_.is_open ()) {
+        // Connection went away while the service was busy
+        return;
+    }
+    write_response (response);
+    if (paused_) {
+        paused_ = false;
+        read_requests ();
+    }
 }
+
 void Connection::write_response (const hlv_service::ServiceResponse& response) {
-    auto self(shared_from_this());
+    // Frame the response onto whatever is waiting to be written, responses
+    // that complete during a write all go out in the next one
     uint64_t size = response.ByteSize ();
-    *((uint64_t*)write_buffer_.data()) = size;
-    response.SerializeToArray (write_buffer_.data() + sizeof(uint64_t), size);
-    BOOST_LOG_TRIVIAL (info) << "Writing response";
-    boost::asio::async_write (socket_,
-        boost::asio::buffer(write_buffer_),
-        boost::asio::transfer_exactly (size + sizeof(uint64_t)),
+    size_t offset = pending_.size ();
+    pending_.resize (offset + sizeof(uint64_t) + size);
+    memcpy (&pending_[offset], &size, sizeof(uint64_t));
+    response.SerializeToArray (&pending_[offset + sizeof(uint64_t)], size);
+    if (!writing_) {
+        start_write ();
+    }
+}
+
+void Connection::start_write () {
+    auto self(shared_from_this());
+    writing_ = true;
+    outgoing_.swap (pending_);
+    pending_.clear ();
+    BOOST_LOG_TRIVIAL (info) << "Writing " << outgoing_.size () << " bytes of responses";
+    hlv::service::common::async_write_all (socket_,
+        outgoing_.data (),
+        outgoing_.size (),
+        hlv::service::common::make_handler (writeMemory_,
         [this, self] (boost::system::error_code ec,
                           std::size_t bytes_transfered) {
+           writing_ = false;
            if (ec) {
                BOOST_LOG_TRIVIAL (info) << "Error sending data " << ec;
+               pending_.clear ();
                manager_.stop(shared_from_this());
+               return;
            }
            BOOST_LOG_TRIVIAL (info) << "Succeeded in sending";
-           response_.Clear();
-        }
+           if (!pending_.empty ()) {
+               start_write ();
+           }
+        })
     );
 }
 
@@ -0,0 +1,261 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <cstring>
+#include <utility>
+#include <boost/log/trivial.hpp>
+#include "mux_client.h"
+
+namespace {
+// Responses larger than this are taken to be garbage
+const uint64_t MAX_MESSAGE = 16 << 20;
+}
+
+namespace hlv {
+namespace service{
+namespace client {
+MuxClient::MuxClient (boost::asio::io_service& io_service,
+                      std::string rhost,
+                      std::string rport) :
+    io_service_ (io_service),
+    socket_ (io_service),
+    resolver_ (io_service),
+    rhost_ (rhost),
+    rport_ (rport),
+    connected_ (false),
+    connecting_ (false),
+    nextRequestID_ (1),
+    writing_ (false),
+    reader_ (MAX_MESSAGE) {
+}
+
+bool MuxClient::connect () {
+    boost::system::error_code ec;
+    if (!hlv::service::common::connect_stream (io_service_, socket_, rhost_, rport_, ec)) {
+        BOOST_LOG_TRIVIAL(error) << "Error connecting to " << rhost_ << ":" << rport_
+                                 << " " << ec;
+        return false;
+    }
+    on_connected ();
+    return true;
+}
+
+void MuxClient::async_connect (std::function<void (bool)> done) {
+    auto self(shared_from_this());
+    connecting_ = true;
+    endpoints_.clear ();
+    if (hlv::service::common::is_unix (rhost_)) {
+        endpoints_.push_back (hlv::service::common::unix_endpoint (
+                rhost_.substr (hlv::service::common::UNIX_PREFIX.size ())));
+        try_connect (0, done);
+        return;
+    }
+    resolver_.async_resolve ({rhost_, rport_},
+        [this, self, done] (boost::system::error_code ec,
+                            boost::asio::ip::tcp::resolver::iterator endpoints) {
+            if (ec) {
+                BOOST_LOG_TRIVIAL(error) << "Could not resolve " << rhost_ << " " << ec;
+                stop ();
+                done (false);
+                return;
+            }
+            if (!connecting_) {
+                // Stopped meanwhile
+                done (false);
+                return;
+            }
+            for (; endpoints != boost::asio::ip::tcp::resolver::iterator (); ++endpoints) {
+                endpoints_.push_back (hlv::service::common::StreamEndpoint (
+                        endpoints->endpoint ()));
+            }
+            try_connect (0, done);
+        });
+}
+
+void MuxClient::try_connect (size_t next, std::function<void (bool)> done) {
+    auto self(shared_from_this());
+    boost::system::error_code ignored;
+    hlv::service::common::close_socket (socket_, ignored);
+    socket_.async_connect (endpoints_[next],
+        [this, self, next, done] (boost::system::error_code ec) {
+            if (!ec) {
+                on_connected ();
+                done (true);
+                return;
+            }
+            if (ec != boost::asio::error::operation_aborted &&
+                next + 1 < endpoints_.size ()) {
+                try_connect (next + 1, done);
+                return;
+            }
+            BOOST_LOG_TRIVIAL(error) << "Error connecting to " << rhost_
+                                     << ":" << rport_ << " " << ec;
+            stop ();
+            done (false);
+        });
+}
+
+void MuxClient::on_connected () {
+    connected_ = true;
+    connecting_ = false;
+    // Requests are small and there can be many in flight, do not let them
+    // wait on each other's acks (meaningless, and failing, over a Unix
+    // domain socket)
+    boost::system::error_code ec;
+    socket_.set_option (boost::asio::ip::tcp::no_delay (true), ec);
+    reader_.reset ();
+    read_responses ();
+    if (!pending_.empty () && !writing_) {
+        start_write ();
+    }
+}
+
+void MuxClient::authenticate (const std::string& identity,
+                              const std::string& token,
+                              Callback done) {
+    request_.Clear ();
+    request_.set_msgtype (hlv_service::ServiceRequest_RequestType_AUTHENTICATE);
+    auto authenticate = request_.mutable_authenticate ();
+    authenticate->set_identity (identity);
+    authenticate->set_token (token);
+    send (request_, [this, done] (bool success,
+                                  const hlv_service::ServiceResponse& response) {
+        if (success) {
+            token_ = response.response ();
+            capability_ = response.capability ();
+        }
+        done (success, response);
+    });
+}
+
+void MuxClient::request (const std::string& token,
+                         int32_t rtype,
+                         const std::string& argument,
+                         Callback done) {
+    request_.Clear ();
+    request_.set_msgtype (hlv_service::ServiceRequest_RequestType_REQUEST);
+    auto request = request_.mutable_request ();
+    request->set_token (token);
+    request->set_requesttype (rtype);
+    request->set_requestargument (argument);
+    send (request_, std::move (done));
+}
+
+void MuxClient::request (int32_t rtype,
+                         const std::string& argument,
+                         Callback done) {
+    request (token_, rtype, argument, std::move (done));
+}
+
+void MuxClient::send (hlv_service::ServiceRequest& request, Callback done) {
+    if (closed ()) {
+        // Never connected, or stopped: fail from the io_service like any
+        // other failure
+        auto self(shared_from_this());
+        io_service_.post ([this, self, done] () { done (false, none_); });
+        return;
+    }
+    int64_t id = nextRequestID_++;
+    request.set_requestid (id);
+    calls_.insert (std::make_pair (id, std::move (done)));
+
+    uint64_t size = request.ByteSize ();
+    size_t offset = pending_.size ();
+    pending_.resize (offset + sizeof(uint64_t) + size);
+    memcpy (&pending_[offset], &size, sizeof(uint64_t));
+    request.SerializeToArray (&pending_[offset + sizeof(uint64_t)], size);
+    if (connected_ && !writing_) {
+        start_write ();
+    }
+}
+
+void MuxClient::start_write () {
+    auto self(shared_from_this());
+    writing_ = true;
+    outgoing_.swap (pending_);
+    pending_.clear ();
+    hlv::service::common::async_write_all (socket_,
+        outgoing_.data (),
+        outgoing_.size (),
+        hlv::service::common::make_handler (writeMemory_,
+        [this, self] (boost::system::error_code ec, std::size_t) {
+            writing_ = false;
+            if (ec) {
+                if (ec != boost::asio::error::operation_aborted) {
+                    BOOST_LOG_TRIVIAL(info) << "Error sending requests " << ec;
+                }
+                stop ();
+                return;
+            }
+            if (!pending_.empty ()) {
+                start_write ();
+            }
+        }));
+}
+
+void MuxClient::read_responses () {
+    // Hand on every response already read before reading more
+    const char* data;
+    size_t length;
+    while (reader_.next (data, length)) {
+        if (!response_.ParseFromArray (data, length)) {
+            BOOST_LOG_TRIVIAL(error) << "Could not parse response";
+            stop ();
+            return;
+        }
+        dispatch (response_);
+        if (!socket_.is_open ()) {
+            return;
+        }
+    }
+    if (reader_.oversized ()) {
+        BOOST_LOG_TRIVIAL(error) << "Response too large, giving up";
+        stop ();
+        return;
+    }
+    auto self(shared_from_this());
+    reader_.async_fill (socket_,
+        [this, self] (boost::system::error_code ec) {
+            if (ec) {
+                if (ec == boost::asio::error::message_size) {
+                    BOOST_LOG_TRIVIAL(error) << "Response too large, giving up";
+                } else if (ec != boost::asio::error::operation_aborted) {
+                    BOOST_LOG_TRIVIAL(info) << "Connection ended " << ec;
+                }
+                stop ();
+                return;
+            }
+            read_responses ();
+        });
+}
+
+void MuxClient::dispatch (const hlv_service::ServiceResponse& response) {
+    auto call = calls_.find (response.requestid ());
+    if (call == calls_.end ()) {
+        BOOST_LOG_TRIVIAL(info) << "Response to unknown request " << response.requestid ();
+        return;
+    }
+    Callback done = std::move (call->second);
+    calls_.erase (call);
+    done (response.success (), response);
+}
+
+void MuxClient::stop () {
+    connected_ = false;
+    connecting_ = false;
+    boost::system::error_code ec;
+    hlv::service::common::close_socket (socket_, ec);
+    pending_.clear ();
+    fail_all ();
+}
+
+void MuxClient::fail_all () {
+    // Callbacks may send new requests, those fail on their own
+    std::unordered_map<int64_t, Callback> calls;
+    calls.swap (calls_);
+    for (auto& call : calls) {
+        call.second (false, none_);
+    }
+}
+} // namespace client
+} // namespace service
+} // namespace hlv
@@ -18,7 +18,8 @@ SyncClient::SyncClient (std::string rhost,
             io_service_ (),
             socket_ (io_service_),
             rhost_ (rhost),
-            rport_ (rport) {
+            rport_ (rport),
+            nextRequestID_ (1) {
 }
 
 std::tuple<bool, const std::string>
@@ -28,8 +29,7 @@ SyncClient::authenticate (const std::string& identity,
     BOOST_LOG_TRIVIAL(info) << "Authentication with ID " << identity;
     request_.Clear();
     response_.Clear();
-    request_.set_requestid (1); // Since we have only one request inflight, don't need
-                                // to distinguish between them.
+    request_.set_requestid (nextRequestID_++);
     request_.set_msgtype (hlv_service::ServiceRequest_RequestType_AUTHENTICATE);
     auto authenticate = request_.mutable_authenticate();
     authenticate->set_identity(identity);
@@ -47,6 +47,7 @@ SyncClient::authenticate (const std::string& identity,
         return std::make_tuple(false, "");
     }
     token_ = response_.response(); 
+    capability_ = response_.capability();
     return std::make_tuple(true, token_);
 }
 
@@ -58,8 +59,7 @@ SyncClient::request (const std::string& token,
                             << " argument " << argument;
     request_.Clear();
     response_.Clear();
-    request_.set_requestid (1); // Since we have only one request inflight, don't need
-                                // to distinguish between them.
+    request_.set_requestid (nextRequestID_++);
     request_.set_msgtype (hlv_service::ServiceRequest_RequestType_REQUEST);
     auto request = request_.mutable_request ();
     request->set_token (token);
@@ -90,10 +90,8 @@ SyncClient::request (int32_t rtype,
 }
 
 bool SyncClient::connect () {
-    boost::asio::ip::tcp::resolver resolver(io_service_);
-    boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve({rhost_, rport_});
     boost::system::error_code ec;
-    socket_.connect(endpoint, ec);
+    hlv::service::common::connect_stream (io_service_, socket_, rhost_, rport_, ec);
     if (ec) {
         BOOST_LOG_TRIVIAL(error) << "Error connecting to remote endpoint";
         return false;
@@ -125,6 +123,17 @@ bool SyncClient::send_request (const hlv_service::ServiceRequest& request) {
 }
 
 bool SyncClient::receive_response () {
+    // Servers may answer out of order, skip anything that is not the answer
+    // to the request just sent
+    do {
+        if (!receive_message ()) {
+            return false;
+        }
+    } while (response_.requestid () != request_.requestid ());
+    return true;
+}
+
+bool SyncClient::receive_message () {
     uint64_t size = 0;
     boost::system::error_code ec;
     boost::asio::read (socket_,
@@ -147,7 +156,11 @@ bool SyncClient::receive_response () {
         return false;
     }
 
-    response_.ParseFromArray (buffer_.data(), size);
+    if (!response_.ParseFromArray (buffer_.data(), size)) {
+        BOOST_LOG_TRIVIAL (info) << "Could not parse response";
+        stop();
+        return false;
+    }
     return true;
 }
 }
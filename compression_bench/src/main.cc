@@ -0,0 +1,126 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <array>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <boost/program_options.hpp>
+#include "frame_compression.h"
+#include "lookup.pb.h"
+namespace po = boost::program_options;
+
+namespace {
+// Build a lookup response that looks like what discovery sends back for a
+// key with count endpoints registered.
+void build_response (ev_lookup::Response& response, uint32_t count) {
+    response.set_token (0x5eed);
+    response.set_querystring ("services.example.edu:frontend");
+    response.set_success (true);
+    for (uint32_t i = 0; i < count; i++) {
+        std::stringstream type, value;
+        type << "endpoint" << i;
+        value << "10." << ((i >> 16) & 0xff) << "." << ((i >> 8) & 0xff)
+              << "." << (i & 0xff) << ":" << (8000 + (i % 1000));
+        ev_lookup::Value* v = response.add_values ();
+        v->set_type (type.str ());
+        v->set_value (value.str ());
+    }
+}
+
+double mbps (uint64_t bytes, uint64_t iterations, double usec) {
+    return usec > 0 ? (bytes * iterations) / usec : 0.0;
+}
+}
+
+// Measure how well lookup responses compress and how long it takes
+int main (int argc, char* argv[]) {
+    po::options_description desc("EV frame compression benchmark");
+    uint32_t iterations = 1000;
+    size_t threshold = ev::compression::DEFAULT_THRESHOLD;
+
+    desc.add_options()
+        ("h,help", "Display help")
+        ("i,iterations", po::value<uint32_t>(&iterations)->implicit_value(iterations),
+            "Iterations per response size")
+        ("t,threshold", po::value<size_t>(&threshold)->implicit_value(threshold),
+            "Compression threshold");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::cerr << desc << std::endl;
+        return 0;
+    }
+
+    std::array<char, 131072> raw;
+    std::array<char, 131072> compressed;
+    std::array<char, 131072> inflated;
+    ev::compression::FrameCompressor compressor (threshold);
+
+    std::cout << std::setw(10) << "values"
+              << std::setw(10) << "raw"
+              << std::setw(12) << "compressed"
+              << std::setw(8) << "ratio"
+              << std::setw(12) << "comp us"
+              << std::setw(12) << "comp MB/s"
+              << std::setw(12) << "decomp us"
+              << std::setw(12) << "decomp MB/s" << std::endl;
+
+    for (uint32_t count = 1; count <= 2048; count *= 2) {
+        ev_lookup::Response response;
+        build_response (response, count);
+        size_t size = response.ByteSize ();
+        if (size > raw.size ()) {
+            break;
+        }
+        response.SerializeToArray (raw.data (), size);
+
+        uint64_t header = 0;
+        auto start = std::chrono::steady_clock::now ();
+        for (uint32_t i = 0; i < iterations; i++) {
+            header = compressor.compress (raw.data (),
+                                          size,
+                                          compressed.data (),
+                                          compressed.size ());
+        }
+        auto mid = std::chrono::steady_clock::now ();
+
+        size_t out = size;
+        size_t wire = size;
+        if (header != 0) {
+            wire = ev::compression::frame_length (header);
+            for (uint32_t i = 0; i < iterations; i++) {
+                if (!ev::compression::decompress (compressed.data (),
+                                                  wire,
+                                                  inflated.data (),
+                                                  inflated.size (),
+                                                  out) || out != size) {
+                    std::cerr << "Decompression failed for " << count
+                              << " values" << std::endl;
+                    return 1;
+                }
+            }
+        }
+        auto end = std::chrono::steady_clock::now ();
+
+        double compUs = std::chrono::duration_cast<std::chrono::microseconds>
+                            (mid - start).count ();
+        double decompUs = std::chrono::duration_cast<std::chrono::microseconds>
+                            (end - mid).count ();
+        std::cout << std::setw(10) << count
+                  << std::setw(10) << size
+                  << std::setw(12) << wire
+                  << std::setw(8) << std::setprecision(3)
+                        << (double)size / wire
+                  << std::setw(12) << compUs / iterations
+                  << std::setw(12) << mbps (size, iterations, compUs)
+                  << std::setw(12) << decompUs / iterations
+                  << std::setw(12) << mbps (size, iterations, decompUs)
+                  << std::endl;
+    }
+    return 0;
+}
@@ -3,248 +3,223 @@
 #include <utility>
 #include <iostream>
 #include <string>
-#include <sstream>
 #include <cassert>
 #include <algorithm>
 #include <cstdio>
 #include <boost/log/trivial.hpp>
+#include <managed_client.h>
 #include "coordinator_connection.h"
 #include "coordinator_server.h"
+#include "journal.h"
+#include "leases.h"
+#include "update_commands.h"
 #include "consts.h"
 
-namespace {
-// Callback for redis. hiredis is in C and need this to call C++ (in particular need a 
-// function that does not need the this pointer.)
-void redisReflector (redisAsyncContext* context, void* reply, void* data) {
-    // Find connection from the data passed in
-    auto connect = 
-                  (hlv::service::coordinator::Connection*)data;
-    redisReply* rreply = (redisReply*) reply;
-    connect->redisResponse (rreply);
-}
-}
-
 namespace hlv {
 namespace service{
 namespace coordinator {
-Connection::Connection (boost::asio::ip::tcp::socket socket,
+Connection::Connection (hlv::service::common::StreamSocket socket,
                         ConnectionManager& manager,
                         ConnectionInformation& config) :
     socket_ (std::move(socket)),
-    bufferSize_ (0),
+    reader_ (131072, ev::compression::COMPRESSED_FRAME),
     manager_ (manager),
-    config_ (config) {
+    config_ (config),
+    command_ (config.prefix),
+    admitted_ (false),
+    redisFailed_ (false) {
 }
 
 // Start listening on the socket.
 void Connection::start () {
     BOOST_LOG_TRIVIAL(info) << "Starting connection";
-    read_size();
+    auto self(shared_from_this());
+    boost::asio::spawn (config_.io_service,
+        [this, self] (boost::asio::yield_context yield) {
+            serve (yield);
+        });
 }
 
 // Stop listening on the socket, close the socket.
 void Connection::stop () {
-    socket_.close();
+    common::close_socket (socket_);
 }
 
-// Write an ev_lookup::UpdateResponse
-void Connection::write_response (const ev_lookup::UpdateResponse& response) {
-    // Bump up the refcount on this to make sure we don't delete this object while
-    // waiting for asio to be done.
-    auto self(shared_from_this());
-
-    // Compute size of response
-    uint64_t size = response.ByteSize ();
-
-    // All messages are 64-bits of size followed by the message
-    *((uint64_t*)write_buffer_.data()) = size;
-    response.SerializeToArray (write_buffer_.data() + sizeof(uint64_t), size);
-
-    BOOST_LOG_TRIVIAL (info) << "Writing response";
-    
-    // Asynchronously write message
-    boost::asio::async_write (socket_,
-        boost::asio::buffer(write_buffer_),
-        boost::asio::transfer_exactly (size + sizeof(uint64_t)),
-        [this, self] (boost::system::error_code ec,
-                          std::size_t bytes_transfered) {
-           if (ec) {
-               BOOST_LOG_TRIVIAL (info) << "Error sending join message " << ec;
-               manager_.stop(shared_from_this());
-           }
-           BOOST_LOG_TRIVIAL (info) << "Successfully responded";
-            response_.Clear ();
-           read_size ();
+void Connection::serve (boost::asio::yield_context yield) {
+    boost::system::error_code ec;
+    const char* data;
+    size_t length;
+    while (common::read_frame (socket_, reader_, data, length,
+                [this] (bool partial) {
+                    // Answered everything asked so far, let the client
+                    // reconnect elsewhere. The read fails once closed.
+                    if (!partial && manager_.draining ()) {
+                        BOOST_LOG_TRIVIAL (info) << "Draining, closing connection";
+                        common::close_socket (socket_);
+                    }
+                    manager_.expect (this, partial ? common::READ : common::IDLE);
+                }, yield, ec)) {
+        // Waiting on Redis from here on
+        manager_.expect (this, common::NO_DEADLINE);
+        if (reader_.flags ()) {
+            if (!config_.acceptCompressed) {
+                BOOST_LOG_TRIVIAL(error) << "Compressed update from a client never offered it";
+                break;
+            }
+            if (!ev::compression::decompress (data, length, buffer_.data (),
+                                              buffer_.size (), length)) {
+                BOOST_LOG_TRIVIAL(error) << "Could not decompress request";
+                break;
+            }
+            data = buffer_.data ();
         }
-    );
-}
-
-// Read the 64-bit size sent before a message.
-void Connection::read_size () {
-    auto self(shared_from_this());
-    boost::asio::async_read (socket_, 
-            boost::asio::buffer(&bufferSize_, sizeof(bufferSize_)),
-            [this, self] (boost::system::error_code ec, 
-                                std::size_t bytes_transfered) {
-                BOOST_LOG_TRIVIAL(info) << "Read connection";
-                if (!ec) {
-                    BOOST_LOG_TRIVIAL(info) << "Read " 
-                                << bufferSize_
-                                << " byte preheader " 
-                                << bytes_transfered;
-                    read_buffer(bufferSize_);
-                } else if (ec != boost::asio::error::operation_aborted) {
-                    // Stop here
-                    BOOST_LOG_TRIVIAL(info) << "Connection ended";
-                    manager_.stop(shared_from_this());
-                }
-                else {
-                    BOOST_LOG_TRIVIAL(error) << "Unknown ASIO error " << ec << " closing socket";
-                    manager_.stop(shared_from_this());
-                }
-            });
-}
-
-void Connection::execute_updates (const ev_lookup::Update& updates) {
-    switch (updates.operation ()) {
-        case ev_lookup::Update::SET_VALUES:
-            set_values (updates);
+        if (!update_.ParseFromArray(data, length)) {
+            BOOST_LOG_TRIVIAL(error) << "Could not parse request";
             break;
-        case ev_lookup::Update::DELETE_TYPES:
-            del_types (updates);
-            break;
-        case ev_lookup::Update::DELETE_KEY:
-            del_key (updates);
-            break;
-        case ev_lookup::Update::SET_PERM:
-            set_perm (updates);
+        }
+        execute_updates (update_, yield);
+        update_.Clear ();
+        if (!write_response (yield)) {
             break;
+        }
+    }
+    if (ec == boost::asio::error::message_size) {
+        BOOST_LOG_TRIVIAL(error) << "Update too large, closing";
+    } else if (ec && ec != boost::asio::error::operation_aborted) {
+        BOOST_LOG_TRIVIAL(info) << "Connection ended " << ec;
     }
+    manager_.stop(shared_from_this());
 }
 
-// Set one or more values
-void Connection::set_values (const ev_lookup::Update& update) {
-    assert (update.operation () == ev_lookup::Update::SET_VALUES);
-    if (update.values_size() == 0) {
-        BOOST_LOG_TRIVIAL (info) << "Failing SET_VALUES due to lack of types";
-        response_.set_success (false); 
-        write_response (response_);
-        return;
+// Write an ev_lookup::UpdateResponse
+bool Connection::write_response (boost::asio::yield_context yield) {
+    if (admitted_) {
+        admitted_ = false;
+        config_.admission->release (admittedAt_, !redisFailed_);
+    }
+    BOOST_LOG_TRIVIAL (info) << "Writing response";
+    manager_.expect (this, common::WRITE);
+    boost::system::error_code ec;
+    bool written = common::write_frame (socket_, response_, frame_,
+                                        handlerMemory_, yield, ec);
+    response_.Clear ();
+    if (!written) {
+        BOOST_LOG_TRIVIAL (info) << "Error sending response " << ec;
     }
-    std::stringstream keystream;
-    keystream << config_.prefix.c_str() << ":" << update.key ();
-    std::string key = keystream.str ();
-    const char** args = new const char*[2 + 2 * update.values_size ()];
-    size_t index = 0;
-    // hiredis hmset updates. We use hmset to minimize the cost of repeated
-    args [index++] = "hmset";
-    args [index++] = key.c_str ();
-    for (auto kv : update.values ()) {
-        args [index++] = kv.type ().c_str ();
-        args [index++] = kv.value().c_str ();
-    }
-    redisAsyncCommandArgv (config_.redisContext,
-                       redisReflector,
-                       this,
-                       index,
-                       args,
-                       NULL);
-    delete[] args;
+    return written;
 }
 
-// Delete one or more types
-void Connection::del_types (const ev_lookup::Update& update) {
-    assert (update.operation () == ev_lookup::Update::DELETE_TYPES);
-    if (update.values_size() == 0) {
-        BOOST_LOG_TRIVIAL (info) << "Failing DELETE_TYPES due to lack of types";
-        response_.set_success (false); 
-        write_response (response_);
+void Connection::execute_updates (ev_lookup::Update& updates,
+                                  boost::asio::yield_context yield) {
+    if (!check_capability (updates) || !well_formed (updates) || !admit ()) {
+        response_.set_success (false);
+        return;
+    }
+    // Let the client know it can send us compressed updates
+    if (config_.acceptCompressed) {
+        response_.set_acceptcompressed (true);
+    }
+    if (updates.operation () == ev_lookup::Update::RENEW) {
+        // Renewals change nothing lasting, there is nothing to journal
+        renewed (common::redis_wait (
+            [&] (redisCallbackFn* fn, void* data) {
+                send_renew (*config_.redis, command_, updates, fn, data);
+                return REDIS_OK;
+            }, yield));
         return;
     }
-    std::stringstream keystream;
-    keystream << config_.prefix.c_str() << ":" << update.key ();
-    std::string key = keystream.str ();
-    const char** args = new const char*[2 +  update.values_size ()];
-    size_t index = 0;
-    args [index++] = "hdel";
-    args [index++] = key.c_str ();
-    for (auto kv : update.values ()) {
-        args [index++] = kv.type ().c_str ();
-    }
-    redisAsyncCommandArgv (config_.redisContext,
-                       redisReflector,
-                       this,
-                       index,
-                       args,
-                       NULL);
-    delete[] args;
+    // Leases run from now, and a replay of the journal has to know when
+    // that was
+    if (updates.operation () == ev_lookup::Update::SET_VALUES && updates.lease () > 0) {
+        updates.set_leasedeadline (common::lease::deadline (updates.lease ()));
+    } else {
+        updates.clear_leasedeadline ();
+    }
+    if (config_.journal) {
+        // Journaled alongside Redis applying it, the update is acknowledged
+        // once both are done
+        auto self(shared_from_this());
+        journaled_.reset ();
+        config_.journal->append (updates, [this, self] (bool durable) {
+            journaled_.set (durable);
+        });
+    }
+    // Redis is waited on first, its reply is only good until the next wait
+    applied (common::redis_wait (
+        [&] (redisCallbackFn* fn, void* data) {
+            send_update (*config_.redis, command_, updates, fn, data);
+            return REDIS_OK;
+        }, yield));
+    if (config_.journal && !journaled_.wait (yield)) {
+        BOOST_LOG_TRIVIAL (error) << "Failing update that could not be journaled";
+        response_.set_success (false);
+    }
+}
+
+bool Connection::check_capability (const ev_lookup::Update& update) {
+    if (!config_.capabilities) {
+        return true;
+    }
+    if (!update.has_capability ()) {
+        if (config_.requireCapability) {
+            BOOST_LOG_TRIVIAL (info) << "Failing update without a capability";
+            return false;
+        }
+        return true;
+    }
+    common::capability::Claims claims;
+    if (!config_.capabilities->verify (update.capability (), claims)) {
+        BOOST_LOG_TRIVIAL (info) << "Failing update with an invalid or expired capability";
+        return false;
+    }
+    BOOST_LOG_TRIVIAL (info) << "Update from "
+                             << std::string (claims.identity, claims.identityLength);
+    return true;
 }
 
-// Delete key
-void Connection::del_key (const ev_lookup::Update& update) {
-    assert (update.operation () == ev_lookup::Update::DELETE_KEY);
-    redisAsyncCommand (config_.redisContext,
-                       redisReflector,
-                       this, 
-                       "del %s:%s",
-                       config_.prefix.c_str(),
-                       update.key ().c_str());
+bool Connection::admit () {
+    if (!config_.admission) {
+        return true;
+    }
+    if (!config_.admission->try_acquire ()) {
+        BOOST_LOG_TRIVIAL (info) << "Redis busy or down, shedding update";
+        return false;
+    }
+    admitted_ = true;
+    admittedAt_ = common::AdmissionController::Clock::now ();
+    redisFailed_ = false;
+    return true;
 }
 
-// Set permissions for key
-void Connection::set_perm (const ev_lookup::Update& update) {
-    assert (update.operation () == ev_lookup::Update::SET_PERM);
-    if (!update.has_permission ()) {
-        BOOST_LOG_TRIVIAL (info) << "Failing SET_PERM operation since no permissions specified";
+void Connection::applied (redisReply* reply) {
+    BOOST_LOG_TRIVIAL (info) << "Got response";
+    // EXEC replies with the update's reply first and the new version last. An
+    // error instead means the transaction was aborted, and no reply at all
+    // that the connection to Redis was lost (the update may or may not
+    // have been applied).
+    if (!reply) {
         response_.set_success (false);
-        write_response (response_);
+        redisFailed_ = true;
         return;
     }
-
-    redisAsyncCommand (config_.redisContext,
-                       redisReflector,
-                       this, 
-                       "hset %s:%s %s %llu",
-                       config_.prefix.c_str(),
-                       update.key ().c_str (),
-                       hlv::service::lookup::PERM_BIT_FIELD.c_str(),
-                       update.permission ());
-}
-
-void Connection::read_buffer (uint64_t length) {
-    auto self(shared_from_this());
-    BOOST_LOG_TRIVIAL(info) << "Being asked to read " << bufferSize_ << " bytes";
-    boost::asio::async_read (socket_, 
-            boost::asio::buffer(buffer_),
-            boost::asio::transfer_exactly(length),
-            [this, self] (boost::system::error_code ec,
-                          std::size_t bytes_transfered) {
-                BOOST_LOG_TRIVIAL(info) << "Read data";
-                if (!ec) {
-                    
-                    if (!update_.ParseFromArray(buffer_.data(), bytes_transfered)) {
-                        BOOST_LOG_TRIVIAL(error) << "Could not parse request";
-                        manager_.stop(shared_from_this());
-                        return;
-                    }
-                    execute_updates (update_);
-                } else if (ec != boost::asio::error::operation_aborted) {
-                    // Stop here
-                    BOOST_LOG_TRIVIAL(info) << "Connection ended read: " << bytes_transfered;
-                    manager_.stop(shared_from_this());
-                }
-                else {
-                    BOOST_LOG_TRIVIAL(error) << "Unknown ASIO error " << ec << " closing socket";
-                    manager_.stop(shared_from_this());
-                }
-            });
+    bool success = (reply->type == REDIS_REPLY_ARRAY &&
+                    reply->elements >= 2 &&
+                    reply->element[0]->type != REDIS_REPLY_ERROR);
+    response_.set_success (success);
+    // A nil EXEC (aborted) or an error reply means Redis failed us
+    redisFailed_ = (reply->type != REDIS_REPLY_ARRAY);
+    redisReply* version = success ? reply->element[reply->elements - 1] : nullptr;
+    if (version && version->type == REDIS_REPLY_INTEGER) {
+        response_.set_version (version->integer);
+    }
 }
 
-void Connection::redisResponse (redisReply* reply) {
-    BOOST_LOG_TRIVIAL (info) << "Got response";
-    response_.set_success (reply->type != REDIS_REPLY_ERROR);
-    update_.Clear ();
-    write_response (response_);
+void Connection::renewed (redisReply* reply) {
+    // The script replies with how many of the leases it found to renew,
+    // the client adds again whatever ran out
+    redisFailed_ = (!reply || reply->type == REDIS_REPLY_ERROR);
+    response_.set_success (reply && reply->type == REDIS_REPLY_INTEGER &&
+                           reply->integer == update_.values_size ());
 }
 
 } // namespace coordinator
@@ -1,13 +1,34 @@
 // Copyright 20xx The Regents of the University of California
 // This is a test service for SDN-v2 High Level Virtualization
 #include <memory>
+#include <vector>
 #include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
+#include <command_builder.h>
 #include "lookup.pb.h"
 #include "common_manager.h"
+#include "stream_socket.h"
+#include "uring.h"
+#include "handler_memory.h"
+#include "frame_reader.h"
+#include "coroutine.h"
+#include "admission_controller.h"
+#include "capability.h"
+#include "frame_compression.h"
 #ifndef _EV_UPDATE_CONNECTION_H_
 #define _EV_UPDATE_CONNECTION_H_
+namespace asio_redis {
+class ManagedRedisClient;
+}
+namespace hlv {
+namespace service {
+namespace coordinator {
+class Journal;
+}
+}
+}
 /// The Connection class implements the logic used by the EV lookup service
 namespace hlv {
 namespace service{
@@ -19,26 +40,49 @@ struct ConnectionInformation {
     std::string redisServer; 
     // Redis port
     uint32_t redisPort;
-    // hiredis context
-    redisAsyncContext* redisContext;
+    // Redis connection
+    asio_redis::ManagedRedisClient* redis;
     // Prefix: allows for multiple coordinators to share the same redis server.
     std::string prefix;
+    // Connections run as coroutines on this
+    boost::asio::io_service& io_service;
+    // Limits updates waiting on Redis, null for no limit
+    hlv::service::common::AdmissionController* admission;
+    // Checks capabilities sent with updates, null to accept any update
+    hlv::service::common::capability::Verifier* capabilities;
+    // Fail updates that come without a capability
+    bool requireCapability;
+    // Updates are journaled before they are acknowledged, null to rely on
+    // Redis persistence alone
+    Journal* journal;
+    // Offer clients to send LZ4 compressed updates, and take them
+    bool acceptCompressed;
     ConnectionInformation(
             const std::string& _redisServer,
             const uint32_t  _redisPort,
-            redisAsyncContext* _redisContext,
-            std::string _prefix) :
+            asio_redis::ManagedRedisClient* _redis,
+            std::string _prefix,
+            boost::asio::io_service& _io_service) :
             redisServer (_redisServer),
             redisPort (_redisPort),
-            redisContext (_redisContext),
-            prefix (_prefix) {
+            redis (_redis),
+            prefix (_prefix),
+            io_service (_io_service),
+            admission (nullptr),
+            capabilities (nullptr),
+            requireCapability (false),
+            journal (nullptr),
+            acceptCompressed (true) {
     }
 
 };
 
-/// The coordinator logic is implemented in the connection class
+/// The coordinator logic is implemented in the connection class. Each
+/// connection is a coroutine that reads an update, has Redis (and the
+/// journal) apply it and answers it.
 class Connection
-    : public std::enable_shared_from_this<Connection>
+    : public std::enable_shared_from_this<Connection>,
+      public hlv::service::common::ManagedConnection
 {
   private:
     typedef std::shared_ptr<hlv::service::coordinator::Connection> ConnectionPtr;
@@ -50,7 +94,7 @@ class Connection
     Connection () = delete;
     
     // Construct a Connection given a socket
-    explicit Connection (boost::asio::ip::tcp::socket socket, 
+    explicit Connection (hlv::service::common::StreamSocket socket, 
             hlv::service::common::ConnectionManager<ConnectionPtr>& manager,
             ConnectionInformation& config);
 
@@ -61,40 +105,42 @@ class Connection
     // Stop listening on the socket. This is mostly important when exiting.
     void stop ();
 
-    // Callback for Redis get
-    void redisResponse (redisReply* reply);  
-
   private:
-    // Process an update message
-    void execute_updates (const ev_lookup::Update&);
-
-    // Set permission
-    void set_perm (const ev_lookup::Update&);
+    // Serve updates until the connection ends, as a coroutine. Messages to
+    // the coordinator are always encoded as a 64-bit length, followed by
+    // an Update (../proto/lookup.proto) message.
+    void serve (boost::asio::yield_context yield);
 
-    // Delete key (all types are erased)
-    void del_key (const ev_lookup::Update&);
+    // Carry out update_, filling in response_
+    void execute_updates (ev_lookup::Update& updates,
+                          boost::asio::yield_context yield);
 
-    // Delete one or more types
-    void del_types (const ev_lookup::Update&);
+    // Fill in response_ from the reply to an update's EXEC
+    void applied (redisReply* reply);
 
-    // Set one or more values
-    void set_values (const ev_lookup::Update&);
+    // Fill in response_ from the reply to a renewal
+    void renewed (redisReply* reply);
 
-    // Listen for messages. Messages to the coordinator are always encoded as a
-    // 64-bit length, followed by a Update (../proto/lookup.proto) message. 
-    void read_size ();
+    // Check the capability sent with update, false if the update should be
+    // failed
+    bool check_capability (const ev_lookup::Update& update);
 
-    // Read update message from the network.
-    void read_buffer (uint64_t length);
+    // Ask the admission controller to let the update go to Redis, false if
+    // it should be failed right away
+    bool admit ();
 
-    // Write an UpdateResponse
-    void write_response (const ev_lookup::UpdateResponse&);
+    // Write response_, false if the connection failed
+    bool write_response (boost::asio::yield_context yield);
 
     // Socket for this connection
-    boost::asio::ip::tcp::socket socket_;
+    hlv::service::common::StreamSocket socket_;
 
-    // A temporary variable that holds the amount to be read
-    uint64_t bufferSize_;
+    // Updates are read off the socket here, compressed or not
+    hlv::service::common::FrameReader reader_;
+
+    // Updates are read and answered one at a time, so there is only ever
+    // one write for this to hold the handler of
+    hlv::service::common::HandlerMemory handlerMemory_;
 
     // Manage several connections
     hlv::service::common::ConnectionManager<ConnectionPtr>& manager_;
@@ -102,11 +148,24 @@ class Connection
     // Configuration
     const ConnectionInformation& config_;
 
-    // Buffer, expect never to need more than 128k
+    // Redis commands are built here, keys under config_.prefix
+    asio_redis::CommandBuilder command_;
+
+    // Compressed updates are decompressed here, expect never to need more
+    // than 128k
     std::array<char, 131072> buffer_;
-    std::array<char, 131072> write_buffer_;
+    // Responses are framed here
+    std::vector<char> frame_;
     ev_lookup::Update update_;
     ev_lookup::UpdateResponse response_;
+
+    // Was the current update admitted to Redis, when, and did Redis fail it
+    bool admitted_;
+    hlv::service::common::AdmissionController::Clock::time_point admittedAt_;
+    bool redisFailed_;
+
+    // Did the journal make the current update durable
+    hlv::service::common::Pending<bool> journaled_;
 };
 } // namespace coordinator
 } // namespace service
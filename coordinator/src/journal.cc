@@ -0,0 +1,315 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/crc.hpp>
+#include <boost/log/trivial.hpp>
+#include "journal.h"
+
+namespace {
+// Record header: length and CRC-32 of the update
+const size_t HEADER_SIZE = 8;
+// Records longer than this are taken to be garbage; updates are read into
+// a 128k buffer, so none is this long
+const uint32_t MAX_RECORD = 1 << 20;
+
+void put_le32 (char* out, uint32_t value) {
+    for (size_t i = 0; i < 4; i++) {
+        out[i] = (char)((value >> (8 * i)) & 0xff);
+    }
+}
+
+uint32_t get_le32 (const char* in) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < 4; i++) {
+        value |= (uint32_t)(unsigned char)in[i] << (8 * i);
+    }
+    return value;
+}
+
+uint32_t crc32 (const char* data, size_t length) {
+    boost::crc_32_type crc;
+    crc.process_bytes (data, length);
+    return crc.checksum ();
+}
+
+// Hand the updates in the journal at path to fn, cutting it off after the
+// last whole record. A journal that does not exist holds nothing.
+bool replay_file (const std::string& path,
+                  std::function<void (const ev_lookup::Update&)>& fn,
+                  uint64_t& records) {
+    if (access (path.c_str (), F_OK) != 0) {
+        return true;
+    }
+    std::ifstream in (path, std::ios::in | std::ios::binary);
+    if (!in) {
+        BOOST_LOG_TRIVIAL (error) << "Could not read journal " << path;
+        return false;
+    }
+    ev_lookup::Update update;
+    std::vector<char> buffer;
+    char header[HEADER_SIZE];
+    uint64_t good = 0;
+    bool torn = false;
+    while (in.read (header, HEADER_SIZE)) {
+        uint32_t length = get_le32 (header);
+        uint32_t crc = get_le32 (header + 4);
+        if (length > MAX_RECORD) {
+            torn = true;
+            break;
+        }
+        buffer.resize (length);
+        if (!in.read (buffer.data (), length) ||
+            crc32 (buffer.data (), length) != crc ||
+            !update.ParseFromArray (buffer.data (), length)) {
+            torn = true;
+            break;
+        }
+        fn (update);
+        records++;
+        good += HEADER_SIZE + length;
+    }
+    if (!torn && in.gcount () == 0) {
+        return true;
+    }
+    // Whatever follows the last whole record was being written when the
+    // coordinator went down, and was never acknowledged
+    BOOST_LOG_TRIVIAL (info) << "Cutting journal " << path << " off at " << good
+                             << " bytes, after a torn record";
+    in.close ();
+    if (truncate (path.c_str (), good) != 0) {
+        BOOST_LOG_TRIVIAL (error) << "Could not truncate " << path << ": " << strerror (errno);
+        return false;
+    }
+    return true;
+}
+}
+
+namespace hlv {
+namespace service {
+namespace coordinator {
+Journal::Journal (boost::asio::io_service& io_service,
+                  const std::string& path,
+                  size_t groupSize,
+                  std::chrono::microseconds groupDelay,
+                  uint64_t maxBytes) :
+    io_service_ (io_service),
+    path_ (path),
+    oldPath_ (path + ".old"),
+    groupSize_ (groupSize),
+    groupDelay_ (groupDelay),
+    maxBytes_ (maxBytes),
+    fd_ (-1),
+    size_ (0),
+    stopping_ (false),
+    failed_ (false),
+    hasOld_ (false),
+    records_ (0),
+    groups_ (0) {
+}
+
+Journal::~Journal () {
+    stop ();
+    if (fd_ >= 0) {
+        close (fd_);
+    }
+}
+
+bool Journal::replay (const std::string& path,
+                      std::function<void (const ev_lookup::Update&)> fn,
+                      uint64_t& records) {
+    records = 0;
+    return replay_file (path + ".old", fn, records) &&
+           replay_file (path, fn, records);
+}
+
+bool Journal::open () {
+    fd_ = ::open (path_.c_str (), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        BOOST_LOG_TRIVIAL (error) << "Could not open journal " << path_ << ": " << strerror (errno);
+        return false;
+    }
+    off_t size = lseek (fd_, 0, SEEK_END);
+    size_ = (size > 0) ? size : 0;
+    hasOld_ = (access (oldPath_.c_str (), F_OK) == 0);
+    if (!sync_directory ()) {
+        return false;
+    }
+    writer_ = std::thread ([this] () { run (); });
+    return true;
+}
+
+void Journal::append (const ev_lookup::Update& update, Callback done) {
+    uint32_t length = update.ByteSize ();
+    std::lock_guard<std::mutex> lock (mutex_);
+    if (failed_ || stopping_) {
+        io_service_.post ([done] () { done (false); });
+        return;
+    }
+    size_t offset = pending_.size ();
+    pending_.resize (offset + HEADER_SIZE + length);
+    char* record = &pending_[offset];
+    update.SerializeToArray (record + HEADER_SIZE, length);
+    put_le32 (record, length);
+    put_le32 (record + 4, crc32 (record + HEADER_SIZE, length));
+    if (callbacks_.empty ()) {
+        firstPending_ = Clock::now ();
+    }
+    callbacks_.push_back (std::move (done));
+    // The writer waits for the first record of a group, then for the group
+    // to fill up or time out
+    if (callbacks_.size () == 1 || callbacks_.size () >= groupSize_) {
+        wake_.notify_one ();
+    }
+}
+
+void Journal::run () {
+    std::string writing;
+    std::unique_lock<std::mutex> lock (mutex_);
+    while (true) {
+        wake_.wait (lock, [this] () { return stopping_ || !callbacks_.empty (); });
+        if (callbacks_.empty ()) {
+            // Stopping, and everything is written
+            break;
+        }
+        Clock::time_point deadline = firstPending_ + groupDelay_;
+        while (!stopping_ && callbacks_.size () < groupSize_ &&
+               wake_.wait_until (lock, deadline) != std::cv_status::timeout) {
+        }
+        writing.swap (pending_);
+        pending_.clear ();
+        auto group = std::make_shared<std::vector<Callback>> ();
+        group->swap (callbacks_);
+        bool ok = !failed_;
+        bool rotate = !hasOld_ && maxBytes_ > 0;
+        lock.unlock ();
+
+        bool durable = ok && write_group (writing);
+        bool rotated = false;
+        if (durable && rotate && size_ >= maxBytes_) {
+            rotated = this->rotate ();
+            // The group is on disk anyway, but nothing after it can be
+            // written
+            ok = rotated;
+        }
+        io_service_.post ([group, durable] () {
+            for (auto& done : *group) {
+                done (durable);
+            }
+        });
+
+        lock.lock ();
+        records_ += group->size ();
+        groups_++;
+        if (!durable || !ok) {
+            failed_ = true;
+        }
+        if (rotated) {
+            hasOld_ = true;
+            if (rotated_) {
+                io_service_.post (rotated_);
+            }
+        }
+    }
+}
+
+bool Journal::write_group (const std::string& buffer) {
+    const char* data = buffer.data ();
+    size_t left = buffer.size ();
+    while (left > 0) {
+        ssize_t written = write (fd_, data, left);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            BOOST_LOG_TRIVIAL (error) << "Could not write journal: " << strerror (errno);
+            return false;
+        }
+        data += written;
+        left -= written;
+    }
+    if (fdatasync (fd_) != 0) {
+        BOOST_LOG_TRIVIAL (error) << "Could not sync journal: " << strerror (errno);
+        return false;
+    }
+    size_ += buffer.size ();
+    return true;
+}
+
+bool Journal::rotate () {
+    BOOST_LOG_TRIVIAL (info) << "Rotating journal at " << size_ << " bytes";
+    if (rename (path_.c_str (), oldPath_.c_str ()) != 0) {
+        BOOST_LOG_TRIVIAL (error) << "Could not move journal aside: " << strerror (errno);
+        return false;
+    }
+    int fd = ::open (path_.c_str (), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        BOOST_LOG_TRIVIAL (error) << "Could not start a new journal: " << strerror (errno);
+        return false;
+    }
+    close (fd_);
+    fd_ = fd;
+    size_ = 0;
+    return sync_directory ();
+}
+
+void Journal::checkpoint () {
+    {
+        std::lock_guard<std::mutex> lock (mutex_);
+        if (!hasOld_) {
+            return;
+        }
+    }
+    if (unlink (oldPath_.c_str ()) != 0 && errno != ENOENT) {
+        BOOST_LOG_TRIVIAL (error) << "Could not remove " << oldPath_ << ": " << strerror (errno);
+        return;
+    }
+    sync_directory ();
+    BOOST_LOG_TRIVIAL (info) << "Journal checkpointed";
+    std::lock_guard<std::mutex> lock (mutex_);
+    hasOld_ = false;
+}
+
+bool Journal::sync_directory () {
+    size_t slash = path_.rfind ('/');
+    std::string directory = (slash == std::string::npos) ? "." :
+                            (slash == 0) ? "/" : path_.substr (0, slash);
+    int fd = ::open (directory.c_str (), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        BOOST_LOG_TRIVIAL (error) << "Could not open " << directory << ": " << strerror (errno);
+        return false;
+    }
+    bool ok = (fsync (fd) == 0);
+    close (fd);
+    return ok;
+}
+
+void Journal::stop () {
+    {
+        std::lock_guard<std::mutex> lock (mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_one ();
+    if (writer_.joinable ()) {
+        writer_.join ();
+    }
+}
+
+void Journal::add_metrics (hlv::service::common::StatsReporter& stats,
+                           const std::string& prefix) {
+    stats.add (prefix + "records", [this] () {
+        std::lock_guard<std::mutex> lock (mutex_);
+        return (double)records_;
+    });
+    stats.add (prefix + "fsyncs", [this] () {
+        std::lock_guard<std::mutex> lock (mutex_);
+        return (double)groups_;
+    });
+}
+} // namespace coordinator
+} // namespace service
+} // namespace hlv
@@ -0,0 +1,127 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include "lookup.pb.h"
+#include "stats_reporter.h"
+#ifndef _EV_COORDINATOR_JOURNAL_H_
+#define _EV_COORDINATOR_JOURNAL_H_
+namespace hlv {
+namespace service {
+namespace coordinator {
+/// A write-ahead journal of the updates the coordinator applies, so that
+/// updates acknowledged to clients survive Redis losing them (whatever
+/// Redis persistence is configured to do). The coordinator replays it into
+/// Redis when it starts.
+///
+/// Records are appended by the io_service thread and written by a thread
+/// of the journal's own, which fsyncs them in groups: once groupSize
+/// records are waiting or groupDelay after the first of them, whichever
+/// comes first. Each append's callback runs on the io_service once its
+/// group is on disk, so a single fsync covers every update that arrived
+/// meanwhile.
+///
+/// A record is its length (uint32 little endian), the CRC-32 of the update
+/// (uint32 little endian) and the serialized ev_lookup::Update. A crash can
+/// leave a torn record at the end of the file; replay stops there and cuts
+/// it off.
+///
+/// Once the journal grows past maxBytes it is moved to path.old and a new
+/// one started. path.old is replayed along with path until checkpoint says
+/// Redis has saved everything in it (see main), then it is removed. The
+/// journal only rotates when there is no path.old.
+class Journal {
+  public:
+    typedef std::function<void (bool durable)> Callback;
+    typedef std::chrono::steady_clock Clock;
+
+    Journal () = delete;
+    Journal (const Journal&) = delete;
+    Journal& operator= (const Journal&) = delete;
+
+    Journal (boost::asio::io_service& io_service,
+             const std::string& path,
+             size_t groupSize,
+             std::chrono::microseconds groupDelay,
+             uint64_t maxBytes);
+    ~Journal ();
+
+    /// Hand every update in the journal at path (path.old first) to fn, in
+    /// the order they were appended, cutting off a torn tail. False if a
+    /// journal could not be read.
+    static bool replay (const std::string& path,
+                        std::function<void (const ev_lookup::Update&)> fn,
+                        uint64_t& records);
+
+    /// Open the journal for appending and start writing, false if it could
+    /// not be opened
+    bool open ();
+
+    /// Queue update, done is told whether it made it to disk. Once a write
+    /// fails every later append fails too: updates are refused rather than
+    /// acknowledged without being durable.
+    void append (const ev_lookup::Update& update, Callback done);
+
+    /// Called on the io_service after the journal moved to path.old
+    void on_rotate (std::function<void ()> f) { rotated_ = f; }
+
+    /// Everything in path.old is safe elsewhere, remove it
+    void checkpoint ();
+
+    /// Write what is queued and stop the writer
+    void stop ();
+
+    /// Register counts of records and fsyncs, names start with prefix
+    void add_metrics (hlv::service::common::StatsReporter& stats,
+                      const std::string& prefix = "journal.");
+
+  private:
+    // The writer thread
+    void run ();
+
+    // Write buffer to the journal and fsync it
+    bool write_group (const std::string& buffer);
+
+    // Move the journal to path.old and start a new one
+    bool rotate ();
+
+    // fsync the directory holding the journal, making renames and new files
+    // durable
+    bool sync_directory ();
+
+    boost::asio::io_service& io_service_;
+    const std::string path_;
+    const std::string oldPath_;
+    const size_t groupSize_;
+    const std::chrono::microseconds groupDelay_;
+    const uint64_t maxBytes_;
+    int fd_;
+    uint64_t size_;
+    std::function<void ()> rotated_;
+
+    // Guards everything below
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::thread writer_;
+    bool stopping_;
+    bool failed_;
+    bool hasOld_;
+    // Framed records waiting to be written, and their callbacks
+    std::string pending_;
+    std::vector<Callback> callbacks_;
+    Clock::time_point firstPending_;
+
+    uint64_t records_;
+    uint64_t groups_;
+};
+} // namespace coordinator
+} // namespace service
+} // namespace hlv
+#endif
@@ -1,39 +1,118 @@
 // Copyright 20xx The Regents of the University of California
 // This is a test service for SDN-v2 High Level Virtualization
+#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <thread>
 #include <tuple>
+#include <algorithm>
+#include <vector>
 #include <signal.h>
 #include <boost/asio.hpp>
 #include <boost/program_options.hpp>
 #include <boost/log/trivial.hpp>
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
-#include <hiredisasio.h>
+#include <managed_client.h>
 #include "consts.h"
 #include "logging_common.h"
+#include "socket_handoff.h"
+#include "admission_controller.h"
+#include "capability.h"
+#include "leases.h"
 #include "coordinator_server.h"
+#include "journal.h"
+#include "stats_reporter.h"
+#include "update_commands.h"
 
 // Main file for EV lookup coordinator
 namespace po = boost::program_options;
+
 namespace {
-void connectCallback (const redisAsyncContext* c, int status) {
-    if (status != REDIS_OK) {
-        std::cerr << "Error " << c->errstr << std::endl;
-        return;
+// Replies to journal updates replayed into Redis
+struct Replay {
+    uint64_t outstanding;
+    uint64_t lost;
+};
+
+void replayReply (redisAsyncContext*, void* reply, void* data) {
+    Replay* replay = (Replay*)data;
+    replay->outstanding--;
+    // An update Redis refuses now was refused the first time too, only a
+    // lost connection leaves the journal unapplied
+    if (!reply) {
+        replay->lost++;
     }
-    BOOST_LOG_TRIVIAL (info) << "Connected with redis";
 }
 
-void disconnectCallback (const redisAsyncContext* c, int status) {
-    BOOST_LOG_TRIVIAL (info) << "Disconnected ";
-    if (status != REDIS_OK) {
-        std::cerr << "Disconnected due to error " << c->errstr << std::endl;
+/// Drops the old journal once Redis has saved a snapshot taken after the
+/// journal was rotated, which holds everything in it
+class Checkpoint {
+  public:
+    Checkpoint (boost::asio::io_service& io_service,
+                asio_redis::ManagedRedisClient& redis,
+                hlv::service::coordinator::Journal& journal) :
+        redis_ (redis),
+        journal_ (journal),
+        timer_ (io_service),
+        saving_ (false) {
+    }
+
+    // Start a snapshot and wait for it
+    void start () {
+        saving_ = false;
+        redis_.write (bgsaveReply, this, "BGSAVE");
+    }
+
+    void stop () {
+        timer_.cancel ();
+    }
+
+  private:
+    static void bgsaveReply (redisAsyncContext*, void* r, void* data) {
+        Checkpoint* checkpoint = (Checkpoint*)data;
+        redisReply* reply = (redisReply*)r;
+        // A snapshot that was already running may predate the rotation:
+        // wait for it, then take another
+        checkpoint->saving_ = reply && reply->type != REDIS_REPLY_ERROR;
+        if (reply && reply->type == REDIS_REPLY_ERROR) {
+            BOOST_LOG_TRIVIAL (info) << "BGSAVE: " << reply->str;
+        }
+        checkpoint->poll ();
+    }
+
+    static void infoReply (redisAsyncContext*, void* r, void* data) {
+        Checkpoint* checkpoint = (Checkpoint*)data;
+        redisReply* reply = (redisReply*)r;
+        if (!reply || reply->type != REDIS_REPLY_STRING ||
+            strstr (reply->str, "rdb_bgsave_in_progress:1")) {
+            checkpoint->poll ();
+        } else if (!checkpoint->saving_) {
+            checkpoint->start ();
+        } else if (strstr (reply->str, "rdb_last_bgsave_status:ok")) {
+            checkpoint->journal_.checkpoint ();
+        } else {
+            BOOST_LOG_TRIVIAL (error) << "Redis failed to save, keeping the old journal";
+            checkpoint->start ();
+        }
+    }
+
+    void poll () {
+        timer_.expires_from_now (boost::posix_time::seconds (1));
+        timer_.async_wait ([this] (boost::system::error_code ec) {
+            if (!ec) {
+                redis_.read (infoReply, this, "INFO persistence");
+            }
+        });
     }
-}
-}
 
+    asio_redis::ManagedRedisClient& redis_;
+    hlv::service::coordinator::Journal& journal_;
+    boost::asio::deadline_timer timer_;
+    bool saving_;
+};
+}
 int
 main (int argc, char* argv[]) {
     GOOGLE_PROTOBUF_VERIFY_VERSION;
@@ -46,6 +125,18 @@ main (int argc, char* argv[]) {
                 redisAddress = "127.0.0.1",
                 prefix = hlv::service::lookup::REDIS_PREFIX;
     int32_t redisPort = hlv::service::lookup::REDIS_PORT;
+    std::string handoffPath;
+    uint32_t drainSeconds = 30;
+    hlv::service::common::Timeouts timeouts (300, 30, 30);
+    uint32_t redisLimit = 1024;
+    uint32_t statsInterval = 60;
+    double redisTolerance = 2.0;
+    std::vector<std::string> capabilityKeys;
+    std::string journalPath;
+    uint32_t journalGroup = 64;
+    uint32_t journalDelay = 1000;
+    uint32_t journalMax = 64;
+    uint32_t sweepInterval = 1000;
     desc.add_options()
         ("help,h", "Display help")
         ("address,a", po::value<std::string>(&address)->implicit_value(address), "Bind to address")
@@ -53,7 +144,41 @@ main (int argc, char* argv[]) {
         ("raddress,r", po::value<std::string>(&redisAddress)->implicit_value(redisAddress), "Redis server")
         ("rport", po::value<int32_t>(&redisPort)->implicit_value(redisPort), "Redis port")
         ("prefix,p", po::value<std::string>(&prefix), 
-                   "Prefix for redis DB");
+                   "Prefix for redis DB")
+        ("handoff", po::value<std::string>(&handoffPath),
+                   "Unix socket for hot restarts: take over the listening socket from the server on it, "
+                   "and hand ours to the next one")
+        ("drain", po::value<uint32_t>(&drainSeconds)->implicit_value(drainSeconds),
+                   "Seconds to wait for open connections after handing off")
+        ("idle-timeout", po::value<uint32_t>(&timeouts.idle)->implicit_value(timeouts.idle),
+                   "Close connections idle for this many seconds (0 disables)")
+        ("read-timeout", po::value<uint32_t>(&timeouts.read)->implicit_value(timeouts.read),
+                   "Close connections that take this many seconds to send a request (0 disables)")
+        ("write-timeout", po::value<uint32_t>(&timeouts.write)->implicit_value(timeouts.write),
+                   "Close connections that take this many seconds to read a response (0 disables)")
+        ("redis-limit", po::value<uint32_t>(&redisLimit)->implicit_value(redisLimit),
+                   "Most requests waiting on Redis at once, lowered automatically when Redis slows down (0 disables)")
+        ("redis-tolerance", po::value<double>(&redisTolerance)->implicit_value(redisTolerance),
+                   "Redis is taken to be overloaded once round trips are this many times the fastest seen")
+        ("stats", po::value<uint32_t>(&statsInterval)->implicit_value(statsInterval),
+                   "Seconds between stats reports (0 disables)")
+        ("capability-key", po::value<std::vector<std::string>>(&capabilityKeys)->composing(),
+                   "Check capabilities sent with updates against the key in this file (repeatable)")
+        ("require-capability", "Fail updates sent without a capability")
+        ("no-compress", "Do not offer clients compressed updates, and close connections that send them anyway")
+        ("journal", po::value<std::string>(&journalPath),
+                   "Journal updates to this file before acknowledging them, and replay it into Redis on start")
+        ("journal-group", po::value<uint32_t>(&journalGroup)->implicit_value(journalGroup),
+                   "Sync the journal once this many updates are waiting")
+        ("journal-delay", po::value<uint32_t>(&journalDelay)->implicit_value(journalDelay),
+                   "or once the first of them waited this many microseconds")
+        ("journal-max", po::value<uint32_t>(&journalMax)->implicit_value(journalMax),
+                   "Start a new journal past this many MB, dropping the old one once Redis has saved "
+                   "a snapshot (BGSAVE) after it (0 never does)")
+        ("sweep-leases", po::value<uint32_t>(&sweepInterval)->implicit_value(sweepInterval),
+                   "Milliseconds between removals of registrations whose lease ran out (0 leaves it to other servers)")
+        ("io-uring", "Serve connections through io_uring rather than epoll "
+                   "(builds with HLV_IO_URING, Linux 5.19 or later)");
     po::options_description options;
     options.add(desc);
     po::variables_map vm;
@@ -72,39 +197,165 @@ main (int argc, char* argv[]) {
         return 0;
     }
 
-    // Connect to Redis
-    redisAsyncContext *context = redisAsyncConnect (redisAddress.c_str(), redisPort);
-    if (!context) {
-        std::cerr << "Failed to allocate redis context" << std::endl;
-        return 0;
-    }
+    // Create server
+    boost::asio::io_service io_service;
 
-    if (context->err) {
-        std::cerr << "Failed to connect to redis instance " << context->errstr << std::endl;
+    // Connect to Redis, reconnecting whenever the connection is lost.
+    // Updates are writes, they fail rather than wait for a reconnect.
+    asio_redis::ManagedRedisClient client (io_service, redisAddress, redisPort);
+    if (!client.connect ()) {
+        std::cerr << "Failed to connect to redis instance " << client.errstr () << std::endl;
         return 0;
-    }  
-
-    redisAsyncSetConnectCallback (context, connectCallback);
-    redisAsyncSetDisconnectCallback (context, disconnectCallback);
+    }
 
-    // Create server
-    boost::asio::io_service io_service;
+    // Put back whatever Redis lost of the updates that were acknowledged
+    // before the coordinator last went down
+    std::unique_ptr<hlv::service::coordinator::Journal> journal;
+    if (!journalPath.empty ()) {
+        while (!client.connected ()) {
+            io_service.run_one ();
+        }
+        asio_redis::CommandBuilder command (prefix);
+        Replay replay = {0, 0};
+        uint64_t records = 0;
+        uint64_t expired = 0;
+        uint64_t now = hlv::service::common::lease::deadline (0);
+        auto start = std::chrono::steady_clock::now ();
+        bool read = hlv::service::coordinator::Journal::replay (journalPath,
+            [&] (const ev_lookup::Update& update) {
+                if (update.operation () == ev_lookup::Update::RENEW ||
+                    !hlv::service::coordinator::well_formed (update)) {
+                    return;
+                }
+                // Values whose lease ran out while the coordinator was down
+                // stay gone. Renewals are not journaled, so one that was
+                // renewed is either still in Redis (and left alone) or has
+                // to be registered again, as after any missed renewal.
+                if (update.has_leasedeadline () && update.leasedeadline () <= now) {
+                    expired++;
+                    return;
+                }
+                replay.outstanding++;
+                hlv::service::coordinator::send_update (client, command, update,
+                                                        replayReply, &replay,
+                                                        true);
+                // Keep the pipeline full without queueing the whole journal
+                while (replay.outstanding > 1024) {
+                    io_service.run_one ();
+                }
+            }, records);
+        while (replay.outstanding > 0) {
+            io_service.run_one ();
+        }
+        if (!read || replay.lost > 0) {
+            std::cerr << "Could not replay journal " << journalPath << std::endl;
+            return 1;
+        }
+        BOOST_LOG_TRIVIAL(info) << "Replayed " << records << " journaled updates ("
+                                << expired << " with expired leases skipped) in "
+                                << std::chrono::duration<double> (
+                                        std::chrono::steady_clock::now () - start).count ()
+                                << "s";
+        journal.reset (new hlv::service::coordinator::Journal (
+                                                io_service,
+                                                journalPath,
+                                                std::max<uint32_t> (1, journalGroup),
+                                                std::chrono::microseconds (journalDelay),
+                                                (uint64_t)journalMax << 20));
+    }
+    std::unique_ptr<Checkpoint> checkpoint;
+    if (journal) {
+        checkpoint.reset (new Checkpoint (io_service, client, *journal));
+        Checkpoint* saver = checkpoint.get ();
+        journal->on_rotate ([saver] () { saver->start (); });
+        if (!journal->open ()) {
+            std::cerr << "Could not open journal " << journalPath << std::endl;
+            return 1;
+        }
+    }
 
-    asio_redis::redisBoostClient client (io_service, context);
     // Server information
     hlv::service::coordinator::ConnectionInformation information 
                                                     (redisAddress,
                                                      redisPort,
-                                                     context,
-                                                     prefix);
-    // Create an update server
-    hlv::service::coordinator::Server update (
-            io_service,
-            address,
-            port,
-            information);
+                                                     &client,
+                                                     prefix,
+                                                     io_service);
+    information.acceptCompressed = vm.count ("no-compress") == 0;
+    hlv::service::common::StatsReporter stats (io_service, "coordinator", statsInterval);
+    stats.add ("redis.reconnects", [&client] () { return (double)client.reconnects (); });
+    stats.add ("redis.failed", [&client] () { return (double)client.failed (); });
+    if (journal) {
+        journal->add_metrics (stats);
+        information.journal = journal.get ();
+    }
+
+    // Only take updates from clients the auth service vouched for
+    hlv::service::common::capability::Verifier capabilities;
+    for (auto& path : capabilityKeys) {
+        if (!capabilities.add_key_file (path)) {
+            std::cerr << "Could not read capability key from " << path << std::endl;
+            return 1;
+        }
+    }
+    if (!capabilities.empty ()) {
+        capabilities.add_metrics (stats);
+        information.capabilities = &capabilities;
+        information.requireCapability = vm.count ("require-capability") > 0;
+    } else if (vm.count ("require-capability")) {
+        std::cerr << "--require-capability needs a --capability-key" << std::endl;
+        return 1;
+    }
+
+    // Fail updates rather than queue them when Redis slows down
+    std::unique_ptr<hlv::service::common::AdmissionController> admissionController;
+    if (redisLimit > 0) {
+        admissionController.reset (new hlv::service::common::AdmissionController (
+                                                        std::min<uint32_t> (8, redisLimit),
+                                                        redisLimit,
+                                                        redisTolerance));
+        admissionController->add_metrics (stats);
+        information.admission = admissionController.get ();
+        // Stop sending updates to a Redis connection that is gone
+        hlv::service::common::AdmissionController* admission = admissionController.get ();
+        client.on_connect ([admission] () { admission->connected (); });
+        client.on_disconnect ([admission] () { admission->disconnected (); });
+    }
+    // Create an update server, on the listening socket of the server being
+    // replaced if there is one
+    std::unique_ptr<hlv::service::coordinator::Server> update;
+    std::vector<int> inherited;
+    if (!handoffPath.empty () &&
+        hlv::service::common::handoff::take_over (handoffPath, inherited)) {
+        update.reset (new hlv::service::coordinator::Server (
+                io_service,
+                inherited[0],
+                information));
+    } else {
+        update.reset (new hlv::service::coordinator::Server (
+                io_service,
+                address,
+                port,
+                information));
+    }
     BOOST_LOG_TRIVIAL(info) << "Starting update server" << std::endl;
-    update.start ();
+    update->set_timeouts (timeouts);
+    if (vm.count ("io-uring") &&
+        !update->set_backend (hlv::service::common::Backend::IO_URING)) {
+        std::cerr << "io_uring is not available" << std::endl;
+        return 1;
+    }
+    update->start ();
+    // Expire registrations whose lease ran out
+    hlv::service::common::lease::Sweeper sweeper (io_service,
+                                                  client,
+                                                  prefix,
+                                                  boost::posix_time::milliseconds (sweepInterval));
+    if (sweepInterval > 0) {
+        sweeper.add_metrics (stats);
+        sweeper.start ();
+    }
+    stats.start ();
 
     boost::asio::signal_set signals (io_service);
     signals.add (SIGINT);
@@ -112,15 +363,49 @@ main (int argc, char* argv[]) {
 #if defined(SIGQUIT)
     signals.add (SIGQUIT);
 #endif
-    signals.async_wait ([&](boost::system::error_code, int) {
-        std::cout << "Quitting" << std::endl;
-        update.stop ();
+    boost::asio::deadline_timer drainTimer (io_service);
+    auto shutdown = [&] () {
+        drainTimer.cancel ();
+        update->stop ();
+        sweeper.stop ();
+        stats.stop ();
+        if (checkpoint) {
+            checkpoint->stop ();
+        }
+        if (journal) {
+            journal->stop ();
+        }
         client.stop ();
         io_service.stop ();
+    };
+
+    // Hand the listening socket to a restarted server, then finish the
+    // requests already in flight
+    hlv::service::common::handoff::Listener handoff (
+            io_service,
+            handoffPath,
+            [&] () { return std::vector<int> (1, update->native_handle ()); },
+            [&] () {
+                update->stop_accepting ();
+                hlv::service::common::handoff::drain (
+                        drainTimer,
+                        *update,
+                        boost::posix_time::microsec_clock::universal_time () +
+                            boost::posix_time::seconds (drainSeconds),
+                        shutdown);
+            });
+    if (!handoffPath.empty ()) {
+        handoff.start ();
+    }
+
+    signals.async_wait ([&](boost::system::error_code, int) {
+        std::cout << "Quitting" << std::endl;
+        handoff.stop ();
+        shutdown ();
     });
     // This thread now provides I/O service
     io_service.run();
-    redisAsyncDisconnect (context);
+    client.disconnect ();
     google::protobuf::ShutdownProtobufLibrary();
     return 0;
 
@@ -0,0 +1,180 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <cassert>
+#include <string>
+#include <boost/log/trivial.hpp>
+#include <managed_client.h>
+#include "update_commands.h"
+#include "consts.h"
+#include "leases.h"
+
+namespace {
+// Suffix of a key's version counter
+const std::string VERSION_SUFFIX = "." + hlv::service::lookup::VERSION_KEY;
+}
+
+namespace hlv {
+namespace service {
+namespace coordinator {
+bool well_formed (const ev_lookup::Update& update) {
+    switch (update.operation ()) {
+        case ev_lookup::Update::SET_VALUES:
+            if (update.values_size () == 0) {
+                BOOST_LOG_TRIVIAL (info) << "Failing SET_VALUES due to lack of types";
+                return false;
+            }
+            return true;
+        case ev_lookup::Update::DELETE_TYPES:
+            if (update.values_size () == 0) {
+                BOOST_LOG_TRIVIAL (info) << "Failing DELETE_TYPES due to lack of types";
+                return false;
+            }
+            return true;
+        case ev_lookup::Update::DELETE_KEY:
+            return true;
+        case ev_lookup::Update::SET_PERM:
+            if (!update.has_permission ()) {
+                BOOST_LOG_TRIVIAL (info) << "Failing SET_PERM operation since no permissions specified";
+                return false;
+            }
+            return true;
+        case ev_lookup::Update::RENEW:
+            if (update.values_size () == 0 || update.lease () == 0) {
+                BOOST_LOG_TRIVIAL (info) << "Failing RENEW without types or lease";
+                return false;
+            }
+            return true;
+    }
+    return false;
+}
+
+namespace {
+// Values set with a lease get (or have renewed) a lease entry; those set
+// without one and deleted ones lose theirs, so they neither expire nor
+// linger
+void send_leases (asio_redis::ManagedRedisClient& redis,
+                  asio_redis::CommandBuilder& command,
+                  const ev_lookup::Update& update,
+                  bool replay) {
+    std::string entry;
+    std::string deadline;
+    bool leased = (update.operation () == ev_lookup::Update::SET_VALUES &&
+                   update.lease () > 0);
+    if (leased) {
+        deadline = std::to_string (update.has_leasedeadline () ?
+                                   update.leasedeadline () :
+                                   common::lease::deadline (update.lease ()));
+    }
+    if (leased && replay) {
+        command.begin (5 + update.values_size ())
+               .arg ("EVAL", 4)
+               .arg (common::lease::EXTEND_SCRIPT, sizeof (common::lease::EXTEND_SCRIPT) - 1)
+               .arg ("1", 1)
+               .key (hlv::service::lookup::LEASE_SET)
+               .arg (deadline);
+        for (auto& kv : update.values ()) {
+            common::lease::entry (common::lease::HASH_FIELD, update.key (), kv.type (), entry);
+            command.arg (entry);
+        }
+        redis.write (NULL, NULL, command);
+        return;
+    }
+    if (leased) {
+        command.begin (2 + 2 * update.values_size ())
+               .arg ("ZADD", 4);
+    } else {
+        command.begin (2 + update.values_size ())
+               .arg ("ZREM", 4);
+    }
+    command.key (hlv::service::lookup::LEASE_SET);
+    for (auto& kv : update.values ()) {
+        common::lease::entry (common::lease::HASH_FIELD, update.key (), kv.type (), entry);
+        if (leased) {
+            command.arg (deadline);
+        }
+        command.arg (entry);
+    }
+    redis.write (NULL, NULL, command);
+}
+}
+
+void send_update (asio_redis::ManagedRedisClient& redis,
+                  asio_redis::CommandBuilder& command,
+                  const ev_lookup::Update& update,
+                  redisCallbackFn* fn,
+                  void* privdata,
+                  bool replay) {
+    assert (well_formed (update));
+    redis.write (NULL, NULL, "MULTI");
+    switch (update.operation ()) {
+        case ev_lookup::Update::SET_VALUES:
+            // hiredis hmset updates. We use hmset to minimize the cost of repeated
+            command.begin (2 + 2 * update.values_size ())
+                   .arg ("hmset", 5)
+                   .key (update.key ());
+            for (auto& kv : update.values ()) {
+                command.arg (kv.type ()).arg (kv.value ());
+            }
+            redis.write (NULL, NULL, command);
+            send_leases (redis, command, update, replay);
+            break;
+        case ev_lookup::Update::DELETE_TYPES:
+            command.begin (2 + update.values_size ())
+                   .arg ("hdel", 4)
+                   .key (update.key ());
+            for (auto& kv : update.values ()) {
+                command.arg (kv.type ());
+            }
+            redis.write (NULL, NULL, command);
+            send_leases (redis, command, update, replay);
+            break;
+        case ev_lookup::Update::DELETE_KEY:
+            // The version key outlives the key, so that a key that is deleted and
+            // then recreated never goes back to a version a client has seen.
+            command.begin (2)
+                   .arg ("del", 3)
+                   .key (update.key ());
+            redis.write (NULL, NULL, command);
+            break;
+        case ev_lookup::Update::SET_PERM:
+            command.begin (4)
+                   .arg ("hset", 4)
+                   .key (update.key ())
+                   .arg (hlv::service::lookup::PERM_BIT_FIELD)
+                   .arg ((uint64_t)update.permission ());
+            redis.write (NULL, NULL, command);
+            break;
+        case ev_lookup::Update::RENEW:
+            assert (false);
+            break;
+    }
+    command.begin (2)
+           .arg ("INCR", 4)
+           .key (update.key (), VERSION_SUFFIX.data (), VERSION_SUFFIX.size ());
+    redis.write (NULL, NULL, command);
+    redis.write (fn, privdata, "EXEC");
+}
+
+void send_renew (asio_redis::ManagedRedisClient& redis,
+                 asio_redis::CommandBuilder& command,
+                 const ev_lookup::Update& update,
+                 redisCallbackFn* fn,
+                 void* privdata) {
+    assert (update.operation () == ev_lookup::Update::RENEW && well_formed (update));
+    std::string entry;
+    std::string deadline = std::to_string (common::lease::deadline (update.lease ()));
+    command.begin (5 + update.values_size ())
+           .arg ("EVAL", 4)
+           .arg (common::lease::RENEW_SCRIPT, sizeof (common::lease::RENEW_SCRIPT) - 1)
+           .arg ("1", 1)
+           .key (hlv::service::lookup::LEASE_SET)
+           .arg (deadline);
+    for (auto& kv : update.values ()) {
+        common::lease::entry (common::lease::HASH_FIELD, update.key (), kv.type (), entry);
+        command.arg (entry);
+    }
+    redis.write (fn, privdata, command);
+}
+} // namespace coordinator
+} // namespace service
+} // namespace hlv
@@ -0,0 +1,48 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <hiredis/async.h>
+#include <command_builder.h>
+#include "lookup.pb.h"
+#ifndef _EV_UPDATE_COMMANDS_H_
+#define _EV_UPDATE_COMMANDS_H_
+namespace asio_redis {
+class ManagedRedisClient;
+}
+namespace hlv {
+namespace service {
+namespace coordinator {
+/// False (and logs why) if update cannot be applied: SET_VALUES and
+/// DELETE_TYPES without values, SET_PERM without a permission, RENEW without
+/// types or a lease
+bool well_formed (const ev_lookup::Update& update);
+
+/// Send a well formed update other than RENEW to Redis. The update is
+/// wrapped in MULTI/EXEC along with an INCR of the key's version, so that
+/// readers never see a change without a new version; fn gets the reply to
+/// EXEC (the update's reply first and the new version last, the change to
+/// the values' leases in between for SET_VALUES and DELETE_TYPES). Keys are
+/// built under command's prefix. Used for updates from clients and for
+/// replaying the journal.
+///
+/// Leases run out at the update's LeaseDeadline if it has one, a Lease from
+/// now otherwise. When replaying, a lease already running longer (renewed
+/// since the update was journaled) is left as it is.
+void send_update (asio_redis::ManagedRedisClient& redis,
+                  asio_redis::CommandBuilder& command,
+                  const ev_lookup::Update& update,
+                  redisCallbackFn* fn,
+                  void* privdata,
+                  bool replay = false);
+
+/// Extend the leases of the types in a RENEW update. This changes nothing
+/// readers see, so there is no new version; fn gets the number of leases
+/// renewed (see leases.h).
+void send_renew (asio_redis::ManagedRedisClient& redis,
+                 asio_redis::CommandBuilder& command,
+                 const ev_lookup::Update& update,
+                 redisCallbackFn* fn,
+                 void* privdata);
+} // namespace coordinator
+} // namespace service
+} // namespace hlv
+#endif
@@ -0,0 +1,171 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <boost/asio.hpp>
+#include <boost/log/core.hpp>
+#include "lookup.pb.h"
+#include "journal.h"
+
+/// Checks the journal's framing as replay sees it: records come back whole
+/// and in the order they were appended (path.old first), a torn tail is
+/// cut off at the last whole record, and appending carries on after it.
+namespace {
+typedef hlv::service::coordinator::Journal Journal;
+
+int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": failed: " #cond << std::endl; \
+            failures++; \
+        } \
+    } while (0)
+
+ev_lookup::Update make_update (uint32_t i) {
+    ev_lookup::Update update;
+    update.set_token (i);
+    update.set_operation (ev_lookup::Update::SET_VALUES);
+    update.set_key ("key" + std::to_string (i));
+    auto value = update.add_values ();
+    value->set_type ("type");
+    // Vary the length so records do not all line up
+    value->set_value (std::string (i % 37, 'v'));
+    return update;
+}
+
+// Append updates [first, last) and wait for them to be on disk
+void append (const std::string& path, uint32_t first, uint32_t last,
+             uint64_t maxBytes = 0) {
+    boost::asio::io_service io_service;
+    Journal journal (io_service, path, 4, std::chrono::microseconds (100), maxBytes);
+    CHECK (journal.open ());
+    uint32_t durable = 0;
+    for (uint32_t i = first; i < last; i++) {
+        journal.append (make_update (i), [&durable] (bool ok) {
+            if (ok) {
+                durable++;
+            }
+        });
+    }
+    journal.stop ();
+    io_service.run ();
+    CHECK (durable == last - first);
+}
+
+// Keys of the updates replayed from path
+std::vector<std::string> replay (const std::string& path) {
+    std::vector<std::string> keys;
+    uint64_t records = 0;
+    CHECK (Journal::replay (path, [&keys] (const ev_lookup::Update& update) {
+        keys.push_back (update.key ());
+    }, records));
+    CHECK (records == keys.size ());
+    return keys;
+}
+
+std::vector<std::string> expected (uint32_t first, uint32_t last) {
+    std::vector<std::string> keys;
+    for (uint32_t i = first; i < last; i++) {
+        keys.push_back ("key" + std::to_string (i));
+    }
+    return keys;
+}
+
+off_t file_size (const std::string& path) {
+    struct stat st;
+    return stat (path.c_str (), &st) == 0 ? st.st_size : -1;
+}
+
+void remove_journal (const std::string& path) {
+    unlink (path.c_str ());
+    unlink ((path + ".old").c_str ());
+}
+
+void test_round_trip (const std::string& path) {
+    remove_journal (path);
+    CHECK (replay (path).empty ());
+    append (path, 0, 100);
+    CHECK (replay (path) == expected (0, 100));
+    // Replaying again changes nothing
+    CHECK (replay (path) == expected (0, 100));
+}
+
+void test_torn_tail (const std::string& path) {
+    remove_journal (path);
+    append (path, 0, 10);
+    off_t whole = file_size (path);
+    append (path, 10, 11);
+    off_t longer = file_size (path);
+    CHECK (longer > whole + 8);
+    // Cut the last record off halfway through its update, then halfway
+    // through its header
+    for (off_t at : {longer - 1, whole + 4}) {
+        CHECK (truncate (path.c_str (), at) == 0);
+        CHECK (replay (path) == expected (0, 10));
+        CHECK (file_size (path) == whole);
+        append (path, 10, 11);
+        CHECK (replay (path) == expected (0, 11));
+    }
+}
+
+void test_corrupt_record (const std::string& path) {
+    remove_journal (path);
+    append (path, 0, 5);
+    off_t whole = file_size (path);
+    append (path, 5, 6);
+    // Flip a byte of the last update, its CRC no longer matches
+    FILE* file = fopen (path.c_str (), "r+b");
+    CHECK (file != nullptr);
+    if (file) {
+        fseek (file, -1, SEEK_END);
+        int c = fgetc (file);
+        fseek (file, -1, SEEK_END);
+        fputc (c ^ 0xff, file);
+        fclose (file);
+    }
+    CHECK (replay (path) == expected (0, 5));
+    CHECK (file_size (path) == whole);
+}
+
+void test_rotation (const std::string& path) {
+    remove_journal (path);
+    // Rotates after the first group that passes 256 bytes, then not again
+    // until checkpoint
+    append (path, 0, 50, 256);
+    CHECK (file_size (path + ".old") > 0);
+    append (path, 50, 60, 256);
+    CHECK (replay (path) == expected (0, 60));
+    // A torn tail in path.old is cut off too, and path still follows it
+    off_t old = file_size (path + ".old");
+    CHECK (truncate ((path + ".old").c_str (), old - 1) == 0);
+    std::vector<std::string> keys = replay (path);
+    CHECK (keys.size () == 59);
+    if (!keys.empty ()) {
+        CHECK (keys.back () == "key59");
+    }
+}
+}
+
+int main (int argc, char* argv[]) {
+    boost::log::core::get ()->set_logging_enabled (false);
+    std::string directory = (argc > 1) ? argv[1] : "/tmp";
+    std::string path = directory + "/journal_test." + std::to_string (getpid ());
+    test_round_trip (path);
+    test_torn_tail (path);
+    test_corrupt_record (path);
+    test_rotation (path);
+    remove_journal (path);
+    if (failures > 0) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "journal_test passed" << std::endl;
+    return 0;
+}
@@ -10,6 +10,11 @@ namespace ev_lookup {
     class Update;
     class UpdateResponse;
 }
+namespace ev {
+namespace compression {
+    class FrameCompressor;
+}
+}
 namespace hlv {
 namespace coordinator {
 /// Client to synchronously update the EV lookup service. This client is not
@@ -62,9 +67,22 @@ class EvUpdateClient {
     /// token: uint64_t token authorizing update
     /// key: std::string:      key to update
     /// values: TypeValueMap:  types and values to set
+    /// lease: uint32_t:       seconds the values stay unless renewed, 0 for good
     bool set_values (const uint64_t token,
                      const std::string& key, 
-                     const TypeValueMap& values) const;
+                     const TypeValueMap& values,
+                     const uint32_t lease = 0) const;
+
+    /// Extend the leases on types of a given key. Fails if any of them ran
+    /// out already, set them again then.
+    /// token: uint64_t token authorizing update
+    /// key: std::string:  key to update
+    /// types: TypeList:   types to renew
+    /// lease: uint32_t:   seconds from now the types stay
+    bool renew (const uint64_t token,
+                const std::string& key,
+                const TypeList& types,
+                const uint32_t lease) const;
 
     virtual ~EvUpdateClient();
 
@@ -80,11 +98,18 @@ class EvUpdateClient {
     uint32_t port_;
     bool connected_;
 
+    // Set once the coordinator tells us it takes compressed updates
+    mutable bool serverCompresses_;
+
     // Space to deserialize protobuf
     mutable ev_lookup::Update* update_;
     mutable ev_lookup::UpdateResponse* response_;
+    // Compression state for updates
+    mutable ev::compression::FrameCompressor* compressor_;
     // Buffer, expect never to need more than 128k
     mutable std::array<char, 131072> buffer_;
+    // Space to serialize updates before compressing them
+    mutable std::array<char, 131072> deflate_buffer_;
 
     // Communicating with the other end
     // We are never going to call run on this io_service_ so no
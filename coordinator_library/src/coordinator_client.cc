@@ -2,6 +2,7 @@
 #include <utility>
 #include <boost/log/trivial.hpp>
 #include "coordinator_client.h"
+#include "frame_compression.h"
 #include "lookup.pb.h"
 namespace hlv {
 namespace coordinator {
@@ -13,8 +14,10 @@ EvUpdateClient::EvUpdateClient (const std::string& host,
                  host_ (host),
                  port_ (port),
                  connected_ (false),
+                 serverCompresses_ (false),
                  update_ (new ev_lookup::Update),
                  response_ (new ev_lookup::UpdateResponse),
+                 compressor_ (new ev::compression::FrameCompressor),
                  io_service_ (),
                  socket_ (io_service_) {
 }
@@ -63,7 +66,8 @@ bool EvUpdateClient::set_permissions (const uint64_t token,
 /// values: TypeValueMap:  types and values to set
 bool EvUpdateClient::set_values (const uint64_t token,
                                  const std::string& key, 
-                                 const TypeValueMap& values) const {
+                                 const TypeValueMap& values,
+                                 const uint32_t lease) const {
     update_->Clear ();
     update_->set_operation (ev_lookup::Update::SET_VALUES);
     update_->set_token (token);
@@ -73,6 +77,33 @@ bool EvUpdateClient::set_values (const uint64_t token,
         val->set_type (tv.first);
         val->set_value (tv.second);
     }
+    if (lease > 0) {
+        update_->set_lease (lease);
+    }
+    send_update (*update_);
+    recv_response (*response_);
+    return response_-> success ();
+}
+
+/// Extend the leases on types of a given key
+/// token: uint64_t token authorizing update
+/// key: std::string:  key to update
+/// types: TypeList:   types to renew
+/// lease: uint32_t:   seconds from now the types stay
+bool EvUpdateClient::renew (const uint64_t token,
+                            const std::string& key,
+                            const TypeList& types,
+                            const uint32_t lease) const {
+    update_->Clear ();
+    update_->set_operation (ev_lookup::Update::RENEW);
+    update_->set_token (token);
+    update_->set_key (key);
+    update_->set_lease (lease);
+    for (auto t : types) {
+        auto val = update_->add_values ();
+        val->set_type (t);
+        val->set_value ("");
+    }
     send_update (*update_);
     recv_response (*response_);
     return response_-> success ();
@@ -116,13 +147,25 @@ bool EvUpdateClient::del_types (const uint64_t token,
 // Send update to the server
 bool EvUpdateClient::send_update (const ev_lookup::Update& update) const {
     uint64_t size = update.ByteSize ();
-    *((uint64_t*)buffer_.data()) = size;
-    update.SerializeToArray (buffer_.data() + sizeof(uint64_t), size);
+    uint64_t header = 0;
+    if (serverCompresses_ && compressor_->worthwhile (size)) {
+        update.SerializeToArray (deflate_buffer_.data(), size);
+        header = compressor_->compress (deflate_buffer_.data (),
+                                        size,
+                                        buffer_.data() + sizeof(uint64_t),
+                                        buffer_.size() - sizeof(uint64_t));
+    }
+    if (header == 0) {
+        header = size;
+        update.SerializeToArray (buffer_.data() + sizeof(uint64_t), size);
+    }
+    *((uint64_t*)buffer_.data()) = header;
     BOOST_LOG_TRIVIAL (info) << "Sending update";
     boost::system::error_code ec;
     boost::asio::write (socket_,
       boost::asio::buffer(buffer_),
-      boost::asio::transfer_exactly (size + sizeof(uint64_t)),
+      boost::asio::transfer_exactly (ev::compression::frame_length (header)
+                                        + sizeof(uint64_t)),
       ec);
     if (ec) {
         BOOST_LOG_TRIVIAL (info) << "Error sending update " << ec;
@@ -156,12 +199,18 @@ bool EvUpdateClient::recv_response (ev_lookup::UpdateResponse& response) const {
     }
 
     response.ParseFromArray (buffer_.data(), size);
+    // Only responses to updates the coordinator carried out say whether
+    // it takes compressed ones
+    if (response.has_acceptcompressed ()) {
+        serverCompresses_ = response.acceptcompressed ();
+    }
     return true;
 }
 
 EvUpdateClient::~EvUpdateClient() {
     delete update_;
     delete response_;
+    delete compressor_;
 }
 }
 }
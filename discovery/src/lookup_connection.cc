@@ -7,36 +7,30 @@
 #include <cstring>
 #include <algorithm>
 #include <boost/log/trivial.hpp>
+#include <managed_client.h>
+#include <reply_decoder.h>
 #include "lookup_connection.h"
+#include "watch_manager.h"
+#include "negative_cache.h"
+#include "response_cache.h"
 #include "lookup_server.h"
+#include "parse_number.h"
 #include "consts.h"
 
 namespace {
-/// A set of Redis callbacks
-// Callback for when we query the global discovery server 
-void getCallback (redisAsyncContext* context, void* reply, void* data) {
-    hlv::service::lookup::server::Connection* connect = 
-                        (hlv::service::lookup::server::Connection*)data;
-    redisReply* rreply = (redisReply*) reply;
-    connect->getSucceeded (rreply);
+// Callback for get of a key's version. The connection's coroutine waits for
+// it, so the connection is still there.
+void versionCallback (redisAsyncContext* context, void* reply, void* data) {
+    ((hlv::service::lookup::server::Connection*)data)->versionSucceeded (
+            (const asio_redis::FlatReply*) reply);
 }
 
-// Callback for hget to get permission on local discovery keys
-void localPermGetCallback (redisAsyncContext* context, void* reply, void* data) {
-    hlv::service::lookup::server::Connection* connect = 
-                        (hlv::service::lookup::server::Connection*)data;
-    redisReply* rreply = (redisReply*) reply;
-    connect->getPermFieldSucceeded (rreply);
-}
-
-// Callback for smembers to get local discovery stuff
-void localSmemberCallback (redisAsyncContext* context, void* reply, void* data) {
-    hlv::service::lookup::server::Connection* connect = 
-                        (hlv::service::lookup::server::Connection*)data;
-    redisReply* rreply = (redisReply*) reply;
-    connect->smemberSucceeded (rreply);
-}
+// Suffixes of a key's set of local values and of its version counter
+const std::string LOCAL_SET_SUFFIX = "." + hlv::service::lookup::LOCAL_SET;
+const std::string VERSION_SUFFIX = "." + hlv::service::lookup::VERSION_KEY;
 
+// Most responses a watcher can fall behind by before it is disconnected
+const size_t MAX_PENDING_RESPONSES = 1024;
 
 }
 
@@ -44,201 +38,530 @@ namespace hlv {
 namespace service{
 namespace lookup {
 namespace server {
-Connection::Connection (boost::asio::ip::tcp::socket socket,
+Connection::Connection (hlv::service::common::StreamSocket socket,
                         ConnectionManager& manager,
                         ConnectionInformation& config) :
     socket_ (std::move(socket)),
-    bufferSize_ (0),
     manager_ (manager),
-    config_ (config) {
+    config_ (config),
+    compressor_ (config.compressionThreshold),
+    acceptCompressed_ (false),
+    version_ (0),
+    tenant_ (nullptr),
+    admitted_ (false),
+    redisFailed_ (false),
+    stopped_ (false),
+    reading_ (false) {
+}
+
+void Connection::decode_replies (asio_redis::ManagedRedisClient& client) {
+    client.decode_flat (versionCallback);
+    common::decode_flat (client);
 }
 
 void Connection::start () {
     BOOST_LOG_TRIVIAL(info) << "Starting connection";
-    read_size();
+    auto self(shared_from_this());
+    boost::asio::spawn (config_.io_service,
+        [this, self] (boost::asio::yield_context yield) {
+            serve (yield);
+        });
 }
 
 void Connection::stop () {
-    socket_.close();
+    for (auto tenant : watchedTenants_) {
+        tenant->watches->unwatch_all (this);
+    }
+    watchedTenants_.clear ();
+    stopped_ = true;
+    common::close_socket (socket_);
 }
 
-void Connection::write_response (const ev_lookup::Response& response) {
-    auto self(shared_from_this());
-    uint64_t size = response.ByteSize ();
-    *((uint64_t*)write_buffer_.data()) = size;
-    response.SerializeToArray (write_buffer_.data() + sizeof(uint64_t), size);
-    BOOST_LOG_TRIVIAL (info) << "Writing response";
-    boost::asio::async_write (socket_,
-        boost::asio::buffer(write_buffer_),
-        boost::asio::transfer_exactly (size + sizeof(uint64_t)),
-        [this, self] (boost::system::error_code ec,
-                          std::size_t bytes_transfered) {
-           if (ec) {
-               BOOST_LOG_TRIVIAL (info) << "Error sending join message " << ec;
-               manager_.stop(shared_from_this());
-           }
-           BOOST_LOG_TRIVIAL (info) << "Successfully responded";
-           read_size ();
+void Connection::serve (boost::asio::yield_context yield) {
+    boost::system::error_code ec;
+    const char* data;
+    size_t length;
+    while (!stopped_) {
+        if (!write_pushed (yield)) {
+            break;
         }
-    );
+        reading_ = true;
+        bool read = common::read_frame (socket_, reader_, data, length,
+                [this] (bool partial) {
+                    // Answered everything asked so far, let the client
+                    // reconnect elsewhere. The read fails once closed.
+                    if (!partial && manager_.draining ()) {
+                        BOOST_LOG_TRIVIAL (info) << "Draining, closing connection";
+                        common::close_socket (socket_);
+                    }
+                    // Connections with watches are expected to sit quietly,
+                    // but not halfway through a query
+                    manager_.expect (this, partial ? common::READ :
+                                     watchedTenants_.empty () ? common::IDLE :
+                                     common::WATCHING);
+                }, yield, ec);
+        reading_ = false;
+        if (!read) {
+            // A push cancelled the read to be written (see push_response)
+            if (ec == boost::asio::error::operation_aborted && !stopped_ &&
+                !pushed_.empty ()) {
+                continue;
+            }
+            break;
+        }
+        // Waiting on Redis from here on
+        manager_.expect (this, common::NO_DEADLINE);
+        if (!handle_query (data, length, yield) || !write_response (yield)) {
+            break;
+        }
+    }
+    if (ec == boost::asio::error::message_size) {
+        BOOST_LOG_TRIVIAL(error) << "Query too large, closing";
+    } else if (ec && ec != boost::asio::error::operation_aborted) {
+        BOOST_LOG_TRIVIAL(info) << "Connection ended " << ec;
+    }
+    manager_.stop(shared_from_this());
 }
 
-void Connection::read_size () {
-    auto self(shared_from_this());
-    boost::asio::async_read (socket_, 
-            boost::asio::buffer(&bufferSize_, sizeof(bufferSize_)),
-            [this, self] (boost::system::error_code ec, 
-                                std::size_t bytes_transfered) {
-                BOOST_LOG_TRIVIAL(info) << "Read connection";
-                if (!ec) {
-                    BOOST_LOG_TRIVIAL(info) << "Read " 
-                                << bufferSize_
-                                << " byte preheader " 
-                                << bytes_transfered;
-                    read_buffer(bufferSize_);
-                } else if (ec != boost::asio::error::operation_aborted) {
-                    // Stop here
-                    BOOST_LOG_TRIVIAL(info) << "Connection ended";
-                    manager_.stop(shared_from_this());
-                }
-                else {
-                    BOOST_LOG_TRIVIAL(error) << "Unknown ASIO error " << ec << " closing socket";
-                    manager_.stop(shared_from_this());
-                }
-            });
+bool Connection::write_response (boost::asio::yield_context yield) {
+    release_admission ();
+    if (tenant_) {
+        tenant_->responseBytes += response_.ByteSize ();
+        if (!response_.success ()) {
+            tenant_->failures++;
+        }
+    }
+    query_.Clear ();
+    uint64_t size = response_.ByteSize ();
+    bool written;
+    if (acceptCompressed_ && compressor_.worthwhile (size)) {
+        // Compressed from scratch space into the write buffer
+        response_.SerializeToString (&scratch_);
+        written = write_frame (scratch_.data (), size, yield);
+    } else {
+        response_.SerializeToArray (write_buffer_.data() + sizeof(uint64_t),
+                                    size);
+        *((uint64_t*)write_buffer_.data()) = size;
+        written = write_frame (nullptr, size, yield);
+    }
+    response_.Clear ();
+    return written;
+}
+
+void Connection::push_response (const ev_lookup::Response& response) {
+    if (pushed_.size () >= MAX_PENDING_RESPONSES) {
+        // Client is not keeping up. Closing the socket fails the read or
+        // write in progress, which takes care of the rest.
+        BOOST_LOG_TRIVIAL (info) << "Too many pushes queued, disconnecting";
+        common::close_socket (socket_);
+        return;
+    }
+    pushed_.emplace_back (response.SerializeAsString ());
+    if (reading_ && pushed_.size () == 1) {
+        boost::system::error_code ec;
+        common::cancel_socket (socket_, ec);
+    }
+}
+
+bool Connection::write_pushed (boost::asio::yield_context yield) {
+    while (!pushed_.empty ()) {
+        std::string next = std::move (pushed_.front ());
+        pushed_.pop_front ();
+        if (!write_frame (next.data (), next.size (), yield)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Connection::write_frame (const char* data,
+                              size_t size,
+                              boost::asio::yield_context yield) {
+    // data is null when the frame is in write_buffer_ already
+    uint64_t header = size;
+    if (data) {
+        char* payload = write_buffer_.data() + sizeof(uint64_t);
+        header = 0;
+        if (acceptCompressed_ && compressor_.worthwhile (size)) {
+            header = compressor_.compress (data,
+                                           size,
+                                           payload,
+                                           write_buffer_.size() - sizeof(uint64_t));
+        }
+        if (header == 0) {
+            memcpy (payload, data, size);
+            header = size;
+        }
+        *((uint64_t*)write_buffer_.data()) = header;
+    }
+    BOOST_LOG_TRIVIAL (info) << "Writing response";
+    manager_.expect (this, common::WRITE);
+    boost::system::error_code ec;
+    if (!common::write_buffer (socket_,
+                               write_buffer_.data (),
+                               ev::compression::frame_length (header)
+                                   + sizeof(uint64_t),
+                               writeMemory_,
+                               yield,
+                               ec)) {
+        BOOST_LOG_TRIVIAL (info) << "Error sending response " << ec;
+        return false;
+    }
+    BOOST_LOG_TRIVIAL (info) << "Successfully responded";
+    return true;
 }
 
 /// Execute a global query
-void Connection::global_lookup () {
+void Connection::global_lookup (boost::asio::yield_context yield) {
     BOOST_LOG_TRIVIAL (info) << "Querying globally " 
-                             << config_.prefix 
+                             << tenant_->prefix 
                              << ":"
                              << query_.querystring ();
-    redisAsyncCommand (config_.redisContext, 
-                        getCallback, 
-                        this, 
-                        "HGETALL %s:%s", 
-                        config_.prefix.c_str(),
-                        query_.querystring ().c_str());  
+    if (tenant_->negativeCache &&
+        !tenant_->negativeCache->may_exist (query_.querystring (), false) &&
+        confirm_missing (false, yield)) {
+        fail_request ();
+        return;
+    }
+    query_global (yield);
+}
+
+/// Ask Redis for a global key
+void Connection::query_global (boost::asio::yield_context yield) {
+    // Waiting for Redis to come back is only worth it with nothing to serve
+    if (!config_.redis->connected () && serve_stale ()) {
+        return;
+    }
+    if (!admit ()) {
+        if (!serve_stale ()) {
+            fail_request ();
+        }
+        return;
+    }
+    get_version (tenant_->prefix);
+    command_.begin (2)
+            .arg ("HGETALL", 7)
+            .key (query_.querystring ());
+    global_reply (common::redis_read_flat (*config_.redis, command_, yield));
+    versionRead_.wait (yield);
+}
+
+/// The filter has not heard of the key. Fail straight away if it is caught
+/// up, otherwise it may not have heard of a write made just before it
+/// (re)subscribed either: fail once it has caught up, unless the key turns
+/// up.
+bool Connection::confirm_missing (bool local, boost::asio::yield_context yield) {
+    if (!tenant_->negativeCache->caught_up ()) {
+        synced_.reset ();
+        tenant_->negativeCache->sync ([this] (bool synced) {
+            synced_.set (synced);
+        });
+        if (!synced_.wait (yield) ||
+            tenant_->negativeCache->may_exist (query_.querystring (), local)) {
+            return false;
+        }
+    }
+    BOOST_LOG_TRIVIAL (info) << "No such key, not asking redis";
+    return true;
+}
+
+/// Get the version of the key being queried. Redis answers in order, so
+/// this is read before (and is at most as new as) whatever is looked up
+/// next; at worst a client is sent values it already has.
+void Connection::get_version (const std::string& prefix) {
+    version_ = 0;
+    versionRead_.reset ();
+    command_.set_prefix (prefix);
+    command_.begin (2)
+            .arg ("GET", 3)
+            .key (query_.querystring (),
+                  VERSION_SUFFIX.data (),
+                  VERSION_SUFFIX.size ());
+    config_.redis->read (versionCallback, this, command_);
+}
+
+void Connection::versionSucceeded (const asio_redis::FlatReply* reply) {
+    // Never written (or an error, treat as unknown)
+    version_ = 0;
+    if (reply && reply->type () == REDIS_REPLY_STRING &&
+        !parse_u64 (reply->str (), reply->len (), version_)) {
+        version_ = 0;
+    }
+    versionRead_.set (true);
+}
+
+bool Connection::admit () {
+    if (!config_.admission) {
+        return true;
+    }
+    if (!config_.admission->try_acquire ()) {
+        BOOST_LOG_TRIVIAL (info) << "Redis busy or down, shedding query";
+        return false;
+    }
+    admitted_ = true;
+    admittedAt_ = common::AdmissionController::Clock::now ();
+    redisFailed_ = false;
+    return true;
+}
+
+void Connection::redis_failed () {
+    redisFailed_ = true;
+}
+
+void Connection::release_admission () {
+    if (admitted_) {
+        admitted_ = false;
+        config_.admission->release (admittedAt_, !redisFailed_);
+    }
+}
+
+bool Connection::set_version () {
+    // Replies can only overtake the version's when Redis is failing them
+    if (version_ == 0 || !versionRead_.done ()) {
+        return false;
+    }
+    response_.set_version (version_);
+    return query_.has_ifversionnot () && query_.ifversionnot () == version_;
 }
 
 /// Execute a local query
 /// Start by getting permission for the local key
-void Connection::local_lookup () {
+void Connection::local_lookup (boost::asio::yield_context yield) {
     BOOST_LOG_TRIVIAL (info) << "Querying locally " 
-                             << config_.localPrefix 
+                             << tenant_->localPrefix 
                              << ":"
                              << query_.querystring ()
                              << " " 
                              << hlv::service::lookup::PERM_BIT_FIELD;
-    redisAsyncCommand (config_.redisContext, 
-                        localPermGetCallback, 
-                        this, 
-                        "HGET %s:%s %s", 
-                        config_.localPrefix.c_str(),
-                        query_.querystring ().c_str(),
-                        hlv::service::lookup::PERM_BIT_FIELD.c_str ());  
+    if (tenant_->negativeCache &&
+        !tenant_->negativeCache->may_exist (query_.querystring (), true) &&
+        confirm_missing (true, yield)) {
+        fail_request ();
+        return;
+    }
+    query_local (yield);
 }
 
-/// Callback for response to the previous call, once permission bits are retrieved
-void Connection::getPermFieldSucceeded (redisReply* reply) {
+/// Ask Redis for the permission bits of a local key
+void Connection::query_local (boost::asio::yield_context yield) {
+    if (!config_.redis->connected () && serve_stale ()) {
+        return;
+    }
+    if (!admit ()) {
+        if (!serve_stale ()) {
+            fail_request ();
+        }
+        return;
+    }
+    command_.set_prefix (tenant_->localPrefix);
+    command_.begin (3)
+            .arg ("HGET", 4)
+            .key (query_.querystring ())
+            .arg (hlv::service::lookup::PERM_BIT_FIELD);
+    if (local_permitted (common::redis_read_flat (*config_.redis, command_, yield))) {
+        lookup_local_set (yield);
+    }
+}
+
+/// Once permission bits are retrieved
+bool Connection::local_permitted (const asio_redis::FlatReply* reply) {
     BOOST_LOG_TRIVIAL (info) << "Got response to request for permissions";
-    if (reply->type == REDIS_REPLY_ERROR) {
+    uint64_t token = 0;
+    if (!reply || reply->type () == REDIS_REPLY_ERROR) {
         BOOST_LOG_TRIVIAL (error) << "Redis sent us an error, 'tis sad, fail";
-        fail_request ();
-    } else if (reply->type == REDIS_REPLY_NIL) {
+        redis_unavailable ();
+        return false;
+    } else if (reply->type () == REDIS_REPLY_NIL) {
         BOOST_LOG_TRIVIAL (info) << "Getting permissions field failed, too bad";
-        lookup_local_set ();
-    } else if (reply->type == REDIS_REPLY_STRING) {
-        uint64_t token = std::stoull(std::string(reply->str));
+        return true;
+    } else if (reply->type () == REDIS_REPLY_STRING) {
+        if (!parse_u64 (reply->str (), reply->len (), token)) {
+            BOOST_LOG_TRIVIAL (info) << "Garbled permissions, not allowed";
+            fail_request ();
+            return false;
+        }
         // Either this is globally accessible or we have the right token (for local
         // queries we only return in these cases)
         if (token == query_.token () || token == 0) {
             BOOST_LOG_TRIVIAL (info) << "Successfully authenticated local token, now "
                                     << "executing actual query ";
-            lookup_local_set ();
-        } else {
-            BOOST_LOG_TRIVIAL (info) << "Looks like you are not allowed in here";
-            fail_request ();
+            return true;
         }
-    } else {
-        BOOST_LOG_TRIVIAL (info) << "Unrecognized redis return type";
+        BOOST_LOG_TRIVIAL (info) << "Looks like you are not allowed in here";
         fail_request ();
+        return false;
     }
+    BOOST_LOG_TRIVIAL (info) << "Unrecognized redis return type";
+    fail_request ();
+    return false;
 }
 
 /// Actually lookup local values
-void Connection::lookup_local_set () {
+void Connection::lookup_local_set (boost::asio::yield_context yield) {
     BOOST_LOG_TRIVIAL (info) << "Looking up local set"
-                             << config_.localPrefix
+                             << tenant_->localPrefix
                              << ":"
                              << query_.querystring ()
                              << "."
                              <<  hlv::service::lookup::LOCAL_SET;
-    redisAsyncCommand (config_.redisContext,
-                       localSmemberCallback,
-                       this,
-                       "SMEMBERS %s:%s.%s",
-                       config_.localPrefix.c_str (),
-                       query_.querystring ().c_str (),
-                       hlv::service::lookup::LOCAL_SET.c_str ());
+    get_version (tenant_->localPrefix);
+    command_.begin (2)
+            .arg ("SMEMBERS", 8)
+            .key (query_.querystring (),
+                  LOCAL_SET_SUFFIX.data (),
+                  LOCAL_SET_SUFFIX.size ());
+    local_reply (common::redis_read_flat (*config_.redis, command_, yield));
+    versionRead_.wait (yield);
 }
 
-// Callback for getting response to local values
-void Connection::smemberSucceeded (redisReply* reply) {
+// Turn the local values into a response
+void Connection::local_reply (const asio_redis::FlatReply* reply) {
+    if (!reply || reply->type () == REDIS_REPLY_ERROR) {
+        BOOST_LOG_TRIVIAL (info) << "SMEMBERS failed";
+        redis_unavailable ();
+        return;
+    }
     response_.Clear();
     response_.set_token (config_.token);
     response_.set_querystring (query_.querystring ());
     BOOST_LOG_TRIVIAL (info) << "smembers returned";
-    if (reply->type == REDIS_REPLY_ARRAY && reply->elements > 0) {
+    if (reply->type () == REDIS_REPLY_ARRAY && reply->elements () > 0) {
         BOOST_LOG_TRIVIAL (info) << "SMEMBERS succeeded, converting to result";
         // Indicate that we did in fact find a value
         response_.set_success (true);
-        for (uint32_t j = 0; j < reply->elements; j ++) {
+        if (set_version ()) {
+            BOOST_LOG_TRIVIAL (info) << "Not modified";
+            response_.set_notmodified (true);
+            return;
+        }
+        for (size_t j = 0; j < reply->elements (); j ++) {
             auto val = response_.add_values();
             val->set_type ("");
-            val->set_value (reply->element[j]->str);
+            val->set_value (reply->str (j), reply->element (j).length);
         }
+        remember (response_);
     } else {
-        BOOST_LOG_TRIVIAL (info) << "SMEMBERS failed";
+        BOOST_LOG_TRIVIAL (info) << "SMEMBERS found nothing";
         response_.set_success (false);
+        if (tenant_->negativeCache) {
+            tenant_->negativeCache->missed (true);
+        }
     }
-    query_.Clear ();
-    write_response (response_);
 }
 
-void Connection::read_buffer (uint64_t length) {
-    auto self(shared_from_this());
-    BOOST_LOG_TRIVIAL(info) << "Being asked to read " << bufferSize_ << " bytes";
-    boost::asio::async_read (socket_, 
-            boost::asio::buffer(buffer_),
-            boost::asio::transfer_exactly(length),
-            [this, self] (boost::system::error_code ec,
-                          std::size_t bytes_transfered) {
-                BOOST_LOG_TRIVIAL(info) << "Read data";
-                if (!ec) {
-                    
-                    if (!query_.ParseFromArray(buffer_.data(), bytes_transfered)) {
-                        BOOST_LOG_TRIVIAL(error) << "Could not parse request";
-                        manager_.stop(shared_from_this());
-                        return;
-                    }
-                    
-                    if (query_.type () == ev_lookup::Query::GLOBAL) {
-                        global_lookup ();
-                    } else if (query_.type() == ev_lookup::Query::LOCAL) {
-                        local_lookup ();
-                    }
-                } else if (ec != boost::asio::error::operation_aborted) {
-                    // Stop here
-                    BOOST_LOG_TRIVIAL(info) << "Connection ended read: " << bytes_transfered;
-                    manager_.stop(shared_from_this());
-                }
-                else {
-                    BOOST_LOG_TRIVIAL(error) << "Unknown ASIO error " << ec << " closing socket";
-                    manager_.stop(shared_from_this());
-                }
-            });
+bool Connection::handle_query (const char* data,
+                               size_t length,
+                               boost::asio::yield_context yield) {
+    if (!query_.ParseFromArray(data, length)) {
+        BOOST_LOG_TRIVIAL(error) << "Could not parse request";
+        return false;
+    }
+    acceptCompressed_ = query_.acceptcompressed ();
+
+    auto tenant = config_.tenants.find (query_.tenant ());
+    if (tenant == config_.tenants.end ()) {
+        BOOST_LOG_TRIVIAL(info) << "Unknown tenant " << query_.tenant ();
+        tenant_ = nullptr;
+        fail_request ();
+        return true;
+    }
+    tenant_ = tenant->second.get ();
+    tenant_->queries++;
+
+    if (!check_capability ()) {
+        fail_request ();
+        return true;
+    }
+
+    if (query_.watch () == ev_lookup::Query::STOP) {
+        stop_watch ();
+        return true;
+    } else if (query_.watch () == ev_lookup::Query::START) {
+        if (!tenant_->watches) {
+            BOOST_LOG_TRIVIAL(info) << "Watches not supported";
+            fail_request ();
+            return true;
+        }
+        start_watch ();
+    }
+
+    if (query_.type () == ev_lookup::Query::GLOBAL) {
+        global_lookup (yield);
+    } else if (query_.type() == ev_lookup::Query::LOCAL) {
+        local_lookup (yield);
+    } else {
+        fail_request ();
+    }
+    return true;
+}
+
+/// Register the watch before answering the query, so that no change made
+/// after the answer is read from Redis can be missed.
+void Connection::start_watch () {
+    BOOST_LOG_TRIVIAL (info) << "Watching " << query_.querystring ();
+    tenant_->watches->watch (query_, shared_from_this ());
+    watchedTenants_.insert (tenant_);
+}
+
+/// Acknowledge the end of a watch with an empty, successful response
+void Connection::stop_watch () {
+    BOOST_LOG_TRIVIAL (info) << "No longer watching " << query_.querystring ();
+    if (tenant_->watches) {
+        tenant_->watches->unwatch (query_, this);
+    }
+    response_.Clear ();
+    response_.set_token (config_.token);
+    response_.set_querystring (query_.querystring ());
+    response_.set_success (true);
+}
+
+bool Connection::check_capability () {
+    if (!config_.capabilities) {
+        return true;
+    }
+    if (!query_.has_capability ()) {
+        if (config_.requireCapability) {
+            BOOST_LOG_TRIVIAL (info) << "Query without a capability";
+            return false;
+        }
+        return true;
+    }
+    common::capability::Claims claims;
+    if (!config_.capabilities->verify (query_.capability (), claims)) {
+        BOOST_LOG_TRIVIAL (info) << "Query with an invalid or expired capability";
+        return false;
+    }
+    // Everything downstream (permission checks, watches, the stale cache)
+    // goes by the token
+    query_.set_token (claims.permissions);
+    return true;
+}
+
+bool Connection::serve_stale () {
+    if (!config_.stale || !tenant_ ||
+        !config_.stale->fetch (tenant_->name, query_, response_)) {
+        return false;
+    }
+    BOOST_LOG_TRIVIAL (info) << "Serving cached answer";
+    if (response_.has_version () && query_.has_ifversionnot () &&
+        query_.ifversionnot () == response_.version ()) {
+        response_.clear_values ();
+        response_.set_notmodified (true);
+    }
+    return true;
+}
+
+void Connection::redis_unavailable () {
+    redis_failed ();
+    if (!serve_stale ()) {
+        fail_request ();
+    }
+}
+
+void Connection::remember (const ev_lookup::Response& response) {
+    if (config_.stale && !response.notmodified ()) {
+        config_.stale->store (tenant_->name, query_, response);
+    }
 }
 
 void Connection::fail_request () {
@@ -246,48 +569,64 @@ void Connection::fail_request () {
     response_.set_token (config_.token);
     response_.set_querystring (query_.querystring ());
     response_.set_success (false);
-    query_.Clear ();
-    write_response (response_);
 }
 
-// Callback for getting global values succeeded
-void Connection::getSucceeded (redisReply* reply) {
+// Turn the global values into a response
+void Connection::global_reply (const asio_redis::FlatReply* reply) {
     BOOST_LOG_TRIVIAL (info) << "Got response";
+    if (!reply || reply->type () == REDIS_REPLY_ERROR) {
+        BOOST_LOG_TRIVIAL (info) << "Redis could not answer";
+        redis_unavailable ();
+        return;
+    }
     response_.Clear();
     response_.set_token (config_.token);
     response_.set_querystring (query_.querystring ());
     
+    bool notModified = false;
     // HGETALL responds with an array the where even elements represent
     // hash keys and odd elements represent values
     // See also: http://redis.io/commands/hgetall
-    if (reply->type == REDIS_REPLY_ARRAY && reply->elements > 0) {
+    if (reply->type () == REDIS_REPLY_ARRAY && reply->elements () > 0) {
         // Indicate that we did in fact find a value
         response_.set_success (true);
-        for (uint32_t j = 0; j < reply->elements; j += 2) {
-            std::string key (reply->element[j]->str);
-            if (key == PERM_BIT_FIELD) {
+        // Values are only skipped once the permission check passes
+        notModified = set_version ();
+        for (size_t j = 0; j + 1 < reply->elements (); j += 2) {
+            if (reply->equals (j, PERM_BIT_FIELD.data (), PERM_BIT_FIELD.size ())) {
                 BOOST_LOG_TRIVIAL (info) << "Checking authorization token"; 
-                uint64_t token = std::stoull(std::string
-                                            (reply->element[j+1]->str));
-                if (token != 0 && !( token & query_.token())) {
+                uint64_t token = 0;
+                bool parsed = parse_u64 (reply->str (j + 1),
+                                         reply->element (j + 1).length,
+                                         token);
+                if (!parsed || (token != 0 && !( token & query_.token()))) {
                     BOOST_LOG_TRIVIAL (info) << "Not authorized, failing ";
                     response_.set_success (false);
                     response_.clear_values ();
+                    response_.clear_version ();
+                    notModified = false;
                     break;
                 }
-            } else {
+            } else if (!notModified) {
                 auto val = response_.add_values();
-                val->set_type (key);
-                val->set_value (reply->element[j + 1]->str);
+                val->set_type (reply->str (j), reply->element (j).length);
+                val->set_value (reply->str (j + 1), reply->element (j + 1).length);
             }
         }
     } else {
         BOOST_LOG_TRIVIAL (info) << "No entry found, failing";
         // Indicate a sad lack of values
         response_.set_success (false);
+        if (tenant_->negativeCache) {
+            tenant_->negativeCache->missed (false);
+        }
+    }
+    if (notModified) {
+        BOOST_LOG_TRIVIAL (info) << "Not modified";
+        response_.set_notmodified (true);
+    } else if (response_.success ()) {
+        remember (response_);
     }
-    query_.Clear ();
-    write_response (response_);
 }
 
 } // namespace server
@@ -1,60 +1,164 @@
 // Copyright 20xx The Regents of the University of California
 // This is a test service for SDN-v2 High Level Virtualization
+#include <deque>
+#include <map>
 #include <memory>
+#include <set>
+#include <string>
+#include <utility>
 #include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
+#include <command_builder.h>
 #include "lookup.pb.h"
 #include "common_manager.h"
+#include "stream_socket.h"
+#include "uring.h"
+#include "admission_controller.h"
+#include "capability.h"
+#include "coroutine.h"
+#include "frame_compression.h"
+#include "frame_reader.h"
+#include "handler_memory.h"
 #ifndef _HLV_LOOKUP_CONNECTION_H_
 #define _HLV_LOOKUP_CONNECTION_H_
+namespace asio_redis {
+class ManagedRedisClient;
+class FlatReply;
+}
 /// The Connection class implements the logic used by the HLV lookup service
 namespace hlv {
 namespace service{
 namespace lookup {
 namespace server {
+class WatchManager;
+class NegativeCache;
+class ResponseCache;
+
+/// A (prefix, localPrefix) pair served by a lookup server. One process can
+/// host many tenants; they share the Redis connections, buffers and the
+/// io_service, and only keep per prefix state (watches, negative cache).
+struct Tenant {
+    std::string name;
+    std::string prefix;
+    std::string localPrefix;
+    // Watched queries, null if watches are not supported
+    WatchManager* watches;
+    // Filter of existing keys, null to always ask Redis
+    NegativeCache* negativeCache;
+    // Queries received
+    uint64_t queries;
+    // Queries that failed (not found, not allowed, unknown)
+    uint64_t failures;
+    // Bytes of responses sent (not counting pushes)
+    uint64_t responseBytes;
+    Tenant(
+            const std::string& _name,
+            const std::string& _prefix,
+            const std::string& _localPrefix,
+            WatchManager* _watches = nullptr,
+            NegativeCache* _negativeCache = nullptr) :
+            name (_name),
+            prefix (_prefix),
+            localPrefix (_localPrefix),
+            watches (_watches),
+            negativeCache (_negativeCache),
+            queries (0),
+            failures (0),
+            responseBytes (0) {
+    }
+};
 
 /// Information used by each of the connection objects for initialization.
 struct ConnectionInformation {
     uint64_t token; // A token to authenticate this lookup server
     std::string redisServer; // Redis server
     uint32_t redisPort; // Port
-    redisAsyncContext* redisContext;
-    std::string prefix;
-    std::string localPrefix;
+    asio_redis::ManagedRedisClient* redis;
+    // Connections run as coroutines on this
+    boost::asio::io_service& io_service;
+    // Responses at least this big are compressed for clients that accept it
+    size_t compressionThreshold;
+    // Tenants by name, queries without a tenant go to the one named ""
+    std::map<std::string, std::unique_ptr<Tenant>> tenants;
+    // Limits queries waiting on Redis, null for no limit
+    hlv::service::common::AdmissionController* admission;
+    // Answers served when Redis cannot give one, null to fail instead
+    ResponseCache* stale;
+    // Checks capabilities sent with queries, null to go by Token alone
+    hlv::service::common::capability::Verifier* capabilities;
+    // Fail queries that come without a capability
+    bool requireCapability;
     ConnectionInformation(
             const uint64_t _token,
             const std::string& _redisServer,
             const uint32_t  _redisPort,
-            redisAsyncContext* _redisContext,
-            std::string _prefix,
-            std::string _localPrefix) :
+            asio_redis::ManagedRedisClient* _redis,
+            boost::asio::io_service& _io_service,
+            size_t _compressionThreshold = ev::compression::DEFAULT_THRESHOLD) :
             token (_token),
             redisServer (_redisServer),
             redisPort (_redisPort),
-            redisContext (_redisContext),
-            prefix (_prefix),
-            localPrefix (_localPrefix) {
+            redis (_redis),
+            io_service (_io_service),
+            compressionThreshold (_compressionThreshold),
+            admission (nullptr),
+            stale (nullptr),
+            capabilities (nullptr),
+            requireCapability (false) {
+    }
+
+    /// Serve another tenant, returns false if the name is already taken or
+    /// one of the prefixes overlaps another tenant's (tenants sharing keys
+    /// would see each other's watches and cached misses)
+    bool add_tenant (std::unique_ptr<Tenant> tenant) {
+        for (auto& other : tenants) {
+            if (other.first == tenant->name ||
+                overlaps (other.second->prefix, tenant->prefix) ||
+                overlaps (other.second->localPrefix, tenant->localPrefix) ||
+                overlaps (other.second->prefix, tenant->localPrefix) ||
+                overlaps (other.second->localPrefix, tenant->prefix)) {
+                return false;
+            }
+        }
+        std::string name = tenant->name;
+        tenants.insert (std::make_pair (name, std::move (tenant)));
+        return true;
     }
 
+    /// Do keys under one prefix also fall under the other. Keyspace
+    /// patterns are prefix:*, so ev:* also matches every ev:a: key.
+    static bool overlaps (const std::string& a, const std::string& b) {
+        const std::string& shorter = a.size () <= b.size () ? a : b;
+        const std::string& longer = a.size () <= b.size () ? b : a;
+        if (longer.compare (0, shorter.size (), shorter) != 0) {
+            return false;
+        }
+        return longer.size () == shorter.size () || longer[shorter.size ()] == ':';
+    }
 };
 
 /// A connection represents a single client connected to the service.
 /// Connections are themselves stateless (out of necessity), and are mainly
 /// responsible for reading bytes off the wire and dispatching them
-/// appropriately.
+/// appropriately. Each connection is a coroutine that reads a query,
+/// answers it from Redis (or the caches) and writes the response, so a
+/// lookup reads top to bottom. Responses pushed for watched queries are
+/// written by the same coroutine, between queries.
 class Connection
-    : public std::enable_shared_from_this<Connection>
+    : public std::enable_shared_from_this<Connection>,
+      public hlv::service::common::ManagedConnection
 {
-  private:
-    typedef std::shared_ptr<hlv::service::lookup::server::Connection> ConnectionPtr;
   public:
+    typedef std::shared_ptr<hlv::service::lookup::server::Connection> ConnectionPtr;
+
     Connection (const Connection&) = delete;
     Connection& operator=(const Connection&) = delete;
     Connection () = delete;
     
     // Construct a Connection given a socket
-    explicit Connection (boost::asio::ip::tcp::socket socket, 
+    explicit Connection (hlv::service::common::StreamSocket socket, 
             hlv::service::common::ConnectionManager<ConnectionPtr>& manager,
             ConnectionInformation& config);
 
@@ -64,41 +168,108 @@ class Connection
     // Stop listening
     void stop ();
 
-    // Callback for Redis hgetall
-    void getSucceeded (redisReply* reply);  
+    // Have client decode replies to lookups into flat storage (see
+    // reply_decoder.h) rather than redisReply trees, lookups expect this
+    static void decode_replies (asio_redis::ManagedRedisClient& client);
 
-    // Callback for getting PERM bits for local query
-    void getPermFieldSucceeded (redisReply* reply);
-    
-    // Callback for getting PERM bits for local query
-    void smemberSucceeded (redisReply* reply);
+    // Callback for getting the version of the key being queried
+    void versionSucceeded (const asio_redis::FlatReply* reply);
+
+    // Send a response the client did not ask for (a change to a watched
+    // query). Safe to call at any point, the response is written once the
+    // query being answered (if any) has been.
+    void push_response (const ev_lookup::Response& response);
 
   private:
-    // Lookup set
-    void lookup_local_set ();
+    // Serve queries until the connection ends, as a coroutine
+    void serve (boost::asio::yield_context yield);
 
-    // Send failing response
-    void fail_request ();
+    // Parse a query and answer it into response_. False if the query
+    // could not be parsed and the connection should be closed.
+    bool handle_query (const char* data,
+                       size_t length,
+                       boost::asio::yield_context yield);
 
     // Global lookup
-    void global_lookup ();
+    void global_lookup (boost::asio::yield_context yield);
+
+    // Ask Redis for a global key
+    void query_global (boost::asio::yield_context yield);
 
     // Local lookup
-    void local_lookup ();
+    void local_lookup (boost::asio::yield_context yield);
 
-    // Listen for buffer
-    void read_size ();
+    // Ask Redis for the permission bits of a local key, then its values
+    void query_local (boost::asio::yield_context yield);
 
-    // Read buffer off the wire
-    void read_buffer (uint64_t length);
+    // Lookup set
+    void lookup_local_set (boost::asio::yield_context yield);
 
-    void write_response (const ev_lookup::Response&);
+    // The negative cache has not heard of the key: true if the query
+    // should be failed, false if it should go to Redis
+    bool confirm_missing (bool local, boost::asio::yield_context yield);
 
-    // Socket for this connection
-    boost::asio::ip::tcp::socket socket_;
+    // Send a GET for the version of the key being queried, pipelined ahead
+    // of the actual lookup (see versionSucceeded)
+    void get_version (const std::string& prefix);
+
+    // Set the version on response_, returns true if the client already has
+    // this version and should get a NOT_MODIFIED instead of values
+    bool set_version ();
 
-    // A temporary variable that holds the amount to be read
-    uint64_t bufferSize_;
+    // Turn Redis's replies into response_
+    void global_reply (const asio_redis::FlatReply* reply);
+    void local_reply (const asio_redis::FlatReply* reply);
+
+    // Check the local key's permission bits, false (with response_ set)
+    // if the query should not go on
+    bool local_permitted (const asio_redis::FlatReply* reply);
+
+    // Fail the current query
+    void fail_request ();
+
+    // Check the capability sent with query_ and use its permissions as the
+    // query's token. False if the query should be failed.
+    bool check_capability ();
+
+    // Answer from config_.stale, false if it has nothing for this query
+    bool serve_stale ();
+
+    // Redis could not answer (gone, or an error): answer from the stale
+    // cache if possible, fail otherwise
+    void redis_unavailable ();
+
+    // Keep a successful answer around for serve_stale
+    void remember (const ev_lookup::Response& response);
+
+    // Ask the admission controller to let the query go to Redis, false if
+    // it should be failed right away
+    bool admit ();
+
+    // Note that Redis failed the query (as opposed to finding nothing)
+    void redis_failed ();
+
+    // Give back the admission slot of the current query, if it has one
+    void release_admission ();
+
+    // Start or stop watching the current query
+    void start_watch ();
+    void stop_watch ();
+
+    // Write response_, the answer to the current query
+    bool write_response (boost::asio::yield_context yield);
+
+    // Write the responses pushed meanwhile
+    bool write_pushed (boost::asio::yield_context yield);
+
+    // Frame (and possibly compress) a serialized response into write_buffer_
+    // and write it
+    bool write_frame (const char* data,
+                      size_t size,
+                      boost::asio::yield_context yield);
+
+    // Socket for this connection
+    hlv::service::common::StreamSocket socket_;
 
     // Manage several connections
     hlv::service::common::ConnectionManager<ConnectionPtr>& manager_;
@@ -106,8 +277,53 @@ class Connection
     // Configuration
     const ConnectionInformation& config_;
 
-    // Buffer, expect never to need more than 128k
-    std::array<char, 131072> buffer_;
+    // Compression state for responses
+    ev::compression::FrameCompressor compressor_;
+
+    // Did the client ask for compressed responses
+    bool acceptCompressed_;
+
+    // Version of the key being looked up, and has Redis sent it. The
+    // coroutine waits for it even when the lookup is answered without it,
+    // as Redis holds a pointer to the connection until then.
+    uint64_t version_;
+    hlv::service::common::Pending<bool> versionRead_;
+
+    // Tenant the current query is for
+    Tenant* tenant_;
+
+    // Was the current query admitted to Redis, when, and did Redis fail it
+    bool admitted_;
+    hlv::service::common::AdmissionController::Clock::time_point admittedAt_;
+    bool redisFailed_;
+
+    // Has the negative cache caught up
+    hlv::service::common::Pending<bool> synced_;
+
+    // Has the connection been stopped
+    bool stopped_;
+
+    // Is the coroutine waiting for a query. Pushes cancel the read to be
+    // written.
+    bool reading_;
+
+    // Tenants this connection has watches with
+    std::set<Tenant*> watchedTenants_;
+
+    // Memory for the handler of the write in progress
+    hlv::service::common::HandlerMemory writeMemory_;
+
+    // Pushed responses waiting to be written, serialized
+    std::deque<std::string> pushed_;
+
+    // Space to serialize responses before compressing them
+    std::string scratch_;
+
+    // Redis commands are built here, keys under the tenant's prefixes
+    asio_redis::CommandBuilder command_;
+
+    // Queries off the wire, expect never to need more than 128k
+    hlv::service::common::FrameReader reader_;
     std::array<char, 131072> write_buffer_;
     ev_lookup::Query query_;
     ev_lookup::Response response_;
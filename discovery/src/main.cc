@@ -1,7 +1,10 @@
 // Copyright 20xx The Regents of the University of California
 // This is a test service for SDN-v2 High Level Virtualization
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <memory>
+#include <vector>
 #include <thread>
 #include <tuple>
 #include <signal.h>
@@ -10,27 +13,29 @@
 #include <boost/log/trivial.hpp>
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
-#include <hiredisasio.h>
+#include <managed_client.h>
 #include "consts.h"
 #include "logging_common.h"
 #include "lookup_server.h"
+#include "watch_manager.h"
+#include "negative_cache.h"
+#include "response_cache.h"
+#include "stats_reporter.h"
+#include "socket_handoff.h"
+#include "admission_controller.h"
+#include "capability.h"
 
 // Main file for EV lookup server
 namespace po = boost::program_options;
 namespace {
-void connectCallback (const redisAsyncContext* c, int status) {
-    if (status != REDIS_OK) {
-        std::cerr << "Error " << c->errstr << std::endl;
-        return;
-    }
-    BOOST_LOG_TRIVIAL (info) << "Connected with redis";
-}
-
-void disconnectCallback (const redisAsyncContext* c, int status) {
-    BOOST_LOG_TRIVIAL (info) << "Disconnected ";
-    if (status != REDIS_OK) {
-        std::cerr << "Disconnected due to error " << c->errstr << std::endl;
-    }
+// Report how a Redis connection is holding up
+void add_redis_metrics (hlv::service::common::StatsReporter& stats,
+                        const std::string& prefix,
+                        asio_redis::ManagedRedisClient& client) {
+    stats.add (prefix + "reconnects", [&client] () { return (double)client.reconnects (); });
+    stats.add (prefix + "replayed", [&client] () { return (double)client.replayed (); });
+    stats.add (prefix + "failed", [&client] () { return (double)client.failed (); });
+    stats.add (prefix + "buffered", [&client] () { return (double)client.buffered (); });
 }
 }
 
@@ -47,6 +52,21 @@ main (int argc, char* argv[]) {
                 prefix = hlv::service::lookup::REDIS_PREFIX,
                 lprefix;
     int32_t redisPort = hlv::service::lookup::REDIS_PORT;
+    size_t compressThreshold = ev::compression::DEFAULT_THRESHOLD;
+    size_t bloomKeys = 100000;
+    double bloomFp = 0.01;
+    uint32_t statsInterval = 60;
+    std::string handoffPath;
+    uint32_t drainSeconds = 30;
+    hlv::service::common::Timeouts timeouts (300, 30, 30);
+    uint32_t redisLimit = 1024;
+    double redisTolerance = 2.0;
+    double redisBuffer = 2.0;
+    size_t staleEntries = 10000;
+    uint32_t staleAge = 300;
+    std::vector<std::string> tenantSpecs;
+    std::vector<std::string> capabilityKeys;
+    std::string unixPath;
     desc.add_options()
         ("help,h", "Display help")
         ("address,a", po::value<std::string>(&address)->implicit_value("0.0.0.0"), "Bind to address")
@@ -54,8 +74,47 @@ main (int argc, char* argv[]) {
         ("raddress,r", po::value<std::string>(&redisAddress)->implicit_value("127.0.0.1"), "Redis server")
         ("rport", po::value<int32_t>(&redisPort)->implicit_value(6379), "Redis port")
         ("prefix,p", po::value<std::string>(&prefix), 
-                   "Prefix for redis DB")
-        ("lprefix,l", po::value<std::string>(&lprefix), "Local prefix to use for this lookup server");
+                   "Prefix for redis DB (default tenant)")
+        ("lprefix,l", po::value<std::string>(&lprefix), "Local prefix to use for this lookup server (default tenant)")
+        ("tenant,t", po::value<std::vector<std::string>>(&tenantSpecs)->composing(),
+                   "Also serve a named tenant, given as name,prefix,lprefix (repeatable)")
+        ("compress", po::value<size_t>(&compressThreshold)->implicit_value(compressThreshold), 
+                   "Compress responses at least this many bytes long (0 disables)")
+        ("bloom-keys", po::value<size_t>(&bloomKeys)->implicit_value(bloomKeys),
+                   "Size the negative lookup filter for this many keys (0 disables)")
+        ("bloom-fp", po::value<double>(&bloomFp)->implicit_value(bloomFp),
+                   "False positive rate for the negative lookup filter")
+        ("stats", po::value<uint32_t>(&statsInterval)->implicit_value(statsInterval),
+                   "Seconds between stats reports (0 disables)")
+        ("handoff", po::value<std::string>(&handoffPath),
+                   "Unix socket for hot restarts: take over the listening socket from the server on it, "
+                   "and hand ours to the next one")
+        ("drain", po::value<uint32_t>(&drainSeconds)->implicit_value(drainSeconds),
+                   "Seconds to wait for open connections after handing off")
+        ("idle-timeout", po::value<uint32_t>(&timeouts.idle)->implicit_value(timeouts.idle),
+                   "Close connections idle for this many seconds (0 disables)")
+        ("read-timeout", po::value<uint32_t>(&timeouts.read)->implicit_value(timeouts.read),
+                   "Close connections that take this many seconds to send a request (0 disables)")
+        ("write-timeout", po::value<uint32_t>(&timeouts.write)->implicit_value(timeouts.write),
+                   "Close connections that take this many seconds to read a response (0 disables)")
+        ("redis-limit", po::value<uint32_t>(&redisLimit)->implicit_value(redisLimit),
+                   "Most requests waiting on Redis at once, lowered automatically when Redis slows down (0 disables)")
+        ("redis-tolerance", po::value<double>(&redisTolerance)->implicit_value(redisTolerance),
+                   "Redis is taken to be overloaded once round trips are this many times the fastest seen")
+        ("redis-buffer", po::value<double>(&redisBuffer)->implicit_value(redisBuffer),
+                   "Seconds to hold lookups for while reconnecting to Redis")
+        ("stale-entries", po::value<size_t>(&staleEntries)->implicit_value(staleEntries),
+                   "Answers to remember for when Redis is unavailable (0 disables)")
+        ("stale-age", po::value<uint32_t>(&staleAge)->implicit_value(staleAge),
+                   "Seconds a remembered answer may be served for")
+        ("capability-key", po::value<std::vector<std::string>>(&capabilityKeys)->composing(),
+                   "Check capabilities sent with queries against the key in this file (repeatable)")
+        ("require-capability", "Fail queries sent without a capability")
+        ("unix", po::value<std::string>(&unixPath),
+                   "Also accept connections on a Unix domain socket at this path, "
+                   "for clients on this host")
+        ("io-uring", "Serve connections through io_uring rather than epoll "
+                   "(builds with HLV_IO_URING, Linux 5.19 or later)");
     po::options_description options;
     options.add(desc);
     po::variables_map vm;
@@ -68,66 +127,258 @@ main (int argc, char* argv[]) {
         return 0;
     }
 
-    if (!vm.count ("prefix")) {
-        std::cerr << "Cowardly failing to start without prefix (tenant ID)" << std::endl;
-        std::cerr << desc << std::endl;
-        return 0;
+    // Default tenant, for queries that do not name one
+    std::vector<std::tuple<std::string, std::string, std::string>> tenantList;
+    if (vm.count ("prefix") || vm.count ("lprefix")) {
+        if (!vm.count ("prefix")) {
+            std::cerr << "Cowardly failing to start without prefix (tenant ID)" << std::endl;
+            std::cerr << desc << std::endl;
+            return 0;
+        }
+
+        if (!vm.count ("lprefix")) {
+            std::cerr << "Cowardly failing to start without local prefix" << std::endl;
+            std::cerr << desc << std::endl;
+            return 0;
+        }
+        tenantList.push_back (std::make_tuple ("", prefix, lprefix));
     }
 
-    if (!vm.count ("lprefix")) {
-        std::cerr << "Cowardly failing to start without local prefix" << std::endl;
+    for (auto& spec : tenantSpecs) {
+        size_t first = spec.find (',');
+        size_t second = (first == std::string::npos) ?
+                            std::string::npos : spec.find (',', first + 1);
+        if (second == std::string::npos || first == 0 ||
+            second == first + 1 || second + 1 == spec.size ()) {
+            std::cerr << "Tenant should be name,prefix,lprefix not " << spec << std::endl;
+            return 0;
+        }
+        tenantList.push_back (std::make_tuple (spec.substr (0, first),
+                                               spec.substr (first + 1, second - first - 1),
+                                               spec.substr (second + 1)));
+    }
+
+    if (tenantList.empty ()) {
+        std::cerr << "Cowardly failing to start without prefix (tenant ID)" << std::endl;
         std::cerr << desc << std::endl;
         return 0;
     }
 
-    // Connect to Redis
-    redisAsyncContext *context = redisAsyncConnect (redisAddress.c_str(), redisPort);
-    if (!context) {
-        std::cerr << "Failed to allocate redis context" << std::endl;
+    // Create server
+    boost::asio::io_service io_service;
+
+    // Connect to Redis, reconnecting whenever the connection is lost
+    asio_redis::ManagedRedisClient client (io_service, redisAddress, redisPort);
+    client.set_buffering (std::chrono::milliseconds ((int64_t)(redisBuffer * 1000)), 10000);
+    if (!client.connect ()) {
+        std::cerr << "Failed to connect to redis instance " << client.errstr () << std::endl;
         return 0;
     }
 
-    if (context->err) {
-        std::cerr << "Failed to connect to redis instance " << context->errstr << std::endl;
+    // Subscriptions for watched queries need a Redis connection of their own
+    asio_redis::ManagedRedisClient watchClient (io_service, redisAddress, redisPort);
+    if (!watchClient.connect ()) {
+        std::cerr << "Failed to connect to redis instance " << watchClient.errstr () << std::endl;
         return 0;
-    }  
-
-    // Create server
-    boost::asio::io_service io_service;
+    }
 
-    asio_redis::redisBoostClient client (io_service, context);
+    // Lookups decode their replies without building redisReply trees
+    hlv::service::lookup::server::Connection::decode_replies (client);
     // Server information
     hlv::service::lookup::server::ConnectionInformation information 
                                                     (0, 
                                                      redisAddress,
                                                      redisPort,
-                                                     context,
-                                                     prefix,
-                                                     lprefix);
-    // Create a lookup server            
-    hlv::service::lookup::server::Server lookup (
-            io_service,
-            address,
-            port,
-            information);
-    lookup.start ();
-    redisAsyncSetConnectCallback (context, connectCallback);
-    redisAsyncSetDisconnectCallback (context, disconnectCallback);
+                                                     &client,
+                                                     io_service,
+                                                     compressThreshold);
+    hlv::service::common::StatsReporter stats (io_service, "lookup", statsInterval);
+    add_redis_metrics (stats, "redis.", client);
+    add_redis_metrics (stats, "redis.watch.", watchClient);
+
+    // Keep answering queries that were answered recently while Redis is
+    // away
+    std::unique_ptr<hlv::service::lookup::server::ResponseCache> staleCache;
+    if (staleEntries > 0) {
+        staleCache.reset (new hlv::service::lookup::server::ResponseCache (
+                                                        staleEntries,
+                                                        std::chrono::seconds (staleAge)));
+        staleCache->add_metrics (stats);
+        information.stale = staleCache.get ();
+    }
+
+    // Queries carrying a capability are checked here, against keys shared
+    // with the auth service
+    hlv::service::common::capability::Verifier capabilities;
+    for (auto& path : capabilityKeys) {
+        if (!capabilities.add_key_file (path)) {
+            std::cerr << "Could not read capability key from " << path << std::endl;
+            return 1;
+        }
+    }
+    if (!capabilities.empty ()) {
+        capabilities.add_metrics (stats);
+        information.capabilities = &capabilities;
+        information.requireCapability = vm.count ("require-capability") > 0;
+    } else if (vm.count ("require-capability")) {
+        std::cerr << "--require-capability needs a --capability-key" << std::endl;
+        return 1;
+    }
+
+    // Shed queries rather than queue them when Redis slows down or the
+    // connection to it is gone. Shed queries are answered from the stale
+    // cache where they can be.
+    std::unique_ptr<hlv::service::common::AdmissionController> admissionController;
+    if (redisLimit > 0) {
+        admissionController.reset (new hlv::service::common::AdmissionController (
+                                                        std::min<uint32_t> (8, redisLimit),
+                                                        redisLimit,
+                                                        redisTolerance));
+        admissionController->add_metrics (stats);
+        information.admission = admissionController.get ();
+        // Stop sending queries to a Redis connection that is gone
+        hlv::service::common::AdmissionController* admission = admissionController.get ();
+        client.on_connect ([admission] () { admission->connected (); });
+        client.on_disconnect ([admission] () { admission->disconnected (); });
+    }
+
+    // Tenants share both Redis connections, only per prefix state is
+    // per tenant
+    std::vector<std::unique_ptr<hlv::service::lookup::server::WatchManager>> watches;
+    std::vector<std::unique_ptr<hlv::service::lookup::server::NegativeCache>> negativeCaches;
+    for (auto& spec : tenantList) {
+        const std::string& name = std::get<0> (spec);
+        const std::string& tprefix = std::get<1> (spec);
+        const std::string& tlprefix = std::get<2> (spec);
+        watches.emplace_back (new hlv::service::lookup::server::WatchManager (
+                                                        &watchClient,
+                                                        &client,
+                                                        0,
+                                                        tprefix,
+                                                        tlprefix));
+        hlv::service::lookup::server::WatchManager* tenantWatches = watches.back ().get ();
+        hlv::service::lookup::server::NegativeCache* negativeCache = nullptr;
+        if (bloomKeys > 0) {
+            negativeCaches.emplace_back (new hlv::service::lookup::server::NegativeCache (
+                                                        &watchClient,
+                                                        &client,
+                                                        tprefix,
+                                                        tlprefix,
+                                                        bloomKeys,
+                                                        bloomFp));
+            negativeCache = negativeCaches.back ().get ();
+        }
+        std::unique_ptr<hlv::service::lookup::server::Tenant> tenant (
+                new hlv::service::lookup::server::Tenant (name,
+                                                          tprefix,
+                                                          tlprefix,
+                                                          tenantWatches,
+                                                          negativeCache));
+        hlv::service::lookup::server::Tenant* t = tenant.get ();
+        if (!information.add_tenant (std::move (tenant))) {
+            std::cerr << "Tenant " << name << " (" << tprefix << ", " << tlprefix
+                      << ") clashes with another tenant" << std::endl;
+            return 0;
+        }
+
+        std::string metric = "tenant." + (name.empty () ? std::string ("default") : name) + ".";
+        stats.add (metric + "queries", [t] () { return (double)t->queries; });
+        stats.add (metric + "failures", [t] () { return (double)t->failures; });
+        stats.add (metric + "response_bytes", [t] () { return (double)t->responseBytes; });
+        stats.add (metric + "watched", [t] () { return (double)t->watches->watched (); });
+        stats.add (metric + "memory", [t] () {
+            return (double)(sizeof(*t) + t->watches->memory () +
+                            (t->negativeCache ? t->negativeCache->memory () : 0));
+        });
+        if (negativeCache) {
+            negativeCache->add_metrics (stats, metric);
+        }
+        BOOST_LOG_TRIVIAL (info) << "Serving tenant '" << name << "' prefix " << tprefix
+                                 << " local prefix " << tlprefix;
+    }
+    // Create a lookup server, on the listening socket of the server being
+    // replaced if there is one
+    std::unique_ptr<hlv::service::lookup::server::Server> lookup;
+    std::vector<int> inherited;
+    if (!handoffPath.empty () &&
+        hlv::service::common::handoff::take_over (handoffPath, inherited)) {
+        lookup.reset (new hlv::service::lookup::server::Server (
+                io_service,
+                inherited[0],
+                information));
+    } else {
+        lookup.reset (new hlv::service::lookup::server::Server (
+                io_service,
+                address,
+                port,
+                information));
+    }
+    lookup->set_timeouts (timeouts);
+    // A Unix domain socket comes second, if the server being replaced had
+    // one (at the same path, as long as --unix did not change)
+    if (!unixPath.empty ()) {
+        if (inherited.size () > 1) {
+            lookup->adopt_unix (inherited[1]);
+        } else {
+            lookup->listen_unix (unixPath);
+        }
+    } else if (inherited.size () > 1) {
+        close (inherited[1]);
+    }
+    if (vm.count ("io-uring") &&
+        !lookup->set_backend (hlv::service::common::Backend::IO_URING)) {
+        std::cerr << "io_uring is not available" << std::endl;
+        return 1;
+    }
+    lookup->start ();
+    for (auto& negativeCache : negativeCaches) {
+        negativeCache->start ();
+    }
+    stats.start ();
     boost::asio::signal_set signals (io_service);
     signals.add (SIGINT);
     signals.add (SIGTERM);
 #if defined(SIGQUIT)
     signals.add (SIGQUIT);
 #endif
-    signals.async_wait ([&](boost::system::error_code, int) {
-        std::cout << "Quitting" << std::endl;
-        lookup.stop ();
+    boost::asio::deadline_timer drainTimer (io_service);
+    auto shutdown = [&] () {
+        drainTimer.cancel ();
+        lookup->stop ();
+        stats.stop ();
         client.stop ();
+        watchClient.stop ();
         io_service.stop ();
+    };
+
+    // Hand the listening sockets to a restarted server, then finish the
+    // requests already in flight
+    hlv::service::common::handoff::Listener handoff (
+            io_service,
+            handoffPath,
+            [&] () { return lookup->native_handles (); },
+            [&] () {
+                lookup->stop_accepting ();
+                hlv::service::common::handoff::drain (
+                        drainTimer,
+                        *lookup,
+                        boost::posix_time::microsec_clock::universal_time () +
+                            boost::posix_time::seconds (drainSeconds),
+                        shutdown);
+            });
+    if (!handoffPath.empty ()) {
+        handoff.start ();
+    }
+
+    signals.async_wait ([&](boost::system::error_code, int) {
+        std::cout << "Quitting" << std::endl;
+        handoff.stop ();
+        shutdown ();
     });
     // This thread now provides I/O service
     io_service.run();
-    redisAsyncDisconnect (context);
+    client.disconnect ();
+    watchClient.disconnect ();
     google::protobuf::ShutdownProtobufLibrary();
     return 0;
 
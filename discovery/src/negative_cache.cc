@@ -0,0 +1,441 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <boost/log/trivial.hpp>
+#include <managed_client.h>
+#include "negative_cache.h"
+#include "consts.h"
+
+namespace {
+typedef hlv::service::lookup::server::NegativeCache NegativeCache;
+
+// Rebuild once this fraction of the keys in a filter have been deleted
+const double STALE_FRACTION = 0.25;
+
+// Keys asked for by each SCAN call
+const char* SCAN_COUNT = "1000";
+
+// Subscriptions made by psubscribe: the fence channel and both prefixes
+const int SUBSCRIPTIONS = 3;
+
+// Callback for keyspace notifications
+void notificationCallback (redisAsyncContext* context, void* reply, void* data) {
+    if (!reply) {
+        return;
+    }
+    NegativeCache* cache = (NegativeCache*)data;
+    cache->notified ((redisReply*)reply);
+}
+
+// Callback for SCAN
+void scanCallback (redisAsyncContext* context, void* reply, void* data) {
+    NegativeCache::Filter* filter = (NegativeCache::Filter*)data;
+    filter->cache->scanned (filter, (redisReply*)reply);
+}
+
+// Callback for PUBLISH of a fence
+void publishCallback (redisAsyncContext* context, void* reply, void* data) {
+    NegativeCache* cache = (NegativeCache*)data;
+    cache->published ((redisReply*)reply);
+}
+
+// Name for a channel no other lookup server publishes fences on
+std::string fence_channel (const std::string& prefix) {
+    std::random_device random;
+    return "ev:fence:" + prefix + ":" + std::to_string (random ()) +
+           std::to_string (random ());
+}
+
+// Does str end with suffix
+bool ends_with (const std::string& str, const std::string& suffix) {
+    return str.size () >= suffix.size () &&
+           str.compare (str.size () - suffix.size (), suffix.size (), suffix) == 0;
+}
+}
+
+namespace hlv {
+namespace service{
+namespace lookup {
+namespace server {
+NegativeCache::Filter::Filter (NegativeCache* _cache,
+                               bool _local,
+                               const std::string& _prefix,
+                               const std::string& _pattern) :
+    cache (_cache),
+    local (_local),
+    prefix (_prefix + ":"),
+    pattern (_pattern),
+    // Both filters are sized by rebuild
+    filter (1, 0.5),
+    building (1, 0.5),
+    ready (false),
+    scanning (false),
+    rescan (false),
+    scanned (0),
+    capacity (0),
+    deletes (0),
+    avoided (0),
+    passed (0),
+    passedEmpty (0) {
+}
+
+NegativeCache::NegativeCache (asio_redis::ManagedRedisClient* subscribeClient,
+                              asio_redis::ManagedRedisClient* queryClient,
+                              const std::string& prefix,
+                              const std::string& localPrefix,
+                              size_t expected,
+                              double fpRate,
+                              const uint32_t database) :
+    subscribeClient_ (subscribeClient),
+    queryClient_ (queryClient),
+    channelPrefix_ ("__keyspace@" + std::to_string (database) + "__:"),
+    expected_ (expected),
+    fpRate_ (fpRate),
+    global_ (this, false, prefix, channelPrefix_ + prefix + ":*"),
+    local_ (this, true, localPrefix, channelPrefix_ + localPrefix + ":*"),
+    fenceChannel_ (fence_channel (prefix)),
+    fenceSeq_ (0),
+    fencing_ (false),
+    confirmed_ (0),
+    fenceConfirmed_ (false),
+    caughtUp_ (false) {
+}
+
+void NegativeCache::start () {
+    subscribeClient_->on_connect ([this] () { psubscribe (); });
+    subscribeClient_->on_disconnect ([this] () { subscriptions_lost (); });
+    if (subscribeClient_->connected ()) {
+        psubscribe ();
+    }
+}
+
+void NegativeCache::psubscribe () {
+    confirmed_ = 0;
+    caughtUp_ = false;
+    // Subscribed first, so that it is in place by the time a filter is
+    // built and a miss can need a fence
+    subscribeClient_->subscribe (notificationCallback,
+                                 this,
+                                 "SUBSCRIBE %s",
+                                 fenceChannel_.c_str ());
+    // Filters are built once the subscription is confirmed, so that no
+    // write can fall between the SCAN and the first notification.
+    for (Filter* filter : {&global_, &local_}) {
+        subscribeClient_->subscribe (notificationCallback,
+                                     this,
+                                     "PSUBSCRIBE %s",
+                                     filter->pattern.c_str ());
+    }
+}
+
+void NegativeCache::subscriptions_lost () {
+    confirmed_ = 0;
+    caughtUp_ = false;
+    for (Filter* filter : {&global_, &local_}) {
+        BOOST_LOG_TRIVIAL (info) << "Negative cache for " << filter->prefix
+                                 << " unusable until Redis is back";
+        filter->ready = false;
+        if (filter->scanning) {
+            filter->rescan = true;
+        }
+    }
+    // Fences cannot come back on a connection that is gone
+    if (fencing_) {
+        fenced (false);
+    }
+}
+
+void NegativeCache::subscription_confirmed () {
+    if (++confirmed_ < SUBSCRIPTIONS) {
+        return;
+    }
+    // Catch up now rather than on the first miss. A fence in flight was
+    // published too early to count, fenced starts another.
+    if (!fencing_) {
+        fence ();
+    }
+}
+
+bool NegativeCache::may_exist (const std::string& key, bool local) {
+    Filter& filter = local ? local_ : global_;
+    if (!filter.ready) {
+        return true;
+    }
+    if (filter.filter.maybe_contains (key)) {
+        filter.passed++;
+        return true;
+    }
+    filter.avoided++;
+    return false;
+}
+
+void NegativeCache::sync (std::function<void (bool)> done) {
+    waiting_.push_back (std::move (done));
+    if (!fencing_) {
+        fence ();
+    }
+}
+
+void NegativeCache::fence () {
+    fencing_ = true;
+    fenceConfirmed_ = confirmed_ == SUBSCRIPTIONS;
+    fenceSeq_++;
+    fenced_.swap (waiting_);
+    publishing_.push_back (fenceSeq_);
+    // Not buffered when Redis is away: a fence published after a reconnect
+    // says nothing about what was missed meanwhile
+    queryClient_->write (publishCallback,
+                         this,
+                         "PUBLISH %s %s",
+                         fenceChannel_.c_str (),
+                         std::to_string (fenceSeq_).c_str ());
+}
+
+void NegativeCache::published (redisReply* reply) {
+    if (publishing_.empty ()) {
+        return;
+    }
+    uint64_t seq = publishing_.front ();
+    publishing_.pop_front ();
+    // Nobody got it, so it is never coming back
+    bool lost = !reply || reply->type != REDIS_REPLY_INTEGER ||
+                reply->integer == 0;
+    if (lost && fencing_ && seq == fenceSeq_) {
+        BOOST_LOG_TRIVIAL (info) << "Fence lost, asking Redis instead";
+        fenced (false);
+    }
+}
+
+void NegativeCache::fenced (bool synced) {
+    fencing_ = false;
+    if (synced && fenceConfirmed_) {
+        if (!caughtUp_) {
+            BOOST_LOG_TRIVIAL (info) << "Negative cache caught up, answering "
+                                     << "misses without a fence";
+        }
+        caughtUp_ = true;
+    }
+    std::vector<std::function<void (bool)>> done;
+    done.swap (fenced_);
+    for (auto& callback : done) {
+        callback (synced);
+    }
+    // Callbacks can start lookups that sync (and so fence) themselves, and
+    // the subscriptions may have been confirmed while this was in flight
+    bool catchUp = synced && !caughtUp_ && confirmed_ == SUBSCRIPTIONS;
+    if (!fencing_ && (!waiting_.empty () || catchUp)) {
+        fence ();
+    }
+}
+
+void NegativeCache::missed (bool local) {
+    Filter& filter = local ? local_ : global_;
+    if (filter.ready) {
+        filter.passedEmpty++;
+    }
+}
+
+bool NegativeCache::client_key (const Filter* filter,
+                                const char* key,
+                                size_t length,
+                                std::string& out) const {
+    if (length <= filter->prefix.size () ||
+        memcmp (key, filter->prefix.data (), filter->prefix.size ()) != 0) {
+        return false;
+    }
+    out.assign (key + filter->prefix.size (), length - filter->prefix.size ());
+    // Version keys stay around after the key is deleted
+    if (ends_with (out, "." + hlv::service::lookup::VERSION_KEY)) {
+        return false;
+    }
+    // Local lookups are for the key, not the set that holds its values
+    std::string setSuffix = "." + hlv::service::lookup::LOCAL_SET;
+    if (filter->local && ends_with (out, setSuffix)) {
+        out.resize (out.size () - setSuffix.size ());
+    }
+    return true;
+}
+
+void NegativeCache::notified (redisReply* reply) {
+    if (reply->type != REDIS_REPLY_ARRAY || reply->elements < 3 ||
+        reply->element[0]->type != REDIS_REPLY_STRING) {
+        return;
+    }
+    std::string kind (reply->element[0]->str);
+    // [subscribe, channel, count] once the fence channel is subscribed to
+    if (kind == "subscribe") {
+        if (fenceChannel_.compare (0, std::string::npos, reply->element[1]->str,
+                                   reply->element[1]->len) == 0) {
+            subscription_confirmed ();
+        }
+        return;
+    }
+    // [message, channel, payload] for fences
+    if (kind == "message" && reply->elements == 3 &&
+        fenceChannel_.compare (0, std::string::npos, reply->element[1]->str,
+                               reply->element[1]->len) == 0) {
+        if (fencing_ && std::to_string (fenceSeq_) == reply->element[2]->str) {
+            fenced (true);
+        }
+        return;
+    }
+    std::string pattern (reply->element[1]->str, reply->element[1]->len);
+    Filter* filter = (pattern == global_.pattern) ? &global_ :
+                     (pattern == local_.pattern) ? &local_ : nullptr;
+    if (!filter) {
+        return;
+    }
+    if (kind == "psubscribe") {
+        BOOST_LOG_TRIVIAL (info) << "Building negative cache for "
+                                 << filter->prefix;
+        rebuild (filter);
+        subscription_confirmed ();
+        return;
+    }
+    // [pmessage, pattern, channel, event]
+    if (kind != "pmessage" || reply->elements != 4) {
+        return;
+    }
+    const redisReply* channel = reply->element[2];
+    if ((size_t)channel->len < channelPrefix_.size ()) {
+        return;
+    }
+    std::string key;
+    if (!client_key (filter,
+                     channel->str + channelPrefix_.size (),
+                     channel->len - channelPrefix_.size (),
+                     key)) {
+        return;
+    }
+    std::string event (reply->element[3]->str);
+    if (event == "del" || event == "expired" || event == "evicted") {
+        filter->deletes++;
+        if (filter->ready && !filter->scanning &&
+            filter->deletes > STALE_FRACTION * std::max<uint64_t> (filter->scanned, 1024)) {
+            BOOST_LOG_TRIVIAL (info) << "Negative cache for " << filter->prefix
+                                     << " has too many deleted keys, rebuilding";
+            rebuild (filter);
+        }
+        return;
+    }
+    // Anything else may have created the key. Skipping keys that are
+    // already there keeps inserted () close to the number of distinct keys.
+    if (filter->scanning) {
+        filter->building.insert (key);
+    }
+    if (filter->filter.maybe_contains (key)) {
+        return;
+    }
+    filter->filter.insert (key);
+    if (filter->ready && filter->filter.inserted () > filter->capacity) {
+        BOOST_LOG_TRIVIAL (info) << "Negative cache for " << filter->prefix
+                                 << " is full, rebuilding";
+        rebuild (filter);
+    }
+}
+
+void NegativeCache::rebuild (Filter* filter) {
+    if (filter->scanning) {
+        return;
+    }
+    // Leave room to grow past the current count
+    size_t size = std::max<size_t> (expected_, 2 * filter->filter.inserted ());
+    filter->building = ev::filter::BloomFilter (size, fpRate_);
+    filter->capacity = size;
+    filter->scanning = true;
+    filter->deletes = 0;
+    scan (filter, "0");
+}
+
+void NegativeCache::scan (Filter* filter, const char* cursor) {
+    std::string match = filter->prefix + "*";
+    queryClient_->read (scanCallback,
+                        filter,
+                        "SCAN %s MATCH %s COUNT %s",
+                        cursor,
+                        match.c_str (),
+                        SCAN_COUNT);
+}
+
+void NegativeCache::scanned (Filter* filter, redisReply* reply) {
+    // SCAN replies with [next cursor, [keys]]
+    if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 ||
+        reply->element[0]->type != REDIS_REPLY_STRING ||
+        reply->element[1]->type != REDIS_REPLY_ARRAY) {
+        BOOST_LOG_TRIVIAL (error) << "SCAN failed, negative cache for "
+                                  << filter->prefix << " not updated";
+        filter->scanning = false;
+        filter->rescan = false;
+        filter->building = ev::filter::BloomFilter (1, 0.5);
+        return;
+    }
+    std::string key;
+    const redisReply* keys = reply->element[1];
+    for (size_t i = 0; i < keys->elements; i++) {
+        if (client_key (filter, keys->element[i]->str, keys->element[i]->len, key)) {
+            filter->building.insert (key);
+        }
+    }
+    if (strcmp (reply->element[0]->str, "0") != 0) {
+        scan (filter, reply->element[0]->str);
+        return;
+    }
+    if (filter->rescan) {
+        filter->rescan = false;
+        filter->scanning = false;
+        rebuild (filter);
+        return;
+    }
+    // Done, serve from the new filter and let go of the old one
+    filter->filter.swap (filter->building);
+    filter->building = ev::filter::BloomFilter (1, 0.5);
+    filter->scanned = filter->filter.inserted ();
+    filter->scanning = false;
+    filter->ready = true;
+    BOOST_LOG_TRIVIAL (info) << "Negative cache for " << filter->prefix
+                             << " holds " << filter->scanned << " keys in "
+                             << filter->filter.memory () << " bytes";
+}
+
+size_t NegativeCache::memory () const {
+    size_t bytes = 0;
+    for (const Filter* filter : {&global_, &local_}) {
+        bytes += filter->filter.memory () + filter->building.memory ();
+    }
+    return bytes;
+}
+
+void NegativeCache::add_metrics (hlv::service::common::StatsReporter& stats,
+                                 const std::string& prefix) {
+    for (Filter* filter : {&global_, &local_}) {
+        std::string name = prefix +
+                           (filter->local ? "bloom.local." : "bloom.global.");
+        stats.add (name + "memory", [filter] () {
+            return (double)(filter->filter.memory () + filter->building.memory ());
+        });
+        stats.add (name + "keys", [filter] () {
+            return (double)filter->filter.inserted ();
+        });
+        stats.add (name + "estimated_fp", [filter] () {
+            return filter->filter.estimated_fp_rate ();
+        });
+        // Of the lookups for keys that were not there, how many did the
+        // filter let through
+        stats.add (name + "observed_fp", [filter] () {
+            uint64_t negatives = filter->passedEmpty + filter->avoided;
+            return negatives ? (double)filter->passedEmpty / negatives : 0.0;
+        });
+        stats.add (name + "avoided", [filter] () {
+            return (double)filter->avoided;
+        });
+        stats.add (name + "passed", [filter] () {
+            return (double)filter->passed;
+        });
+    }
+}
+} // namespace server
+} // namespace lookup
+} // namespace service
+} // namespace hlv
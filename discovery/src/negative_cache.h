@@ -0,0 +1,196 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include "bloom_filter.h"
+#include "stats_reporter.h"
+#ifndef _HLV_LOOKUP_NEGATIVE_CACHE_H_
+#define _HLV_LOOKUP_NEGATIVE_CACHE_H_
+namespace asio_redis {
+class ManagedRedisClient;
+}
+namespace hlv {
+namespace service{
+namespace lookup {
+namespace server {
+
+/// Answers "definitely not there" for keys that do not exist, without going
+/// to Redis. Keeps a Bloom filter of the keys under the global and the local
+/// prefix. Each filter is filled by a SCAN at startup and kept current from
+/// keyspace notifications, so it sees writes made by the coordinator and
+/// the edge boxes.
+///
+/// Bloom filters cannot forget, so deleted keys stay in the filter (costing
+/// a Redis lookup each, as before) until the filter is rebuilt by another
+/// SCAN. A rebuild happens once enough keys have been deleted, or when the
+/// filter holds more keys than it was sized for. Until the first SCAN is
+/// complete every key is let through. The same goes after the subscribe
+/// connection is lost, as keys created meanwhile were not notified: the
+/// filters are rebuilt once it is back.
+///
+/// Right after (re)subscribing the filter may not have heard of writes made
+/// just before the subscriptions took effect, so a miss is only final once
+/// the filter has caught up with Redis (sync): the cache publishes a fence
+/// on a channel of its own, and as Redis sends a subscriber messages in the
+/// order it published them, every write made before the fence has been
+/// notified once the fence comes back. Lookups waiting at the same time
+/// share a fence. Once a fence published after every subscription was
+/// confirmed has come back, notifications keep the filter current and
+/// misses are answered straight away (caught_up) until the subscribe
+/// connection is lost again.
+class NegativeCache {
+  public:
+    /// State for one prefix
+    struct Filter {
+        NegativeCache* cache;
+        bool local;
+        std::string prefix;
+        std::string pattern;
+        // Filter lookups are answered from
+        ev::filter::BloomFilter filter;
+        // Filter being filled by a SCAN, swapped in when it is done
+        ev::filter::BloomFilter building;
+        // Has a SCAN completed
+        bool ready;
+        bool scanning;
+        // Notifications were missed during the SCAN, start over once done
+        bool rescan;
+        // Keys found by the last complete SCAN
+        uint64_t scanned;
+        // Keys the filter was sized for
+        uint64_t capacity;
+        // Keys deleted since the last complete SCAN
+        uint64_t deletes;
+        // Lookups answered from the filter
+        uint64_t avoided;
+        // Lookups let through
+        uint64_t passed;
+        // Lookups let through that found nothing. Includes deleted keys,
+        // so this is an upper bound on false positives.
+        uint64_t passedEmpty;
+
+        Filter (NegativeCache* _cache,
+                bool _local,
+                const std::string& _prefix,
+                const std::string& _pattern);
+    };
+
+    NegativeCache () = delete;
+    NegativeCache (const NegativeCache&) = delete;
+    NegativeCache& operator= (const NegativeCache&) = delete;
+
+    /// subscribeClient: Redis connection in subscribe mode (may be shared
+    ///                  with WatchManager)
+    /// queryClient: Redis connection used for SCAN
+    /// expected: keys each filter is sized for at first
+    /// fpRate: false positive rate wanted at that size
+    /// database: Redis database the keys live in
+    NegativeCache (asio_redis::ManagedRedisClient* subscribeClient,
+                   asio_redis::ManagedRedisClient* queryClient,
+                   const std::string& prefix,
+                   const std::string& localPrefix,
+                   size_t expected,
+                   double fpRate,
+                   const uint32_t database = 0);
+
+    /// Subscribe to changes and start filling the filters
+    void start ();
+
+    /// Could key exist, as far as the filter knows. False means the lookup
+    /// can be failed once sync says the filter is current.
+    bool may_exist (const std::string& key, bool local);
+
+    /// Have the filters seen every notification since the subscriptions
+    /// were confirmed. If so a miss is final without a sync.
+    bool caught_up () const {
+        return caughtUp_;
+    }
+
+    /// Call done (true) once the filters have seen every write Redis made
+    /// before now, or done (false) if that cannot be known (e.g., Redis is
+    /// gone) and the lookup should go to Redis instead.
+    void sync (std::function<void (bool)> done);
+
+    /// A lookup that was let through found nothing
+    void missed (bool local);
+
+    /// Bytes used by the filters
+    size_t memory () const;
+
+    /// Register memory and false positive metrics, names start with prefix
+    void add_metrics (hlv::service::common::StatsReporter& stats,
+                      const std::string& prefix = "");
+
+    // Callback for keyspace notifications
+    void notified (redisReply* reply);
+
+    // Callback for SCAN
+    void scanned (Filter* filter, redisReply* reply);
+
+    // Callback for the PUBLISH of a fence
+    void published (redisReply* reply);
+
+  private:
+    // Subscribe to changes under both prefixes
+    void psubscribe ();
+
+    // The subscribe connection went away, stop trusting the filters
+    void subscriptions_lost ();
+
+    // Redis confirmed one of the subscriptions made by psubscribe
+    void subscription_confirmed ();
+
+    // Start a SCAN to rebuild a filter
+    void rebuild (Filter* filter);
+
+    // Continue a SCAN from cursor
+    void scan (Filter* filter, const char* cursor);
+
+    // Publish a fence for the lookups waiting on one
+    void fence ();
+
+    // The fence in flight came back (synced) or was lost
+    void fenced (bool synced);
+
+    // Turn a Redis key into the key clients look up. Returns false for keys
+    // that are not looked up (version keys).
+    bool client_key (const Filter* filter,
+                     const char* key,
+                     size_t length,
+                     std::string& out) const;
+
+    asio_redis::ManagedRedisClient* subscribeClient_;
+    asio_redis::ManagedRedisClient* queryClient_;
+    const std::string channelPrefix_;
+    const size_t expected_;
+    const double fpRate_;
+    Filter global_;
+    Filter local_;
+
+    // Channel fences are published on, unique to this cache
+    const std::string fenceChannel_;
+    // Last fence published, and is it in flight
+    uint64_t fenceSeq_;
+    bool fencing_;
+    // Subscriptions Redis confirmed since the last (re)subscribe
+    int confirmed_;
+    // Was the fence in flight published after all of them were confirmed
+    bool fenceConfirmed_;
+    // Has such a fence come back since
+    bool caughtUp_;
+    // Fences published whose PUBLISH has not been answered, in order
+    std::deque<uint64_t> publishing_;
+    // Lookups waiting on the fence in flight, and on the next one
+    std::vector<std::function<void (bool)>> fenced_;
+    std::vector<std::function<void (bool)>> waiting_;
+};
+} // namespace server
+} // namespace lookup
+} // namespace service
+} // namespace hlv
+#endif
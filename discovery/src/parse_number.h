@@ -0,0 +1,37 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <cstddef>
+#include <cstdint>
+#ifndef _HLV_LOOKUP_PARSE_NUMBER_H_
+#define _HLV_LOOKUP_PARSE_NUMBER_H_
+namespace hlv {
+namespace service{
+namespace lookup {
+namespace server {
+
+/// Parse a decimal integer straight out of a Redis reply (which need not
+/// be NUL terminated), false if it is not one. Never throws, so it is safe
+/// to use in hiredis callbacks.
+inline bool parse_u64 (const char* str, size_t length, uint64_t& out) {
+    if (length == 0 || length > 20) {
+        return false;
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (str[i] < '0' || str[i] > '9') {
+            return false;
+        }
+        uint64_t digit = str[i] - '0';
+        if (value > (UINT64_MAX - digit) / 10) {
+            return false;
+        }
+        value = value * 10 + digit;
+    }
+    out = value;
+    return true;
+}
+} // namespace server
+} // namespace lookup
+} // namespace service
+} // namespace hlv
+#endif
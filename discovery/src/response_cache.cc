@@ -0,0 +1,78 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <iterator>
+#include "response_cache.h"
+
+namespace hlv {
+namespace service{
+namespace lookup {
+namespace server {
+ResponseCache::ResponseCache (size_t capacity, Clock::duration maxAge) :
+    capacity_ (capacity),
+    maxAge_ (maxAge),
+    hits_ (0),
+    misses_ (0) {
+}
+
+void ResponseCache::make_key (const std::string& tenant,
+                              const ev_lookup::Query& query) {
+    key_.assign (tenant);
+    key_.push_back ('\0');
+    key_.push_back (query.type () == ev_lookup::Query::LOCAL ? 'L' : 'G');
+    uint64_t token = query.token ();
+    key_.append ((const char*)&token, sizeof (token));
+    key_.append (query.querystring ());
+}
+
+void ResponseCache::store (const std::string& tenant,
+                           const ev_lookup::Query& query,
+                           const ev_lookup::Response& response) {
+    if (capacity_ == 0) {
+        return;
+    }
+    make_key (tenant, query);
+    auto it = index_.find (key_);
+    if (it != index_.end ()) {
+        entries_.splice (entries_.begin (), entries_, it->second);
+    } else if (index_.size () >= capacity_) {
+        // Reuse the oldest entry
+        Entries::iterator oldest = std::prev (entries_.end ());
+        index_.erase (oldest->key);
+        oldest->key = key_;
+        entries_.splice (entries_.begin (), entries_, oldest);
+        index_.insert (std::make_pair (key_, entries_.begin ()));
+    } else {
+        entries_.push_front (Entry ());
+        entries_.front ().key = key_;
+        index_.insert (std::make_pair (key_, entries_.begin ()));
+    }
+    Entry& entry = entries_.front ();
+    response.SerializeToString (&entry.response);
+    entry.stored = Clock::now ();
+}
+
+bool ResponseCache::fetch (const std::string& tenant,
+                           const ev_lookup::Query& query,
+                           ev_lookup::Response& response) {
+    make_key (tenant, query);
+    auto it = index_.find (key_);
+    if (it == index_.end () ||
+        Clock::now () - it->second->stored > maxAge_ ||
+        !response.ParseFromString (it->second->response)) {
+        misses_++;
+        return false;
+    }
+    hits_++;
+    return true;
+}
+
+void ResponseCache::add_metrics (hlv::service::common::StatsReporter& stats,
+                                 const std::string& prefix) {
+    stats.add (prefix + "stale.entries", [this] () { return (double)size (); });
+    stats.add (prefix + "stale.hits", [this] () { return (double)hits_; });
+    stats.add (prefix + "stale.misses", [this] () { return (double)misses_; });
+}
+} // namespace server
+} // namespace lookup
+} // namespace service
+} // namespace hlv
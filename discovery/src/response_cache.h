@@ -0,0 +1,75 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <chrono>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include "lookup.pb.h"
+#include "stats_reporter.h"
+#ifndef _HLV_LOOKUP_RESPONSE_CACHE_H_
+#define _HLV_LOOKUP_RESPONSE_CACHE_H_
+namespace hlv {
+namespace service{
+namespace lookup {
+namespace server {
+
+/// The last successful answer to recently made queries, kept so lookups can
+/// still be answered (with possibly stale values) while Redis cannot be
+/// reached. Entries are per tenant, query type, token and key, so a client
+/// is only ever given an answer that was given to the same token. Least
+/// recently stored entries are dropped first.
+class ResponseCache {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    ResponseCache () = delete;
+    ResponseCache (const ResponseCache&) = delete;
+    ResponseCache& operator= (const ResponseCache&) = delete;
+
+    /// capacity: most answers kept
+    /// maxAge: answers older than this are never served
+    ResponseCache (size_t capacity, Clock::duration maxAge);
+
+    /// Remember the answer to query (for tenant)
+    void store (const std::string& tenant,
+                const ev_lookup::Query& query,
+                const ev_lookup::Response& response);
+
+    /// Fill response with the last answer to query, false if there is none
+    /// or it is too old
+    bool fetch (const std::string& tenant,
+                const ev_lookup::Query& query,
+                ev_lookup::Response& response);
+
+    size_t size () const { return index_.size (); }
+
+    /// Register hit, miss and size metrics, names start with prefix
+    void add_metrics (hlv::service::common::StatsReporter& stats,
+                      const std::string& prefix = "");
+
+  private:
+    struct Entry {
+        std::string key;
+        std::string response;
+        Clock::time_point stored;
+    };
+    typedef std::list<Entry> Entries;
+
+    // Build the key for query in key_
+    void make_key (const std::string& tenant, const ev_lookup::Query& query);
+
+    const size_t capacity_;
+    const Clock::duration maxAge_;
+    // Most recently stored first
+    Entries entries_;
+    std::unordered_map<std::string, Entries::iterator> index_;
+    // Reused to build keys
+    std::string key_;
+    uint64_t hits_;
+    uint64_t misses_;
+};
+} // namespace server
+} // namespace lookup
+} // namespace service
+} // namespace hlv
+#endif
@@ -0,0 +1,429 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <algorithm>
+#include <cstring>
+#include <boost/log/trivial.hpp>
+#include <managed_client.h>
+#include "watch_manager.h"
+#include "lookup_connection.h"
+#include "parse_number.h"
+#include "consts.h"
+
+namespace {
+typedef hlv::service::lookup::server::WatchManager WatchManager;
+
+// Callback for keyspace notifications on the subscribe context
+void notificationCallback (redisAsyncContext* context, void* reply, void* data) {
+    if (!reply) {
+        return;
+    }
+    WatchManager* manager = (WatchManager*)data;
+    manager->notified ((redisReply*)reply);
+}
+
+// Callback for HGETALL of a watched global key
+void globalRefreshCallback (redisAsyncContext* context, void* reply, void* data) {
+    WatchManager::Watched* watched = (WatchManager::Watched*)data;
+    WatchManager* manager = watched->manager;
+    manager->globalRefreshed (watched, (redisReply*)reply);
+}
+
+// Callback for HGET of a watched local key's permission bits
+void localPermRefreshCallback (redisAsyncContext* context, void* reply, void* data) {
+    WatchManager::Watched* watched = (WatchManager::Watched*)data;
+    WatchManager* manager = watched->manager;
+    manager->localPermRefreshed (watched, (redisReply*)reply);
+}
+
+// Callback for SMEMBERS of a watched local set
+void localSetRefreshCallback (redisAsyncContext* context, void* reply, void* data) {
+    WatchManager::Watched* watched = (WatchManager::Watched*)data;
+    WatchManager* manager = watched->manager;
+    manager->localSetRefreshed (watched, (redisReply*)reply);
+}
+
+// Same check as Connection::global_reply
+bool globalAllowed (uint64_t perm, uint64_t token) {
+    return perm == 0 || (perm & token);
+}
+
+// Same check as Connection::local_permitted
+bool localAllowed (uint64_t perm, uint64_t token) {
+    return perm == 0 || perm == token;
+}
+
+// Garbled permission bits, as in Connection::global_reply nobody is allowed
+bool noneAllowed (uint64_t perm, uint64_t token) {
+    return false;
+}
+}
+
+namespace hlv {
+namespace service{
+namespace lookup {
+namespace server {
+WatchManager::WatchManager (asio_redis::ManagedRedisClient* subscribeClient,
+                            asio_redis::ManagedRedisClient* queryClient,
+                            const uint64_t token,
+                            const std::string& prefix,
+                            const std::string& localPrefix,
+                            const uint32_t database) :
+    subscribeClient_ (subscribeClient),
+    queryClient_ (queryClient),
+    token_ (token),
+    prefix_ (prefix),
+    localPrefix_ (localPrefix),
+    channelPrefix_ ("__keyspace@" + std::to_string (database) + "__:") {
+    subscribeClient_->on_connect ([this] () { resubscribe (); });
+    subscribeClient_->on_disconnect ([this] () { subscriptions_lost (); });
+}
+
+std::string WatchManager::watch_id (const ev_lookup::Query& query) const {
+    return (query.type () == ev_lookup::Query::LOCAL ? "L:" : "G:")
+                + query.querystring ();
+}
+
+void WatchManager::watch (const ev_lookup::Query& query,
+                          ConnectionPtr connection) {
+    std::string id = watch_id (query);
+    auto it = watches_.find (id);
+    Watched* watched = nullptr;
+    if (it == watches_.end ()) {
+        std::unique_ptr<Watched> entry (new Watched);
+        entry->manager = this;
+        entry->local = (query.type () == ev_lookup::Query::LOCAL);
+        entry->key = query.querystring ();
+        if (entry->local) {
+            std::string base = localPrefix_ + ":" + entry->key;
+            entry->channels.push_back (channelPrefix_ + base);
+            entry->channels.push_back (channelPrefix_ + base + "."
+                                            + hlv::service::lookup::LOCAL_SET);
+        } else {
+            entry->channels.push_back (channelPrefix_ + prefix_ + ":"
+                                            + entry->key);
+        }
+        entry->subscribed = false;
+        entry->refreshing = false;
+        entry->dirty = false;
+        entry->perm = 0;
+        watched = entry.get ();
+        watches_.insert (std::make_pair (id, std::move (entry)));
+    } else {
+        watched = it->second.get ();
+    }
+
+    if (!watched->subscribed) {
+        subscribe (watched);
+    }
+
+    const Connection* cid = connection.get ();
+    for (auto& watcher : watched->watchers) {
+        if (watcher.id == cid) {
+            // Watching again, possibly with a different token
+            watcher.token = query.token ();
+            return;
+        }
+    }
+    Watcher watcher = {cid, connection, query.token ()};
+    watched->watchers.push_back (watcher);
+    connections_[cid].insert (watched);
+    BOOST_LOG_TRIVIAL (info) << "Watching " << id << " for "
+                             << watched->watchers.size () << " connections";
+}
+
+void WatchManager::unwatch (const ev_lookup::Query& query,
+                            const Connection* connection) {
+    auto it = watches_.find (watch_id (query));
+    if (it == watches_.end ()) {
+        return;
+    }
+    Watched* watched = it->second.get ();
+    auto conn = connections_.find (connection);
+    if (conn != connections_.end ()) {
+        conn->second.erase (watched);
+        if (conn->second.empty ()) {
+            connections_.erase (conn);
+        }
+    }
+    remove_watcher (watched, connection);
+}
+
+void WatchManager::unwatch_all (const Connection* connection) {
+    auto conn = connections_.find (connection);
+    if (conn == connections_.end ()) {
+        return;
+    }
+    std::set<Watched*> watched;
+    watched.swap (conn->second);
+    connections_.erase (conn);
+    for (auto w : watched) {
+        remove_watcher (w, connection);
+    }
+}
+
+size_t WatchManager::memory () const {
+    size_t bytes = 0;
+    for (auto& watch : watches_) {
+        const Watched* watched = watch.second.get ();
+        bytes += sizeof(Watched) + watch.first.size () + watched->key.size ();
+        for (auto& channel : watched->channels) {
+            // Once here, once as a key in channels_
+            bytes += 2 * channel.size ();
+        }
+        bytes += watched->watchers.capacity () * sizeof(Watcher);
+    }
+    return bytes;
+}
+
+void WatchManager::remove_watcher (Watched* watched,
+                                   const Connection* connection) {
+    auto& watchers = watched->watchers;
+    watchers.erase (std::remove_if (watchers.begin (),
+                                    watchers.end (),
+                                    [connection] (const Watcher& w) {
+                                        return w.id == connection;
+                                    }),
+                    watchers.end ());
+    if (watchers.empty ()) {
+        unsubscribe (watched);
+        release (watched);
+    }
+}
+
+void WatchManager::release (Watched* watched) {
+    if (!watched->watchers.empty () || watched->refreshing) {
+        return;
+    }
+    BOOST_LOG_TRIVIAL (info) << "No longer watching " << watched->key;
+    watches_.erase ((watched->local ? "L:" : "G:") + watched->key);
+}
+
+void WatchManager::subscribe (Watched* watched) {
+    // Otherwise resubscribe takes care of it once Redis is back
+    if (!subscribeClient_->connected ()) {
+        return;
+    }
+    for (auto& channel : watched->channels) {
+        channels_[channel] = watched;
+        subscribeClient_->subscribe (notificationCallback,
+                                     this,
+                                     "SUBSCRIBE %s",
+                                     channel.c_str ());
+    }
+    watched->subscribed = true;
+}
+
+void WatchManager::unsubscribe (Watched* watched) {
+    if (!watched->subscribed) {
+        return;
+    }
+    for (auto& channel : watched->channels) {
+        channels_.erase (channel);
+        subscribeClient_->subscribe (notificationCallback,
+                                     this,
+                                     "UNSUBSCRIBE %s",
+                                     channel.c_str ());
+    }
+    watched->subscribed = false;
+}
+
+void WatchManager::resubscribe () {
+    if (watches_.empty ()) {
+        return;
+    }
+    BOOST_LOG_TRIVIAL (info) << "Subscribing to " << watches_.size ()
+                             << " watched keys again";
+    for (auto& watch : watches_) {
+        Watched* watched = watch.second.get ();
+        if (!watched->subscribed) {
+            subscribe (watched);
+        }
+        refresh (watched);
+    }
+}
+
+void WatchManager::subscriptions_lost () {
+    channels_.clear ();
+    for (auto& watch : watches_) {
+        watch.second->subscribed = false;
+    }
+}
+
+void WatchManager::notified (redisReply* reply) {
+    // Pub/sub messages are [message, channel, payload]; subscribe and
+    // unsubscribe confirmations come through here too and are ignored.
+    if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 3 ||
+        reply->element[0]->type != REDIS_REPLY_STRING ||
+        strcmp (reply->element[0]->str, "message") != 0) {
+        return;
+    }
+    std::string channel (reply->element[1]->str, reply->element[1]->len);
+    auto it = channels_.find (channel);
+    if (it == channels_.end ()) {
+        return;
+    }
+    BOOST_LOG_TRIVIAL (info) << "Watched key changed " << channel
+                             << " (" << reply->element[2]->str << ")";
+    refresh (it->second);
+}
+
+void WatchManager::refresh (Watched* watched) {
+    if (watched->refreshing) {
+        watched->dirty = true;
+        return;
+    }
+    watched->refreshing = true;
+    watched->dirty = false;
+    if (watched->local) {
+        queryClient_->read (localPermRefreshCallback,
+                            watched,
+                            "HGET %s:%s %s",
+                            localPrefix_.c_str (),
+                            watched->key.c_str (),
+                            hlv::service::lookup::PERM_BIT_FIELD.c_str ());
+    } else {
+        queryClient_->read (globalRefreshCallback,
+                            watched,
+                            "HGETALL %s:%s",
+                            prefix_.c_str (),
+                            watched->key.c_str ());
+    }
+}
+
+void WatchManager::refreshed (Watched* watched) {
+    watched->refreshing = false;
+    if (watched->watchers.empty ()) {
+        release (watched);
+    } else if (watched->dirty) {
+        refresh (watched);
+    }
+}
+
+void WatchManager::globalRefreshed (Watched* watched, redisReply* reply) {
+    if (!reply || reply->type == REDIS_REPLY_ERROR) {
+        BOOST_LOG_TRIVIAL (error) << "Could not refresh watched key "
+                                  << watched->key;
+        refreshed (watched);
+        return;
+    }
+    authorized_.Clear ();
+    authorized_.set_token (token_);
+    authorized_.set_querystring (watched->key);
+    authorized_.set_pushed (true);
+    denied_.CopyFrom (authorized_);
+    denied_.set_success (false);
+
+    uint64_t perm = 0;
+    bool parsed = true;
+    if (reply->type == REDIS_REPLY_ARRAY && reply->elements > 0) {
+        authorized_.set_success (true);
+        for (uint32_t j = 0; j + 1 < reply->elements; j += 2) {
+            std::string key (reply->element[j]->str);
+            if (key == PERM_BIT_FIELD) {
+                parsed = parse_u64 (reply->element[j + 1]->str,
+                                    reply->element[j + 1]->len,
+                                    perm);
+            } else {
+                auto val = authorized_.add_values ();
+                val->set_type (key);
+                val->set_value (reply->element[j + 1]->str);
+            }
+        }
+    } else {
+        // Key was deleted
+        authorized_.set_success (false);
+    }
+    if (!parsed) {
+        BOOST_LOG_TRIVIAL (info) << "Garbled permissions for " << watched->key
+                                 << ", denying watchers";
+    }
+    watched->perm = perm;
+    fan_out (watched, authorized_, denied_, parsed ? globalAllowed : noneAllowed);
+    refreshed (watched);
+}
+
+void WatchManager::localPermRefreshed (Watched* watched, redisReply* reply) {
+    if (!reply || reply->type == REDIS_REPLY_ERROR) {
+        BOOST_LOG_TRIVIAL (error) << "Could not refresh permissions for "
+                                  << watched->key;
+        refreshed (watched);
+        return;
+    }
+    // No permission bits means anyone may look, as in local_lookup
+    uint64_t perm = 0;
+    if (reply->type == REDIS_REPLY_STRING &&
+        !parse_u64 (reply->str, reply->len, perm)) {
+        BOOST_LOG_TRIVIAL (info) << "Garbled permissions for " << watched->key
+                                 << ", denying watchers";
+        denied_.Clear ();
+        denied_.set_token (token_);
+        denied_.set_querystring (watched->key);
+        denied_.set_pushed (true);
+        denied_.set_local (true);
+        denied_.set_success (false);
+        fan_out (watched, denied_, denied_, noneAllowed);
+        refreshed (watched);
+        return;
+    }
+    watched->perm = perm;
+    queryClient_->read (localSetRefreshCallback,
+                        watched,
+                        "SMEMBERS %s:%s.%s",
+                        localPrefix_.c_str (),
+                        watched->key.c_str (),
+                        hlv::service::lookup::LOCAL_SET.c_str ());
+}
+
+void WatchManager::localSetRefreshed (Watched* watched, redisReply* reply) {
+    if (!reply || reply->type == REDIS_REPLY_ERROR) {
+        BOOST_LOG_TRIVIAL (error) << "Could not refresh local set "
+                                  << watched->key;
+        refreshed (watched);
+        return;
+    }
+    authorized_.Clear ();
+    authorized_.set_token (token_);
+    authorized_.set_querystring (watched->key);
+    authorized_.set_pushed (true);
+    authorized_.set_local (true);
+    denied_.CopyFrom (authorized_);
+    denied_.set_success (false);
+
+    if (reply->type == REDIS_REPLY_ARRAY && reply->elements > 0) {
+        authorized_.set_success (true);
+        for (uint32_t j = 0; j < reply->elements; j ++) {
+            auto val = authorized_.add_values ();
+            val->set_type ("");
+            val->set_value (reply->element[j]->str);
+        }
+    } else {
+        authorized_.set_success (false);
+    }
+    fan_out (watched, authorized_, denied_, localAllowed);
+    refreshed (watched);
+}
+
+void WatchManager::fan_out (Watched* watched,
+                            const ev_lookup::Response& authorized,
+                            const ev_lookup::Response& denied,
+                            bool (*allowed) (uint64_t perm, uint64_t token)) {
+    BOOST_LOG_TRIVIAL (info) << "Pushing " << watched->key << " to "
+                             << watched->watchers.size () << " watchers";
+    // Pushing never calls back into the manager, the watcher list is stable
+    // for the duration of this loop.
+    for (auto& watcher : watched->watchers) {
+        ConnectionPtr connection = watcher.connection.lock ();
+        if (!connection) {
+            continue;
+        }
+        if (allowed (watched->perm, watcher.token)) {
+            connection->push_response (authorized);
+        } else {
+            connection->push_response (denied);
+        }
+    }
+}
+} // namespace server
+} // namespace lookup
+} // namespace service
+} // namespace hlv
@@ -0,0 +1,162 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include "lookup.pb.h"
+#ifndef _HLV_LOOKUP_WATCH_MANAGER_H_
+#define _HLV_LOOKUP_WATCH_MANAGER_H_
+namespace asio_redis {
+class ManagedRedisClient;
+}
+namespace hlv {
+namespace service{
+namespace lookup {
+namespace server {
+class Connection;
+
+/// Tracks watched queries for all connections on a lookup server. Each
+/// watched key is subscribed to (via Redis keyspace notifications) exactly
+/// once, no matter how many connections watch it. When a notification
+/// arrives the key is queried once and the result pushed to every watcher,
+/// filtered by that watcher's token. Notifications that arrive while a
+/// key is being queried are coalesced into a single follow up query.
+///
+/// Requires notify-keyspace-events to include K and the relevant event
+/// classes (see config/redis.conf).
+///
+/// Subscriptions are made again whenever the subscribe connection comes
+/// back, and every watched key is refreshed then since changes made in the
+/// meantime were not notified.
+class WatchManager {
+  public:
+    typedef std::shared_ptr<Connection> ConnectionPtr;
+
+    /// A connection watching a key
+    struct Watcher {
+        const Connection* id;
+        std::weak_ptr<Connection> connection;
+        uint64_t token;
+    };
+
+    /// A single watched key
+    struct Watched {
+        WatchManager* manager;
+        bool local;
+        std::string key;
+        // Keyspace channels this key is subscribed to
+        std::vector<std::string> channels;
+        bool subscribed;
+        // A query for the key is outstanding
+        bool refreshing;
+        // Key changed while refreshing, query again when done
+        bool dirty;
+        // Permission bits from the last refresh
+        uint64_t perm;
+        std::vector<Watcher> watchers;
+    };
+
+    WatchManager () = delete;
+    WatchManager (const WatchManager&) = delete;
+    WatchManager& operator= (const WatchManager&) = delete;
+
+    /// subscribeClient: Redis connection used only for SUBSCRIBE, it cannot
+    ///                  issue other commands once subscribed
+    /// queryClient: Redis connection used to query watched keys
+    /// token: token for this lookup server
+    /// prefix, localPrefix: as in Tenant
+    /// database: Redis database the keys live in
+    WatchManager (asio_redis::ManagedRedisClient* subscribeClient,
+                  asio_redis::ManagedRedisClient* queryClient,
+                  const uint64_t token,
+                  const std::string& prefix,
+                  const std::string& localPrefix,
+                  const uint32_t database = 0);
+
+    /// Push changes to the result of query to connection
+    void watch (const ev_lookup::Query& query, ConnectionPtr connection);
+
+    /// Stop pushing changes to the result of query to connection
+    void unwatch (const ev_lookup::Query& query, const Connection* connection);
+
+    /// Drop every watch held by connection
+    void unwatch_all (const Connection* connection);
+
+    /// Number of keys being watched
+    size_t watched () const { return watches_.size (); }
+
+    /// Rough number of bytes used to track watches
+    size_t memory () const;
+
+    // Callback for keyspace notifications
+    void notified (redisReply* reply);
+
+    // Callback for HGETALL on a global key
+    void globalRefreshed (Watched* watched, redisReply* reply);
+
+    // Callback for HGET on a local key's permission bits
+    void localPermRefreshed (Watched* watched, redisReply* reply);
+
+    // Callback for SMEMBERS on a local set
+    void localSetRefreshed (Watched* watched, redisReply* reply);
+
+  private:
+    // Identifies a watched query
+    std::string watch_id (const ev_lookup::Query& query) const;
+
+    // SUBSCRIBE/UNSUBSCRIBE to a key's channels
+    void subscribe (Watched* watched);
+    void unsubscribe (Watched* watched);
+
+    // The subscribe connection came back, subscribe and refresh every key
+    void resubscribe ();
+
+    // The subscribe connection went away along with its subscriptions
+    void subscriptions_lost ();
+
+    // Remove connection from watched, dropping the key when nobody is left
+    void remove_watcher (Watched* watched, const Connection* connection);
+
+    // Free the key if nobody watches it and no query is outstanding
+    void release (Watched* watched);
+
+    // Query a key again after it changed
+    void refresh (Watched* watched);
+
+    // Done querying, either push or query again
+    void refreshed (Watched* watched);
+
+    // Push a result to every live watcher; authorized gets the result,
+    // denied is sent to watchers whose token does not grant access
+    void fan_out (Watched* watched,
+                  const ev_lookup::Response& authorized,
+                  const ev_lookup::Response& denied,
+                  bool (*allowed) (uint64_t perm, uint64_t token));
+
+    asio_redis::ManagedRedisClient* subscribeClient_;
+    asio_redis::ManagedRedisClient* queryClient_;
+    const uint64_t token_;
+    const std::string prefix_;
+    const std::string localPrefix_;
+    const std::string channelPrefix_;
+
+    // Watched keys by watch_id
+    std::map<std::string, std::unique_ptr<Watched>> watches_;
+    // Watched keys by keyspace channel
+    std::map<std::string, Watched*> channels_;
+    // Watched keys by connection, to clean up on disconnect
+    std::map<const Connection*, std::set<Watched*>> connections_;
+
+    // Space to build pushed responses
+    ev_lookup::Response authorized_;
+    ev_lookup::Response denied_;
+};
+} // namespace server
+} // namespace lookup
+} // namespace service
+} // namespace hlv
+#endif
@@ -12,18 +12,24 @@ int main (int argc, char* argv[]) {
     // Argument parsing
     po::options_description desc("EV Lookup Client Example");
     std::string server = "127.0.0.1",
-                query = "";
+                query = "",
+                tenant = "";
     uint64_t token = 0;
     uint32_t port = hlv::service::lookup::SERVER_PORT;
     bool local = false;
+    bool watch = false;
 
     desc.add_options()
         ("h,help", "Display help") 
         ("l,local", po::value<bool>(&local)->zero_tokens(), "Local lookup")
+        ("w,watch", po::value<bool>(&watch)->zero_tokens(),
+            "Keep printing results as they change")
         ("s,server", po::value<std::string>(&server)->implicit_value("127.0.0.1"),
             "Lookup server to contact")
         ("p,port", po::value<uint32_t>(&port)->implicit_value(port),
-            "Lookup server port");
+            "Lookup server port")
+        ("t,tenant", po::value<std::string>(&tenant),
+            "Tenant to query on a shared lookup server");
 
     po::options_description hidden;
     hidden.add_options()
@@ -52,22 +58,30 @@ int main (int argc, char* argv[]) {
 
     // Create client
     hlv::lookup::client::EvLookupClient client (server, port);
+    client.set_tenant (tenant);
     bool connect = client.connect ();
     if (!connect) {
         std::cerr << "Failed to connect to lookup service" << std::endl;
         return 0;
     }
 
-    uint64_t rtoken;
+    uint64_t rtoken = 0;
     bool qsuccess;
     if (local) {
         std::cerr << "Querying locally" << std::endl;
         std::list<std::string> results;
-        qsuccess = client.LocalQuery (token,
-                                 query,
-                                 rtoken,
-                                 results);
-        if (!qsuccess) {
+        if (watch) {
+            qsuccess = client.LocalWatch (token,
+                                          query,
+                                          rtoken,
+                                          results);
+        } else {
+            qsuccess = client.LocalQuery (token,
+                                          query,
+                                          rtoken,
+                                          results);
+        }
+        if (!qsuccess && !watch) {
             std::cerr << "Failed to query or no results found" << std::endl;
             return 0;
         }
@@ -77,11 +91,18 @@ int main (int argc, char* argv[]) {
         }
     } else {
         std::map<std::string, std::string> results;
-        qsuccess = client.Query (token,
-                               query,
-                               rtoken,
-                               results);
-        if (!qsuccess) {
+        if (watch) {
+            qsuccess = client.Watch (token,
+                                     query,
+                                     rtoken,
+                                     results);
+        } else {
+            qsuccess = client.Query (token,
+                                     query,
+                                     rtoken,
+                                     results);
+        }
+        if (!qsuccess && !watch) {
             std::cerr << "Failed to query or no results found" << std::endl;
             return 0;
         }
@@ -90,6 +111,21 @@ int main (int argc, char* argv[]) {
             std::cout << "  " << kv.first << ":   " << kv.second << std::endl;
         }
     }
+
+    // Print changes until the server goes away
+    hlv::lookup::client::EvLookupClient::Change change;
+    while (watch && client.NextChange (change)) {
+        std::cout << "Changed " << change.query << std::endl;
+        if (!change.found) {
+            std::cout << "  (no results)" << std::endl;
+        }
+        for (auto val : change.localResult) {
+            std::cout << val << std::endl;
+        }
+        for (auto kv : change.result) {
+            std::cout << "  " << kv.first << ":   " << kv.second << std::endl;
+        }
+    }
     std::cout << "Done" << std::endl;
     return 1;
 }
@@ -0,0 +1,111 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#ifndef __EV_ENDPOINT_SELECTOR_LIB__
+#define __EV_ENDPOINT_SELECTOR_LIB__
+namespace hlv {
+namespace lookup {
+namespace client {
+/// Picks which of the endpoints a lookup returned to send a request to.
+/// Endpoints are registered as host:port (or unix:/path for a Unix domain
+/// socket on this host), optionally followed by @distance (the Distance of
+/// a ProxyRegister, smaller is nearer; 0 when missing). Requests go to the
+/// nearest endpoints that are healthy; among those the one with the lower
+/// RTT (an EWMA of what callers report) of two picked at random, so that
+/// load spreads without every client piling onto the single fastest
+/// replica. Endpoints failing repeatedly are ejected for a while, longer
+/// each time they fail again after coming back. Not thread safe.
+class EndpointSelector {
+  public:
+    struct Endpoint {
+        std::string address;   // As registered, used to report on it
+        std::string host;
+        std::string port;
+        int32_t distance;
+    };
+
+    /// Separates the address of an endpoint from its distance
+    static const char DISTANCE_SEPARATOR = '@';
+
+    /// Split a registered endpoint, false if it is not host:port[@distance]
+    /// or unix:/path[@distance] (whose host is unix:/path, port empty)
+    static bool parse (const std::string& address, Endpoint& endpoint);
+
+    /// alpha: weight of the newest RTT sample
+    /// maxFailures: consecutive failures after which an endpoint is ejected
+    /// ejection: how long the first ejection lasts, each later one (without
+    ///           a success in between) doubles up to maxEjection
+    explicit EndpointSelector (double alpha = 0.3,
+                               uint32_t maxFailures = 2,
+                               std::chrono::milliseconds ejection =
+                                    std::chrono::milliseconds (1000),
+                               std::chrono::milliseconds maxEjection =
+                                    std::chrono::milliseconds (30000));
+
+    EndpointSelector (const EndpointSelector&) = delete;
+    EndpointSelector& operator= (const EndpointSelector&) = delete;
+
+    /// Choose from these endpoints from now on, as returned by LocalQuery.
+    /// What was learnt about endpoints still there is kept, the rest is
+    /// forgotten; endpoints that do not parse are skipped.
+    void update (const std::list<std::string>& addresses);
+
+    /// Choose from this one endpoint, as returned by Query
+    void update (const std::string& address);
+
+    /// Choose an endpoint. If every endpoint is ejected the one due back
+    /// first is returned. False if there are no endpoints.
+    bool select (Endpoint& endpoint);
+
+    /// Choose an endpoint other than those in skip, for retrying a request
+    /// elsewhere. False if there are no others.
+    bool select (Endpoint& endpoint, const std::set<std::string>& skip);
+
+    /// A request to address succeeded after rtt
+    void success (const std::string& address, std::chrono::microseconds rtt);
+
+    /// A request to address failed
+    void failure (const std::string& address);
+
+    /// Number of endpoints to choose from
+    size_t size () const { return candidates_.size (); }
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct State {
+        Endpoint endpoint;
+        double rtt;                  // EWMA in microseconds, < 0 if unknown
+        uint32_t failures;           // Consecutive failures
+        uint32_t ejections;          // Ejections since the last success
+        Clock::time_point ejectedUntil;
+    };
+
+    // Cost of sending to an endpoint among those as near. Endpoints without
+    // an RTT yet come first, so that they get measured.
+    double cost (const State& state) const;
+
+    const double alpha_;
+    const uint32_t maxFailures_;
+    const std::chrono::milliseconds ejection_;
+    const std::chrono::milliseconds maxEjection_;
+
+    // What is known about every endpoint seen, by address
+    std::map<std::string, State> states_;
+    // Addresses of the endpoints currently chosen from
+    std::vector<std::string> candidates_;
+    // Space for the nearest healthy candidates while selecting
+    std::vector<State*> nearest_;
+    std::minstd_rand random_;
+};
+}
+}
+}
+#endif // __EV_ENDPOINT_SELECTOR_LIB__
@@ -1,9 +1,11 @@
 // Copyright 20xx The Regents of the University of California
 // This is a test service for SDN-v2 High Level Virtualization
+#include <deque>
 #include <map>
 #include <list>
 #include <memory>
 #include <boost/asio.hpp>
+#include "stream_socket.h"
 #ifndef __EV_QUERY_CLIENT_LIB__
 #define __EV_QUERY_CLIENT_LIB__
 namespace ev_lookup {
@@ -19,6 +21,16 @@ class EvLookupClient {
   public:
     typedef std::map<std::string, std::string> LookupResult;
     typedef std::list<std::string> LocalLookup;
+
+    /// A change to a watched query, pushed by the server
+    struct Change {
+        std::string query;        // Query string that changed
+        bool local;               // Is this a LocalWatch
+        bool found;               // False if deleted or no longer accessible
+        uint64_t resultToken;     // Token sent back by server
+        LookupResult result;      // New values for Watch
+        LocalLookup localResult;  // New values for LocalWatch
+    };
     // Delete no argument constructor
     EvLookupClient () = delete;
 
@@ -26,8 +38,9 @@ class EvLookupClient {
     EvLookupClient (const EvLookupClient&) = delete;
     
     /// Construct an EV Lookup Client.
-    /// host; string address of lookup host
-    /// port: uint32_t port of lookup host
+    /// host; string address of lookup host, or unix:/path for a lookup
+    ///       server listening on a Unix domain socket on this host
+    /// port: uint32_t port of lookup host, unused for unix:/path
     explicit EvLookupClient (const std::string& host,
                              const uint32_t port);
 
@@ -36,6 +49,14 @@ class EvLookupClient {
 
     /// Disconnect from EV lookup service
     void disconnect ();
+
+    /// Ask the server for compressed responses (on by default). The server
+    /// only compresses responses above its size threshold.
+    void set_compression (bool enable);
+
+    /// Query this tenant, for lookup servers hosting several. The default
+    /// ("") is the server's default tenant.
+    void set_tenant (const std::string& tenant);
     
     /// Query EV lookup service
     /// token: Authentication token
@@ -59,6 +80,52 @@ class EvLookupClient {
                      uint64_t& resultToken,
                      LocalLookup& result) const;
 
+    /// Conditional Query, for clients that poll.
+    /// version: In, the version of the result the caller holds (0 for none).
+    ///          Out, the current version.
+    /// modified: false if the caller's result is current, in which case
+    ///           result is left alone.
+    /// Other arguments and return are as for Query.
+    bool QueryIfModified (const uint64_t token,
+                          const std::string& query,
+                          uint64_t& version,
+                          bool& modified,
+                          uint64_t& resultToken,
+                          LookupResult& result) const;
+
+    /// Conditional LocalQuery, see QueryIfModified
+    bool LocalQueryIfModified (const uint64_t token,
+                               const std::string& query,
+                               uint64_t& version,
+                               bool& modified,
+                               uint64_t& resultToken,
+                               LocalLookup& result) const;
+
+    /// Query EV lookup service and keep watching the result. Arguments and
+    /// return are as for Query. The server keeps the watch even if the key
+    /// does not exist yet; changes are retrieved with NextChange.
+    bool Watch (const uint64_t token,
+                const std::string& query,
+                uint64_t& resultToken,
+                LookupResult& result) const;
+
+    /// LocalQuery EV lookup service and keep watching the result. Arguments
+    /// and return are as for LocalQuery.
+    bool LocalWatch (const uint64_t token,
+                     const std::string& query,
+                     uint64_t& resultToken,
+                     LocalLookup& result) const;
+
+    /// Stop watching a query
+    /// local: true to stop a LocalWatch, false to stop a Watch
+    bool Unwatch (const uint64_t token,
+                  const std::string& query,
+                  bool local) const;
+
+    /// Block until one of the watched queries changes. Changes that arrived
+    /// while waiting for other responses are returned first.
+    bool NextChange (Change& change) const;
+
     virtual ~EvLookupClient();
 
   private:
@@ -68,23 +135,33 @@ class EvLookupClient {
     // Receive response from the server
     bool recv_response (ev_lookup::Response& response) const; 
 
+    // Receive the response to the last query, setting aside any changes
+    // pushed in the meantime
+    bool recv_reply (ev_lookup::Response& response) const;
+
     // Host and port
     std::string host_;
     uint32_t port_;
     bool connected_;
+    bool compression_;
+    std::string tenant_;
 
     // Space to deserialize protobuf
     mutable ev_lookup::Query* query_;
     mutable ev_lookup::Response* response_;
     // Buffer, expect never to need more than 128k
     mutable std::array<char, 131072> buffer_;
+    // Space to decompress responses into
+    mutable std::array<char, 131072> inflate_buffer_;
+    // Pushed changes not yet returned by NextChange
+    mutable std::deque<std::shared_ptr<ev_lookup::Response>> changes_;
 
     // Communicating with the other end
     // We are never going to call run on this io_service_ so no
     // need to use a common one
     mutable boost::asio::io_service io_service_;
     // Socket
-    mutable boost::asio::ip::tcp::socket socket_;
+    mutable hlv::service::common::StreamSocket socket_;
 };
 }
 }
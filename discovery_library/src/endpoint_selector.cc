@@ -0,0 +1,182 @@
+#include <algorithm>
+#include <string>
+#include <boost/log/trivial.hpp>
+#include "endpoint_selector.h"
+#include "stream_socket.h"
+namespace hlv {
+namespace lookup {
+namespace client {
+const char EndpointSelector::DISTANCE_SEPARATOR;
+
+/// Split a registered endpoint
+bool EndpointSelector::parse (const std::string& address, Endpoint& endpoint) {
+    size_t colon = address.find (':');
+    if (colon == std::string::npos || colon == 0) {
+        return false;
+    }
+    size_t separator;
+    endpoint.address = address;
+    if (hlv::service::common::is_unix (address)) {
+        // unix:/path is all host, there is no port
+        separator = address.rfind (DISTANCE_SEPARATOR);
+        endpoint.host = address.substr (0, separator);
+        endpoint.port.clear ();
+        if (endpoint.host.size () == hlv::service::common::UNIX_PREFIX.size ()) {
+            return false;
+        }
+    } else {
+        separator = address.find (DISTANCE_SEPARATOR, colon);
+        endpoint.host = address.substr (0, colon);
+        endpoint.port = address.substr (colon + 1,
+                                        separator == std::string::npos ?
+                                            std::string::npos : separator - colon - 1);
+        if (endpoint.port.empty () ||
+            endpoint.port.find (':') != std::string::npos) {
+            return false;
+        }
+    }
+    endpoint.distance = 0;
+    if (separator != std::string::npos) {
+        try {
+            size_t used = 0;
+            endpoint.distance = std::stoi (address.substr (separator + 1), &used);
+            if (used != address.size () - separator - 1) {
+                return false;
+            }
+        } catch (std::exception&) {
+            return false;
+        }
+    }
+    return true;
+}
+
+EndpointSelector::EndpointSelector (double alpha,
+                                    uint32_t maxFailures,
+                                    std::chrono::milliseconds ejection,
+                                    std::chrono::milliseconds maxEjection) :
+    alpha_ (alpha),
+    maxFailures_ (maxFailures),
+    ejection_ (ejection),
+    maxEjection_ (maxEjection),
+    random_ (std::random_device () ()) {
+}
+
+void EndpointSelector::update (const std::list<std::string>& addresses) {
+    // Endpoints no longer registered are forgotten
+    std::map<std::string, State> states;
+    candidates_.clear ();
+    for (auto& address : addresses) {
+        auto known = states_.find (address);
+        if (known != states_.end ()) {
+            states.insert (*known);
+        } else {
+            State state;
+            if (!parse (address, state.endpoint)) {
+                BOOST_LOG_TRIVIAL (info) << "Skipping endpoint " << address;
+                continue;
+            }
+            state.rtt = -1;
+            state.failures = 0;
+            state.ejections = 0;
+            states.emplace (address, state);
+        }
+        candidates_.push_back (address);
+    }
+    states_.swap (states);
+}
+
+void EndpointSelector::update (const std::string& address) {
+    update (std::list<std::string> {address});
+}
+
+bool EndpointSelector::select (Endpoint& endpoint) {
+    return select (endpoint, std::set<std::string> ());
+}
+
+bool EndpointSelector::select (Endpoint& endpoint, const std::set<std::string>& skip) {
+    Clock::time_point now = Clock::now ();
+    State* soonest = nullptr;
+    nearest_.clear ();
+    for (auto& address : candidates_) {
+        if (skip.count (address)) {
+            continue;
+        }
+        State& state = states_[address];
+        if (state.failures >= maxFailures_ && state.ejectedUntil > now) {
+            if (!soonest || state.ejectedUntil < soonest->ejectedUntil) {
+                soonest = &state;
+            }
+            continue;
+        }
+        if (!nearest_.empty () &&
+            state.endpoint.distance < nearest_.front ()->endpoint.distance) {
+            nearest_.clear ();
+        }
+        if (nearest_.empty () ||
+            state.endpoint.distance == nearest_.front ()->endpoint.distance) {
+            nearest_.push_back (&state);
+        }
+    }
+    if (nearest_.empty ()) {
+        // Everything is ejected, better to try one than to give up
+        if (!soonest) {
+            return false;
+        }
+        endpoint = soonest->endpoint;
+        return true;
+    }
+    State* chosen = nearest_.front ();
+    if (nearest_.size () > 1) {
+        std::uniform_int_distribution<size_t> pick (0, nearest_.size () - 1);
+        size_t first = pick (random_);
+        size_t second = pick (random_);
+        if (second == first) {
+            second = (first + 1) % nearest_.size ();
+        }
+        chosen = (cost (*nearest_[second]) < cost (*nearest_[first]) ?
+                        nearest_[second] : nearest_[first]);
+    }
+    endpoint = chosen->endpoint;
+    return true;
+}
+
+void EndpointSelector::success (const std::string& address, std::chrono::microseconds rtt) {
+    auto known = states_.find (address);
+    if (known == states_.end ()) {
+        return;
+    }
+    State& state = known->second;
+    double sample = (double)rtt.count ();
+    state.rtt = (state.rtt < 0 ? sample : alpha_ * sample + (1 - alpha_) * state.rtt);
+    state.failures = 0;
+    state.ejections = 0;
+}
+
+void EndpointSelector::failure (const std::string& address) {
+    auto known = states_.find (address);
+    if (known == states_.end ()) {
+        return;
+    }
+    State& state = known->second;
+    state.failures++;
+    if (state.failures < maxFailures_) {
+        return;
+    }
+    // Failing again right after coming back out keeps it out longer
+    std::chrono::milliseconds duration = ejection_;
+    for (uint32_t i = 0; i < state.ejections && duration < maxEjection_; i++) {
+        duration *= 2;
+    }
+    duration = std::min (duration, maxEjection_);
+    state.ejections++;
+    state.ejectedUntil = Clock::now () + duration;
+    BOOST_LOG_TRIVIAL (info) << "Ejecting endpoint " << address << " for "
+                             << duration.count () << "ms";
+}
+
+double EndpointSelector::cost (const State& state) const {
+    return state.rtt < 0 ? 0 : state.rtt;
+}
+}
+}
+}
@@ -2,6 +2,7 @@
 #include <utility>
 #include <boost/log/trivial.hpp>
 #include "query_client.h"
+#include "frame_compression.h"
 #include "lookup.pb.h"
 namespace hlv {
 namespace lookup {
@@ -14,6 +15,7 @@ EvLookupClient::EvLookupClient (const std::string& host,
                  host_ (host),
                  port_ (port),
                  connected_ (false),
+                 compression_ (true),
                  query_ (new ev_lookup::Query),
                  response_ (new ev_lookup::Response),
                  io_service_ (),
@@ -22,10 +24,8 @@ EvLookupClient::EvLookupClient (const std::string& host,
 
 /// Connect to EV Lookup service
 bool EvLookupClient::connect () {
-    boost::asio::ip::tcp::resolver resolver(io_service_);
-    boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve({host_, std::to_string (port_)});
     boost::system::error_code ec;
-    socket_.connect(endpoint, ec);
+    hlv::service::common::connect_stream (io_service_, socket_, host_, std::to_string (port_), ec);
     if (ec) {
         BOOST_LOG_TRIVIAL(error) << "Error connecting to remote endpoint";
         connected_ = false;
@@ -40,6 +40,16 @@ void EvLookupClient::disconnect () {
     socket_.close();
 }
 
+/// Ask the server for compressed responses
+void EvLookupClient::set_compression (bool enable) {
+    compression_ = enable;
+}
+
+/// Query this tenant
+void EvLookupClient::set_tenant (const std::string& tenant) {
+    tenant_ = tenant;
+}
+
 /// Query EV lookup service
 /// token: Authentication token
 /// query: Query string
@@ -57,12 +67,16 @@ bool EvLookupClient::Query (const uint64_t token,
     response_->Clear ();
     query_->set_token (token);
     query_->set_querystring (query);
+    if (!tenant_.empty ()) {
+        query_->set_tenant (tenant_);
+    }
     query_->set_type (ev_lookup::Query::GLOBAL);
+    query_->set_acceptcompressed (compression_);
     bool success = send_query (*query_);
     if (!success) {
         return false;
     }
-    success = recv_response (*response_);
+    success = recv_reply (*response_);
     if (!success) {
         return false;
     }
@@ -96,12 +110,16 @@ bool EvLookupClient::LocalQuery (const uint64_t token,
     response_->Clear ();
     query_->set_token (token);
     query_->set_querystring (query);
+    if (!tenant_.empty ()) {
+        query_->set_tenant (tenant_);
+    }
     query_->set_type (ev_lookup::Query::LOCAL);
+    query_->set_acceptcompressed (compression_);
     bool success = send_query (*query_);
     if (!success) {
         return false;
     }
-    success = recv_response (*response_);
+    success = recv_reply (*response_);
     if (!success) {
         return false;
     }
@@ -139,10 +157,10 @@ bool EvLookupClient::send_query (const ev_lookup::Query& query) const {
 
 // Receive response from the server
 bool EvLookupClient::recv_response (ev_lookup::Response& response) const {
-    uint64_t size = 0;
+    uint64_t header = 0;
     boost::system::error_code ec;
     boost::asio::read (socket_,
-            boost::asio::buffer (&size, sizeof(size)),
+            boost::asio::buffer (&header, sizeof(header)),
             ec);
 
     if (ec) {
@@ -150,6 +168,7 @@ bool EvLookupClient::recv_response (ev_lookup::Response& response) const {
         return false;
     }
 
+    size_t size = ev::compression::frame_length (header);
     boost::asio::read (socket_,
             boost::asio::buffer (buffer_),
             boost::asio::transfer_exactly (size),
@@ -160,10 +179,279 @@ bool EvLookupClient::recv_response (ev_lookup::Response& response) const {
         return false;
     }
 
+    if (ev::compression::is_compressed (header)) {
+        if (!ev::compression::decompress (buffer_.data (),
+                                          size,
+                                          inflate_buffer_.data (),
+                                          inflate_buffer_.size (),
+                                          size)) {
+            BOOST_LOG_TRIVIAL (info) << "Error decompressing message";
+            return false;
+        }
+        response.ParseFromArray (inflate_buffer_.data(), size);
+        return true;
+    }
+
     response.ParseFromArray (buffer_.data(), size);
     return true;
 }
 
+/// Conditional Query
+bool EvLookupClient::QueryIfModified (const uint64_t token,
+                                      const std::string& query,
+                                      uint64_t& version,
+                                      bool& modified,
+                                      uint64_t& resultToken,
+                                      LookupResult& result) const {
+    if (!connected_) {
+        return false;
+    }
+    query_->Clear ();
+    response_->Clear ();
+    query_->set_token (token);
+    query_->set_querystring (query);
+    if (!tenant_.empty ()) {
+        query_->set_tenant (tenant_);
+    }
+    query_->set_type (ev_lookup::Query::GLOBAL);
+    query_->set_acceptcompressed (compression_);
+    if (version != 0) {
+        query_->set_ifversionnot (version);
+    }
+    bool success = send_query (*query_);
+    if (!success) {
+        return false;
+    }
+    success = recv_reply (*response_);
+    if (!success) {
+        return false;
+    }
+
+    if (!response_->success ()) {
+        return false;
+    }
+
+    resultToken = response_->token ();
+    version = response_->version ();
+    modified = !response_->notmodified ();
+    if (!modified) {
+        return true;
+    }
+    for (auto kv : response_->values ()) {
+        result.insert (std::make_pair (kv.type(), kv.value()));
+    }
+    return true;
+}
+
+/// Conditional LocalQuery
+bool EvLookupClient::LocalQueryIfModified (const uint64_t token,
+                                           const std::string& query,
+                                           uint64_t& version,
+                                           bool& modified,
+                                           uint64_t& resultToken,
+                                           LocalLookup& result) const {
+    if (!connected_) {
+        return false;
+    }
+    query_->Clear ();
+    response_->Clear ();
+    query_->set_token (token);
+    query_->set_querystring (query);
+    if (!tenant_.empty ()) {
+        query_->set_tenant (tenant_);
+    }
+    query_->set_type (ev_lookup::Query::LOCAL);
+    query_->set_acceptcompressed (compression_);
+    if (version != 0) {
+        query_->set_ifversionnot (version);
+    }
+    bool success = send_query (*query_);
+    if (!success) {
+        return false;
+    }
+    success = recv_reply (*response_);
+    if (!success) {
+        return false;
+    }
+
+    if (!response_->success ()) {
+        return false;
+    }
+
+    resultToken = response_->token ();
+    version = response_->version ();
+    modified = !response_->notmodified ();
+    if (!modified) {
+        return true;
+    }
+    for (auto kv : response_->values ()) {
+        result.push_back (kv.value());
+    }
+    return true;
+}
+
+/// Query EV lookup service and keep watching the result
+bool EvLookupClient::Watch (const uint64_t token,
+                            const std::string& query,
+                            uint64_t& resultToken,
+                            LookupResult& result) const {
+    if (!connected_) {
+        return false;
+    }
+    query_->Clear ();
+    response_->Clear ();
+    query_->set_token (token);
+    query_->set_querystring (query);
+    if (!tenant_.empty ()) {
+        query_->set_tenant (tenant_);
+    }
+    query_->set_type (ev_lookup::Query::GLOBAL);
+    query_->set_acceptcompressed (compression_);
+    query_->set_watch (ev_lookup::Query::START);
+    bool success = send_query (*query_);
+    if (!success) {
+        return false;
+    }
+    success = recv_reply (*response_);
+    if (!success) {
+        return false;
+    }
+
+    if (!response_->success ()) {
+        return false;
+    }
+
+    resultToken = response_->token ();
+    for (auto kv : response_->values ()) {
+        result.insert (std::make_pair (kv.type(), kv.value()));
+    }
+    return true;
+}
+
+/// LocalQuery EV lookup service and keep watching the result
+bool EvLookupClient::LocalWatch (const uint64_t token,
+                                 const std::string& query,
+                                 uint64_t& resultToken,
+                                 LocalLookup& result) const {
+    if (!connected_) {
+        return false;
+    }
+    query_->Clear ();
+    response_->Clear ();
+    query_->set_token (token);
+    query_->set_querystring (query);
+    if (!tenant_.empty ()) {
+        query_->set_tenant (tenant_);
+    }
+    query_->set_type (ev_lookup::Query::LOCAL);
+    query_->set_acceptcompressed (compression_);
+    query_->set_watch (ev_lookup::Query::START);
+    bool success = send_query (*query_);
+    if (!success) {
+        return false;
+    }
+    success = recv_reply (*response_);
+    if (!success) {
+        return false;
+    }
+
+    if (!response_->success ()) {
+        return false;
+    }
+
+    resultToken = response_->token ();
+    for (auto kv : response_->values ()) {
+        result.push_back (kv.value());
+    }
+    return true;
+}
+
+/// Stop watching a query
+bool EvLookupClient::Unwatch (const uint64_t token,
+                              const std::string& query,
+                              bool local) const {
+    if (!connected_) {
+        return false;
+    }
+    query_->Clear ();
+    response_->Clear ();
+    query_->set_token (token);
+    query_->set_querystring (query);
+    if (!tenant_.empty ()) {
+        query_->set_tenant (tenant_);
+    }
+    query_->set_type (local ? ev_lookup::Query::LOCAL :
+                              ev_lookup::Query::GLOBAL);
+    query_->set_watch (ev_lookup::Query::STOP);
+    bool success = send_query (*query_);
+    if (!success) {
+        return false;
+    }
+    success = recv_reply (*response_);
+    if (!success) {
+        return false;
+    }
+    // Changes that were already pushed for this query are of no interest
+    for (auto it = changes_.begin (); it != changes_.end ();) {
+        if ((*it)->querystring () == query && (*it)->local () == local) {
+            it = changes_.erase (it);
+        } else {
+            ++it;
+        }
+    }
+    return response_->success ();
+}
+
+/// Block until one of the watched queries changes
+bool EvLookupClient::NextChange (Change& change) const {
+    if (!connected_) {
+        return false;
+    }
+    std::shared_ptr<ev_lookup::Response> pushed;
+    if (!changes_.empty ()) {
+        pushed = changes_.front ();
+        changes_.pop_front ();
+    } else {
+        pushed = std::make_shared<ev_lookup::Response> ();
+        do {
+            if (!recv_response (*pushed)) {
+                return false;
+            }
+        } while (!pushed->pushed ());
+    }
+
+    change.query = pushed->querystring ();
+    change.local = pushed->local ();
+    change.found = pushed->success ();
+    change.resultToken = pushed->token ();
+    change.result.clear ();
+    change.localResult.clear ();
+    for (auto kv : pushed->values ()) {
+        if (change.local) {
+            change.localResult.push_back (kv.value());
+        } else {
+            change.result.insert (std::make_pair (kv.type(), kv.value()));
+        }
+    }
+    return true;
+}
+
+// Receive the response to the last query
+bool EvLookupClient::recv_reply (ev_lookup::Response& response) const {
+    while (true) {
+        if (!recv_response (response)) {
+            return false;
+        }
+        if (!response.pushed ()) {
+            return true;
+        }
+        std::shared_ptr<ev_lookup::Response> pushed =
+                                std::make_shared<ev_lookup::Response> ();
+        pushed->Swap (&response);
+        changes_.push_back (pushed);
+    }
+}
+
 EvLookupClient::~EvLookupClient() {
     delete query_;
     delete response_;
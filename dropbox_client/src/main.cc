@@ -8,6 +8,7 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/tokenizer.hpp>
 #include <query_client.h>
+#include <endpoint_selector.h>
 #include <update_client.h>
 #include <sync_client.h>
 #include <logging_common.h>
@@ -118,18 +119,21 @@ std::unique_ptr<hlv::ebox::update::EvLDiscoveryClient>
         result = 0;
         return nullptr;
     }
-    const std::string location = results.front ();
-    std::vector<std::string> split_results;
-    boost::split(split_results, location, boost::is_any_of(":"), boost::token_compress_off);
-    if (split_results.size () != 2) {
+    // The nearest edge box, there is nothing else to go by yet
+    hlv::lookup::client::EndpointSelector selector;
+    selector.update (results);
+    hlv::lookup::client::EndpointSelector::Endpoint location;
+    if (!selector.select (location)) {
         result = false;
         std::cerr << "Do not understand response" << std::endl;
         return nullptr;
     }
+    // There is no port for an edge box on a Unix domain socket
+    uint32_t port = location.port.empty () ? 0 : std::stoul (location.port);
     auto ret = std::unique_ptr<hlv::ebox::update::EvLDiscoveryClient>(
                     new hlv::ebox::update::EvLDiscoveryClient (token,
-                                                               split_results[0],
-                                                               std::stoul (split_results[1])));
+                                                               location.host,
+                                                               port));
     return ret;
 }
 
@@ -44,7 +44,9 @@ int main (int argc, char* argv[]) {
         ("accessible,a", po::value<uint64_t>(&accessibleBy)->implicit_value (accessibleBy),
             "Permission for accessing")
         ("type,t", po::value<std::string>(&type)->implicit_value (type),
-            "Type of server");
+            "Type of server")
+        ("io-uring", "Serve connections through io_uring rather than epoll "
+            "(builds with HLV_IO_URING, Linux 5.19 or later)");
     po::options_description options;
     options.add(desc);
     po::variables_map vm;
@@ -64,6 +66,11 @@ int main (int argc, char* argv[]) {
                                   address,
                                   std::to_string(port), 
                                   info);
+    if (vm.count ("io-uring") &&
+        !server.set_backend (hlv::service::common::Backend::IO_URING)) {
+        std::cerr << "io_uring is not available" << std::endl;
+        return 1;
+    }
     launchService (io_service, server);
     
     // Cannonical address
@@ -5,6 +5,8 @@
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
 #include "common_manager.h"
+#include "stream_socket.h"
+#include "uring.h"
 #ifndef _EV_ECHO_CONNECTION_H_
 #define _EV_ECHO_CONNECTION_H_
 /// The Connection class implements the logic used for a simple server
@@ -25,7 +27,8 @@ struct ConnectionInformation {
 /// responsible for reading bytes off the wire and dispatching them
 /// appropriately.
 class Connection
-    : public std::enable_shared_from_this<Connection>
+    : public std::enable_shared_from_this<Connection>,
+      public hlv::service::common::ManagedConnection
 {
   private:
     typedef std::shared_ptr<hlv::service::echo::server::Connection> ConnectionPtr;
@@ -35,7 +38,7 @@ class Connection
     Connection () = delete;
     
     // Construct a Connection given a socket
-    explicit Connection (boost::asio::ip::tcp::socket socket, 
+    explicit Connection (hlv::service::common::StreamSocket socket, 
             hlv::service::common::ConnectionManager<ConnectionPtr>& manager,
             ConnectionInformation& config);
 
@@ -50,7 +53,7 @@ class Connection
     void read ();
 
     // Socket for this connection
-    boost::asio::ip::tcp::socket socket_;
+    hlv::service::common::StreamSocket socket_;
 
     // A temporary variable that holds the amount to be read
     uint64_t bufferSize_;
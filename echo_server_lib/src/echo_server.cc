@@ -14,7 +14,7 @@ namespace hlv {
 namespace service{
 namespace echo {
 namespace server {
-Connection::Connection (boost::asio::ip::tcp::socket socket,
+Connection::Connection (hlv::service::common::StreamSocket socket,
                         ConnectionManager& manager,
                         ConnectionInformation& config) :
     socket_ (std::move(socket)),
@@ -29,22 +29,21 @@ void Connection::start () {
 }
 
 void Connection::stop () {
-    socket_.close();
+    hlv::service::common::close_socket(socket_);
 }
 
 /// Read and write data from the socket
 void Connection::read () {
     auto self(shared_from_this());
     BOOST_LOG_TRIVIAL(info) << "Reading input";
-    socket_.async_read_some (boost::asio::buffer(buffer_),
+    hlv::service::common::async_read_some (socket_, buffer_.data(), buffer_.size(),
             [this, self] (boost::system::error_code ec,
                           std::size_t bytes_transfered) {
                 BOOST_LOG_TRIVIAL(info) << "Read data";
                 if (!ec) {
-                    std::string data (buffer_.data (), bytes_transfered);
-                    std::cout << data << std::endl;
-                    boost::asio::async_write(socket_, 
-                        boost::asio::buffer(buffer_, bytes_transfered),
+                    BOOST_LOG_TRIVIAL(debug) << std::string (buffer_.data (), bytes_transfered);
+                    hlv::service::common::async_write_all(socket_,
+                        buffer_.data(), bytes_transfered,
                         [this, self] (boost::system::error_code ec, 
                                      std::size_t bytes_written) {
                             if (!ec) {
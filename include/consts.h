@@ -10,12 +10,21 @@ namespace lookup {
     const int32_t AUTH_PORT = 8087;
     const int32_t EBOX_PORT = 8088;
     const int32_t EBOX_RENDEZVOUS_PORT = 8089;
+    const int32_t PROXY_PORT = 8090;
+    const int32_t PROXY_REGISTER_PORT = 8091;
     const int32_t REDIS_PORT = 6379;
     const std::string REDIS_PREFIX = "ev";
     const std::string PERM_BIT_FIELD = "ev:perm_bits"; 
     const std::string LOCAL_SET = "ev:local_set";
+    // Suffix for the key holding a key's version (bumped on every change)
+    const std::string VERSION_KEY = "ev:version";
+    // Key (under the prefix) of the sorted set of registration lease
+    // deadlines, see leases.h
+    const std::string LEASE_SET = "ev:leases";
     const std::string AUTH_LOCATION = "auth";
     const std::string AUTH_SERVICE = "auth";
+    const std::string PROXY_LOCATION = "proxy";
+    const std::string PROXY_SERVICE = "proxy";
     const std::string LDEBOX_LOCATION = "ev:ebox";
     const std::string PROVIDER_LOCATION = "ev:provider";
     const std::string ECHO_LOCATION = "ev:echo";
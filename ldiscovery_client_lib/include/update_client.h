@@ -3,7 +3,9 @@
 #include <map>
 #include <list>
 #include <memory>
+#include <set>
 #include <boost/asio.hpp>
+#include "stream_socket.h"
 #ifndef __EV_EBOX_DISCOVERY_UPDATE_LIB__
 #define __EV_EBOX_DISCOVERY_UPDATE_LIB__
 namespace ev_ebox {
@@ -25,8 +27,9 @@ class EvLDiscoveryClient {
     EvLDiscoveryClient (const EvLDiscoveryClient&) = delete;
     
     /// Construct an EV Update Client.
-    /// host; string address of update address
-    /// port: uint32_t port for update server
+    /// host; string address of update address, or unix:/path for an edge
+    ///       box listening on a Unix domain socket on this host
+    /// port: uint32_t port for update server, unused for unix:/path
     explicit EvLDiscoveryClient (const uint64_t token,
                                  const std::string& host,
                                  const uint32_t port);
@@ -48,8 +51,16 @@ class EvLDiscoveryClient {
     /// token: uint64_t token authorizing update
     /// key: std::string:      key to update
     /// values: TypeValueMap:  types and values to set
+    /// lease: uint32_t:       seconds the values stay unless renewed (see
+    ///                        renew), 0 for good
     bool set_values (const std::string& key, 
-                     const ValueList& values) const;
+                     const ValueList& values,
+                     const uint32_t lease = 0) const;
+
+    /// Renew the leases on every value set with one, with one message per
+    /// key. Values whose lease ran out anyway are set again. Call this a few
+    /// times per lease.
+    bool renew () const;
 
     virtual ~EvLDiscoveryClient();
 
@@ -60,8 +71,18 @@ class EvLDiscoveryClient {
     // Receive response from the server
     bool recv_response (ev_ebox::Response&) const; 
 
+    // Send the update in update_ and wait for the response
+    bool execute () const;
+
     uint64_t token_;
 
+    // Values set with a lease, and the lease, by key
+    struct Leased {
+        uint32_t lease;
+        std::set<std::string> values;
+    };
+    mutable std::map<std::string, Leased> leased_;
+
     // Host and port
     std::string host_;
     uint32_t port_;
@@ -78,7 +99,7 @@ class EvLDiscoveryClient {
     // need to use a common one
     mutable boost::asio::io_service io_service_;
     // Socket
-    mutable boost::asio::ip::tcp::socket socket_;
+    mutable hlv::service::common::StreamSocket socket_;
 };
 } // update
 } // ebox
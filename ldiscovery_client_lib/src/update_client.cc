@@ -24,10 +24,8 @@ EvLDiscoveryClient::EvLDiscoveryClient (const uint64_t token,
 
 /// Connect to EV update service
 bool EvLDiscoveryClient::connect () {
-    boost::asio::ip::tcp::resolver resolver(io_service_);
-    boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve({host_, std::to_string (port_)});
     boost::system::error_code ec;
-    socket_.connect(endpoint, ec);
+    hlv::service::common::connect_stream (io_service_, socket_, host_, std::to_string (port_), ec);
     if (ec) {
         BOOST_LOG_TRIVIAL(error) << "Error connecting to remote endpoint";
         connected_ = false;
@@ -47,7 +45,8 @@ void EvLDiscoveryClient::disconnect () {
 /// key: std::string:      key to update
 /// values: TypeValueMap:  types and values to set
 bool EvLDiscoveryClient::set_values (const std::string& key, 
-                                     const ValueList& values) const {
+                                     const ValueList& values,
+                                     const uint32_t lease) const {
     update_->Clear ();
     BOOST_LOG_TRIVIAL(info) << "Registering with key " << key;
     update_->set_type (ev_ebox::LocalUpdate::ADD);
@@ -56,9 +55,50 @@ bool EvLDiscoveryClient::set_values (const std::string& key,
     for (auto v : values) {
         update_->add_values (v);
     }
-    send_update (*update_);
-    recv_response (*response_);
-    return response_-> success ();
+    if (lease > 0) {
+        update_->set_lease (lease);
+    }
+    if (!execute ()) {
+        return false;
+    }
+    // Remember what to renew, and forget values that are now set for good
+    if (lease > 0) {
+        Leased& leased = leased_[key];
+        leased.lease = lease;
+        leased.values.insert (values.begin (), values.end ());
+    } else if (leased_.count (key)) {
+        for (auto& v : values) {
+            leased_[key].values.erase (v);
+        }
+    }
+    return true;
+}
+
+/// Renew every lease, setting values again if their lease ran out
+bool EvLDiscoveryClient::renew () const {
+    bool success = true;
+    for (auto& leased : leased_) {
+        if (leased.second.values.empty ()) {
+            continue;
+        }
+        update_->Clear ();
+        update_->set_type (ev_ebox::LocalUpdate::RENEW);
+        update_->set_token (token_);
+        update_->set_key (leased.first);
+        update_->set_lease (leased.second.lease);
+        for (auto& v : leased.second.values) {
+            update_->add_values (v);
+        }
+        if (execute ()) {
+            continue;
+        }
+        BOOST_LOG_TRIVIAL(info) << "Leases on " << leased.first << " ran out, registering again";
+        update_->set_type (ev_ebox::LocalUpdate::ADD);
+        if (!execute ()) {
+            success = false;
+        }
+    }
+    return success;
 }
 
 /// Delete types from a given key
@@ -74,9 +114,21 @@ bool EvLDiscoveryClient::del_values (const std::string& key,
     for (auto v : values) {
         update_->add_values (v);
     }
-    send_update (*update_);
-    recv_response (*response_);
-    return response_-> success ();
+    if (!execute ()) {
+        return false;
+    }
+    if (leased_.count (key)) {
+        for (auto& v : values) {
+            leased_[key].values.erase (v);
+        }
+    }
+    return true;
+}
+
+bool EvLDiscoveryClient::execute () const {
+    return send_update (*update_) &&
+           recv_response (*response_) &&
+           response_->success ();
 }
 
 // Send update to the server
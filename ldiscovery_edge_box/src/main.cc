@@ -5,37 +5,24 @@
 #include <thread>
 #include <tuple>
 #include <sstream>
+#include <vector>
 #include <signal.h>
 #include <boost/asio.hpp>
 #include <boost/program_options.hpp>
 #include <boost/log/trivial.hpp>
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
-#include <hiredisasio.h>
+#include <managed_client.h>
 #include <getifaddr.h>
 #include "consts.h"
 #include "logging_common.h"
+#include "socket_handoff.h"
+#include "capability.h"
+#include "leases.h"
 #include "update_server.h"
 
 // Main file for EV ebox server
 namespace po = boost::program_options;
-namespace {
-void connectCallback (const redisAsyncContext* c, int status) {
-    if (status != REDIS_OK) {
-        std::cerr << "Error " << c->errstr << std::endl;
-        return;
-    }
-    BOOST_LOG_TRIVIAL (info) << "Connected with redis";
-}
-
-void disconnectCallback (const redisAsyncContext* c, int status) {
-    BOOST_LOG_TRIVIAL (info) << "Disconnected ";
-    if (status != REDIS_OK) {
-        std::cerr << "Disconnected due to error " << c->errstr << std::endl;
-    }
-}
-}
-
 int
 main (int argc, char* argv[]) {
     GOOGLE_PROTOBUF_VERIFY_VERSION;
@@ -48,6 +35,13 @@ main (int argc, char* argv[]) {
                 redisAddress = "127.0.0.1",
                 prefix = hlv::service::lookup::REDIS_PREFIX;
     int32_t redisPort = hlv::service::lookup::REDIS_PORT;
+    std::string handoffPath;
+    uint32_t drainSeconds = 30;
+    hlv::service::common::Timeouts timeouts (300, 30, 30);
+    std::vector<std::string> capabilityKeys;
+    uint32_t sweepInterval = 1000;
+    int32_t distance = 0;
+    std::string unixPath;
     desc.add_options()
         ("help,h", "Display help")
         ("address,a", po::value<std::string>(&address)->implicit_value(address), "Bind to address")
@@ -55,7 +49,31 @@ main (int argc, char* argv[]) {
         ("raddress,r", po::value<std::string>(&redisAddress)->implicit_value(redisAddress), "Redis server")
         ("rport", po::value<int32_t>(&redisPort)->implicit_value(redisPort), "Redis port")
         ("prefix", po::value<std::string>(&prefix)->implicit_value(prefix), 
-                   "Prefix for redis DB");
+                   "Prefix for redis DB")
+        ("handoff", po::value<std::string>(&handoffPath),
+                   "Unix socket for hot restarts: take over the listening socket from the server on it, "
+                   "and hand ours to the next one")
+        ("drain", po::value<uint32_t>(&drainSeconds)->implicit_value(drainSeconds),
+                   "Seconds to wait for open connections after handing off")
+        ("idle-timeout", po::value<uint32_t>(&timeouts.idle)->implicit_value(timeouts.idle),
+                   "Close connections idle for this many seconds (0 disables)")
+        ("read-timeout", po::value<uint32_t>(&timeouts.read)->implicit_value(timeouts.read),
+                   "Close connections that take this many seconds to send a request (0 disables)")
+        ("write-timeout", po::value<uint32_t>(&timeouts.write)->implicit_value(timeouts.write),
+                   "Close connections that take this many seconds to read a response (0 disables)")
+        ("capability-key", po::value<std::vector<std::string>>(&capabilityKeys)->composing(),
+                   "Check capabilities sent with updates against the key in this file (repeatable)")
+        ("require-capability", "Fail updates sent without a capability")
+        ("sweep-leases", po::value<uint32_t>(&sweepInterval)->implicit_value(sweepInterval),
+                   "Milliseconds between removals of registrations whose lease ran out (0 leaves it to other servers)")
+        ("distance", po::value<int32_t>(&distance)->implicit_value(distance),
+                   "Distance to register with, clients use the nearest edge box")
+        ("unix", po::value<std::string>(&unixPath),
+                   "Also accept connections on a Unix domain socket at this path")
+        ("register-unix", "Register the Unix domain socket rather than the TCP address, "
+                   "for when every client is on this host")
+        ("io-uring", "Serve connections through io_uring rather than epoll "
+                   "(builds with HLV_IO_URING, Linux 5.19 or later)");
     po::options_description options;
     options.add(desc);
     po::variables_map vm;
@@ -74,6 +92,11 @@ main (int argc, char* argv[]) {
         return 0;
     }
 
+    if (vm.count ("register-unix") && unixPath.empty ()) {
+        std::cerr << "--register-unix needs --unix" << std::endl;
+        return 1;
+    }
+
     // Register this box with lookup
     std::string registerAddress = address;
     if (registerAddress == "0.0.0.0") {
@@ -108,7 +131,15 @@ main (int argc, char* argv[]) {
     freeReplyObject (syncReply);
     
     std::stringstream location;
-    location << registerAddress << ":" << port;
+    if (vm.count ("register-unix")) {
+        location << hlv::service::common::UNIX_PREFIX << unixPath;
+    } else {
+        location << registerAddress << ":" << port;
+    }
+    if (distance != 0) {
+        // As EndpointSelector parses it
+        location << "@" << distance;
+    }
     syncReply = (redisReply*) redisCommand (syncContext,
                                             "sadd %s:%s.%s %s",
                                              prefix.c_str (),
@@ -122,39 +153,84 @@ main (int argc, char* argv[]) {
     freeReplyObject (syncReply);
     redisFree (syncContext);
 
-    // Connect to Redis
-    redisAsyncContext *context = redisAsyncConnect (redisAddress.c_str(), redisPort);
-    if (!context) {
-        std::cerr << "Failed to allocate redis context" << std::endl;
-        return 0;
-    }
-
-    if (context->err) {
-        std::cerr << "Failed to connect to redis instance " << syncContext->errstr << std::endl;
-        return 0;
-    }  
-
-    redisAsyncSetConnectCallback (context, connectCallback);
-    redisAsyncSetDisconnectCallback (context, disconnectCallback);
-
     // Create server
     boost::asio::io_service io_service;
 
-    asio_redis::redisBoostClient client (io_service, context);
+    // Connect to Redis, reconnecting whenever the connection is lost
+    asio_redis::ManagedRedisClient client (io_service, redisAddress, redisPort);
+    if (!client.connect ()) {
+        std::cerr << "Failed to connect to redis instance " << client.errstr () << std::endl;
+        return 0;
+    }
+
     // Server information
     hlv::service::ebox::update::ConnectionInformation information 
                                                     (redisAddress,
                                                      redisPort,
-                                                     context,
-                                                     prefix);
+                                                     &client,
+                                                     prefix,
+                                                     io_service);
     BOOST_LOG_TRIVIAL (info) << "Using prefix " << prefix;
-    // Create an update server
-    hlv::service::ebox::update::Server update (
-            io_service,
-            address,
-            port,
-            information);
-    update.start ();
+
+    // Edge boxes check capabilities themselves, no need to ask the auth
+    // service who a client is
+    hlv::service::common::capability::Verifier capabilities;
+    for (auto& path : capabilityKeys) {
+        if (!capabilities.add_key_file (path)) {
+            std::cerr << "Could not read capability key from " << path << std::endl;
+            return 1;
+        }
+    }
+    if (!capabilities.empty ()) {
+        information.capabilities = &capabilities;
+        information.requireCapability = vm.count ("require-capability") > 0;
+    } else if (vm.count ("require-capability")) {
+        std::cerr << "--require-capability needs a --capability-key" << std::endl;
+        return 1;
+    }
+    // Create an update server, on the listening socket of the server being
+    // replaced if there is one
+    std::unique_ptr<hlv::service::ebox::update::Server> update;
+    std::vector<int> inherited;
+    if (!handoffPath.empty () &&
+        hlv::service::common::handoff::take_over (handoffPath, inherited)) {
+        update.reset (new hlv::service::ebox::update::Server (
+                io_service,
+                inherited[0],
+                information));
+    } else {
+        update.reset (new hlv::service::ebox::update::Server (
+                io_service,
+                address,
+                port,
+                information));
+    }
+    update->set_timeouts (timeouts);
+    // A Unix domain socket comes second, if the server being replaced had
+    // one (at the same path, as long as --unix did not change)
+    if (!unixPath.empty ()) {
+        if (inherited.size () > 1) {
+            update->adopt_unix (inherited[1]);
+        } else {
+            update->listen_unix (unixPath);
+        }
+    } else if (inherited.size () > 1) {
+        close (inherited[1]);
+    }
+    if (vm.count ("io-uring") &&
+        !update->set_backend (hlv::service::common::Backend::IO_URING)) {
+        std::cerr << "io_uring is not available" << std::endl;
+        return 1;
+    }
+    update->start ();
+    // Expire registrations whose lease ran out
+    hlv::service::common::lease::Sweeper sweeper (io_service,
+                                                  client,
+                                                  prefix,
+                                                  boost::posix_time::milliseconds (sweepInterval));
+    if (sweepInterval > 0) {
+        sweeper.start ();
+    }
 
     boost::asio::signal_set signals (io_service);
     signals.add (SIGINT);
@@ -162,15 +238,50 @@ main (int argc, char* argv[]) {
 #if defined(SIGQUIT)
     signals.add (SIGQUIT);
 #endif
-    signals.async_wait ([&](boost::system::error_code, int) {
-        std::cout << "Quitting" << std::endl;
-        update.stop ();
+    boost::asio::deadline_timer drainTimer (io_service);
+    auto shutdown = [&] () {
+        drainTimer.cancel ();
+        update->stop ();
+        sweeper.stop ();
         client.stop ();
         io_service.stop ();
+    };
+
+    // Hand the listening sockets to a restarted server, then finish the
+    // requests already in flight
+    bool handedOff = false;
+    hlv::service::common::handoff::Listener handoff (
+            io_service,
+            handoffPath,
+            [&] () { return update->native_handles (); },
+            [&] () {
+                handedOff = true;
+                update->stop_accepting ();
+                hlv::service::common::handoff::drain (
+                        drainTimer,
+                        *update,
+                        boost::posix_time::microsec_clock::universal_time () +
+                            boost::posix_time::seconds (drainSeconds),
+                        shutdown);
+            });
+    if (!handoffPath.empty ()) {
+        handoff.start ();
+    }
+
+    signals.async_wait ([&](boost::system::error_code, int) {
+        std::cout << "Quitting" << std::endl;
+        handoff.stop ();
+        shutdown ();
     });
     // This thread now provides I/O service
     io_service.run();
-    redisAsyncDisconnect (context);
+    client.disconnect ();
+
+    // The server that took over is still registered at this location
+    if (handedOff) {
+        google::protobuf::ShutdownProtobufLibrary();
+        return 1;
+    }
 
     syncContext = redisConnect (redisAddress.c_str (), redisPort);
     if (syncContext == NULL) {
@@ -3,47 +3,22 @@
 #include <utility>
 #include <iostream>
 #include <string>
-#include <sstream>
 #include <cassert>
 #include <algorithm>
 #include <cstdio>
+#include <cstdlib>
 #include <boost/log/trivial.hpp>
+#include <managed_client.h>
+#include "coroutine.h"
 #include "update_connection.h"
 #include "update_server.h"
 #include "consts.h"
+#include "leases.h"
 
 namespace {
-/// Response to HGET. HGET is called to retrieve PERM bits
-void redisHashResponse (redisAsyncContext* context, void* reply, void* data) {
-    hlv::service::ebox::update::Connection* connect = 
-                        (hlv::service::ebox::update::Connection*)data;
-    redisReply* rreply = (redisReply*) reply;
-    connect->hashReply (rreply);
-}
-
-/// Response to HSETNX which is called to set permission bits
-void redisHashSetResponse (redisAsyncContext* context, void* reply, void* data) {
-    hlv::service::ebox::update::Connection* connect = 
-                        (hlv::service::ebox::update::Connection*)data;
-    redisReply* rreply = (redisReply*) reply;
-    connect->hashSetReply (rreply);
-}
-
-/// Callback for SADD used to add to the local discovery box
-void redisSAddResponse (redisAsyncContext* context, void* reply, void* data) {
-    hlv::service::ebox::update::Connection* connect = 
-                        (hlv::service::ebox::update::Connection*)data;
-    redisReply* rreply = (redisReply*) reply;
-    connect->saddReply (rreply);
-}
-
-/// Callback for srem remove elements from local discovery box
-void redisSRemResponse (redisAsyncContext* context, void* reply, void* data) {
-    hlv::service::ebox::update::Connection* connect = 
-                        (hlv::service::ebox::update::Connection*)data;
-    redisReply* rreply = (redisReply*) reply;
-    connect->sremReply (rreply);
-}
+// Suffixes of a key's set of local hosts and of its version counter
+const std::string LOCAL_SET_SUFFIX = "." + hlv::service::lookup::LOCAL_SET;
+const std::string VERSION_SUFFIX = "." + hlv::service::lookup::VERSION_KEY;
 }
 
 namespace hlv {
@@ -62,283 +37,295 @@ namespace update {
 ///    2. If found check if permissions match.
 ///    3. If permissions match remove elements.
 
-Connection::Connection (boost::asio::ip::tcp::socket socket,
+Connection::Connection (hlv::service::common::StreamSocket socket,
                         ConnectionManager& manager,
                         ConnectionInformation& config) :
     socket_ (std::move(socket)),
-    bufferSize_ (0),
     manager_ (manager),
-    config_ (config) {
+    config_ (config),
+    command_ (config.prefix) {
 }
 
 void Connection::start () {
     BOOST_LOG_TRIVIAL(info) << "Starting connection";
-    read_size();
-}
-
-void Connection::stop () {
-    socket_.close();
-}
-
-void Connection::write_response (const ev_ebox::Response& response) {
     auto self(shared_from_this());
-    uint64_t size = response.ByteSize ();
-    *((uint64_t*)write_buffer_.data()) = size;
-    response.SerializeToArray (write_buffer_.data() + sizeof(uint64_t), size);
-    BOOST_LOG_TRIVIAL (info) << "Writing response";
-    boost::asio::async_write (socket_,
-        boost::asio::buffer(write_buffer_),
-        boost::asio::transfer_exactly (size + sizeof(uint64_t)),
-        [this, self] (boost::system::error_code ec,
-                          std::size_t bytes_transfered) {
-           if (ec) {
-               BOOST_LOG_TRIVIAL (info) << "Error sending join message " << ec;
-               manager_.stop(shared_from_this());
-           }
-           BOOST_LOG_TRIVIAL (info) << "Successfully responded";
-           response_.Clear ();
-           read_size ();
-        }
-    );
+    boost::asio::spawn (config_.io_service,
+        [this, self] (boost::asio::yield_context yield) {
+            serve (yield);
+        });
 }
 
-void Connection::read_size () {
-    auto self(shared_from_this());
-    boost::asio::async_read (socket_, 
-            boost::asio::buffer(&bufferSize_, sizeof(bufferSize_)),
-            [this, self] (boost::system::error_code ec, 
-                                std::size_t bytes_transfered) {
-                BOOST_LOG_TRIVIAL(info) << "Read connection";
-                if (!ec) {
-                    BOOST_LOG_TRIVIAL(info) << "Read " 
-                                << bufferSize_
-                                << " byte preheader " 
-                                << bytes_transfered;
-                    read_buffer(bufferSize_);
-                } else if (ec != boost::asio::error::operation_aborted) {
-                    // Stop here
-                    BOOST_LOG_TRIVIAL(info) << "Connection ended";
-                    manager_.stop(shared_from_this());
-                }
-                else {
-                    BOOST_LOG_TRIVIAL(error) << "Unknown ASIO error " << ec << " closing socket";
-                    manager_.stop(shared_from_this());
-                }
-            });
+void Connection::stop () {
+    common::close_socket (socket_);
 }
 
-void Connection::read_buffer (uint64_t length) {
-    auto self(shared_from_this());
-    BOOST_LOG_TRIVIAL(info) << "Being asked to read " << bufferSize_ << " bytes";
-    boost::asio::async_read (socket_, 
-            boost::asio::buffer(buffer_),
-            boost::asio::transfer_exactly(length),
-            [this, self] (boost::system::error_code ec,
-                          std::size_t bytes_transfered) {
-                BOOST_LOG_TRIVIAL(info) << "Read data";
-                if (!ec) {
-                    
-                    if (!update_.ParseFromArray(buffer_.data(), bytes_transfered)) {
-                        BOOST_LOG_TRIVIAL(error) << "Could not parse request";
-                        manager_.stop(shared_from_this());
-                        return;
+void Connection::serve (boost::asio::yield_context yield) {
+    boost::system::error_code ec;
+    const char* data;
+    size_t length;
+    while (common::read_frame (socket_, reader_, data, length,
+                [this] (bool partial) {
+                    // Answered everything asked so far, let the client
+                    // reconnect elsewhere. The read fails once closed.
+                    if (!partial && manager_.draining ()) {
+                        BOOST_LOG_TRIVIAL (info) << "Draining, closing connection";
+                        common::close_socket (socket_);
                     }
-                    process_request ();
-                    //execute_updates (update_);
-                } else if (ec != boost::asio::error::operation_aborted) {
-                    // Stop here
-                    BOOST_LOG_TRIVIAL(info) << "Connection ended read: " << bytes_transfered;
-                    manager_.stop(shared_from_this());
-                }
-                else {
-                    BOOST_LOG_TRIVIAL(error) << "Unknown ASIO error " << ec << " closing socket";
-                    manager_.stop(shared_from_this());
-                }
-            });
+                    manager_.expect (this, partial ? common::READ : common::IDLE);
+                }, yield, ec)) {
+        BOOST_LOG_TRIVIAL(info) << "Read " << length << " byte request";
+        // Waiting on Redis from here on
+        manager_.expect (this, common::NO_DEADLINE);
+        if (!update_.ParseFromArray(data, length)) {
+            BOOST_LOG_TRIVIAL(error) << "Could not parse request";
+            break;
+        }
+        response_.set_token (0);
+        response_.set_success (process_request (yield));
+        update_.Clear ();
+        BOOST_LOG_TRIVIAL (info) << "Writing response";
+        manager_.expect (this, common::WRITE);
+        if (!common::write_frame (socket_, response_, frame_, handlerMemory_, yield, ec)) {
+            BOOST_LOG_TRIVIAL (info) << "Error sending response " << ec;
+            break;
+        }
+        BOOST_LOG_TRIVIAL (info) << "Successfully responded";
+        response_.Clear ();
+    }
+    if (ec == boost::asio::error::message_size) {
+        BOOST_LOG_TRIVIAL(error) << "Request too large, closing";
+    } else if (ec != boost::asio::error::operation_aborted) {
+        BOOST_LOG_TRIVIAL(info) << "Connection ended";
+    }
+    manager_.stop(shared_from_this());
 }
 
 // Process all requests
-void Connection::process_request () {
+bool Connection::process_request (boost::asio::yield_context yield) {
     if (update_.values_size() == 0) {
         BOOST_LOG_TRIVIAL (info) << "Failing due to lack of types";
-        fail_request ();
-        return;
+        return false;
     }
-    // Step 1 for either add or remove get permissions
-    // The flow is
-    // get_permtoken -> hashReply (perm found) -> hashSetReply (set perm?) ->
-    // {update_set -> saddReply} (add to set) or {remove_from_set ->  sremReply} (remove from set)
-    get_permtoken ();
-}
-
-// Try to get permission tokens
-void Connection::get_permtoken () {
-    redisAsyncCommand (config_.redisContext, 
-                      redisHashResponse,
-                      this,
-                      "HGET %s:%s %s",
-                      config_.prefix.c_str (),
-                      update_.key ().c_str (),
-                      hlv::service::lookup::PERM_BIT_FIELD.c_str ());
-                        
+    if (!check_capability ()) {
+        return false;
+    }
+    // Step 1 for either add or remove get permissions, then change the set
+    if (!check_permission (yield)) {
+        return false;
+    }
+    if (update_.type () == ev_ebox::LocalUpdate::ADD) {
+        return update_set (yield);
+    } else if (update_.type () == ev_ebox::LocalUpdate::REMOVE) {
+        return remove_from_set (yield);
+    } else if (update_.type () == ev_ebox::LocalUpdate::RENEW) {
+        return renew (yield);
+    }
+    return false;
 }
 
-// Got a response from get permission tokens
-void Connection::hashReply (redisReply* reply) {
-    // Called back in here when PERM tokens are gotten
-    BOOST_LOG_TRIVIAL (info) << "Got response to looking up PERM bits";
-    if (reply->type == REDIS_REPLY_ERROR) {
-        BOOST_LOG_TRIVIAL(error) << "Redis sent us an error, 'tis sad, fail";
-        fail_request ();
-    } else if (reply->type == REDIS_REPLY_NIL) {
-        // If not found and adding just try adding a permission bit
-        if (update_.type () == ev_ebox::LocalUpdate::ADD) {
-            BOOST_LOG_TRIVIAL (info) << "This key doesn't exist, which is fine";
-            BOOST_LOG_TRIVIAL (info) << "Setting token to current token " << update_.token ();
-            redisAsyncCommand (config_.redisContext,
-                               redisHashSetResponse,
-                               this,
-                               "HSETNX %s:%s %s %llu",
-                               config_.prefix.c_str (),
-                               update_.key ().c_str (),
-                               hlv::service::lookup::PERM_BIT_FIELD.c_str (),
-                               update_.token ());
-        } else {
-            BOOST_LOG_TRIVIAL (info) << "This key doesn't exist, can't really remove";
-            fail_request ();
-        }
-    } else if (reply->type == REDIS_REPLY_STRING) {
-        uint64_t token = std::stoull (std::string(reply->str));
-        if (token != update_.token ()) {
-            // This is an implementation detail, should be more general, simpler this way for now
-            BOOST_LOG_TRIVIAL (info) << "Can only join a local lookup group with the same token, failing"
-                                    << "token = " << token << " given " << update_.token ();
-            fail_request ();
-        } else {
-            if (update_.type () == ev_ebox::LocalUpdate::ADD) {
-                update_set ();
-            } else if (update_.type () == ev_ebox::LocalUpdate::REMOVE) {
-                remove_from_set (); 
-            }
+bool Connection::check_capability () {
+    if (!config_.capabilities) {
+        return true;
+    }
+    if (!update_.has_capability ()) {
+        if (config_.requireCapability) {
+            BOOST_LOG_TRIVIAL (info) << "Failing update without a capability";
+            return false;
         }
-    } else {
-        BOOST_LOG_TRIVIAL (error) << "Redis's reply made no sense. The reply type was " << reply->type;
-        fail_request ();
+        return true;
     }
+    hlv::service::common::capability::Claims claims;
+    if (!config_.capabilities->verify (update_.capability (), claims)) {
+        BOOST_LOG_TRIVIAL (info) << "Failing update with an invalid or expired capability";
+        return false;
+    }
+    // The permission bits set on, and compared against, the key
+    update_.set_token (claims.permissions);
+    return true;
 }
 
-// Got a response from trying to exclusively adding permission bits
-void Connection::hashSetReply (redisReply* reply) {
-    BOOST_LOG_TRIVIAL (info) << "Got response from setting PERM bits";
-    if (reply->type == REDIS_REPLY_ERROR) {
-        BOOST_LOG_TRIVIAL(error) << "Redis sent us an error, 'tis sad, fail";
-        fail_request ();
-    } else if (reply->type == REDIS_REPLY_INTEGER) {
-        if (reply->integer == 1) {
-            update_set ();
-        } else {
-            // Someone beat us
-            BOOST_LOG_TRIVIAL (info) << "SETNX reports we lost the race";
-            // Get token and see what it is
-            get_permtoken ();
+bool Connection::check_permission (boost::asio::yield_context yield) {
+    while (true) {
+        command_.begin (3)
+                .arg ("HGET", 4)
+                .key (update_.key ())
+                .arg (hlv::service::lookup::PERM_BIT_FIELD);
+        redisReply* reply = common::redis_read (*config_.redis, command_, yield);
+        BOOST_LOG_TRIVIAL (info) << "Got response to looking up PERM bits";
+        if (!reply || reply->type == REDIS_REPLY_ERROR) {
+            BOOST_LOG_TRIVIAL(error) << "Redis sent us an error, 'tis sad, fail";
+            return false;
+        } else if (reply->type == REDIS_REPLY_STRING) {
+            char* end = NULL;
+            uint64_t token = strtoull (reply->str, &end, 10);
+            if (reply->len == 0 || end != reply->str + reply->len) {
+                BOOST_LOG_TRIVIAL (error) << "Permission bits " << reply->str << " are not a number";
+                return false;
+            }
+            if (token != update_.token ()) {
+                // This is an implementation detail, should be more general, simpler this way for now
+                BOOST_LOG_TRIVIAL (info) << "Can only join a local lookup group with the same token, failing"
+                                        << "token = " << token << " given " << update_.token ();
+                return false;
+            }
+            return true;
+        } else if (reply->type != REDIS_REPLY_NIL) {
+            BOOST_LOG_TRIVIAL (error) << "Redis's reply made no sense. The reply type was " << reply->type;
+            return false;
         }
-    } else {
-        BOOST_LOG_TRIVIAL (error) << "Redis's reply made no sense. The reply type was " << reply->type;
-        fail_request ();
+        // If not found and adding just try adding a permission bit
+        if (update_.type () != ev_ebox::LocalUpdate::ADD) {
+            BOOST_LOG_TRIVIAL (info) << "This key doesn't exist, can't really remove or renew";
+            return false;
+        }
+        BOOST_LOG_TRIVIAL (info) << "This key doesn't exist, which is fine";
+        BOOST_LOG_TRIVIAL (info) << "Setting token to current token " << update_.token ();
+        command_.begin (4)
+                .arg ("HSETNX", 6)
+                .key (update_.key ())
+                .arg (hlv::service::lookup::PERM_BIT_FIELD)
+                .arg ((uint64_t)update_.token ());
+        reply = common::redis_write (*config_.redis, command_, yield);
+        BOOST_LOG_TRIVIAL (info) << "Got response from setting PERM bits";
+        if (!reply || reply->type == REDIS_REPLY_ERROR) {
+            BOOST_LOG_TRIVIAL(error) << "Redis sent us an error, 'tis sad, fail";
+            return false;
+        } else if (reply->type != REDIS_REPLY_INTEGER) {
+            BOOST_LOG_TRIVIAL (error) << "Redis's reply made no sense. The reply type was " << reply->type;
+            return false;
+        } else if (reply->integer == 1) {
+            return true;
+        }
+        // Someone beat us, get their token and see what it is
+        BOOST_LOG_TRIVIAL (info) << "SETNX reports we lost the race";
     }
 }
 
 // Add elements to set of local hosts
-void Connection::update_set () {
-    std::stringstream keystream;
-    keystream << config_.prefix.c_str() << ":" 
-              << update_.key () 
-              << "." << hlv::service::lookup::LOCAL_SET;
-    std::string key = keystream.str ();
-    BOOST_LOG_TRIVIAL (info) << "Adding to " << key; 
-    const char** args = new const char*[2 + update_.values_size ()];
-    size_t index = 0;
-    args [index++] = "sadd";
-    args [index++] = key.c_str ();
-    for (auto v: update_.values ()) {
-        args[index++] = v.c_str ();
+bool Connection::update_set (boost::asio::yield_context yield) {
+    BOOST_LOG_TRIVIAL (info) << "Adding to " << config_.prefix << ":"
+                             << update_.key () << LOCAL_SET_SUFFIX;
+    command_.begin (2 + update_.values_size ())
+            .arg ("sadd", 4)
+            .key (update_.key (), LOCAL_SET_SUFFIX.data (), LOCAL_SET_SUFFIX.size ());
+    for (auto& v : update_.values ()) {
+        command_.arg (v);
     }
 
-    redisAsyncCommandArgv (config_.redisContext,
-                       redisSAddResponse,
-                       this,
-                       index,
-                       args,
-                       NULL);
-    delete[] args;
-}
-
-void Connection::saddReply (redisReply* reply) {
+    redisReply* reply = versioned_update (yield);
     BOOST_LOG_TRIVIAL (info) << "Got response from SADD";
-    if (reply->type == REDIS_REPLY_ERROR) {
+    if (!reply || reply->type == REDIS_REPLY_ERROR) {
         BOOST_LOG_TRIVIAL (error) << "Redis sent us an error";
-        fail_request ();
-    } else {
-        response_.set_token (0);
-        response_.set_success (true);
-        update_.Clear ();
-        write_response (response_);
+        return false;
     }
+    return true;
 }
 
 // Remove from set
-void Connection::remove_from_set () {
-    std::stringstream keystream;
-    keystream << config_.prefix.c_str() << ":" 
-              << update_.key () 
-              << "." << hlv::service::lookup::LOCAL_SET;
-    std::string key = keystream.str ();
-    BOOST_LOG_TRIVIAL (info) << "Removing from " << key; 
-    const char** args = new const char*[2 + update_.values_size ()];
-    size_t index = 0;
-    args [index++] = "srem";
-    args [index++] = key.c_str ();
-    for (auto v: update_.values ()) {
-        args[index++] = v.c_str ();
+bool Connection::remove_from_set (boost::asio::yield_context yield) {
+    BOOST_LOG_TRIVIAL (info) << "Removing from " << config_.prefix << ":"
+                             << update_.key () << LOCAL_SET_SUFFIX;
+    command_.begin (2 + update_.values_size ())
+            .arg ("srem", 4)
+            .key (update_.key (), LOCAL_SET_SUFFIX.data (), LOCAL_SET_SUFFIX.size ());
+    for (auto& v : update_.values ()) {
+        command_.arg (v);
     }
 
-    redisAsyncCommandArgv (config_.redisContext,
-                       redisSRemResponse,
-                       this,
-                       index,
-                       args,
-                       NULL);
-    delete[] args;
-}
-
-void Connection::sremReply (redisReply* reply) {
+    redisReply* reply = versioned_update (yield);
     BOOST_LOG_TRIVIAL (info) << "Got response from SREM";
-    if (reply->type == REDIS_REPLY_ERROR) {
+    if (!reply || reply->type == REDIS_REPLY_ERROR) {
         BOOST_LOG_TRIVIAL (error) << "Redis sent us an error";
-        fail_request ();
-    } else if (reply->type == REDIS_REPLY_INTEGER) {
-        if (reply->integer > 0) {
-            response_.set_token (0);
-            response_.set_success (true);
-            update_.Clear ();
-            write_response (response_);
-        } else {
-            BOOST_LOG_TRIVIAL (info) << "No members found to delete";
-            fail_request ();
-        }
-    } else {
+        return false;
+    } else if (reply->type != REDIS_REPLY_INTEGER) {
         BOOST_LOG_TRIVIAL (info) << "Weird BOOST response";
-        fail_request ();
+        return false;
+    } else if (reply->integer == 0) {
+        BOOST_LOG_TRIVIAL (info) << "No members found to delete";
+        return false;
+    }
+    return true;
+}
+
+// Extend the leases on the values, if they still have them
+bool Connection::renew (boost::asio::yield_context yield) {
+    if (update_.lease () == 0) {
+        BOOST_LOG_TRIVIAL (info) << "Failing RENEW without a lease";
+        return false;
+    }
+    std::string deadline = std::to_string (
+                hlv::service::common::lease::deadline (update_.lease ()));
+    command_.begin (5 + update_.values_size ())
+            .arg ("EVAL", 4)
+            .arg (hlv::service::common::lease::RENEW_SCRIPT,
+                  sizeof (hlv::service::common::lease::RENEW_SCRIPT) - 1)
+            .arg ("1", 1)
+            .key (hlv::service::lookup::LEASE_SET)
+            .arg (deadline);
+    for (auto& v : update_.values ()) {
+        hlv::service::common::lease::entry (hlv::service::common::lease::LOCAL_SET,
+                                            update_.key (), v, entry_);
+        command_.arg (entry_);
     }
+    redisReply* reply = common::redis_write (*config_.redis, command_, yield);
+    if (!reply || reply->type != REDIS_REPLY_INTEGER) {
+        BOOST_LOG_TRIVIAL (error) << "Could not renew leases";
+        return false;
+    } else if (reply->integer != update_.values_size ()) {
+        // Some ran out already, the client has to add them again
+        BOOST_LOG_TRIVIAL (info) << "Renewed " << reply->integer << " of "
+                                 << update_.values_size () << " leases";
+        return false;
+    }
+    return true;
 }
 
-void Connection::fail_request () {
-    response_.set_token (0);
-    response_.set_success (false);
-    update_.Clear ();
-    write_response (response_);
+// Change the local set and bump its version atomically. Values added with
+// a lease get (or have renewed) a lease entry; those added without one and
+// those removed lose theirs, so they neither expire nor linger.
+redisReply* Connection::versioned_update (boost::asio::yield_context yield) {
+    config_.redis->write (NULL,
+                          NULL,
+                          "MULTI");
+    config_.redis->write (NULL, NULL, command_);
+    bool leased = (update_.type () == ev_ebox::LocalUpdate::ADD && update_.lease () > 0);
+    std::string deadline;
+    if (leased) {
+        deadline = std::to_string (hlv::service::common::lease::deadline (update_.lease ()));
+        command_.begin (2 + 2 * update_.values_size ())
+                .arg ("ZADD", 4);
+    } else {
+        command_.begin (2 + update_.values_size ())
+                .arg ("ZREM", 4);
+    }
+    command_.key (hlv::service::lookup::LEASE_SET);
+    for (auto& v : update_.values ()) {
+        hlv::service::common::lease::entry (hlv::service::common::lease::LOCAL_SET,
+                                            update_.key (), v, entry_);
+        if (leased) {
+            command_.arg (deadline);
+        }
+        command_.arg (entry_);
+    }
+    config_.redis->write (NULL, NULL, command_);
+    command_.begin (2)
+            .arg ("INCR", 4)
+            .key (update_.key (), VERSION_SUFFIX.data (), VERSION_SUFFIX.size ());
+    config_.redis->write (NULL, NULL, command_);
+    command_.begin (1)
+            .arg ("EXEC", 4);
+    return unwrap_exec (common::redis_write (*config_.redis, command_, yield));
 }
 
+// EXEC replies with an array holding the reply to each queued command (the
+// set's, the lease set's and the version's), no reply means the connection
+// to Redis was lost
+redisReply* Connection::unwrap_exec (redisReply* reply) {
+    if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements != 3) {
+        return NULL;
+    }
+    return reply->element[0];
+}
 
 } // namespace update
 } // namespace ebox
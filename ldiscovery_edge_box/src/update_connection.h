@@ -1,13 +1,24 @@
 // Copyright 20xx The Regents of the University of California
 // This is a test service for SDN-v2 High Level Virtualization
 #include <memory>
+#include <vector>
 #include <boost/asio.hpp>
+#include <boost/asio/spawn.hpp>
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
+#include <command_builder.h>
 #include "ebox.pb.h"
+#include "capability.h"
 #include "common_manager.h"
+#include "stream_socket.h"
+#include "uring.h"
+#include "frame_reader.h"
+#include "handler_memory.h"
 #ifndef _HLV_UPDATE_CONNECTION_H_
 #define _HLV_UPDATE_CONNECTION_H_
+namespace asio_redis {
+class ManagedRedisClient;
+}
 /// The Connection class implements the logic used by the HLV ebox service
 namespace hlv {
 namespace service{
@@ -18,17 +29,27 @@ namespace update {
 struct ConnectionInformation {
     std::string redisServer; // Redis server
     uint32_t redisPort; // Port
-    redisAsyncContext* redisContext;
+    asio_redis::ManagedRedisClient* redis;
     std::string prefix;
+    // Connections run as coroutines on this
+    boost::asio::io_service& io_service;
+    // Checks capabilities sent with updates, null to go by Token alone
+    hlv::service::common::capability::Verifier* capabilities;
+    // Fail updates that come without a capability
+    bool requireCapability;
     ConnectionInformation(
             const std::string& _redisServer,
             const uint32_t  _redisPort,
-            redisAsyncContext* _redisContext,
-            std::string _prefix) :
+            asio_redis::ManagedRedisClient* _redis,
+            std::string _prefix,
+            boost::asio::io_service& _io_service) :
             redisServer (_redisServer),
             redisPort (_redisPort),
-            redisContext (_redisContext),
-            prefix (_prefix) {
+            redis (_redis),
+            prefix (_prefix),
+            io_service (_io_service),
+            capabilities (nullptr),
+            requireCapability (false) {
     }
 
 };
@@ -45,8 +66,12 @@ struct ConnectionInformation {
 ///    1. Check for permussion to add using HGET. If not found fail
 ///    2. If found check if permissions match.
 ///    3. If permissions match remove elements.
+/// Renewing leases goes through the same check before extending them.
+/// Each connection is a coroutine that reads a request, carries it out and
+/// answers it, so the sequence reads top to bottom.
 class Connection
-    : public std::enable_shared_from_this<Connection>
+    : public std::enable_shared_from_this<Connection>,
+      public hlv::service::common::ManagedConnection
 {
   private:
     typedef std::shared_ptr<hlv::service::ebox::update::Connection> ConnectionPtr;
@@ -56,7 +81,7 @@ class Connection
     Connection () = delete;
     
     // Construct a Connection given a socket
-    explicit Connection (boost::asio::ip::tcp::socket socket, 
+    explicit Connection (hlv::service::common::StreamSocket socket, 
             hlv::service::common::ConnectionManager<ConnectionPtr>& manager,
             ConnectionInformation& config);
 
@@ -66,47 +91,48 @@ class Connection
     // Stop listening
     void stop ();
 
-    // Callback for Redis hget
-    void hashReply (redisReply* reply);  
-    
-    // Callback for Redis hset
-    void hashSetReply (redisReply* reply);  
-
-    // Callback for Redis sadd
-    void saddReply (redisReply* reply);
-
-    // Callback for srem
-    void sremReply (redisReply* reply);
-
   private:
-    // Process request in update_
-    void process_request ();
+    // Serve requests until the connection ends, as a coroutine
+    void serve (boost::asio::yield_context yield);
 
-    // Actually execute an SADD
-    void update_set ();
+    // Carry out update_, false if it failed
+    bool process_request (boost::asio::yield_context yield);
 
-    // Execute SREM
-    void remove_from_set ();
+    // Check update_'s token against the key's permission bits, setting them
+    // first if an ADD finds none
+    bool check_permission (boost::asio::yield_context yield);
 
-    // Fail request
-    inline void fail_request ();
+    // Add update_'s values to the local set
+    bool update_set (boost::asio::yield_context yield);
 
-    // Get permission token from Redis
-    inline void get_permtoken ();
+    // Remove update_'s values from the local set
+    bool remove_from_set (boost::asio::yield_context yield);
 
-    // Listen for buffer
-    void read_size ();
+    // Extend leases
+    bool renew (boost::asio::yield_context yield);
 
-    // Read buffer off the wire
-    void read_buffer (uint64_t length);
+    // Run a change to the local set in a MULTI/EXEC that also bumps the
+    // key's version. command_ holds an SADD or SREM, returns the reply to
+    // it.
+    redisReply* versioned_update (boost::asio::yield_context yield);
 
-    void write_response (const ev_ebox::Response&);
+    // Unwrap the reply to the SADD or SREM from an EXEC reply, null if the
+    // transaction failed
+    static redisReply* unwrap_exec (redisReply* reply);
+
+    // Check the capability sent with update_ and use its permissions as the
+    // update's token. False if the update should be failed.
+    bool check_capability ();
 
     // Socket for this connection
-    boost::asio::ip::tcp::socket socket_;
+    hlv::service::common::StreamSocket socket_;
+
+    // Requests are read off the socket here
+    hlv::service::common::FrameReader reader_;
 
-    // A temporary variable that holds the amount to be read
-    uint64_t bufferSize_;
+    // Requests are answered one at a time, so there is only ever one write
+    // for this to hold the handler of
+    hlv::service::common::HandlerMemory handlerMemory_;
 
     // Manage several connections
     hlv::service::common::ConnectionManager<ConnectionPtr>& manager_;
@@ -114,9 +140,13 @@ class Connection
     // Configuration
     const ConnectionInformation& config_;
 
-    // Buffer, expect never to need more than 128k
-    std::array<char, 131072> buffer_;
-    std::array<char, 131072> write_buffer_;
+    // Redis commands are built here, keys under config_.prefix
+    asio_redis::CommandBuilder command_;
+    // Lease entries are built here
+    std::string entry_;
+
+    // Responses are framed here
+    std::vector<char> frame_;
     ev_ebox::LocalUpdate update_;
     ev_ebox::Response response_;
 };
@@ -3,13 +3,14 @@
 #include <iostream>
 #include <string>
 #include <list>
+#include <functional>
 #include <thread>
 #include <boost/program_options.hpp>
 #include <boost/log/trivial.hpp>
-#include <boost/algorithm/string.hpp>
 #include <coordinator_client.h>
 #include <logging_common.h>
 #include <query_client.h>
+#include <endpoint_selector.h>
 #include <update_client.h>
 #include <echo_server.h>
 #include "consts.h"
@@ -36,18 +37,21 @@ std::unique_ptr<hlv::ebox::update::EvLDiscoveryClient>
         result = 0;
         return nullptr;
     }
-    const std::string location = results.front ();
-    std::vector<std::string> split_results;
-    boost::split(split_results, location, boost::is_any_of(":"), boost::token_compress_off);
-    if (split_results.size () != 2) {
+    // The nearest edge box, there is nothing else to go by yet
+    hlv::lookup::client::EndpointSelector selector;
+    selector.update (results);
+    hlv::lookup::client::EndpointSelector::Endpoint location;
+    if (!selector.select (location)) {
         result = false;
         std::cerr << "Do not understand response" << std::endl;
         return nullptr;
     }
+    // There is no port for an edge box on a Unix domain socket
+    uint32_t port = location.port.empty () ? 0 : std::stoul (location.port);
     auto ret = std::unique_ptr<hlv::ebox::update::EvLDiscoveryClient>(
                     new hlv::ebox::update::EvLDiscoveryClient (token,
-                                                               split_results[0],
-                                                               std::stoul (split_results[1])));
+                                                               location.host,
+                                                               port));
     return ret;
 }
 
@@ -60,6 +64,9 @@ int main (int argc, char* argv[]) {
     uint32_t coordinator_port = hlv::service::lookup::SERVER_PORT,
               port = 8000;
     uint64_t accessibleBy = 0;
+    uint32_t lease = 0;
+    int32_t distance = 0;
+    std::string unixPath;
     po::options_description desc("Simple Server");
     desc.add_options()
         ("help,h", "Display help") 
@@ -76,7 +83,15 @@ int main (int argc, char* argv[]) {
         ("accessible,a", po::value<uint64_t>(&accessibleBy)->implicit_value (accessibleBy),
             "Permission for accessing")
         ("type,t", po::value<std::string>(&type)->implicit_value (type),
-            "Type of server");
+            "Type of server")
+        ("lease", po::value<uint32_t>(&lease)->implicit_value (lease),
+            "Register with a lease of this many seconds, renewed while running (0 registers for good)")
+        ("distance", po::value<int32_t>(&distance)->implicit_value (distance),
+            "Distance to register with, clients prefer the nearest servers")
+        ("unix", po::value<std::string>(&unixPath),
+            "Also accept connections on a Unix domain socket at this path")
+        ("register-unix",
+            "Register the Unix domain socket rather than the TCP address, for when every client is on this host");
     po::options_description options;
     options.add(desc);
     po::variables_map vm;
@@ -89,6 +104,11 @@ int main (int argc, char* argv[]) {
         return 0;
     }
 
+    if (vm.count ("register-unix") && unixPath.empty ()) {
+        std::cerr << "--register-unix needs --unix" << std::endl;
+        return 1;
+    }
+
     // Listen for connections
     boost::asio::io_service io_service;
     hlv::service::echo::server::ConnectionInformation info;
@@ -96,6 +116,9 @@ int main (int argc, char* argv[]) {
                                   address,
                                   std::to_string(port), 
                                   info);
+    if (!unixPath.empty ()) {
+        server.listen_unix (unixPath);
+    }
     launchService (io_service, server);
     
     // Cannonical address
@@ -109,7 +132,14 @@ int main (int argc, char* argv[]) {
         }
     }
     std::stringstream addressStr;
-    addressStr << address << ":" << port;
+    if (vm.count ("register-unix")) {
+        addressStr << hlv::service::common::UNIX_PREFIX << unixPath;
+    } else {
+        addressStr << address << ":" << port;
+    }
+    if (distance != 0) {
+        addressStr << hlv::lookup::client::EndpointSelector::DISTANCE_SEPARATOR << distance;
+    }
     std::string regAddress = addressStr.str ();
 
     // Register
@@ -136,12 +166,31 @@ int main (int argc, char* argv[]) {
 
     std::list<std::string> changes;
     changes = {regAddress};
-    bool succ = client->set_values (hlv::service::lookup::ECHO_LOCATION, changes);
+    bool succ = client->set_values (hlv::service::lookup::ECHO_LOCATION, changes, lease);
     if (!succ) {
         std::cerr << "Failed to register" << std::endl;
         return 0;
     }
 
+    // Renew the lease three times per lease, so that one lost renewal does not
+    // drop the registration
+    boost::asio::deadline_timer heartbeat (io_service);
+    std::function<void (boost::system::error_code)> renew =
+        [&] (boost::system::error_code ec) {
+            if (ec) {
+                return;
+            }
+            if (!client->renew ()) {
+                BOOST_LOG_TRIVIAL (error) << "Failed to renew lease";
+            }
+            heartbeat.expires_from_now (boost::posix_time::milliseconds (lease * 1000 / 3));
+            heartbeat.async_wait (renew);
+        };
+    if (lease > 0) {
+        heartbeat.expires_from_now (boost::posix_time::milliseconds (lease * 1000 / 3));
+        heartbeat.async_wait (renew);
+    }
+
     std::cerr << "Running server " << std::endl;
     // This thread now provides I/O service
     boost::asio::signal_set signals (io_service);
@@ -153,6 +202,7 @@ int main (int argc, char* argv[]) {
     signals.async_wait ([&](boost::system::error_code, int) {
         std::cout << "Quitting" << std::endl;
         server.stop ();
+        heartbeat.cancel ();
         io_service.stop ();
     });
     io_service.run();
@@ -0,0 +1,63 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#ifndef __EV_BLOOM_FILTER_H__
+#define __EV_BLOOM_FILTER_H__
+namespace ev {
+namespace filter {
+/// A plain Bloom filter over strings. No false negatives: if maybe_contains
+/// returns false the string was never inserted. Not thread safe.
+class BloomFilter {
+  public:
+    /// expected: number of strings the filter is sized for
+    /// fpRate: false positive rate wanted once expected strings are in
+    BloomFilter (size_t expected, double fpRate);
+
+    /// Add a string
+    void insert (const char* data, size_t length);
+    void insert (const std::string& data) {
+        insert (data.data (), data.size ());
+    }
+
+    /// Could this string have been inserted
+    bool maybe_contains (const char* data, size_t length) const;
+    bool maybe_contains (const std::string& data) const {
+        return maybe_contains (data.data (), data.size ());
+    }
+
+    /// Forget everything
+    void clear ();
+
+    /// Exchange contents with another filter
+    void swap (BloomFilter& other);
+
+    /// Bytes used by the bit array
+    size_t memory () const { return bits_.size () * sizeof(uint64_t); }
+
+    /// Number of insert calls since the last clear (duplicates included)
+    size_t inserted () const { return inserted_; }
+
+    /// Number of hash functions
+    uint32_t hashes () const { return hashes_; }
+
+    /// False positive rate expected given the number of insertions so far
+    double estimated_fp_rate () const;
+
+  private:
+    // Two independent hashes, the i-th probe is h1 + i * h2
+    static void hash (const char* data,
+                      size_t length,
+                      uint64_t& h1,
+                      uint64_t& h2);
+
+    std::vector<uint64_t> bits_;
+    uint64_t nbits_;
+    uint32_t hashes_;
+    size_t inserted_;
+};
+} // filter
+} // ev
+#endif // __EV_BLOOM_FILTER_H__
@@ -0,0 +1,77 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#ifndef __EV_FRAME_COMPRESSION_H__
+#define __EV_FRAME_COMPRESSION_H__
+namespace ev {
+namespace compression {
+/// All messages are sent as a 64-bit length followed by the message. Lengths
+/// never come close to 2^63, so the top bit of the length marks a frame whose
+/// payload is LZ4 compressed. A compressed payload is a 32-bit uncompressed
+/// length followed by a single LZ4 block.
+const uint64_t COMPRESSED_FRAME = 1ull << 63;
+
+/// Frames smaller than this are not worth the CPU to compress
+const size_t DEFAULT_THRESHOLD = 1024;
+
+/// Is this frame header for a compressed frame
+inline bool is_compressed (uint64_t header) {
+    return (header & COMPRESSED_FRAME) != 0;
+}
+
+/// Number of bytes on the wire following this frame header
+inline uint64_t frame_length (uint64_t header) {
+    return header & ~COMPRESSED_FRAME;
+}
+
+/// Decompress the payload of a compressed frame. src/length are the bytes
+/// read off the wire, the result is written to dst and its length to out.
+/// Returns false for malformed or oversized frames.
+bool decompress (const char* src,
+                 size_t length,
+                 char* dst,
+                 size_t capacity,
+                 size_t& out);
+
+/// Compresses frames. Holds on to the LZ4 state so that compressing a frame
+/// does not allocate; keep one per connection. Not thread safe.
+class FrameCompressor {
+  public:
+    // Disallow copying
+    FrameCompressor (const FrameCompressor&) = delete;
+    FrameCompressor& operator= (const FrameCompressor&) = delete;
+
+    /// threshold: payloads smaller than this are never compressed, 0 disables
+    ///            compression altogether
+    explicit FrameCompressor (size_t threshold = DEFAULT_THRESHOLD);
+
+    /// Compress length bytes from src into dst (with capacity bytes of space).
+    /// Returns the frame header to send with dst, or 0 if the payload is too
+    /// small or does not shrink, in which case src should be sent as is.
+    uint64_t compress (const char* src,
+                       size_t length,
+                       char* dst,
+                       size_t capacity);
+
+    /// Should a payload of this length be compressed at all
+    bool worthwhile (size_t length) const {
+        return threshold_ != 0 && length >= threshold_;
+    }
+
+    /// Bytes handed to compress that were compressed
+    uint64_t bytes_in () const { return bytesIn_; }
+
+    /// Bytes produced for frames that were compressed
+    uint64_t bytes_out () const { return bytesOut_; }
+
+  private:
+    size_t threshold_;
+    std::vector<char> state_;
+    uint64_t bytesIn_;
+    uint64_t bytesOut_;
+};
+} // compression
+} // ev
+#endif // __EV_FRAME_COMPRESSION_H__
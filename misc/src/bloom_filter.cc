@@ -0,0 +1,85 @@
+#include <algorithm>
+#include <cmath>
+#include "bloom_filter.h"
+namespace {
+// Final mixing step from MurmurHash3
+inline uint64_t mix (uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+}
+
+namespace ev {
+namespace filter {
+BloomFilter::BloomFilter (size_t expected, double fpRate) :
+    inserted_ (0) {
+    expected = std::max<size_t> (expected, 1);
+    fpRate = std::min (std::max (fpRate, 1e-9), 0.5);
+    // m = -n ln(p) / ln(2)^2, k = (m / n) ln(2)
+    double m = -(double)expected * std::log (fpRate) / (std::log (2) * std::log (2));
+    nbits_ = std::max<uint64_t> (64, (uint64_t)std::ceil (m));
+    nbits_ = (nbits_ + 63) & ~63ULL;
+    double k = (double)nbits_ / expected * std::log (2);
+    hashes_ = std::min<uint32_t> (16, std::max<uint32_t> (1, (uint32_t)std::round (k)));
+    bits_.assign (nbits_ / 64, 0);
+}
+
+void BloomFilter::hash (const char* data,
+                        size_t length,
+                        uint64_t& h1,
+                        uint64_t& h2) {
+    // FNV-1a, then mixed two ways
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 0x100000001b3ULL;
+    }
+    h1 = mix (h);
+    h2 = mix (h ^ 0x9e3779b97f4a7c15ULL) | 1;
+}
+
+void BloomFilter::insert (const char* data, size_t length) {
+    uint64_t h1, h2;
+    hash (data, length, h1, h2);
+    for (uint32_t i = 0; i < hashes_; i++) {
+        uint64_t bit = (h1 + i * h2) % nbits_;
+        bits_[bit >> 6] |= (1ULL << (bit & 63));
+    }
+    inserted_++;
+}
+
+bool BloomFilter::maybe_contains (const char* data, size_t length) const {
+    uint64_t h1, h2;
+    hash (data, length, h1, h2);
+    for (uint32_t i = 0; i < hashes_; i++) {
+        uint64_t bit = (h1 + i * h2) % nbits_;
+        if (!(bits_[bit >> 6] & (1ULL << (bit & 63)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void BloomFilter::clear () {
+    std::fill (bits_.begin (), bits_.end (), 0);
+    inserted_ = 0;
+}
+
+void BloomFilter::swap (BloomFilter& other) {
+    bits_.swap (other.bits_);
+    std::swap (nbits_, other.nbits_);
+    std::swap (hashes_, other.hashes_);
+    std::swap (inserted_, other.inserted_);
+}
+
+double BloomFilter::estimated_fp_rate () const {
+    // (1 - e^(-kn/m))^k
+    double exponent = -(double)hashes_ * inserted_ / nbits_;
+    return std::pow (1.0 - std::exp (exponent), hashes_);
+}
+} // filter
+} // ev
@@ -0,0 +1,63 @@
+#include <algorithm>
+#include <cstring>
+#include <lz4.h>
+#include "frame_compression.h"
+namespace ev {
+namespace compression {
+FrameCompressor::FrameCompressor (size_t threshold) :
+    threshold_ (threshold),
+    state_ (LZ4_sizeofState ()),
+    bytesIn_ (0),
+    bytesOut_ (0) {
+}
+
+uint64_t FrameCompressor::compress (const char* src,
+                                    size_t length,
+                                    char* dst,
+                                    size_t capacity) {
+    if (!worthwhile (length) || capacity <= sizeof(uint32_t)) {
+        return 0;
+    }
+    // Only bother with frames that end up smaller than they started
+    size_t limit = std::min (capacity, length) - sizeof(uint32_t);
+    int compressed = LZ4_compress_fast_extState (state_.data (),
+                                                 src,
+                                                 dst + sizeof(uint32_t),
+                                                 length,
+                                                 limit,
+                                                 1);
+    if (compressed <= 0) {
+        return 0;
+    }
+    uint32_t raw = length;
+    memcpy (dst, &raw, sizeof(raw));
+    bytesIn_ += length;
+    bytesOut_ += compressed + sizeof(raw);
+    return (compressed + sizeof(raw)) | COMPRESSED_FRAME;
+}
+
+bool decompress (const char* src,
+                 size_t length,
+                 char* dst,
+                 size_t capacity,
+                 size_t& out) {
+    uint32_t raw = 0;
+    if (length <= sizeof(raw)) {
+        return false;
+    }
+    memcpy (&raw, src, sizeof(raw));
+    if (raw > capacity) {
+        return false;
+    }
+    int decompressed = LZ4_decompress_safe (src + sizeof(raw),
+                                            dst,
+                                            length - sizeof(raw),
+                                            raw);
+    if (decompressed < 0 || (uint32_t)decompressed != raw) {
+        return false;
+    }
+    out = decompressed;
+    return true;
+}
+} // compression
+} // ev
@@ -1,61 +1,88 @@
 // Copyright 20xx The Regents of the University of California
 // This is a test service for SDN-v2 High Level Virtualization
 #include <cassert>
+#include <cstdlib>
 #include <string>
 #include <sstream>
 #include <boost/log/trivial.hpp>
+#include <managed_client.h>
 #include "auth_service.h"
 
+namespace {
+// Callback for redis, hiredis is in C and needs a function that does not
+// need the this pointer.
+void redisTokenResponse (redisAsyncContext* context, void* reply, void* data) {
+    auto pending = (hlv::service::server::AuthService::Pending*)data;
+    pending->service->tokenReply ((redisReply*) reply, pending);
+}
+}
+
 namespace hlv {
 namespace service {
 namespace server {
-// Receive an authentication token and generate a token
-bool AuthService::AuthenticateToken (const int64_t requestID,
+// Receive an authentication token and look up the token to generate
+void AuthService::AuthenticateTokenAsync (const int64_t requestID,
                     const std::string& identity, 
                     const std::string& token, 
-                    hlv_service::ServiceResponse& response) {
+                    Completion done) {
     BOOST_LOG_TRIVIAL(info) << "Received auth request for " << identity 
-                            << " with token " << token << " succeeding";
-    BOOST_LOG_TRIVIAL(info) << "Sending request GET " << prefix_.c_str() << ":" << identity << token << std::endl;
-    redisReply* reply = (redisReply*) redisCommand(syncContext_, "GET %s:%s%s",
-                                prefix_.c_str(), 
-                                identity.c_str(), 
-                                token.c_str());
+                            << " with token " << token;
+    BOOST_LOG_TRIVIAL(info) << "Sending request GET " << prefix_ << ":" << identity << token;
+    Pending* pending = new Pending {this, requestID, identity, std::move (done)};
+    // A GET is safe to send again, so it rides out a Redis reconnect
+    int status = redis_->read (redisTokenResponse,
+                               pending,
+                               "GET %s:%b%b",
+                               prefix_.c_str (),
+                               identity.data (), identity.size (),
+                               token.data (), token.size ());
+    if (status != REDIS_OK) {
+        BOOST_LOG_TRIVIAL(error) << "Could not send GET for auth token";
+        finish (pending, false, 0);
+    }
+}
+
+void AuthService::tokenReply (redisReply* reply, Pending* pending) {
     uint64_t rtoken = 0;
-    if (!reply) {
+    if (!reply || reply->type == REDIS_REPLY_ERROR) {
         BOOST_LOG_TRIVIAL(error) << "Error getting auth token";
-        response.set_requestid (requestID);
-        response.set_success (false);
-        response.set_response (std::to_string(0));
-        return true;
-        
+        finish (pending, false, 0);
+        return;
     } else if (reply->type == REDIS_REPLY_STRING) {
         BOOST_LOG_TRIVIAL(info) << "Actually got token ";
-        rtoken = std::stoull(std::string(reply->str, reply->len));
+        rtoken = std::strtoull (std::string(reply->str, reply->len).c_str (), nullptr, 10);
     }  else if (reply->type == REDIS_REPLY_INTEGER) {
         BOOST_LOG_TRIVIAL(info) << "Actually got token ";
         rtoken = reply->integer;
     } else {
         BOOST_LOG_TRIVIAL(info) << "Could not find token ";
     }
-    freeReplyObject (reply);
     BOOST_LOG_TRIVIAL(info) << "Sending token " << rtoken;
-    
-    response.set_requestid (requestID);
-    response.set_success (true);
-    response.set_response (std::to_string(rtoken));
-    return true;
+    finish (pending, true, rtoken);
+}
+
+void AuthService::finish (Pending* pending, bool success, uint64_t rtoken) {
+    std::unique_ptr<Pending> owned (pending);
+    response_.Clear ();
+    response_.set_requestid (pending->requestID);
+    response_.set_success (success);
+    response_.set_response (std::to_string(rtoken));
+    if (success && minter_) {
+        response_.set_capability (minter_->mint (pending->identity, rtoken));
+    }
+    pending->done (response_);
 }
 
 
 // Do nothing
-bool AuthService::ProcessRequest (const int64_t requestID,
+void AuthService::ProcessRequestAsync (const int64_t requestID,
                         const hlv_service::ServiceRequest& request, 
-                        hlv_service::ServiceResponse& response) {
-    response.set_requestid (requestID);
-    response.set_success (false);
-    response.set_response ("");
-    return true;
+                        Completion done) {
+    response_.Clear ();
+    response_.set_requestid (requestID);
+    response_.set_success (false);
+    response_.set_response ("");
+    done (response_);
 }
 } // namespace server
 } // namespace service
@@ -1,43 +1,70 @@
 // Copyright 20xx The Regents of the University of California
 // This is a test service for SDN-v2 High Level Virtualization
+#include <memory>
 #include <string>
 #include <hiredis/hiredis.h>
+#include <hiredis/async.h>
 #include "service.pb.h"
 #include "service_interface.h"
+#include "capability.h"
 #ifndef _EV_REDIS_AUTH_H_
 #define _EV_REDIS_AUTH_H_
+namespace asio_redis {
+class ManagedRedisClient;
+}
 namespace hlv {
 namespace service {
 namespace server {
 
-// A very simple service module that supports authentication. In this case all
-// authentication tokens are accepted, and the authorization token returned is a
-// hash of the identity.
-class AuthService : public ServiceInterface {
+// Authentication backed by Redis: the authorization token returned is the one
+// stored under prefix:identity+token. Given a minter, clients are also handed
+// a capability holding that token as its permissions. Lookups go to Redis
+// asynchronously, so any number of them can be waiting on it at once.
+class AuthService : public AsyncServiceInterface {
   public:
-    AuthService (redisContext* syncContext,
-                std::string prefix) : 
-                syncContext_ (syncContext),
-                prefix_ (prefix) {}
+    AuthService (asio_redis::ManagedRedisClient* redis,
+                std::string prefix,
+                std::unique_ptr<common::capability::Minter> minter = nullptr) : 
+                redis_ (redis),
+                prefix_ (prefix),
+                minter_ (std::move (minter)) {}
     // Check an authentication token to see if a client can indeed own an
     // identity.  Generates a response which among other things contains the
     // authorization token that should be used in all subsequent requests.
     // Care should be taken to make sure this token is universal: i.e. it
     // authorizes all other service providers that can be used by this
     // client.
-    virtual bool AuthenticateToken (const int64_t requestID,
+    virtual void AuthenticateTokenAsync (const int64_t requestID,
                                 const std::string& identity, 
                                 const std::string& token, 
-                                hlv_service::ServiceResponse& response);
+                                Completion done);
     
     // Process a request. This call is responsible for making sure the
     // authorization token allows the client to receive the requested service. 
-    virtual bool ProcessRequest (const int64_t requestID,
+    virtual void ProcessRequestAsync (const int64_t requestID,
                                  const hlv_service::ServiceRequest& request, 
-                                 hlv_service::ServiceResponse& response);
+                                 Completion done);
+
+    // An authentication waiting on Redis
+    struct Pending {
+        AuthService* service;
+        int64_t requestID;
+        std::string identity;
+        Completion done;
+    };
+
+    // Callback for Redis GET, takes ownership of pending
+    void tokenReply (redisReply* reply, Pending* pending);
+
   private:
-    redisContext* syncContext_;
+    // Answer pending (and free it)
+    void finish (Pending* pending, bool success, uint64_t rtoken);
+
+    asio_redis::ManagedRedisClient* redis_;
     std::string prefix_;
+    std::unique_ptr<common::capability::Minter> minter_;
+    // Reused for every response, answers are complete once done returns
+    hlv_service::ServiceResponse response_;
 };
 } // namespace auth
 } // namespace service
@@ -6,11 +6,13 @@
 #include <boost/asio.hpp>
 #include <boost/program_options.hpp>
 #include <hiredis/hiredis.h>
+#include <managed_client.h>
 #include <coordinator_client.h>
 #include "server.h"
 #include "logging_common.h"
 #include "service.pb.h"
 #include "auth_service.h"
+#include "capability.h"
 #include "getifaddr.h"
 #include "consts.h"
 
@@ -32,6 +34,10 @@ main (int argc, char* argv[]) {
 
     std::string coordinator = "127.0.0.1";
 
+    // Key to sign capabilities with, none are minted without one
+    std::string capabilityKey;
+    int64_t capabilityLifetime = 3600;
+
     // Coordinator port
     int32_t cport = hlv::service::lookup::UPDATE_PORT;
 
@@ -44,7 +50,9 @@ main (int argc, char* argv[]) {
         ("rport", po::value<int32_t>(&redisPort)->implicit_value(6379), "Redis port")
         ("name,n", po::value<std::string>(&servicename)->implicit_value(servicename), "Service name")
         ("coordinator,c", po::value<std::string>(&coordinator)->implicit_value(coordinator), "Coordinator")
-        ("cport,cp", po::value<int32_t>(&cport)->implicit_value(cport), "Coordinator port");
+        ("cport,cp", po::value<int32_t>(&cport)->implicit_value(cport), "Coordinator port")
+        ("capability-key", po::value<std::string>(&capabilityKey), "Mint capabilities signed with the key in this file")
+        ("capability-lifetime", po::value<int64_t>(&capabilityLifetime), "Seconds a minted capability is good for");
     po::options_description options;
     options.add(desc);
 
@@ -57,19 +65,18 @@ main (int argc, char* argv[]) {
         std::cerr << desc;
         return 0;
     }
-    //
-    // Connect to redis
-    redisContext *c  = redisConnect(redisAddress.c_str(), redisPort);
-    if (c == NULL) {
-        std::cerr << "Could not allocate redisContext" << std::endl;
-        return 0;
-    }
 
-    if (c->err) {
-        std::cerr << "Error connecting to redis " << c->errstr;
-        return 0;
+    std::unique_ptr<hlv::service::common::capability::Minter> minter;
+    if (!capabilityKey.empty ()) {
+        std::string secret;
+        if (!hlv::service::common::capability::load_secret (capabilityKey, secret)) {
+            std::cerr << "Could not read capability key from " << capabilityKey
+                      << " (at least " << hlv::service::common::capability::MIN_SECRET
+                      << " bytes)" << std::endl;
+            return 1;
+        }
+        minter.reset (new hlv::service::common::capability::Minter (secret, capabilityLifetime));
     }
-
     // Create coordinator client
     hlv::coordinator::EvUpdateClient cclient (coordinator, cport);
     hlv::coordinator::EvUpdateClient::TypeValueMap vmap;
@@ -104,11 +111,19 @@ main (int argc, char* argv[]) {
 
     // Start server
     boost::asio::io_service io_service;
+
+    // Connect to Redis, reconnecting whenever the connection is lost
+    asio_redis::ManagedRedisClient client (io_service, redisAddress, redisPort);
+    if (!client.connect ()) {
+        std::cerr << "Error connecting to redis " << client.errstr () << std::endl;
+        return 0;
+    }
+
     hlv::service::server::Server server (
             io_service,
             saddr, 
             sport, 
-            std::make_shared<hlv::service::server::AuthService>(c, servicename));
+            std::make_shared<hlv::service::server::AuthService>(&client, servicename, std::move (minter)));
     server.start();
 
     // Register to quit when necessary
@@ -125,7 +140,7 @@ main (int argc, char* argv[]) {
     });
     // This thread now provides I/O service
     io_service.run();
-    redisFree (c);
+    client.disconnect ();
     google::protobuf::ShutdownProtobufLibrary();
     return 0;
 }
@@ -0,0 +1,160 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+#include "hiredisasio.h"
+namespace po = boost::program_options;
+
+namespace {
+// Keeps window commands outstanding until count have been answered
+struct Bench {
+    redisAsyncContext* context;
+    asio_redis::redisBoostClient* client;
+    std::string command;
+    std::string key;
+    uint64_t remaining;
+    uint64_t outstanding;
+    uint64_t errors;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+};
+
+void issue (Bench* bench);
+
+void reply_callback (redisAsyncContext* context, void* r, void* privdata) {
+    Bench* bench = (Bench*)privdata;
+    redisReply* reply = (redisReply*)r;
+    bench->outstanding--;
+    if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+        bench->errors++;
+    }
+    if (bench->remaining > 0) {
+        issue (bench);
+    } else if (bench->outstanding == 0) {
+        bench->end = std::chrono::steady_clock::now();
+        redisAsyncDisconnect (context);
+    }
+}
+
+void issue (Bench* bench) {
+    bench->remaining--;
+    bench->outstanding++;
+    if (bench->command == "GET") {
+        redisAsyncCommand (bench->context, reply_callback, bench, "GET %b",
+                bench->key.data(), bench->key.size());
+    } else {
+        redisAsyncCommand (bench->context, reply_callback, bench, "PING");
+    }
+}
+
+void connect_callback (const redisAsyncContext* context, int status) {
+    if (status != REDIS_OK) {
+        std::cerr << "Could not connect to Redis " << context->errstr << std::endl;
+    }
+}
+}
+
+// Measure how many commands a second go through the asio hiredis adapter
+int main (int argc, char* argv[]) {
+    po::options_description desc("hiredis asio adapter benchmark");
+    std::string redisAddress = "127.0.0.1";
+    uint32_t redisPort = 6379;
+    std::string unixPath;
+    std::string command = "PING";
+    std::string key = "redis_bench:key";
+    uint64_t count = 1000000;
+    uint32_t window = 64;
+    uint32_t threads = 1;
+
+    desc.add_options()
+        ("h,help", "Display help")
+        ("a,address", po::value<std::string>(&redisAddress)->implicit_value(redisAddress),
+            "Redis address")
+        ("p,port", po::value<uint32_t>(&redisPort)->implicit_value(redisPort),
+            "Redis port")
+        ("u,unix", po::value<std::string>(&unixPath),
+            "Connect to Redis over this Unix socket instead")
+        ("c,command", po::value<std::string>(&command)->implicit_value(command),
+            "Command to send (PING or GET)")
+        ("k,key", po::value<std::string>(&key)->implicit_value(key),
+            "Key for GET")
+        ("n,count", po::value<uint64_t>(&count)->implicit_value(count),
+            "Commands to send")
+        ("w,window", po::value<uint32_t>(&window)->implicit_value(window),
+            "Commands outstanding at a time")
+        ("t,threads", po::value<uint32_t>(&threads)->implicit_value(threads),
+            "Threads running the io_service");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::cerr << desc << std::endl;
+        return 0;
+    }
+
+    if (command != "PING" && command != "GET") {
+        std::cerr << "Unknown command " << command << std::endl;
+        return 1;
+    }
+
+    if (window == 0 || threads == 0) {
+        std::cerr << "window and threads must be at least 1" << std::endl;
+        return 1;
+    }
+
+    redisAsyncContext* context = unixPath.empty() ?
+            redisAsyncConnect (redisAddress.c_str(), redisPort) :
+            redisAsyncConnectUnix (unixPath.c_str());
+    if (context->err) {
+        std::cerr << "Error connecting to Redis " << context->errstr << std::endl;
+        return 1;
+    }
+    redisAsyncSetConnectCallback (context, connect_callback);
+
+    boost::asio::io_service io_service;
+    asio_redis::redisBoostClient client (io_service, context, threads > 1);
+
+    Bench bench;
+    bench.context = context;
+    bench.client = &client;
+    bench.command = command;
+    bench.key = key;
+    bench.remaining = count;
+    bench.outstanding = 0;
+    bench.errors = 0;
+    bench.start = bench.end = std::chrono::steady_clock::now();
+
+    client.dispatch([&bench, window] {
+        bench.start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < window && bench.remaining > 0; i++) {
+            issue (&bench);
+        }
+    });
+
+    std::vector<std::thread> runners;
+    for (uint32_t i = 1; i < threads; i++) {
+        runners.emplace_back([&io_service] { io_service.run(); });
+    }
+    io_service.run();
+    for (auto& runner : runners) {
+        runner.join();
+    }
+
+    double usec = std::chrono::duration_cast<std::chrono::microseconds>
+            (bench.end - bench.start).count();
+    uint64_t done = count - bench.remaining;
+    std::cout << command << " x " << done << " window " << window
+              << " threads " << threads << ": "
+              << (usec > 0 ? done * 1e6 / usec : 0.0) << " commands/s, "
+              << bench.errors << " errors" << std::endl;
+    return bench.errors == 0 ? 0 : 1;
+}
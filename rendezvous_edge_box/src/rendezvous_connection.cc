@@ -28,7 +28,7 @@ namespace rendezvous {
 ///    2. If found check if permissions match.
 ///    3. If permissions match remove elements.
 
-Connection::Connection (boost::asio::ip::tcp::socket socket,
+Connection::Connection (hlv::service::common::StreamSocket socket,
                         ConnectionManager& manager,
                         ConnectionInformation& config) :
     socket_ (std::move(socket)),
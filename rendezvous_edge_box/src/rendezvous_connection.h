@@ -5,6 +5,7 @@
 #include <map>
 #include <list>
 #include <common_manager.h>
+#include <stream_socket.h>
 #include "ebox.pb.h"
 #ifndef _EV_RENDEZVOUS_CONNECTION_H_
 #define _EV_RENDEZVOUS_CONNECTION_H_
@@ -28,7 +29,8 @@ struct ConnectionInformation {
 };
 
 class Connection
-    : public std::enable_shared_from_this<Connection>
+    : public std::enable_shared_from_this<Connection>,
+      public hlv::service::common::ManagedConnection
 {
   private:
     typedef std::shared_ptr<hlv::service::ebox::rendezvous::Connection> ConnectionPtr;
@@ -38,7 +40,7 @@ class Connection
     Connection () = delete;
     
     // Construct a Connection given a socket
-    explicit Connection (boost::asio::ip::tcp::socket socket, 
+    explicit Connection (hlv::service::common::StreamSocket socket, 
             hlv::service::common::ConnectionManager<ConnectionPtr>& manager,
             ConnectionInformation& config);
 
@@ -66,7 +68,7 @@ class Connection
     void patch_through ();
 
     // Socket for this connection
-    boost::asio::ip::tcp::socket socket_;
+    hlv::service::common::StreamSocket socket_;
 
     // A temporary variable that holds the amount to be read
     uint64_t bufferSize_;
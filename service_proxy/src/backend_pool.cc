@@ -0,0 +1,260 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <algorithm>
+#include <utility>
+#include <boost/log/trivial.hpp>
+#include "backend_pool.h"
+
+namespace hlv {
+namespace service {
+namespace proxy {
+BackendPool::BackendPool (boost::asio::io_service& io_service,
+                          const PoolLimits& limits) :
+    io_service_ (io_service),
+    limits_ (limits),
+    nextId_ (1),
+    random_ (std::random_device () ()),
+    requests_ (0),
+    unroutable_ (0),
+    opened_ (0),
+    ejected_ (0) {
+}
+
+const uint32_t BackendPool::MAX_FAILURES;
+const uint32_t BackendPool::EJECTION_MS;
+const uint32_t BackendPool::MAX_EJECTION_MS;
+
+uint64_t BackendPool::add (const std::string& address,
+                           int32_t port,
+                           int32_t distance,
+                           const std::vector<int32_t>& types) {
+    uint64_t id = nextId_++;
+    Backend& backend = backends_[id];
+    backend.id = id;
+    backend.host = address;
+    backend.port = std::to_string (port);
+    backend.distance = distance;
+    backend.types = types;
+    backend.failures = 0;
+    backend.ejections = 0;
+    for (auto type : types) {
+        types_[type].push_back (id);
+    }
+    for (uint32_t i = 0; i < limits_.min; i++) {
+        open (backend);
+    }
+    BOOST_LOG_TRIVIAL (info) << "Backend " << id << " at " << address << ":" << port
+                             << " distance " << distance
+                             << " serving " << types.size () << " request types";
+    return id;
+}
+
+void BackendPool::remove (uint64_t id) {
+    auto found = backends_.find (id);
+    if (found == backends_.end ()) {
+        return;
+    }
+    for (auto type : found->second.types) {
+        auto& ids = types_[type];
+        ids.erase (std::remove (ids.begin (), ids.end (), id), ids.end ());
+        if (ids.empty ()) {
+            types_.erase (type);
+        }
+    }
+    // Stopping calls back into whatever is outstanding, which may route
+    // again; take the backend out first
+    std::vector<MuxPtr> connections;
+    connections.swap (found->second.connections);
+    backends_.erase (found);
+    for (auto& mux : connections) {
+        mux->stop ();
+    }
+    BOOST_LOG_TRIVIAL (info) << "Backend " << id << " gone";
+}
+
+bool BackendPool::request (const std::string& token,
+                           int32_t rtype,
+                           const std::string& argument,
+                           Callback done) {
+    Backend* backend = choose (rtype);
+    if (!backend) {
+        unroutable_++;
+        return false;
+    }
+    requests_++;
+    uint64_t id = backend->id;
+    connection (*backend)->request (token, rtype, argument, track (id, std::move (done)));
+    return true;
+}
+
+bool BackendPool::authenticate (const std::string& identity,
+                                const std::string& token,
+                                Callback done) {
+    Backend* backend = choose (AUTHENTICATE_TYPE);
+    if (!backend) {
+        unroutable_++;
+        return false;
+    }
+    requests_++;
+    uint64_t id = backend->id;
+    connection (*backend)->authenticate (identity, token, track (id, std::move (done)));
+    return true;
+}
+
+void BackendPool::stop () {
+    std::map<uint64_t, Backend> backends;
+    backends.swap (backends_);
+    types_.clear ();
+    for (auto& backend : backends) {
+        for (auto& mux : backend.second.connections) {
+            mux->stop ();
+        }
+    }
+}
+
+void BackendPool::add_metrics (hlv::service::common::StatsReporter& stats,
+                               const std::string& prefix) {
+    stats.add (prefix + "backends", [this] () { return (double)backends_.size (); });
+    stats.add (prefix + "requests", [this] () { return (double)requests_; });
+    stats.add (prefix + "unroutable", [this] () { return (double)unroutable_; });
+    stats.add (prefix + "connections.opened", [this] () { return (double)opened_; });
+    stats.add (prefix + "ejections", [this] () { return (double)ejected_; });
+    stats.add (prefix + "outstanding", [this] () {
+        size_t outstanding = 0;
+        for (auto& backend : backends_) {
+            outstanding += load (backend.second);
+        }
+        return (double)outstanding;
+    });
+}
+
+BackendPool::Backend* BackendPool::choose (int32_t rtype) {
+    auto serving = types_.find (rtype);
+    if (serving == types_.end ()) {
+        return nullptr;
+    }
+    Clock::time_point now = Clock::now ();
+    nearest_.clear ();
+    Backend* soonest = nullptr;
+    for (auto id : serving->second) {
+        Backend& backend = backends_[id];
+        if (backend.failures >= MAX_FAILURES && backend.ejectedUntil > now) {
+            if (!soonest || backend.ejectedUntil < soonest->ejectedUntil) {
+                soonest = &backend;
+            }
+            continue;
+        }
+        if (!nearest_.empty () && backend.distance < nearest_.front ()->distance) {
+            nearest_.clear ();
+        }
+        if (nearest_.empty () || backend.distance == nearest_.front ()->distance) {
+            nearest_.push_back (&backend);
+        }
+    }
+    if (nearest_.empty ()) {
+        return soonest;
+    }
+    if (nearest_.size () == 1) {
+        return nearest_.front ();
+    }
+    std::uniform_int_distribution<size_t> pick (0, nearest_.size () - 1);
+    size_t first = pick (random_);
+    size_t second = pick (random_);
+    if (second == first) {
+        second = (first + 1) % nearest_.size ();
+    }
+    return (load (*nearest_[second]) < load (*nearest_[first]) ?
+                nearest_[second] : nearest_[first]);
+}
+
+BackendPool::Callback BackendPool::track (uint64_t id, Callback done) {
+    return [this, id, done] (bool success, const hlv_service::ServiceResponse& response) {
+        // A response, even one failing the request, means the backend is
+        // there; none means the connection went away first
+        if (success || response.has_requestid ()) {
+            succeeded (id);
+        } else {
+            failed (id);
+        }
+        done (success, response);
+    };
+}
+
+void BackendPool::succeeded (uint64_t id) {
+    auto found = backends_.find (id);
+    if (found == backends_.end ()) {
+        return;
+    }
+    found->second.failures = 0;
+    found->second.ejections = 0;
+}
+
+void BackendPool::failed (uint64_t id) {
+    auto found = backends_.find (id);
+    if (found == backends_.end ()) {
+        return;
+    }
+    Backend& backend = found->second;
+    backend.failures++;
+    if (backend.failures < MAX_FAILURES) {
+        return;
+    }
+    // Failing again right after coming back out keeps it out longer
+    uint32_t duration = EJECTION_MS;
+    for (uint32_t i = 0; i < backend.ejections && duration < MAX_EJECTION_MS; i++) {
+        duration *= 2;
+    }
+    duration = std::min (duration, MAX_EJECTION_MS);
+    backend.ejections++;
+    backend.ejectedUntil = Clock::now () + std::chrono::milliseconds (duration);
+    ejected_++;
+    BOOST_LOG_TRIVIAL (info) << "Ejecting backend " << id << " at " << backend.host
+                             << ":" << backend.port << " for " << duration << "ms";
+}
+
+BackendPool::MuxPtr BackendPool::connection (Backend& backend) {
+    // Connections that went away are replaced as needed
+    auto& connections = backend.connections;
+    connections.erase (std::remove_if (connections.begin (), connections.end (),
+                                       [] (const MuxPtr& mux) { return mux->closed (); }),
+                       connections.end ());
+    MuxPtr least;
+    for (auto& mux : connections) {
+        if (!least || mux->outstanding () < least->outstanding ()) {
+            least = mux;
+        }
+    }
+    if (!least ||
+        (least->outstanding () >= limits_.hot && connections.size () < limits_.max)) {
+        return open (backend);
+    }
+    return least;
+}
+
+BackendPool::MuxPtr BackendPool::open (Backend& backend) {
+    auto mux = std::make_shared<hlv::service::client::MuxClient> (io_service_,
+                                                                 backend.host,
+                                                                 backend.port);
+    std::string host = backend.host;
+    uint64_t id = backend.id;
+    mux->async_connect ([this, host, id] (bool connected) {
+        if (!connected) {
+            BOOST_LOG_TRIVIAL (error) << "Could not connect to backend " << host;
+            failed (id);
+        }
+    });
+    backend.connections.push_back (mux);
+    opened_++;
+    return mux;
+}
+
+size_t BackendPool::load (const Backend& backend) {
+    size_t outstanding = 0;
+    for (auto& mux : backend.connections) {
+        outstanding += mux->outstanding ();
+    }
+    return outstanding;
+}
+} // namespace proxy
+} // namespace service
+} // namespace hlv
@@ -0,0 +1,158 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+#include "mux_client.h"
+#include "stats_reporter.h"
+#ifndef _HLV_PROXY_BACKEND_POOL_H_
+#define _HLV_PROXY_BACKEND_POOL_H_
+namespace hlv {
+namespace service {
+namespace proxy {
+/// Request type a backend registers to be sent authentication requests
+const int32_t AUTHENTICATE_TYPE = -1;
+
+/// How many connections to keep to each backend
+struct PoolLimits {
+    // Opened when a backend registers
+    uint32_t min;
+    // Most ever open to one backend
+    uint32_t max;
+    // Another connection is opened once every one has this many requests
+    // outstanding, so busy backends get more capacity
+    uint32_t hot;
+    PoolLimits (uint32_t _min = 1, uint32_t _max = 4, uint32_t _hot = 32) :
+        min (_min),
+        max (_max),
+        hot (_hot) {
+    }
+};
+
+/// The backends registered with the proxy, by the request types they serve,
+/// and pooled connections to each. A request goes to one of the nearest
+/// backends (smallest Distance) serving its type: the less loaded (fewer
+/// requests outstanding) of two picked at random. On that backend it goes
+/// out on the connection with the fewest requests outstanding; requests
+/// from any number of clients share connections, matched up by RequestID
+/// (see MuxClient). Backends that cannot be connected to, or whose
+/// connections drop with requests outstanding, are ejected for a while
+/// after MAX_FAILURES failures in a row, longer each time they fail again
+/// after coming back (as EndpointSelector does for clients); requests go
+/// to the nearest backends that are not ejected. Runs on one io_service,
+/// like the connections.
+class BackendPool {
+  public:
+    typedef hlv::service::client::MuxClient::Callback Callback;
+
+    BackendPool () = delete;
+    BackendPool (const BackendPool&) = delete;
+    BackendPool& operator= (const BackendPool&) = delete;
+
+    BackendPool (boost::asio::io_service& io_service,
+                 const PoolLimits& limits);
+
+    /// Route types to a backend at address:port from now on. Returns an id
+    /// to remove it by.
+    uint64_t add (const std::string& address,
+                  int32_t port,
+                  int32_t distance,
+                  const std::vector<int32_t>& types);
+
+    /// Stop routing to a backend, failing what it has outstanding
+    void remove (uint64_t id);
+
+    /// Send a request to a backend serving rtype; done gets its response.
+    /// False, without calling done, if no backend serves rtype.
+    bool request (const std::string& token,
+                  int32_t rtype,
+                  const std::string& argument,
+                  Callback done);
+
+    /// Send an authentication request to a backend registered for
+    /// AUTHENTICATE_TYPE, as for request
+    bool authenticate (const std::string& identity,
+                       const std::string& token,
+                       Callback done);
+
+    /// Number of backends registered
+    size_t size () const { return backends_.size (); }
+
+    /// Close every connection
+    void stop ();
+
+    void add_metrics (hlv::service::common::StatsReporter& stats,
+                      const std::string& prefix = "");
+
+    /// Consecutive failures after which a backend is ejected
+    static const uint32_t MAX_FAILURES = 2;
+    /// How long the first ejection lasts, each later one (without a
+    /// success in between) doubles up to MAX_EJECTION_MS
+    static const uint32_t EJECTION_MS = 1000;
+    static const uint32_t MAX_EJECTION_MS = 30000;
+
+  private:
+    typedef std::shared_ptr<hlv::service::client::MuxClient> MuxPtr;
+    typedef std::chrono::steady_clock Clock;
+
+    struct Backend {
+        uint64_t id;
+        std::string host;
+        std::string port;
+        int32_t distance;
+        std::vector<int32_t> types;
+        std::vector<MuxPtr> connections;
+        // Consecutive failures, ejections since the last success
+        uint32_t failures;
+        uint32_t ejections;
+        Clock::time_point ejectedUntil;
+    };
+
+    // The backend to send a request of rtype to, null if there is none. If
+    // every backend serving rtype is ejected, the one due back first.
+    Backend* choose (int32_t rtype);
+
+    // Wrap done to count the request's outcome against backend id
+    Callback track (uint64_t id, Callback done);
+
+    // A request to (or connection attempt to) backend id worked, or not
+    void succeeded (uint64_t id);
+    void failed (uint64_t id);
+
+    // The connection to send a request to backend on, opening one if there
+    // is none or all are hot
+    MuxPtr connection (Backend& backend);
+
+    // Open another connection to backend
+    MuxPtr open (Backend& backend);
+
+    // Requests outstanding on every connection to backend
+    static size_t load (const Backend& backend);
+
+    boost::asio::io_service& io_service_;
+    const PoolLimits limits_;
+
+    std::map<uint64_t, Backend> backends_;
+    // Ids of the backends serving each request type
+    std::unordered_map<int32_t, std::vector<uint64_t>> types_;
+    uint64_t nextId_;
+
+    // Space for the nearest backends while choosing
+    std::vector<Backend*> nearest_;
+    std::minstd_rand random_;
+
+    uint64_t requests_;
+    uint64_t unroutable_;
+    uint64_t opened_;
+    uint64_t ejected_;
+};
+} // namespace proxy
+} // namespace service
+} // namespace hlv
+#endif
@@ -0,0 +1,157 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+#include <coordinator_client.h>
+#include "server.h"
+#include "logging_common.h"
+#include "service.pb.h"
+#include "stats_reporter.h"
+#include "backend_pool.h"
+#include "proxy_service.h"
+#include "registration_server.h"
+#include "getifaddr.h"
+#include "consts.h"
+
+namespace po = boost::program_options;
+int
+main (int argc, char* argv[]) {
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+    // Initialize logging
+    init_logging();
+
+    // Option processing
+    po::options_description desc("Service proxy options");
+    std::string saddr = "0.0.0.0",
+                sport = std::to_string (hlv::service::lookup::PROXY_PORT),
+                rport = std::to_string (hlv::service::lookup::PROXY_REGISTER_PORT),
+                servicename = hlv::service::lookup::PROXY_SERVICE;
+    std::string coordinator;
+    int32_t cport = hlv::service::lookup::UPDATE_PORT;
+
+    // What backends are told, and must tell us
+    std::string token, authToken, registerToken;
+
+    hlv::service::proxy::PoolLimits limits;
+    uint32_t statsInterval = 60;
+
+    desc.add_options()
+        ("help,h", "Display help")
+        ("addr,a", po::value<std::string>(&saddr), "Address to bind to")
+        ("port,p", po::value<std::string>(&sport)->implicit_value(sport), "Port clients connect to")
+        ("rport,r", po::value<std::string>(&rport)->implicit_value(rport), "Port backends register on")
+        ("name,n", po::value<std::string>(&servicename)->implicit_value(servicename), "Service name")
+        ("coordinator,c", po::value<std::string>(&coordinator),
+                   "Coordinator to register the proxy with, not registered if not given")
+        ("cport,cp", po::value<int32_t>(&cport)->implicit_value(cport), "Coordinator port")
+        ("token", po::value<std::string>(&token), "Token identifying the proxy to backends")
+        ("auth-token", po::value<std::string>(&authToken), "Auth service token handed to backends")
+        ("register-token", po::value<std::string>(&registerToken),
+                   "Only accept backends registering with this token (required)")
+        ("insecure-registration",
+                   "Accept backends registering without a token: anyone who can reach --rport can then answer clients")
+        ("pool", po::value<uint32_t>(&limits.min)->implicit_value(limits.min),
+                   "Connections opened to each backend as it registers")
+        ("max-pool", po::value<uint32_t>(&limits.max)->implicit_value(limits.max),
+                   "Most connections to one backend")
+        ("hot", po::value<uint32_t>(&limits.hot)->implicit_value(limits.hot),
+                   "Open another connection to a backend once each has this many requests outstanding")
+        ("stats", po::value<uint32_t>(&statsInterval)->implicit_value(statsInterval),
+                   "Seconds between stats reports (0 disables)");
+    po::options_description options;
+    options.add(desc);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+            options(options).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::cerr << desc;
+        return 0;
+    }
+
+    // Backends answer authentication requests too, so anyone able to
+    // register could hand out identities
+    if (registerToken.empty () && !vm.count("insecure-registration")) {
+        std::cerr << "--register-token is required (or --insecure-registration)" << std::endl;
+        return 1;
+    }
+
+    if (limits.max < limits.min || limits.max == 0) {
+        std::cerr << "--max-pool must be at least --pool and 1" << std::endl;
+        return 1;
+    }
+
+    // Figure out our IP address if bound to all
+    std::string my_address = saddr;
+    if (my_address == "0.0.0.0") {
+        if (!getFirstNonLoopbackAddress (my_address)) {
+            std::cerr << "Failed to find address" << std::endl;
+            return 1;
+        }
+    }
+
+    if (!coordinator.empty ()) {
+        std::stringstream full_address;
+        full_address << my_address << ":" << sport;
+        hlv::coordinator::EvUpdateClient cclient (coordinator, cport);
+        hlv::coordinator::EvUpdateClient::TypeValueMap vmap;
+        vmap.insert(std::make_pair(hlv::service::lookup::PROXY_LOCATION, full_address.str()));
+        if (!cclient.connect () || !cclient.set_values (0, servicename, vmap)) {
+            std::cerr << "Failed to register proxy" << std::endl;
+        }
+        cclient.disconnect ();
+    }
+
+    boost::asio::io_service io_service;
+    hlv::service::proxy::BackendPool backends (io_service, limits);
+
+    // Backends are told where clients reach them
+    hlv::service::proxy::RegistrationInformation info (backends);
+    info.join.set_token (token);
+    info.join.set_authtoken (authToken);
+    info.join.set_serviceaddr (my_address);
+    info.join.set_serviceport (std::stoi (sport));
+    info.join.set_clientport (std::stoi (sport));
+    info.token = registerToken;
+    hlv::service::proxy::RegistrationServer registrations (io_service, saddr, rport, info);
+    registrations.start ();
+
+    hlv::service::server::Server server (
+            io_service,
+            saddr,
+            sport,
+            std::make_shared<hlv::service::proxy::ProxyService> (backends));
+    server.start();
+
+    hlv::service::common::StatsReporter stats (io_service, "proxy", statsInterval);
+    backends.add_metrics (stats);
+    stats.add ("clients", [&server] () { return (double)server.connections (); });
+    stats.start ();
+
+    // Register to quit when necessary
+    boost::asio::signal_set signals (io_service);
+    signals.add (SIGINT);
+    signals.add (SIGTERM);
+#if defined(SIGQUIT)
+    signals.add (SIGQUIT);
+#endif
+    signals.async_wait ([&](boost::system::error_code, int) {
+        std::cout << "Quitting" << std::endl;
+        stats.stop ();
+        server.stop ();
+        registrations.stop ();
+        backends.stop ();
+        io_service.stop ();
+    });
+    // This thread now provides I/O service
+    io_service.run();
+    google::protobuf::ShutdownProtobufLibrary();
+    return 0;
+}
@@ -0,0 +1,65 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <utility>
+#include <boost/log/trivial.hpp>
+#include "proxy_service.h"
+
+namespace hlv {
+namespace service {
+namespace proxy {
+ProxyService::ProxyService (BackendPool& backends) :
+    backends_ (backends) {
+}
+
+void ProxyService::AuthenticateTokenAsync (const int64_t requestID,
+                                           const std::string& identity,
+                                           const std::string& token,
+                                           Completion done) {
+    if (!backends_.authenticate (identity, token, relay (requestID, done))) {
+        BOOST_LOG_TRIVIAL (info) << "No backend for authentication";
+        fail (requestID, done);
+    }
+}
+
+void ProxyService::ProcessRequestAsync (const int64_t requestID,
+                                        const hlv_service::ServiceRequest& request,
+                                        Completion done) {
+    if (!request.has_request ()) {
+        fail (requestID, done);
+        return;
+    }
+    const hlv_service::Request& body = request.request ();
+    if (!backends_.request (body.token (),
+                            body.requesttype (),
+                            body.requestargument (),
+                            relay (requestID, done))) {
+        BOOST_LOG_TRIVIAL (info) << "No backend for request type " << body.requesttype ();
+        fail (requestID, done);
+    }
+}
+
+BackendPool::Callback ProxyService::relay (const int64_t requestID, Completion done) {
+    return [requestID, done] (bool success, const hlv_service::ServiceResponse& answer) {
+        hlv_service::ServiceResponse response;
+        if (answer.IsInitialized ()) {
+            response.CopyFrom (answer);
+        } else {
+            // The backend went away before answering
+            response.set_response ("");
+        }
+        response.set_requestid (requestID);
+        response.set_success (success);
+        done (response);
+    };
+}
+
+void ProxyService::fail (const int64_t requestID, const Completion& done) {
+    hlv_service::ServiceResponse response;
+    response.set_requestid (requestID);
+    response.set_success (false);
+    response.set_response ("");
+    done (response);
+}
+} // namespace proxy
+} // namespace service
+} // namespace hlv
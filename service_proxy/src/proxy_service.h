@@ -0,0 +1,46 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <string>
+#include "service.pb.h"
+#include "service_interface.h"
+#include "backend_pool.h"
+#ifndef _HLV_PROXY_SERVICE_H_
+#define _HLV_PROXY_SERVICE_H_
+namespace hlv {
+namespace service {
+namespace proxy {
+/// The service clients of the proxy see: every request is handed to a
+/// backend serving its RequestType (see BackendPool) and the backend's
+/// answer is handed back under the client's RequestID. Requests no backend
+/// serves fail right away, as do those outstanding on a backend that goes
+/// away.
+class ProxyService : public hlv::service::server::AsyncServiceInterface {
+  public:
+    ProxyService () = delete;
+    ProxyService (const ProxyService&) = delete;
+    ProxyService& operator= (const ProxyService&) = delete;
+
+    explicit ProxyService (BackendPool& backends);
+
+    virtual void AuthenticateTokenAsync (const int64_t requestID,
+                                         const std::string& identity,
+                                         const std::string& token,
+                                         Completion done);
+
+    virtual void ProcessRequestAsync (const int64_t requestID,
+                                      const hlv_service::ServiceRequest& request,
+                                      Completion done);
+
+  private:
+    // Pass what the backend answered back to the client
+    static BackendPool::Callback relay (const int64_t requestID, Completion done);
+
+    // Fail a request without asking a backend
+    static void fail (const int64_t requestID, const Completion& done);
+
+    BackendPool& backends_;
+};
+} // namespace proxy
+} // namespace service
+} // namespace hlv
+#endif
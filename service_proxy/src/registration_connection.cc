@@ -0,0 +1,128 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <boost/log/trivial.hpp>
+#include <openssl/crypto.h>
+#include "registration_connection.h"
+
+namespace {
+// Compare tokens in time that does not depend on how much of them matched
+bool token_matches (const std::string& sent, const std::string& expected) {
+    return sent.size () == expected.size () &&
+           CRYPTO_memcmp (sent.data (), expected.data (), expected.size ()) == 0;
+}
+}
+
+namespace hlv {
+namespace service {
+namespace proxy {
+RegistrationConnection::RegistrationConnection (hlv::service::common::StreamSocket socket,
+            hlv::service::common::ConnectionManager<ConnectionPtr>& manager,
+            RegistrationInformation& info) :
+    socket_ (std::move (socket)),
+    bufferSize_ (0),
+    manager_ (manager),
+    info_ (info),
+    backend_ (0) {
+}
+
+void RegistrationConnection::start () {
+    BOOST_LOG_TRIVIAL(info) << "Backend connected";
+    send_join ();
+    read_size ();
+}
+
+void RegistrationConnection::stop () {
+    unregister ();
+    boost::system::error_code ec;
+    socket_.close (ec);
+}
+
+void RegistrationConnection::send_join () {
+    auto self(shared_from_this());
+    uint64_t size = info_.join.ByteSize ();
+    join_.resize (sizeof(uint64_t) + size);
+    memcpy (&join_[0], &size, sizeof(uint64_t));
+    info_.join.SerializeToArray (&join_[sizeof(uint64_t)], size);
+    boost::asio::async_write (socket_,
+        boost::asio::buffer (join_),
+        [this, self] (boost::system::error_code ec, std::size_t) {
+            if (ec && ec != boost::asio::error::operation_aborted) {
+                BOOST_LOG_TRIVIAL (info) << "Error sending join " << ec;
+                manager_.stop (shared_from_this ());
+            }
+        });
+}
+
+void RegistrationConnection::read_size () {
+    auto self(shared_from_this());
+    boost::asio::async_read (socket_,
+            boost::asio::buffer(&bufferSize_, sizeof(bufferSize_)),
+            [this, self] (boost::system::error_code ec, std::size_t) {
+                if (ec == boost::asio::error::operation_aborted) {
+                    return;
+                }
+                if (ec) {
+                    // The backend is gone
+                    BOOST_LOG_TRIVIAL(info) << "Backend disconnected";
+                    manager_.stop (shared_from_this ());
+                    return;
+                }
+                if (bufferSize_ > buffer_.size ()) {
+                    BOOST_LOG_TRIVIAL(error) << "Registration of " << bufferSize_
+                                             << " bytes, closing";
+                    manager_.stop (shared_from_this ());
+                    return;
+                }
+                read_buffer (bufferSize_);
+            });
+}
+
+void RegistrationConnection::read_buffer (uint64_t length) {
+    auto self(shared_from_this());
+    boost::asio::async_read (socket_,
+            boost::asio::buffer(buffer_),
+            boost::asio::transfer_exactly(length),
+            [this, self] (boost::system::error_code ec,
+                          std::size_t bytes_transfered) {
+                if (ec == boost::asio::error::operation_aborted) {
+                    return;
+                }
+                if (ec) {
+                    BOOST_LOG_TRIVIAL(info) << "Backend disconnected";
+                    manager_.stop (shared_from_this ());
+                    return;
+                }
+                if (!register_.ParseFromArray (buffer_.data (), bytes_transfered)) {
+                    BOOST_LOG_TRIVIAL(error) << "Could not parse registration";
+                    manager_.stop (shared_from_this ());
+                    return;
+                }
+                if (!info_.token.empty () && !token_matches (register_.token (), info_.token)) {
+                    BOOST_LOG_TRIVIAL(error) << "Backend at " << register_.address ()
+                                             << " registered with the wrong token";
+                    manager_.stop (shared_from_this ());
+                    return;
+                }
+                register_backend (register_);
+                read_size ();
+            });
+}
+
+void RegistrationConnection::register_backend (const hlv_service::ProxyRegister& reg) {
+    unregister ();
+    std::vector<int32_t> types (reg.requesttypes ().begin (), reg.requesttypes ().end ());
+    backend_ = info_.backends.add (reg.address (), reg.port (), reg.distance (), types);
+}
+
+void RegistrationConnection::unregister () {
+    if (backend_ != 0) {
+        info_.backends.remove (backend_);
+        backend_ = 0;
+    }
+}
+} // namespace proxy
+} // namespace service
+} // namespace hlv
@@ -0,0 +1,94 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <memory>
+#include <string>
+#include <boost/asio.hpp>
+#include <common_manager.h>
+#include <stream_socket.h>
+#include "service.pb.h"
+#include "backend_pool.h"
+#ifndef _HLV_PROXY_REGISTRATION_CONNECTION_H_
+#define _HLV_PROXY_REGISTRATION_CONNECTION_H_
+namespace hlv {
+namespace service {
+namespace proxy {
+/// Information used by each of the registration connections
+struct RegistrationInformation {
+    BackendPool& backends;
+    // Sent to every backend as it connects
+    hlv_service::ProxyJoin join;
+    // Token backends must register with, any is accepted if empty (only
+    // with --insecure-registration)
+    std::string token;
+    RegistrationInformation (BackendPool& _backends) :
+        backends (_backends) {
+    }
+};
+
+/// A backend connected to the proxy (see SyncProxy). The proxy sends a
+/// ProxyJoin, the backend answers with a ProxyRegister giving where to reach
+/// it and the request types it serves, and is routed to for as long as the
+/// connection stays open. A later ProxyRegister replaces the earlier one.
+class RegistrationConnection
+    : public std::enable_shared_from_this<RegistrationConnection>,
+      public hlv::service::common::ManagedConnection
+{
+  private:
+    typedef std::shared_ptr<RegistrationConnection> ConnectionPtr;
+  public:
+    RegistrationConnection (const RegistrationConnection&) = delete;
+    RegistrationConnection& operator=(const RegistrationConnection&) = delete;
+    RegistrationConnection () = delete;
+
+    // Construct a Connection given a socket
+    explicit RegistrationConnection (hlv::service::common::StreamSocket socket,
+            hlv::service::common::ConnectionManager<ConnectionPtr>& manager,
+            RegistrationInformation& info);
+
+    // Send the join and wait for the registration
+    void start ();
+
+    // Stop listening, and routing to the backend
+    void stop ();
+
+  private:
+    // Send the ProxyJoin
+    void send_join ();
+
+    // Listen for buffer
+    void read_size ();
+
+    // Read buffer off the wire
+    void read_buffer (uint64_t length);
+
+    // Route to the backend as it registered
+    void register_backend (const hlv_service::ProxyRegister& reg);
+
+    // Stop routing to the backend
+    void unregister ();
+
+    // Socket for this connection
+    hlv::service::common::StreamSocket socket_;
+
+    // A temporary variable that holds the amount to be read
+    uint64_t bufferSize_;
+
+    // Manage several connections
+    hlv::service::common::ConnectionManager<ConnectionPtr>& manager_;
+
+    RegistrationInformation& info_;
+
+    // The backend's id in the pool, 0 before it registers
+    uint64_t backend_;
+
+    // Framed join
+    std::string join_;
+
+    // Buffer, expect never to need more than 128k
+    std::array<char, 131072> buffer_;
+    hlv_service::ProxyRegister register_;
+};
+} // namespace proxy
+} // namespace service
+} // namespace hlv
+#endif
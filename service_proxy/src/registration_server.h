@@ -0,0 +1,29 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+
+#include <memory>
+#include <boost/asio.hpp>
+#include "registration_connection.h"
+#include "common_manager.h"
+#include "common_server.h"
+#ifndef _HLV_PROXY_REGISTRATION_SERVER_H_
+#define _HLV_PROXY_REGISTRATION_SERVER_H_
+namespace hlv {
+namespace service {
+namespace proxy {
+
+/// Backend registration connection pointer
+typedef std::shared_ptr<RegistrationConnection> RegistrationPtr;
+
+/// Backend registration connection manager
+typedef hlv::service::common::ConnectionManager<RegistrationPtr> RegistrationManager;
+
+/// Server backends register with
+typedef hlv::service::common::Server <RegistrationConnection,
+                                      RegistrationManager,
+                                      RegistrationInformation&>
+                            RegistrationServer;
+} // namespace proxy
+} // namespace service
+} // namespace hlv
+#endif
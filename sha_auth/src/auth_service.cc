@@ -3,52 +3,77 @@
 #include <cassert>
 #include <string>
 #include <boost/log/trivial.hpp>
-#if defined(__APPLE__) && defined(__MACH__)
-#define COMMON_DIGEST_FOR_OPENSSL
-#include <CommonCrypto/CommonDigest.h>
-#define SHA1 CC_SHA1
-#else
-#include <openssl/sha.h>
-#endif
 #include "auth_service.h"
 
-namespace {
-std::string sha256(const std::string str)
-{
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, str.c_str(), str.size());
-    SHA256_Final(hash, &sha256);
-    return std::string((char*)hash, SHA256_DIGEST_LENGTH);
-}
-}
-
 namespace hlv {
 namespace service {
 namespace server {
-// Receive an authentication token and generate a token
-bool AuthService::AuthenticateToken (const int64_t requestID,
+AuthService::AuthService (boost::asio::io_service& io_service,
+                          std::unique_ptr<common::capability::Minter> minter,
+                          uint64_t permissions) :
+    io_service_ (io_service),
+    minter_ (std::move (minter)),
+    permissions_ (permissions),
+    posted_ (false),
+    digest_ (EVP_MD_CTX_create ()),
+    batches_ (0),
+    authenticated_ (0) {
+}
+
+AuthService::~AuthService () {
+    EVP_MD_CTX_destroy (digest_);
+}
+
+// Receive an authentication token, the token is generated with the batch
+void AuthService::AuthenticateTokenAsync (const int64_t requestID,
                     const std::string& identity, 
                     const std::string& token, 
-                    hlv_service::ServiceResponse& response) {
+                    Completion done) {
     BOOST_LOG_TRIVIAL(info) << "Received auth request for " << identity 
                             << " with token " << token << " succeeding";
-    response.set_requestid (requestID);
-    response.set_success (true);
-    response.set_response (::sha256 (identity));
-    return true;
+    batch_.push_back (Pending {requestID, identity, std::move (done)});
+    if (!posted_) {
+        // Runs once the io_service has handled what is already ready, by
+        // then every connection with a request waiting has added to batch_
+        posted_ = true;
+        io_service_.post ([this] () { answer_batch (); });
+    }
+}
+
+void AuthService::answer_batch () {
+    posted_ = false;
+    answering_.swap (batch_);
+    batches_++;
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    for (auto& pending : answering_) {
+        EVP_DigestInit_ex (digest_, EVP_sha256 (), NULL);
+        EVP_DigestUpdate (digest_, pending.identity.data (), pending.identity.size ());
+        EVP_DigestFinal_ex (digest_, hash, &length);
+
+        response_.Clear ();
+        response_.set_requestid (pending.requestID);
+        response_.set_success (true);
+        response_.set_response ((const char*)hash, length);
+        if (minter_) {
+            response_.set_capability (minter_->mint (pending.identity, permissions_));
+        }
+        pending.done (response_);
+    }
+    authenticated_ += answering_.size ();
+    answering_.clear ();
 }
 
 
 // Do nothing
-bool AuthService::ProcessRequest (const int64_t requestID,
+void AuthService::ProcessRequestAsync (const int64_t requestID,
                         const hlv_service::ServiceRequest& request, 
-                        hlv_service::ServiceResponse& response) {
-    response.set_requestid (requestID);
-    response.set_success (false);
-    response.set_response ("");
-    return true;
+                        Completion done) {
+    response_.Clear ();
+    response_.set_requestid (requestID);
+    response_.set_success (false);
+    response_.set_response ("");
+    done (response_);
 }
 } // namespace server
 } // namespace service
@@ -1,8 +1,13 @@
 // Copyright 20xx The Regents of the University of California
 // This is a test service for SDN-v2 High Level Virtualization
+#include <memory>
 #include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <openssl/evp.h>
 #include "service.pb.h"
 #include "service_interface.h"
+#include "capability.h"
 #ifndef _HLV_SIMPLE_SERVICE_H_
 #define _HLV_SIMPLE_SERVICE_H_
 namespace hlv {
@@ -11,26 +16,70 @@ namespace server {
 
 // A very simple service module that supports authentication. In this case all
 // authentication tokens are accepted, and the authorization token returned is a
-// hash of the identity.
-class AuthService : public ServiceInterface {
+// hash of the identity. Given a minter, every client is also handed a
+// capability holding permissions.
+//
+// Authentications are answered in batches: requests that arrive while the
+// io_service is busy are collected and hashed together, with one reused
+// digest context, once it gets to the batch. During a reconnect storm this
+// answers a whole burst per turn of the io_service instead of interleaving
+// a hash with every read.
+class AuthService : public AsyncServiceInterface {
   public:
-    AuthService () {}
+    AuthService () = delete;
+    AuthService (const AuthService&) = delete;
+    AuthService& operator= (const AuthService&) = delete;
+
+    AuthService (boost::asio::io_service& io_service,
+                 std::unique_ptr<common::capability::Minter> minter = nullptr,
+                 uint64_t permissions = 0);
+    virtual ~AuthService ();
+
     // Check an authentication token to see if a client can indeed own an
     // identity.  Generates a response which among other things contains the
     // authorization token that should be used in all subsequent requests.
     // Care should be taken to make sure this token is universal: i.e. it
     // authorizes all other service providers that can be used by this
     // client.
-    virtual bool AuthenticateToken (const int64_t requestID,
+    virtual void AuthenticateTokenAsync (const int64_t requestID,
                                 const std::string& identity, 
                                 const std::string& token, 
-                                hlv_service::ServiceResponse& response);
+                                Completion done);
     
     // Process a request. This call is responsible for making sure the
     // authorization token allows the client to receive the requested service. 
-    virtual bool ProcessRequest (const int64_t requestID,
+    virtual void ProcessRequestAsync (const int64_t requestID,
                                  const hlv_service::ServiceRequest& request, 
-                                 hlv_service::ServiceResponse& response);
+                                 Completion done);
+
+    // Batches hashed, and authentications answered in them
+    uint64_t batches () const { return batches_; }
+    uint64_t authenticated () const { return authenticated_; }
+
+  private:
+    // An authentication waiting for its batch
+    struct Pending {
+        int64_t requestID;
+        std::string identity;
+        Completion done;
+    };
+
+    // Answer everything in batch_
+    void answer_batch ();
+
+    boost::asio::io_service& io_service_;
+    std::unique_ptr<common::capability::Minter> minter_;
+    uint64_t permissions_;
+    // Authentications collected for the next batch, and the batch being
+    // answered (kept to reuse their memory)
+    std::vector<Pending> batch_;
+    std::vector<Pending> answering_;
+    bool posted_;
+    // Reused for every hash
+    EVP_MD_CTX* digest_;
+    hlv_service::ServiceResponse response_;
+    uint64_t batches_;
+    uint64_t authenticated_;
 };
 } // namespace server
 } // namespace service
@@ -10,6 +10,7 @@
 #include "logging_common.h"
 #include "service.pb.h"
 #include "auth_service.h"
+#include "capability.h"
 #include "getifaddr.h"
 #include "consts.h"
 
@@ -29,6 +30,11 @@ main (int argc, char* argv[]) {
 
     std::string coordinator = "127.0.0.1";
 
+    // Key to sign capabilities with, none are minted without one
+    std::string capabilityKey;
+    int64_t capabilityLifetime = 3600;
+    uint64_t capabilityPerms = 0;
+
     // Coordinator port
     int32_t cport = hlv::service::lookup::UPDATE_PORT;
 
@@ -39,7 +45,10 @@ main (int argc, char* argv[]) {
         ("port,p", po::value<std::string>(&sport)->implicit_value("8080"), "Service port")
         ("name,n", po::value<std::string>(&servicename)->implicit_value(servicename), "Service name")
         ("coordinator,c", po::value<std::string>(&coordinator)->implicit_value(coordinator), "Coordinator")
-        ("cport,cp", po::value<int32_t>(&cport)->implicit_value(cport), "Coordinator port");
+        ("cport,cp", po::value<int32_t>(&cport)->implicit_value(cport), "Coordinator port")
+        ("capability-key", po::value<std::string>(&capabilityKey), "Mint capabilities signed with the key in this file")
+        ("capability-lifetime", po::value<int64_t>(&capabilityLifetime), "Seconds a minted capability is good for")
+        ("capability-perms", po::value<uint64_t>(&capabilityPerms), "Permission bits in minted capabilities");
     po::options_description options;
     options.add(desc);
 
@@ -53,6 +62,18 @@ main (int argc, char* argv[]) {
         return 0;
     }
 
+    std::unique_ptr<hlv::service::common::capability::Minter> minter;
+    if (!capabilityKey.empty ()) {
+        std::string secret;
+        if (!hlv::service::common::capability::load_secret (capabilityKey, secret)) {
+            std::cerr << "Could not read capability key from " << capabilityKey
+                      << " (at least " << hlv::service::common::capability::MIN_SECRET
+                      << " bytes)" << std::endl;
+            return 1;
+        }
+        minter.reset (new hlv::service::common::capability::Minter (secret, capabilityLifetime));
+    }
+
     // Create coordinator client
     hlv::coordinator::EvUpdateClient cclient (coordinator, cport);
     hlv::coordinator::EvUpdateClient::TypeValueMap vmap;
@@ -90,7 +111,7 @@ main (int argc, char* argv[]) {
             io_service,
             saddr, 
             sport, 
-            std::make_shared<hlv::service::server::AuthService>());
+            std::make_shared<hlv::service::server::AuthService>(io_service, std::move (minter), capabilityPerms));
     server.start();
 
     // Register to quit when necessary
@@ -5,6 +5,8 @@
 #include <memory>
 #include <boost/asio.hpp>
 #include <query_client.h>
+#include <endpoint_selector.h>
+#include <stream_socket.h>
 #ifndef __EV_SIMPLE_CLIENT_LIB__
 #define __EV_SIMPLE_CLIENT_LIB__
 namespace hlv {
@@ -33,7 +35,9 @@ class EvSimpleClient {
 
     virtual ~EvSimpleClient();
     
-    // Send to servers, read a response, return the response
+    // Send to servers, read a response, return the response. Local requests
+    // go to one of the local servers, see EndpointSelector, and are retried
+    // on another if it fails.
     bool echo_request (const std::string& type, const std::string& str, std::string& response);
     bool local_echo_request (const std::string& type, const std::string& str, std::string& response);
 
@@ -50,14 +54,22 @@ class EvSimpleClient {
     bool send_everywhere (const std::string& str);
 
   private:
+    // Connect socket to endpoint, an address as registered (host:port or
+    // unix:/path)
+    bool connect (const std::string& address,
+                  hlv::service::common::StreamSocket& socket) const;
+
+    bool connect (const hlv::lookup::client::EndpointSelector::Endpoint& endpoint,
+                  hlv::service::common::StreamSocket& socket) const;
+
     // Send a query to the server
     bool send_query (const std::string& str,
-                     boost::asio::ip::tcp::socket& socket) const;
+                     hlv::service::common::StreamSocket& socket) const;
 
     // Send to echo server
     bool send_query_echo (const std:: string& str,
                           std::string& response, 
-                          boost::asio::ip::tcp::socket& socket) const;
+                          hlv::service::common::StreamSocket& socket) const;
 
     std::string servicename_;
     std::string lname_;
@@ -66,6 +78,9 @@ class EvSimpleClient {
     hlv::lookup::client::EvLookupClient& client_;
     std::unique_ptr<hlv::lookup::client::EvLookupClient> localClient_;
 
+    // Chooses among local servers
+    hlv::lookup::client::EndpointSelector localServers_;
+
     // Buffer, expect never to need more than 128k
     mutable std::array<char, 131072> buffer_;
 
@@ -1,7 +1,8 @@
+#include <chrono>
+#include <set>
 #include <string>
 #include <utility>
 #include <boost/log/trivial.hpp>
-#include <boost/algorithm/string.hpp>
 #include "simple_client.h"
 #include "consts.h"
 namespace hlv {
@@ -25,7 +26,7 @@ EvSimpleClient::EvSimpleClient (const std::string name,
 
 // send a query to the server
 bool EvSimpleClient::send_query (const std::string& query,
-                                boost::asio::ip::tcp::socket& socket) const {
+                                hlv::service::common::StreamSocket& socket) const {
     uint64_t size = query.size ();
     *((uint64_t*)buffer_.data()) = size;
     query.copy (buffer_.data() + sizeof(uint64_t), std::string::npos);
@@ -46,7 +47,7 @@ bool EvSimpleClient::send_query (const std::string& query,
 // send a query to echo server
 bool EvSimpleClient::send_query_echo (const std::string& query,
                                       std::string& response,
-                                boost::asio::ip::tcp::socket& socket) const {
+                                hlv::service::common::StreamSocket& socket) const {
     uint64_t size = query.size ();
     BOOST_LOG_TRIVIAL (info) << "sending echo";
     boost::system::error_code ec;
@@ -70,6 +71,29 @@ bool EvSimpleClient::send_query_echo (const std::string& query,
     return true;
 }
 
+// connect to an endpoint
+bool EvSimpleClient::connect (const hlv::lookup::client::EndpointSelector::Endpoint& endpoint,
+                              hlv::service::common::StreamSocket& socket) const {
+    boost::system::error_code ec;
+    if (!hlv::service::common::connect_stream (io_service_, socket,
+                                               endpoint.host, endpoint.port, ec)) {
+        BOOST_LOG_TRIVIAL(error) << "Error connecting to remote endpoint " << endpoint.address;
+        return false;
+    }
+    return true;
+}
+
+// connect to an endpoint as registered
+bool EvSimpleClient::connect (const std::string& address,
+                              hlv::service::common::StreamSocket& socket) const {
+    hlv::lookup::client::EndpointSelector::Endpoint endpoint;
+    if (!hlv::lookup::client::EndpointSelector::parse (address, endpoint)) {
+        BOOST_LOG_TRIVIAL (info) << "Do not understand return";
+        return false;
+    }
+    return connect (endpoint, socket);
+}
+
 bool EvSimpleClient::echo_request (const std::string& type, const std::string& str, std::string& response) {
     uint64_t token = 0;
     std::map<std::string, std::string> results;
@@ -82,23 +106,9 @@ bool EvSimpleClient::echo_request (const std::string& type, const std::string& s
         BOOST_LOG_TRIVIAL (info) << "Could not find provider";
         return false;
     }
-    std::vector<std::string> split_results;
-    boost::split(split_results, server->second, boost::is_any_of(":"), boost::token_compress_off);
-    
-    if (split_results.size() != 2) {
-        BOOST_LOG_TRIVIAL (info) << "Do not understand return";
-        return false;
-    }
-
-    boost::asio::ip::tcp::socket sock (io_service_);
-    boost::asio::ip::tcp::resolver resolver(io_service_);
 
-
-    boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve({split_results[0], split_results[1]});
-    boost::system::error_code ec;
-    sock.connect(endpoint, ec);
-    if (ec) {
-        BOOST_LOG_TRIVIAL(error) << "Error connecting to remote endpoint";
+    hlv::service::common::StreamSocket sock (io_service_);
+    if (!connect (server->second, sock)) {
         return false;
     }
     return send_query_echo(str, response, sock);
@@ -111,28 +121,27 @@ bool EvSimpleClient::local_echo_request (const std::string& type, const std::str
                         lname_,
                         token,
                         results);
-    for (auto addr : results) {
-        std::vector<std::string> split_results;
-        boost::split(split_results, addr, boost::is_any_of(":"), boost::token_compress_off);
-        
-        if (split_results.size() != 2) {
-            BOOST_LOG_TRIVIAL (info) << "Do not understand return";
-            return false;
-        }
-
-        boost::asio::ip::tcp::socket sock (io_service_);
-        boost::asio::ip::tcp::resolver resolver(io_service_);
-
-
-        boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve({split_results[0], split_results[1]});
-        boost::system::error_code ec;
-        sock.connect(endpoint, ec);
-        if (ec) {
-            BOOST_LOG_TRIVIAL(error) << "Error connecting to remote endpoint " << addr;
+    localServers_.update (results);
+
+    // Try the server chosen, and then others until one answers
+    std::set<std::string> tried;
+    hlv::lookup::client::EndpointSelector::Endpoint endpoint;
+    while (localServers_.select (endpoint, tried)) {
+        tried.insert (endpoint.address);
+        hlv::service::common::StreamSocket sock (io_service_);
+        auto start = std::chrono::steady_clock::now ();
+        if (!connect (endpoint, sock) ||
+            !send_query_echo(str, response, sock)) {
+            localServers_.failure (endpoint.address);
+            continue;
         }
-        send_query_echo(str, response, sock);
+        localServers_.success (endpoint.address,
+                std::chrono::duration_cast<std::chrono::microseconds> (
+                    std::chrono::steady_clock::now () - start));
+        return true;
     }
-    return true;
+    BOOST_LOG_TRIVIAL (info) << "No local server answered";
+    return false;
 }
 
 bool EvSimpleClient::send_to_servers (const std::string& type, const std::string& str) {
@@ -147,23 +156,9 @@ bool EvSimpleClient::send_to_servers (const std::string& type, const std::string
         BOOST_LOG_TRIVIAL (info) << "Could not find provider";
         return false;
     }
-    std::vector<std::string> split_results;
-    boost::split(split_results, server->second, boost::is_any_of(":"), boost::token_compress_off);
-    
-    if (split_results.size() != 2) {
-        BOOST_LOG_TRIVIAL (info) << "Do not understand return";
-        return false;
-    }
 
-    boost::asio::ip::tcp::socket sock (io_service_);
-    boost::asio::ip::tcp::resolver resolver(io_service_);
-
-
-    boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve({split_results[0], split_results[1]});
-    boost::system::error_code ec;
-    sock.connect(endpoint, ec);
-    if (ec) {
-        BOOST_LOG_TRIVIAL(error) << "Error connecting to remote endpoint";
+    hlv::service::common::StreamSocket sock (io_service_);
+    if (!connect (server->second, sock)) {
         return false;
     }
     return send_query(str, sock);
@@ -185,23 +180,8 @@ bool EvSimpleClient::send_everywhere (const std::string& type, const std::string
                         token,
                         results);
     for (auto addr : results) {
-        std::vector<std::string> split_results;
-        boost::split(split_results, addr, boost::is_any_of(":"), boost::token_compress_off);
-        
-        if (split_results.size() != 2) {
-            BOOST_LOG_TRIVIAL (info) << "Do not understand return";
-            continue;
-        }
-
-        boost::asio::ip::tcp::socket sock (io_service_);
-        boost::asio::ip::tcp::resolver resolver(io_service_);
-
-
-        boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve({split_results[0], split_results[1]});
-        boost::system::error_code ec;
-        sock.connect(endpoint, ec);
-        if (ec) {
-            BOOST_LOG_TRIVIAL(error) << "Error connecting to remote endpoint " << addr;
+        hlv::service::common::StreamSocket sock (io_service_);
+        if (!connect (addr, sock)) {
             continue;
         }
         send_query (str, sock);
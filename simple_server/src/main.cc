@@ -1,6 +1,9 @@
 // Copyright 20xx The Regents of the University of California
 // This is a test service for SDN-v2 High Level Virtualization
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <thread>
 #include <boost/program_options.hpp>
@@ -9,11 +12,30 @@
 #include <coordinator_client.h>
 #include <logging_common.h>
 #include <simple_server.h>
+#include <sink_writer.h>
 #include "consts.h"
 #include "getifaddr.h"
+#include "stats_reporter.h"
 
 namespace po = boost::program_options;
 
+namespace {
+// How fast count grew per second since the last report
+hlv::service::common::StatsReporter::Metric
+per_second (std::function<uint64_t ()> count) {
+    typedef std::chrono::steady_clock Clock;
+    auto last = std::make_shared<std::pair<uint64_t, Clock::time_point>> (count (), Clock::now ());
+    return [count, last] () {
+        uint64_t now = count ();
+        Clock::time_point at = Clock::now ();
+        double seconds = std::chrono::duration<double> (at - last->second).count ();
+        double rate = seconds > 0 ? (now - last->first) / seconds : 0;
+        *last = std::make_pair (now, at);
+        return rate;
+    };
+}
+}
+
 void launchService (boost::asio::io_service& io_service,
                    hlv::service::simple::server::Server& server) {
     server.start ();
@@ -28,6 +50,11 @@ int main (int argc, char* argv[]) {
     uint32_t coordinator_port = hlv::service::lookup::UPDATE_PORT,
               port = 8000;
     uint64_t accessibleBy = 0;
+    std::string output;
+    uint32_t segmentMB = 256,
+             flushDelay = 10,
+             maxPendingMB = 64,
+             statsInterval = 10;
     po::options_description desc("Simple Server");
     desc.add_options()
         ("help,h", "Display help") 
@@ -44,7 +71,18 @@ int main (int argc, char* argv[]) {
         ("accessible,a", po::value<uint64_t>(&accessibleBy)->implicit_value (accessibleBy),
             "Permission for accessing")
         ("type,t", po::value<std::string>(&type)->implicit_value (type),
-            "Type of server");
+            "Type of server")
+        ("output,o", po::value<std::string>(&output),
+            "Append messages to files starting with this path instead of printing them")
+        ("segment", po::value<uint32_t>(&segmentMB)->implicit_value (segmentMB),
+            "Start a new output file after this many MB")
+        ("flush-delay", po::value<uint32_t>(&flushDelay)->implicit_value (flushDelay),
+            "Most milliseconds a message waits to be written")
+        ("max-pending", po::value<uint32_t>(&maxPendingMB)->implicit_value (maxPendingMB),
+            "Stop reading once this many MB wait to be written")
+        ("sync", "Sync output files after every write")
+        ("stats", po::value<uint32_t>(&statsInterval)->implicit_value (statsInterval),
+            "Seconds between stats reports (0 disables)");
     po::options_description options;
     options.add(desc);
     po::variables_map vm;
@@ -59,7 +97,20 @@ int main (int argc, char* argv[]) {
 
     // Listen for connections
     boost::asio::io_service io_service;
-    hlv::service::simple::server::ConnectionInformation info;
+    std::unique_ptr<hlv::service::simple::server::SinkWriter> writer;
+    if (!output.empty ()) {
+        writer.reset (new hlv::service::simple::server::SinkWriter (io_service,
+                            output,
+                            (uint64_t)segmentMB << 20,
+                            std::chrono::milliseconds (flushDelay),
+                            (size_t)maxPendingMB << 20,
+                            vm.count ("sync") > 0));
+        if (!writer->open ()) {
+            std::cerr << "Could not open output " << output << std::endl;
+            return 1;
+        }
+    }
+    hlv::service::simple::server::ConnectionInformation info (writer.get ());
     hlv::service::simple::server::Server server (io_service,
                                   address,
                                   std::to_string(port), 
@@ -96,6 +147,18 @@ int main (int argc, char* argv[]) {
         std::cerr << "Failed to set permissions" << std::endl;
         return 0;
     }
+    hlv::service::common::StatsReporter stats (io_service, "simple", statsInterval);
+    stats.add ("messages", [&info] () { return (double)info.messages; });
+    stats.add ("messages_per_sec", per_second ([&info] () { return info.messages; }));
+    stats.add ("bytes_per_sec", per_second ([&info] () { return info.bytes; }));
+    stats.add ("connections", [&server] () { return (double)server.connections (); });
+    if (writer) {
+        auto w = writer.get ();
+        stats.add ("written_bytes_per_sec", per_second ([w] () { return w->bytes (); }));
+        stats.add ("files", [w] () { return (double)w->segments (); });
+    }
+    stats.start ();
+
     std::cerr << "Running server " << std::endl;
     // This thread now provides I/O service
     boost::asio::signal_set signals (io_service);
@@ -106,7 +169,11 @@ int main (int argc, char* argv[]) {
 #endif
     signals.async_wait ([&](boost::system::error_code, int) {
         std::cout << "Quitting" << std::endl;
+        stats.stop ();
         server.stop ();
+        if (writer) {
+            writer->stop ();
+        }
         io_service.stop ();
     });
     io_service.run();
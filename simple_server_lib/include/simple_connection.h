@@ -5,6 +5,10 @@
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
 #include "common_manager.h"
+#include "stream_socket.h"
+#include "uring.h"
+#include "frame_reader.h"
+#include "sink_writer.h"
 #ifndef _EV_SIMPLE_CONNECTION_H_
 #define _EV_SIMPLE_CONNECTION_H_
 /// The Connection class implements the logic used for a simple server
@@ -15,7 +19,15 @@ namespace server {
 
 /// Information used by each of the connection objects for initialization.
 struct ConnectionInformation {
-    ConnectionInformation() {
+    // Where messages go, printed if null
+    SinkWriter* writer;
+    // Messages and bytes received, over all connections
+    uint64_t messages;
+    uint64_t bytes;
+    ConnectionInformation(SinkWriter* _writer = nullptr) :
+        writer (_writer),
+        messages (0),
+        bytes (0) {
     }
 
 };
@@ -23,9 +35,11 @@ struct ConnectionInformation {
 /// A connection represents a single client connected to the service.
 /// Connections are themselves stateless (out of necessity), and are mainly
 /// responsible for reading bytes off the wire and dispatching them
-/// appropriately.
+/// appropriately. A connection carries any number of messages, each a
+/// uint64 length and the message.
 class Connection
-    : public std::enable_shared_from_this<Connection>
+    : public std::enable_shared_from_this<Connection>,
+      public hlv::service::common::ManagedConnection
 {
   private:
     typedef std::shared_ptr<hlv::service::simple::server::Connection> ConnectionPtr;
@@ -35,7 +49,7 @@ class Connection
     Connection () = delete;
     
     // Construct a Connection given a socket
-    explicit Connection (boost::asio::ip::tcp::socket socket, 
+    explicit Connection (hlv::service::common::StreamSocket socket, 
             hlv::service::common::ConnectionManager<ConnectionPtr>& manager,
             ConnectionInformation& config);
 
@@ -46,26 +60,20 @@ class Connection
     void stop ();
 
   private:
-    // Listen for buffer
-    void read_size ();
-
-    // Read buffer off the wire
-    void read_buffer (uint64_t length);
+    // Hand on the messages read so far, then read more
+    void read_messages ();
 
     // Socket for this connection
-    boost::asio::ip::tcp::socket socket_;
-
-    // A temporary variable that holds the amount to be read
-    uint64_t bufferSize_;
+    hlv::service::common::StreamSocket socket_;
 
     // Manage several connections
     hlv::service::common::ConnectionManager<ConnectionPtr>& manager_;
 
     // Configuration
-    const ConnectionInformation& config_;
+    ConnectionInformation& config_;
 
-    // Buffer, expect never to need more than 128k
-    std::array<char, 131072> buffer_;
+    // Messages off the wire, expect never to need more than 128k
+    hlv::service::common::FrameReader reader_;
 };
 } // namespace server
 } // namespace simple
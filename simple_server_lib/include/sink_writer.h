@@ -0,0 +1,126 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#ifndef _EV_SIMPLE_SINK_WRITER_H_
+#define _EV_SIMPLE_SINK_WRITER_H_
+namespace hlv {
+namespace service{
+namespace simple {
+namespace server {
+/// Appends the messages a simple server receives to a series of files,
+/// path.<start time>.<n>, each about segmentBytes long. Messages are written
+/// as they came off the wire (a uint64 length and the message) so that the
+/// files can be sent again as they are.
+///
+/// Connections append on the io_service thread, which only copies messages
+/// into blocks; a thread of the writer's own writes the blocks with one
+/// writev once a block fills or flushDelay passes, so that a message costs
+/// a copy and not a system call. Blocks are reused once written. When more
+/// than maxPending bytes are waiting, append says so and the connection
+/// stops reading (so that TCP pushes back on senders) until when_room calls
+/// it back.
+class SinkWriter {
+  public:
+    SinkWriter () = delete;
+    SinkWriter (const SinkWriter&) = delete;
+    SinkWriter& operator= (const SinkWriter&) = delete;
+
+    /// sync: fdatasync after every write, so that what was received survives
+    ///       a crash of the machine and not only of the server
+    SinkWriter (boost::asio::io_service& io_service,
+                const std::string& path,
+                uint64_t segmentBytes,
+                std::chrono::milliseconds flushDelay,
+                size_t maxPending,
+                bool sync = false);
+    ~SinkWriter ();
+
+    /// Open the first file and start writing, false if it could not be
+    /// opened
+    bool open ();
+
+    /// Queue a message. False if the writer is behind, the message is queued
+    /// regardless but the caller should wait for when_room before sending
+    /// more.
+    bool append (const char* data, size_t length);
+
+    /// Call resume on the io_service once the writer has room again
+    void when_room (std::function<void ()> resume);
+
+    /// Write what is queued and stop the writer
+    void stop ();
+
+    /// Messages and bytes (framing included) written, files started
+    uint64_t messages () const { return messages_; }
+    uint64_t bytes () const { return bytes_; }
+    uint64_t segments () const { return segments_; }
+
+    /// False once a write failed, nothing is written after that
+    bool healthy () const { return healthy_; }
+
+  private:
+    // Not BLOCK_SIZE, <linux/fs.h> (under liburing.h) defines that
+    static const size_t BLOCK_BYTES = 256 * 1024;
+
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+        size_t used;
+    };
+
+    // Writer thread
+    void run ();
+
+    // Write blocks to the current file, starting a new one after it
+    // grows past segmentBytes_
+    bool write_blocks (const std::vector<Block>& blocks);
+
+    // Start the next file
+    bool rotate ();
+
+    // A block with at least length bytes free, called with mutex_ held
+    Block& block_for (size_t length);
+
+    boost::asio::io_service& io_service_;
+    const std::string path_;
+    const uint64_t segmentBytes_;
+    const std::chrono::milliseconds flushDelay_;
+    const size_t maxPending_;
+    const bool sync_;
+
+    // Current file
+    int fd_;
+    uint64_t fileBytes_;
+    std::string stamp_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::vector<Block> pending_;
+    std::vector<Block> free_;
+    size_t pendingBytes_;
+    uint64_t pendingMessages_;
+    std::vector<std::function<void ()>> resumers_;
+    bool stopping_;
+
+    std::thread thread_;
+
+    std::atomic<uint64_t> messages_;
+    std::atomic<uint64_t> bytes_;
+    std::atomic<uint64_t> segments_;
+    std::atomic<bool> healthy_;
+};
+} // namespace server
+} // namespace simple
+} // namespace service
+} // namespace hlv
+#endif
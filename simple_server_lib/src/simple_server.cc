@@ -14,64 +14,61 @@ namespace hlv {
 namespace service{
 namespace simple {
 namespace server {
-Connection::Connection (boost::asio::ip::tcp::socket socket,
+Connection::Connection (hlv::service::common::StreamSocket socket,
                         ConnectionManager& manager,
                         ConnectionInformation& config) :
     socket_ (std::move(socket)),
-    bufferSize_ (0),
     manager_ (manager),
     config_ (config) {
 }
 
 void Connection::start () {
     BOOST_LOG_TRIVIAL(info) << "Starting connection";
-    read_size();
+    read_messages();
 }
 
 void Connection::stop () {
-    socket_.close();
+    hlv::service::common::close_socket(socket_);
 }
 
-void Connection::read_size () {
-    auto self(shared_from_this());
-    boost::asio::async_read (socket_, 
-            boost::asio::buffer(&bufferSize_, sizeof(bufferSize_)),
-            [this, self] (boost::system::error_code ec, 
-                                std::size_t bytes_transfered) {
-                BOOST_LOG_TRIVIAL(info) << "Read connection";
-                if (!ec) {
-                    BOOST_LOG_TRIVIAL(info) << "Read " 
-                                << bufferSize_
-                                << " byte preheader " 
-                                << bytes_transfered;
-                    read_buffer(bufferSize_);
-                } else if (ec != boost::asio::error::operation_aborted) {
-                    // Stop here
-                    BOOST_LOG_TRIVIAL(info) << "Connection ended";
-                    manager_.stop(shared_from_this());
-                }
-                else {
-                    BOOST_LOG_TRIVIAL(error) << "Unknown ASIO error " << ec << " closing socket";
-                    manager_.stop(shared_from_this());
+void Connection::read_messages () {
+    // Take every message already read before reading more
+    const char* data;
+    size_t length;
+    while (reader_.next (data, length)) {
+        config_.messages++;
+        config_.bytes += length;
+        if (!config_.writer) {
+            std::cout.write (data, length);
+            std::cout << '\n';
+        } else if (!config_.writer->append (data, length)) {
+            // Leave the rest to wait in the socket until the writer catches
+            // up
+            auto self(shared_from_this());
+            config_.writer->when_room ([this, self] () {
+                if (socket_.is_open ()) {
+                    read_messages ();
                 }
             });
-}
-
-void Connection::read_buffer (uint64_t length) {
+            return;
+        }
+    }
+    if (reader_.oversized ()) {
+        BOOST_LOG_TRIVIAL(error) << "Message too large, closing";
+        manager_.stop(shared_from_this());
+        return;
+    }
     auto self(shared_from_this());
-    BOOST_LOG_TRIVIAL(info) << "Being asked to read " << bufferSize_ << " bytes";
-    boost::asio::async_read (socket_, 
-            boost::asio::buffer(buffer_),
-            boost::asio::transfer_exactly(length),
-            [this, self] (boost::system::error_code ec,
-                          std::size_t bytes_transfered) {
-                BOOST_LOG_TRIVIAL(info) << "Read data";
+    reader_.async_fill (socket_,
+            [this, self] (boost::system::error_code ec) {
                 if (!ec) {
-                    std::string data (buffer_.data (), bytes_transfered);
-                    std::cout << data << std::endl;
+                    read_messages ();
+                } else if (ec == boost::asio::error::message_size) {
+                    BOOST_LOG_TRIVIAL(error) << "Message too large, closing";
+                    manager_.stop(shared_from_this());
                 } else if (ec != boost::asio::error::operation_aborted) {
                     // Stop here
-                    BOOST_LOG_TRIVIAL(info) << "Connection ended read: " << bytes_transfered;
+                    BOOST_LOG_TRIVIAL(info) << "Connection ended";
                     manager_.stop(shared_from_this());
                 }
                 else {
@@ -0,0 +1,221 @@
+// Copyright 20xx The Regents of the University of California
+// This is a test service for SDN-v2 High Level Virtualization
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <boost/log/trivial.hpp>
+#include "sink_writer.h"
+
+namespace hlv {
+namespace service{
+namespace simple {
+namespace server {
+const size_t SinkWriter::BLOCK_BYTES;
+
+SinkWriter::SinkWriter (boost::asio::io_service& io_service,
+                        const std::string& path,
+                        uint64_t segmentBytes,
+                        std::chrono::milliseconds flushDelay,
+                        size_t maxPending,
+                        bool sync) :
+    io_service_ (io_service),
+    path_ (path),
+    segmentBytes_ (segmentBytes),
+    flushDelay_ (flushDelay),
+    maxPending_ (maxPending),
+    sync_ (sync),
+    fd_ (-1),
+    fileBytes_ (0),
+    stamp_ (std::to_string (time (NULL))),
+    pendingBytes_ (0),
+    pendingMessages_ (0),
+    stopping_ (false),
+    messages_ (0),
+    bytes_ (0),
+    segments_ (0),
+    healthy_ (true) {
+}
+
+SinkWriter::~SinkWriter () {
+    stop ();
+}
+
+bool SinkWriter::open () {
+    if (!rotate ()) {
+        return false;
+    }
+    thread_ = std::thread ([this] () { run (); });
+    return true;
+}
+
+bool SinkWriter::append (const char* data, size_t length) {
+    uint64_t size = length;
+    std::lock_guard<std::mutex> lock (mutex_);
+    Block& block = block_for (sizeof(size) + length);
+    memcpy (block.data.get () + block.used, &size, sizeof(size));
+    memcpy (block.data.get () + block.used + sizeof(size), data, length);
+    block.used += sizeof(size) + length;
+    size_t before = pendingBytes_;
+    pendingBytes_ += sizeof(size) + length;
+    pendingMessages_++;
+    // Only wake the writer for full blocks, the rest waits for flushDelay
+    if (before / BLOCK_BYTES != pendingBytes_ / BLOCK_BYTES) {
+        wake_.notify_one ();
+    }
+    return pendingBytes_ < maxPending_;
+}
+
+void SinkWriter::when_room (std::function<void ()> resume) {
+    std::lock_guard<std::mutex> lock (mutex_);
+    if (pendingBytes_ < maxPending_ || stopping_) {
+        io_service_.post (resume);
+        return;
+    }
+    resumers_.push_back (std::move (resume));
+}
+
+void SinkWriter::stop () {
+    {
+        std::lock_guard<std::mutex> lock (mutex_);
+        if (stopping_) {
+            return;
+        }
+        stopping_ = true;
+    }
+    wake_.notify_one ();
+    if (thread_.joinable ()) {
+        thread_.join ();
+    }
+    if (fd_ >= 0) {
+        ::close (fd_);
+        fd_ = -1;
+    }
+}
+
+SinkWriter::Block& SinkWriter::block_for (size_t length) {
+    if (!pending_.empty () &&
+        pending_.back ().size - pending_.back ().used >= length) {
+        return pending_.back ();
+    }
+    if (length <= BLOCK_BYTES && !free_.empty ()) {
+        pending_.push_back (std::move (free_.back ()));
+        free_.pop_back ();
+    } else {
+        Block block;
+        block.size = std::max (length, BLOCK_BYTES);
+        block.data.reset (new char[block.size]);
+        pending_.push_back (std::move (block));
+    }
+    pending_.back ().used = 0;
+    return pending_.back ();
+}
+
+void SinkWriter::run () {
+    std::vector<Block> writing;
+    std::unique_lock<std::mutex> lock (mutex_);
+    while (true) {
+        wake_.wait_for (lock, flushDelay_, [this] () {
+            return stopping_ || pendingBytes_ >= BLOCK_BYTES;
+        });
+        if (pending_.empty ()) {
+            if (stopping_) {
+                break;
+            }
+            continue;
+        }
+        writing.swap (pending_);
+        uint64_t messages = pendingMessages_;
+        size_t bytes = pendingBytes_;
+        pendingBytes_ = 0;
+        pendingMessages_ = 0;
+        std::vector<std::function<void ()>> resumers;
+        resumers.swap (resumers_);
+        lock.unlock ();
+
+        // Connections waiting for room can go on while this is written
+        for (auto& resume : resumers) {
+            io_service_.post (resume);
+        }
+        if (healthy_ && write_blocks (writing)) {
+            messages_ += messages;
+            bytes_ += bytes;
+        }
+
+        lock.lock ();
+        for (auto& block : writing) {
+            if (block.size == BLOCK_BYTES) {
+                free_.push_back (std::move (block));
+            }
+        }
+        writing.clear ();
+    }
+}
+
+bool SinkWriter::write_blocks (const std::vector<Block>& blocks) {
+    std::vector<struct iovec> iov;
+    for (auto& block : blocks) {
+        iov.push_back ({block.data.get (), block.used});
+    }
+    // writev may write less than asked, and takes at most IOV_MAX buffers
+    size_t first = 0;
+    while (first < iov.size ()) {
+        int count = (int)std::min (iov.size () - first, (size_t)IOV_MAX);
+        ssize_t written = writev (fd_, &iov[first], count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            BOOST_LOG_TRIVIAL (error) << "Writing to " << path_ << " failed: "
+                                      << strerror (errno) << ", dropping everything from now on";
+            healthy_ = false;
+            return false;
+        }
+        fileBytes_ += written;
+        while (first < iov.size () && (size_t)written >= iov[first].iov_len) {
+            written -= iov[first].iov_len;
+            first++;
+        }
+        if (first < iov.size ()) {
+            iov[first].iov_base = (char*)iov[first].iov_base + written;
+            iov[first].iov_len -= written;
+        }
+    }
+    if (sync_ && fdatasync (fd_) != 0) {
+        BOOST_LOG_TRIVIAL (error) << "Syncing " << path_ << " failed: " << strerror (errno);
+    }
+    // Files only ever end between batches, so never in the middle of a
+    // message
+    if (fileBytes_ >= segmentBytes_ && !rotate ()) {
+        healthy_ = false;
+        return false;
+    }
+    return true;
+}
+
+bool SinkWriter::rotate () {
+    std::stringstream name;
+    name << path_ << "." << stamp_ << "." << segments_;
+    int fd = ::open (name.str ().c_str (), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        BOOST_LOG_TRIVIAL (error) << "Could not open " << name.str () << ": " << strerror (errno);
+        return false;
+    }
+    if (fd_ >= 0) {
+        ::close (fd_);
+    }
+    fd_ = fd;
+    fileBytes_ = 0;
+    segments_++;
+    BOOST_LOG_TRIVIAL (info) << "Writing to " << name.str ();
+    return true;
+}
+} // namespace server
+} // namespace simple
+} // namespace service
+} // namespace hlv